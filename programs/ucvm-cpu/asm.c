@@ -0,0 +1,555 @@
+/* UCVM CPU Engine - assembler and disassembler
+ * Two-pass assembler for the FULL-mode assembly syntax:
+ *
+ *   ; comment                 label:
+ *   MOV r0, 5                 MOV r0, label
+ *   MOV r2, [0x8000]          MOV r2, [r3+4]
+ *   MOV [r3-8], r2            ADD r0, r1
+ *   JNZ loop                  CALL func / RET
+ *   SYSCALL                   INT 3 / HLT
+ *   .org 0x8000  .word 1, 2  .byte 7  .string "hi\n"  .space 16
+ *
+ * Code is placed at 0x1000 unless moved with .org; execution starts at
+ * the label _start if present, else at 0x1000.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+#include "ucvm.h"
+
+#define MAX_LABELS MAX_SYMBOLS
+#define MAX_LABEL_LENGTH MAX_SYMBOL_LENGTH
+#define MAX_OPERANDS 8
+#define MAX_LINE_LENGTH 1024
+
+typedef Symbol Label;
+
+typedef struct {
+    Program* prog;
+    uint32_t pc;
+    int pass;
+    int line;
+    char* err;
+    size_t errlen;
+    Label labels[MAX_LABELS];
+    int label_count;
+} Assembler;
+
+typedef enum {
+    OPND_REG,
+    OPND_MEM,
+    OPND_VALUE
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    int reg;            /* register, or base register for OPND_MEM (0 = none) */
+    uint32_t value;     /* immediate, address or displacement */
+} Operand;
+
+static int asm_error(Assembler* as, const char* msg, const char* detail) {
+    snprintf(as->err, as->errlen, "line %d: %s%s%s", as->line, msg,
+             detail ? ": " : "", detail ? detail : "");
+    return -1;
+}
+
+static Label* find_label(Assembler* as, const char* name) {
+    for (int i = 0; i < as->label_count; i++) {
+        if (strcmp(as->labels[i].name, name) == 0) {
+            return &as->labels[i];
+        }
+    }
+    return NULL;
+}
+
+static int emit8(Assembler* as, uint32_t v) {
+    if (as->pc >= MEM_SIZE) {
+        return asm_error(as, "program exceeds the 64KB address space", NULL);
+    }
+    if (as->pass == 2) {
+        as->prog->image[as->pc] = (uint8_t)v;
+        as->prog->present[as->pc >> PAGE_SHIFT] = 1;
+        if (as->pc < HEAP_BASE && as->pc >= as->prog->text_end) {
+            as->prog->text_end = as->pc + 1;
+        }
+    }
+    as->pc++;
+    return 0;
+}
+
+static int emit16(Assembler* as, uint32_t v) {
+    if (emit8(as, v & 0xFF) < 0) return -1;
+    return emit8(as, (v >> 8) & 0xFF);
+}
+
+static int emit32(Assembler* as, uint32_t v) {
+    if (emit16(as, v & 0xFFFF) < 0) return -1;
+    return emit16(as, v >> 16);
+}
+
+static char* trim(char* s) {
+    while (isspace((unsigned char)*s)) s++;
+    char* end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    return s;
+}
+
+static int parse_register(const char* s) {
+    if ((s[0] != 'r' && s[0] != 'R') || !isdigit((unsigned char)s[1])) return -1;
+    char* end;
+    long n = strtol(s + 1, &end, 10);
+    if (*end != '\0' || n < 0 || n >= NUM_GPRS) return -1;
+    return (int)n;
+}
+
+/* Number, character literal, or label with an optional +/- offset */
+static int parse_value(Assembler* as, const char* s, uint32_t* out) {
+    char buf[MAX_LABEL_LENGTH];
+    s = s[0] == '+' ? s + 1 : s;
+
+    if (s[0] == '\'' && s[1] && s[2] == '\'' && s[3] == '\0') {
+        *out = (unsigned char)s[1];
+        return 0;
+    }
+    if (isdigit((unsigned char)s[0]) || s[0] == '-') {
+        char* end;
+        long long v = strtoll(s, &end, 0);
+        if (*end != '\0') return asm_error(as, "bad number", s);
+        *out = (uint32_t)v;
+        return 0;
+    }
+    if (!isalpha((unsigned char)s[0]) && s[0] != '_' && s[0] != '.') {
+        return asm_error(as, "bad operand", s);
+    }
+
+    size_t n = strcspn(s, "+-");
+    if (n >= sizeof(buf)) return asm_error(as, "label too long", s);
+    memcpy(buf, s, n);
+    buf[n] = '\0';
+
+    uint32_t offset = 0;
+    if (s[n] && parse_value(as, s[n] == '+' ? s + n + 1 : s + n, &offset) < 0) return -1;
+
+    Label* label = find_label(as, buf);
+    if (!label) {
+        if (as->pass == 2) return asm_error(as, "undefined label", buf);
+        *out = 0;
+        return 0;
+    }
+    *out = label->addr + offset;
+    return 0;
+}
+
+static int parse_operand(Assembler* as, char* s, Operand* op) {
+    s = trim(s);
+    op->reg = 0;
+    op->value = 0;
+
+    if (s[0] == '[') {
+        size_t len = strlen(s);
+        if (len < 3 || s[len - 1] != ']') return asm_error(as, "unterminated memory operand", s);
+        s[len - 1] = '\0';
+        char* inner = trim(s + 1);
+        op->kind = OPND_MEM;
+
+        /* [rN], [rN+disp], [rN-disp] or [addr] */
+        char* sign = strpbrk(inner, "+-");
+        char saved = sign ? *sign : '\0';
+        if (sign) *sign = '\0';
+        int reg = parse_register(trim(inner));
+        if (sign) *sign = saved;
+
+        if (reg < 0) {
+            return parse_value(as, inner, &op->value);
+        }
+        if (reg == 0) {
+            return asm_error(as, "r0 cannot be used as a base register", NULL);
+        }
+        op->reg = reg;
+        if (sign) {
+            uint32_t disp;
+            if (parse_value(as, trim(sign + 1), &disp) < 0) return -1;
+            op->value = saved == '-' ? (uint32_t)-disp : disp;
+        }
+        return 0;
+    }
+
+    int reg = parse_register(s);
+    if (reg >= 0) {
+        op->kind = OPND_REG;
+        op->reg = reg;
+        return 0;
+    }
+
+    op->kind = OPND_VALUE;
+    return parse_value(as, s, &op->value);
+}
+
+/* Split operands on commas that are outside quotes */
+static int split_operands(char* s, char* out[], int max) {
+    int count = 0;
+    int quoted = 0;
+    if (*trim(s) == '\0') return 0;
+
+    out[count++] = s;
+    for (char* p = s; *p; p++) {
+        if (*p == '"' && (p == s || p[-1] != '\\')) {
+            quoted = !quoted;
+        } else if (*p == ',' && !quoted) {
+            *p = '\0';
+            if (count == max) return -1;
+            out[count++] = p + 1;
+        }
+    }
+    return count;
+}
+
+static int emit_string(Assembler* as, const char* s) {
+    s = trim((char*)s);
+    size_t len = strlen(s);
+    if (len < 2 || s[0] != '"' || s[len - 1] != '"') {
+        return asm_error(as, "expected quoted string", s);
+    }
+    for (size_t i = 1; i < len - 1; i++) {
+        char ch = s[i];
+        if (ch == '\\' && i + 1 < len - 1) {
+            switch (s[++i]) {
+                case 'n': ch = '\n'; break;
+                case 't': ch = '\t'; break;
+                case '0': ch = '\0'; break;
+                default: ch = s[i]; break;
+            }
+        }
+        if (emit8(as, (unsigned char)ch) < 0) return -1;
+    }
+    return 0;
+}
+
+static int assemble_directive(Assembler* as, const char* name, char* args) {
+    char* ops[MAX_OPERANDS];
+    uint32_t v;
+
+    if (strcasecmp(name, ".string") == 0) {
+        return emit_string(as, args);
+    }
+
+    int count = split_operands(args, ops, MAX_OPERANDS);
+    if (count < 0) return asm_error(as, "too many operands", NULL);
+
+    if (strcasecmp(name, ".org") == 0) {
+        if (count != 1 || parse_value(as, trim(ops[0]), &v) < 0) {
+            return asm_error(as, "usage", ".org <address>");
+        }
+        if (v >= MEM_SIZE) return asm_error(as, ".org outside the address space", NULL);
+        as->pc = v;
+        return 0;
+    }
+    if (strcasecmp(name, ".space") == 0) {
+        if (count != 1 || parse_value(as, trim(ops[0]), &v) < 0) {
+            return asm_error(as, "usage", ".space <bytes>");
+        }
+        while (v--) {
+            if (emit8(as, 0) < 0) return -1;
+        }
+        return 0;
+    }
+    if (strcasecmp(name, ".word") == 0 || strcasecmp(name, ".byte") == 0) {
+        int word = strcasecmp(name, ".word") == 0;
+        for (int i = 0; i < count; i++) {
+            if (parse_value(as, trim(ops[i]), &v) < 0) return -1;
+            if ((word ? emit32(as, v) : emit8(as, v)) < 0) return -1;
+        }
+        return 0;
+    }
+    return asm_error(as, "unknown directive", name);
+}
+
+static int emit_regpair(Assembler* as, uint8_t opcode, Operand* a, Operand* b) {
+    if (emit8(as, opcode) < 0) return -1;
+    return emit8(as, (a->reg << 4) | b->reg);
+}
+
+static int assemble_instruction(Assembler* as, const char* mnemonic, char* args) {
+    static const struct {
+        const char* name;
+        uint8_t opcode;
+    } alu[] = {
+        {"ADD", OP_ADD}, {"SUB", OP_SUB}, {"MUL", OP_MUL}, {"DIV", OP_DIV}
+    };
+    static const struct {
+        const char* name;
+        uint8_t opcode;
+    } branch[] = {
+        {"JMP", OP_JMP}, {"JZ", OP_JZ}, {"JNZ", OP_JNZ}, {"CALL", OP_CALL}
+    };
+
+    char* texts[MAX_OPERANDS];
+    Operand ops[MAX_OPERANDS];
+    int count = split_operands(args, texts, MAX_OPERANDS);
+    if (count < 0) return asm_error(as, "too many operands", NULL);
+    for (int i = 0; i < count; i++) {
+        if (parse_operand(as, texts[i], &ops[i]) < 0) return -1;
+    }
+
+    if (strcasecmp(mnemonic, "MOV") == 0) {
+        if (count != 2) return asm_error(as, "MOV takes two operands", NULL);
+        Operand* dst = &ops[0];
+        Operand* src = &ops[1];
+        if (dst->kind == OPND_REG && src->kind == OPND_REG) {
+            return emit_regpair(as, OP_MOV_RR, dst, src);
+        }
+        if (dst->kind == OPND_REG && src->kind == OPND_VALUE) {
+            if (emit8(as, OP_MOV_RI) < 0 || emit8(as, dst->reg << 4) < 0) return -1;
+            return emit32(as, src->value);
+        }
+        if (dst->kind == OPND_REG && src->kind == OPND_MEM) {
+            if (emit8(as, OP_LOAD) < 0 || emit8(as, (dst->reg << 4) | src->reg) < 0) return -1;
+            return emit16(as, src->value);
+        }
+        if (dst->kind == OPND_MEM && src->kind == OPND_REG) {
+            if (emit8(as, OP_STORE) < 0 || emit8(as, (src->reg << 4) | dst->reg) < 0) return -1;
+            return emit16(as, dst->value);
+        }
+        return asm_error(as, "unsupported MOV operand combination", NULL);
+    }
+
+    for (size_t i = 0; i < sizeof(alu) / sizeof(alu[0]); i++) {
+        if (strcasecmp(mnemonic, alu[i].name) == 0) {
+            if (count != 2 || ops[0].kind != OPND_REG || ops[1].kind != OPND_REG) {
+                return asm_error(as, "expected two registers", mnemonic);
+            }
+            return emit_regpair(as, alu[i].opcode, &ops[0], &ops[1]);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(branch) / sizeof(branch[0]); i++) {
+        if (strcasecmp(mnemonic, branch[i].name) == 0) {
+            if (count != 1 || ops[0].kind != OPND_VALUE) {
+                return asm_error(as, "expected an address", mnemonic);
+            }
+            if (emit8(as, branch[i].opcode) < 0) return -1;
+            return emit16(as, ops[0].value);
+        }
+    }
+
+    if (strcasecmp(mnemonic, "INT") == 0) {
+        if (count != 1 || ops[0].kind != OPND_VALUE || ops[0].value > 0xFF) {
+            return asm_error(as, "expected an interrupt number", NULL);
+        }
+        if (emit8(as, OP_INT) < 0) return -1;
+        return emit8(as, ops[0].value);
+    }
+
+    uint8_t opcode;
+    if (strcasecmp(mnemonic, "RET") == 0) opcode = OP_RET;
+    else if (strcasecmp(mnemonic, "SYSCALL") == 0) opcode = OP_SYSCALL;
+    else if (strcasecmp(mnemonic, "HLT") == 0) opcode = OP_HLT;
+    else return asm_error(as, "unknown instruction", mnemonic);
+
+    if (count != 0) return asm_error(as, "unexpected operands", mnemonic);
+    return emit8(as, opcode);
+}
+
+/* Remove a trailing comment, ignoring comment characters inside quotes */
+static void strip_comment(char* line) {
+    int quoted = 0;
+    for (char* p = line; *p; p++) {
+        if (*p == '"' && (p == line || p[-1] != '\\')) quoted = !quoted;
+        if (!quoted && (*p == ';' || *p == '#')) {
+            *p = '\0';
+            return;
+        }
+    }
+}
+
+static int assemble_line(Assembler* as, char* line) {
+    strip_comment(line);
+    char* s = trim(line);
+
+    /* Leading label */
+    char* colon = strchr(s, ':');
+    if (colon && !strchr(s, '"') && colon == s + strcspn(s, " \t:")) {
+        *colon = '\0';
+        if (as->pass == 1) {
+            if (find_label(as, s)) return asm_error(as, "duplicate label", s);
+            if (as->label_count == MAX_LABELS) return asm_error(as, "too many labels", NULL);
+            if (strlen(s) >= MAX_LABEL_LENGTH) return asm_error(as, "label too long", s);
+            Label* label = &as->labels[as->label_count++];
+            strcpy(label->name, s);
+            label->addr = as->pc;
+        }
+        s = trim(colon + 1);
+    }
+    if (*s == '\0') return 0;
+
+    char* args = s + strcspn(s, " \t");
+    if (*args) *args++ = '\0';
+
+    if (s[0] == '.') return assemble_directive(as, s, args);
+    return assemble_instruction(as, s, args);
+}
+
+static int compare_symbols(const void* a, const void* b) {
+    uint32_t x = ((const Symbol*)a)->addr, y = ((const Symbol*)b)->addr;
+    return x < y ? -1 : (x > y);
+}
+
+int assemble(const char* source, Program* prog, char* err, size_t errlen) {
+    Assembler* as = calloc(1, sizeof(Assembler));
+    if (!as) {
+        snprintf(err, errlen, "out of memory");
+        return -1;
+    }
+    as->prog = prog;
+    as->err = err;
+    as->errlen = errlen;
+    memset(prog, 0, sizeof(*prog));
+
+    int result = 0;
+    for (as->pass = 1; as->pass <= 2 && result == 0; as->pass++) {
+        const char* p = source;
+        as->pc = TEXT_BASE;
+        as->line = 0;
+        while (*p && result == 0) {
+            char line[MAX_LINE_LENGTH];
+            size_t n = strcspn(p, "\n");
+            as->line++;
+            if (n >= sizeof(line)) {
+                result = asm_error(as, "line too long", NULL);
+                break;
+            }
+            memcpy(line, p, n);
+            line[n] = '\0';
+            result = assemble_line(as, line);
+            p += n + (p[n] == '\n');
+        }
+    }
+
+    Label* start = find_label(as, "_start");
+    prog->entry = start ? start->addr : TEXT_BASE;
+    for (int i = 0; i < as->label_count; i++) {
+        if (as->labels[i].addr < HEAP_BASE) prog->symbols[prog->nsymbols++] = as->labels[i];
+    }
+    qsort(prog->symbols, prog->nsymbols, sizeof(Symbol), compare_symbols);
+    free(as);
+    return result;
+}
+
+/* The last text label at or before addr, or NULL */
+const Symbol* program_symbol(const Program* prog, uint32_t addr) {
+    uint32_t lo = 0, hi = prog->nsymbols;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (prog->symbols[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo ? &prog->symbols[lo - 1] : NULL;
+}
+
+int assemble_file(const char* path, Program* prog, char* err, size_t errlen) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        snprintf(err, errlen, "%s: cannot open", path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char* source = malloc(size + 1);
+    if (!source || fread(source, 1, size, f) != (size_t)size) {
+        snprintf(err, errlen, "%s: read error", path);
+        free(source);
+        fclose(f);
+        return -1;
+    }
+    source[size] = '\0';
+    fclose(f);
+
+    int result = assemble(source, prog, err, errlen);
+    free(source);
+    return result;
+}
+
+const char* opcode_name(uint8_t opcode) {
+    switch (opcode) {
+        case OP_HLT: return "HLT";
+        case OP_MOV_RR: return "MOV.rr";
+        case OP_MOV_RI: return "MOV.ri";
+        case OP_LOAD: return "LOAD";
+        case OP_STORE: return "STORE";
+        case OP_ADD: return "ADD";
+        case OP_SUB: return "SUB";
+        case OP_MUL: return "MUL";
+        case OP_DIV: return "DIV";
+        case OP_JMP: return "JMP";
+        case OP_JZ: return "JZ";
+        case OP_JNZ: return "JNZ";
+        case OP_CALL: return "CALL";
+        case OP_RET: return "RET";
+        case OP_SYSCALL: return "SYSCALL";
+        case OP_INT: return "INT";
+        default: return "???";
+    }
+}
+
+static void format_mem(char* out, size_t len, uint8_t base, uint32_t disp) {
+    if (base == 0) {
+        snprintf(out, len, "[0x%04X]", disp);
+    } else if (disp & 0x8000) {
+        snprintf(out, len, "[r%d-%u]", base, 0x10000 - disp);
+    } else if (disp) {
+        snprintf(out, len, "[r%d+%u]", base, disp);
+    } else {
+        snprintf(out, len, "[r%d]", base);
+    }
+}
+
+/* Disassemble one instruction; returns its size, 0 for undefined opcodes */
+int disassemble(const uint8_t* mem, uint32_t pc, char* out, size_t outlen) {
+    const uint8_t* ip = mem + pc;
+    int a = ip[1] >> 4;
+    int b = ip[1] & 15;
+    uint32_t addr16 = ip[1] | ip[2] << 8;
+    uint32_t disp = ip[2] | ip[3] << 8;
+    char m[32];
+
+    switch (ip[0]) {
+        case OP_HLT: snprintf(out, outlen, "HLT"); break;
+        case OP_MOV_RR: snprintf(out, outlen, "MOV r%d, r%d", a, b); break;
+        case OP_MOV_RI:
+            snprintf(out, outlen, "MOV r%d, 0x%X", a,
+                     (uint32_t)(ip[2] | ip[3] << 8 | ip[4] << 16 | (uint32_t)ip[5] << 24));
+            break;
+        case OP_LOAD:
+            format_mem(m, sizeof(m), b, disp);
+            snprintf(out, outlen, "MOV r%d, %s", a, m);
+            break;
+        case OP_STORE:
+            format_mem(m, sizeof(m), b, disp);
+            snprintf(out, outlen, "MOV %s, r%d", m, a);
+            break;
+        case OP_ADD: snprintf(out, outlen, "ADD r%d, r%d", a, b); break;
+        case OP_SUB: snprintf(out, outlen, "SUB r%d, r%d", a, b); break;
+        case OP_MUL: snprintf(out, outlen, "MUL r%d, r%d", a, b); break;
+        case OP_DIV: snprintf(out, outlen, "DIV r%d, r%d", a, b); break;
+        case OP_JMP: snprintf(out, outlen, "JMP 0x%04X", addr16); break;
+        case OP_JZ: snprintf(out, outlen, "JZ 0x%04X", addr16); break;
+        case OP_JNZ: snprintf(out, outlen, "JNZ 0x%04X", addr16); break;
+        case OP_CALL: snprintf(out, outlen, "CALL 0x%04X", addr16); break;
+        case OP_RET: snprintf(out, outlen, "RET"); break;
+        case OP_SYSCALL: snprintf(out, outlen, "SYSCALL"); break;
+        case OP_INT: snprintf(out, outlen, "INT %u", ip[1]); break;
+        default:
+            snprintf(out, outlen, ".byte 0x%02X", ip[0]);
+            return 0;
+    }
+    return insn_size[ip[0]];
+}
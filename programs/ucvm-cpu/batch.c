@@ -0,0 +1,158 @@
+/* UCVM CPU Engine - batch execution on host threads
+ * Runs many independent programs on a pool of worker threads, M jobs on
+ * N workers. Each job is a whole VM, so its memory, processes and code
+ * caches stay private and the workers share nothing but the job queues.
+ *
+ * A job runs for BATCH_SLICE instructions at a time and then goes to
+ * the back of its worker's queue, so long jobs cannot hold a worker
+ * while short ones wait. Each worker has its own queue and takes from
+ * the front. A worker whose queue is empty steals from the back of
+ * another's, so jobs move to whichever cores are idle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include "ucvm.h"
+
+#define BATCH_SLICE 1000000  /* instructions a job runs before requeueing */
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t* slots;        /* job indices, a ring of njobs entries */
+    uint32_t head, tail;    /* free-running, slot = counter % njobs */
+} BatchQueue;
+
+typedef struct {
+    BatchJob* jobs;
+    uint32_t njobs;
+    uint32_t nworkers;
+    BatchQueue* queues;
+    uint32_t remaining;     /* jobs not yet finished, updated atomically */
+} Batch;
+
+typedef struct {
+    Batch* batch;
+    uint32_t id;
+} BatchWorker;
+
+static void* batch_calloc(size_t n, size_t size) {
+    void* p = calloc(n, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void queue_push(Batch* b, BatchQueue* q, uint32_t job) {
+    pthread_mutex_lock(&q->lock);
+    q->slots[q->tail++ % b->njobs] = job;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Take a job from the front (the owner) or the back (a thief) */
+static int queue_pop(Batch* b, BatchQueue* q, int steal, uint32_t* job) {
+    int found = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->head != q->tail) {
+        *job = steal ? q->slots[--q->tail % b->njobs] : q->slots[q->head++ % b->njobs];
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+/* Run one slice of a job. Returns non-zero once it has finished. */
+static int run_slice(BatchJob* job) {
+    if (!job->vm) {
+        job->vm = malloc(sizeof(VM));
+        if (!job->vm) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        vm_init(job->vm);
+        job->vm->engine = job->engine;
+        job->vm->fuse = job->fuse;
+        job->vm->lazy_flags = job->lazy_flags;
+        vm_load(job->vm, job->prog);
+    }
+    VMStatus st = vm_run(job->vm, BATCH_SLICE);
+    if (st == VM_BUDGET) return 0;
+
+    job->status = st;
+    job->exit_status = job->vm->exit_status;
+    job->fault = job->vm->fault;
+    job->fault_addr = job->vm->fault_addr;
+    job->icount = job->vm->icount;
+    vm_destroy(job->vm);
+    free(job->vm);
+    job->vm = NULL;
+    return 1;
+}
+
+static void* worker_main(void* arg) {
+    BatchWorker* w = arg;
+    Batch* b = w->batch;
+    BatchQueue* own = &b->queues[w->id];
+
+    while (__atomic_load_n(&b->remaining, __ATOMIC_ACQUIRE)) {
+        uint32_t job;
+        int found = queue_pop(b, own, 0, &job);
+        for (uint32_t i = 1; !found && i < b->nworkers; i++) {
+            found = queue_pop(b, &b->queues[(w->id + i) % b->nworkers], 1, &job);
+        }
+        if (!found) {
+            sched_yield();
+            continue;
+        }
+        if (run_slice(&b->jobs[job])) {
+            __atomic_sub_fetch(&b->remaining, 1, __ATOMIC_RELEASE);
+        } else {
+            queue_push(b, own, job);
+        }
+    }
+    return NULL;
+}
+
+/* Run every job to completion on up to nworkers threads, filling in
+ * each job's results. Jobs are dealt round-robin to start with. If the
+ * host refuses a thread, the others steal its share.
+ */
+void batch_run(BatchJob* jobs, uint32_t njobs, uint32_t nworkers) {
+    if (njobs == 0) return;
+    if (nworkers == 0) nworkers = 1;
+    if (nworkers > njobs) nworkers = njobs;
+
+    Batch b = {jobs, njobs, nworkers, batch_calloc(nworkers, sizeof(BatchQueue)), njobs};
+    BatchWorker* workers = batch_calloc(nworkers, sizeof(BatchWorker));
+    pthread_t* threads = batch_calloc(nworkers, sizeof(pthread_t));
+    for (uint32_t i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&b.queues[i].lock, NULL);
+        b.queues[i].slots = batch_calloc(njobs, sizeof(uint32_t));
+        workers[i].batch = &b;
+        workers[i].id = i;
+    }
+    for (uint32_t i = 0; i < njobs; i++) {
+        jobs[i].vm = NULL;
+        queue_push(&b, &b.queues[i % nworkers], i);
+    }
+
+    /* Worker 0 is the calling thread */
+    uint32_t started = 1;
+    while (started < nworkers &&
+           pthread_create(&threads[started], NULL, worker_main, &workers[started]) == 0) {
+        started++;
+    }
+    worker_main(&workers[0]);
+    for (uint32_t i = 1; i < started; i++) pthread_join(threads[i], NULL);
+
+    for (uint32_t i = 0; i < nworkers; i++) {
+        pthread_mutex_destroy(&b.queues[i].lock);
+        free(b.queues[i].slots);
+    }
+    free(b.queues);
+    free(workers);
+    free(threads);
+}
@@ -0,0 +1,149 @@
+/* UCVM CPU Engine - in-memory checkpoints (spec section 2.3)
+ * checkpoint() and restore() without a file, cheap enough to take
+ * thousands a second for reverse execution and fuzzing. A checkpoint
+ * holds the records a snapshot stores and a copy of every page table,
+ * with a reference on each frame the tables map. Taking one makes the
+ * writable pages copy-on-write, as fork does, so the machine runs on
+ * without touching the frames the checkpoint holds. Taking costs a pass
+ * over the page tables and copies no memory.
+ *
+ * The same trap tracks the dirty pages: a page written since the
+ * checkpoint was given a new frame on the way through cow_break. Restore
+ * compares each page table with its copy and remaps only the entries
+ * that differ, so its work beyond that compare is in the pages dirtied,
+ * and it copies nothing either. A checkpoint is not used up by a restore;
+ * a fuzzer can return to the same one for every input.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "exec.h"
+#include "snapshot.h"
+
+/* One process: its records, then its page table */
+typedef struct {
+    _Alignas(8) uint8_t head[SNAP_PROCESS_HEAD];    /* a SnapProcess up to its page table */
+    SnapIO io;
+    PageTableEntry pt[NUM_PAGES];
+} CheckpointProcess;
+
+struct Checkpoint {
+    SnapCPU cpu;
+    SnapClock clock;
+    CheckpointProcess* procs;
+    uint32_t nprocs;
+    uint32_t pids[MAX_PROCS / 32];  /* bit n set: pid n is in procs */
+};
+
+static void* checkpoint_calloc(size_t n, size_t size) {
+    void* p = calloc(n, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/* The process after p in a walk of the process tree from init: its
+ * children, then its zombies, then its siblings. A zombie has no
+ * children of its own; they passed to init when it exited.
+ */
+static Process* walk_next(Process* p) {
+    if (p->children) return p->children;
+    if (p->zombies) return p->zombies;
+    for (; p->parent; p = p->parent) {
+        if (p->sibling) return p->sibling;
+        if (p->state != PROC_ZOMBIE && p->parent->zombies) return p->parent->zombies;
+    }
+    return NULL;
+}
+
+static int has_pid(const Checkpoint* cp, uint32_t pid) {
+    return (cp->pids[pid / 32] >> (pid % 32)) & 1;
+}
+
+/* Save the machine in a checkpoint held in memory. The checkpoint belongs
+ * to vm, whose frames it shares, and must be freed before vm is
+ * destroyed.
+ */
+Checkpoint* checkpoint_take(VM* vm) {
+    Checkpoint* cp = checkpoint_calloc(1, sizeof(Checkpoint));
+    cp->procs = checkpoint_calloc(vm->nprocs ? vm->nprocs : 1, sizeof(CheckpointProcess));
+    snapshot_save_machine(vm, &cp->cpu, &cp->clock);
+    for (Process* p = vm->procs[1]; p && cp->nprocs < vm->nprocs; p = walk_next(p)) {
+        CheckpointProcess* c = &cp->procs[cp->nprocs++];
+        snapshot_save_head((SnapProcess*)(void*)c->head, &c->io, p);
+        mem_share(p->pt, c->pt);
+        for (uint32_t i = 0; i < TLB_ENTRIES; i++) p->tlb[i].write_tag = TLB_INVALID;
+        cp->pids[p->pid / 32] |= 1u << (p->pid % 32);
+    }
+    return cp;
+}
+
+/* Point p's pages back at the frames of pt, dropping the frames they
+ * were given since. Entries still equal to pt are left alone.
+ */
+static void restore_pages(VM* vm, Process* p, const PageTableEntry* pt) {
+    for (uint32_t page = 0; page < NUM_PAGES; page++) {
+        PageTableEntry* e = &p->pt[page];
+        if (e->frame == pt[page].frame && e->flags == pt[page].flags) continue;
+        if (pt[page].frame) frame_ref(pt[page].frame);
+        if (e->frame) frame_unref(vm, e->frame);
+        *e = pt[page];
+        TLBEntry* t = &p->tlb[page & (TLB_ENTRIES - 1)];
+        t->read_tag = t->write_tag = TLB_INVALID;
+    }
+}
+
+/* Return the machine to the state saved in cp. The engine settings are
+ * kept, and output already written stays written. A journal cannot log
+ * the jump, so a machine being journaled is not restored. Returns 0, or
+ * -1 with a message in err.
+ */
+int checkpoint_restore(VM* vm, const Checkpoint* cp, char* err, size_t errlen) {
+    if (vm->journal) {
+        snprintf(err, errlen, "cannot restore a checkpoint while journaling");
+        return -1;
+    }
+
+    /* Processes forked since the checkpoint go first */
+    Process** gone = checkpoint_calloc(vm->nprocs ? vm->nprocs : 1, sizeof(Process*));
+    uint32_t ngone = 0, seen = 0;
+    for (Process* p = vm->procs[1]; p && seen < vm->nprocs; p = walk_next(p), seen++) {
+        if (!has_pid(cp, p->pid)) gone[ngone++] = p;
+    }
+    for (uint32_t i = 0; i < ngone; i++) proc_free(vm, gone[i]);
+    free(gone);
+
+    for (uint32_t i = 0; i < cp->nprocs; i++) {
+        const CheckpointProcess* c = &cp->procs[i];
+        Process* p = vm->procs[c->io.pid];
+        if (!p) p = proc_create_at(vm, c->io.pid);
+        restore_pages(vm, p, c->pt);
+    }
+    for (uint32_t i = 0; i < cp->nprocs; i++) {
+        const CheckpointProcess* c = &cp->procs[i];
+        snapshot_link_process(vm, vm->procs[c->io.pid], (const SnapProcess*)(const void*)c->head, &c->io, 0);
+    }
+    for (uint32_t i = 0; i < cp->nprocs; i++) {
+        Process* p = vm->procs[cp->procs[i].io.pid];
+        if (p->sibling && p->state != PROC_ZOMBIE) p->sibling->sibling_prev = p;
+        trace_rewind(p, cp->clock.icount);
+    }
+
+    /* Equal text ids still mean equal text: frames a checkpoint holds are
+     * never written in place, so the code caches survive unless the
+     * running image changed.
+     */
+    uint32_t cached = vm->text_id;
+    snapshot_link_machine(vm, &cp->cpu, &cp->clock);
+    if (vm->text_id != cached) code_flush(vm);
+    return 0;
+}
+
+void checkpoint_free(VM* vm, Checkpoint* cp) {
+    for (uint32_t i = 0; i < cp->nprocs; i++) mem_release(vm, cp->procs[i].pt);
+    free(cp->procs);
+    free(cp);
+}
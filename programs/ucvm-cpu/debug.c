@@ -0,0 +1,210 @@
+/* UCVM CPU Engine - reverse execution
+ * A Debugger runs a machine forward, taking an in-memory checkpoint
+ * every DEBUG_INTERVAL instructions and recording its host I/O in a
+ * replay log. Going back to instruction n restores the last checkpoint
+ * at or before n and runs forward to n again. The log feeds the re-run
+ * the input the first run read and keeps it from repeating output, so it
+ * retraces the first run exactly. A step back over any distance costs
+ * one restore and at most DEBUG_INTERVAL instructions at full speed.
+ *
+ * Checkpoints pin the frames written between them, so at most
+ * DEBUG_CHECKPOINTS are held. When that many are, every other one in
+ * the older half goes: recent history stays dense and older history
+ * thins out, and the first checkpoint is always kept.
+ *
+ * The file system is not in the checkpoints, so a re-run through a
+ * file-system call would make it again, against files that already have
+ * it. A checkpoint counts only if the guest has not used the file
+ * system since it was taken; history before the first that does is out
+ * of reach.
+ *
+ * Breakpoints and watchpoints are the machine's own (trap.c), so runs
+ * between them go at full speed. Going back and stepping run through
+ * them. reverse-continue looks for the last stop at one by re-running
+ * the stretches before the current position, latest first, then returns
+ * to it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "exec.h"
+
+typedef struct {
+    Checkpoint* cp;
+    uint64_t icount;
+    uint64_t replay_pos;
+    uint64_t fs_calls;
+} DebugPoint;
+
+struct Debugger {
+    VM* vm;
+    DebugPoint points[DEBUG_CHECKPOINTS];   /* by icount */
+    uint32_t npoints;
+};
+
+static void take(Debugger* d) {
+    if (d->npoints == DEBUG_CHECKPOINTS) {
+        uint32_t kept = 1;
+        for (uint32_t i = 1; i < d->npoints; i++) {
+            if (i < d->npoints / 2 && (i & 1)) {
+                checkpoint_free(d->vm, d->points[i].cp);
+            } else {
+                d->points[kept++] = d->points[i];
+            }
+        }
+        d->npoints = kept;
+    }
+    DebugPoint* p = &d->points[d->npoints++];
+    p->cp = checkpoint_take(d->vm);
+    p->icount = d->vm->icount;
+    p->replay_pos = replay_tell(d->vm);
+    p->fs_calls = d->vm->fs_calls;
+}
+
+/* Start debugging vm from where it is. vm must not be journaled, and is
+ * recorded until debug_close.
+ */
+Debugger* debug_open(VM* vm) {
+    Debugger* d = calloc(1, sizeof(Debugger));
+    if (!d) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    d->vm = vm;
+    replay_open(vm);
+    take(d);
+    return d;
+}
+
+void debug_close(Debugger* d) {
+    for (uint32_t i = 0; i < d->npoints; i++) checkpoint_free(d->vm, d->points[i].cp);
+    replay_close(d->vm);
+    free(d);
+}
+
+/* The first checkpoint the machine can go back to, or npoints if there
+ * is none
+ */
+static uint32_t first_point(const Debugger* d) {
+    uint32_t i = d->npoints;
+    while (i > 0 && d->points[i - 1].fs_calls == d->vm->fs_calls) i--;
+    return i;
+}
+
+/* The earliest instruction the machine can be taken back to. *cut is
+ * set if file-system calls keep it from going back further.
+ */
+uint64_t debug_first(const Debugger* d, int* cut) {
+    uint32_t i = first_point(d);
+    *cut = i > 0;
+    if (i == d->npoints || d->points[i].icount > d->vm->icount) return d->vm->icount;
+    return d->points[i].icount;
+}
+
+/* Whether the next instruction to run is at a breakpoint */
+static int at_break(const Debugger* d) {
+    const VM* vm = d->vm;
+    if (!vm->proc || vm->stopped || !vm->traps) return 0;
+    return trap_break_at(vm->traps, vm->cpu->pc);
+}
+
+/* Run forward until icount reaches target or the machine stops, or
+ * stops at a breakpoint or watchpoint unless through. Past the last
+ * checkpoint this is new history, and checkpoints are taken as they
+ * fall due, or early once the file system has been used, so that the
+ * history after it can be reached.
+ */
+static VMStatus run_to(Debugger* d, uint64_t target, int through) {
+    VM* vm = d->vm;
+    for (;;) {
+        const DebugPoint* last = &d->points[d->npoints - 1];
+        if ((vm->icount >= last->icount + DEBUG_INTERVAL || vm->fs_calls != last->fs_calls) &&
+            !vm->stopped) {
+            take(d);
+            last = &d->points[d->npoints - 1];
+        }
+        if (vm->icount >= target) return VM_BUDGET;
+        uint64_t end = last->icount + DEBUG_INTERVAL < target ? last->icount + DEBUG_INTERVAL : target;
+        VMStatus st = vm_run(vm, end - vm->icount);
+        if (st == VM_BREAK && through && trap_hit(vm, NULL)) continue;
+        if (st != VM_BUDGET) return st;
+    }
+}
+
+/* Put the machine back at instruction target, which must not be before
+ * the first checkpoint or after the current position
+ */
+static void go_to(Debugger* d, uint64_t target) {
+    uint32_t lo = 0, hi = d->npoints - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (d->points[mid].icount <= target) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    char err[128];      /* only a journaled machine refuses */
+    checkpoint_restore(d->vm, d->points[lo].cp, err, sizeof(err));
+    replay_seek(d->vm, d->points[lo].replay_pos);
+    trap_resume(d->vm, 0);
+    run_to(d, target, 1);
+}
+
+/* Run n instructions forward, through any breakpoints */
+VMStatus debug_step(Debugger* d, uint64_t n) {
+    return run_to(d, d->vm->icount + n, 1);
+}
+
+/* Run forward until a breakpoint or watchpoint is reached or the machine
+ * stops. Returns VM_BREAK at one. The current instruction runs even if
+ * it has a breakpoint.
+ */
+VMStatus debug_continue(Debugger* d) {
+    trap_resume(d->vm, 1);
+    return run_to(d, UINT64_MAX, 0);
+}
+
+/* Go back n instructions, or as far as debug_first allows. Returns
+ * VM_BREAK if that lands on a breakpoint, VM_BUDGET otherwise.
+ */
+VMStatus debug_reverse_step(Debugger* d, uint64_t n) {
+    int cut;
+    uint64_t first = debug_first(d, &cut), now = d->vm->icount;
+    if (now > first) go_to(d, now - first > n ? now - n : first);
+    return at_break(d) ? VM_BREAK : VM_BUDGET;
+}
+
+/* Go back to the last stop at a breakpoint or watchpoint, or as far as
+ * debug_first allows if there was none. Returns VM_BREAK at one,
+ * VM_BUDGET at the start.
+ */
+VMStatus debug_reverse_continue(Debugger* d) {
+    VM* vm = d->vm;
+    uint64_t now = vm->icount;
+    uint32_t first = first_point(d);
+    uint32_t i = d->npoints;
+    while (i > first && d->points[i - 1].icount >= now) i--;
+
+    for (uint64_t end = now; vm->traps && i > first; end = d->points[--i].icount) {
+        uint64_t hit = UINT64_MAX;
+        uint8_t kind = 0;
+        uint32_t addr = 0;
+        go_to(d, d->points[i - 1].icount);
+        while (run_to(d, end, 0) == VM_BREAK && trap_hit(vm, NULL)) {
+            hit = vm->icount;
+            kind = trap_hit(vm, &addr);
+        }
+        if (hit != UINT64_MAX) {
+            go_to(d, hit);
+            /* As if the run had just stopped there */
+            vm->traps->hit = kind;
+            vm->traps->hit_addr = addr;
+            vm->traps->step_over = 1;
+            return VM_BREAK;
+        }
+    }
+    if (first < d->npoints && d->points[first].icount < now) go_to(d, d->points[first].icount);
+    return at_break(d) ? VM_BREAK : VM_BUDGET;
+}
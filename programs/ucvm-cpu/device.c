@@ -0,0 +1,74 @@
+/* UCVM CPU Engine - memory-mapped devices (spec section 8.4)
+ * Devices are attached to pages of the MMIO window [MMIO_BASE, MEM_SIZE).
+ * Loads and stores to an attached page reach the device's read and write
+ * entry points through the memory manager's slow path; RAM accesses never
+ * look at the device table.
+ */
+
+#include <unistd.h>
+#include "exec.h"
+
+/* Attach dev to the pages covering [addr, addr + len). addr must be
+ * page-aligned, inside the MMIO window and not already taken. Returns 0
+ * on success and -1 otherwise.
+ */
+int mmio_attach(VM* vm, uint32_t addr, uint32_t len, DeviceDriver* dev) {
+    uint32_t count = (len + PAGE_MASK) >> PAGE_SHIFT;
+    if ((addr & PAGE_MASK) || addr < MMIO_BASE || addr >= MEM_SIZE || len == 0 ||
+        count > (MEM_SIZE - addr) >> PAGE_SHIFT) {
+        return -1;
+    }
+    uint32_t first = (addr - MMIO_BASE) >> PAGE_SHIFT;
+    for (uint32_t i = first; i < first + count; i++) {
+        if (vm->mmio[i].dev) return -1;
+    }
+    for (uint32_t i = first; i < first + count; i++) {
+        vm->mmio[i].dev = dev;
+        vm->mmio[i].base = addr;
+        vm->pt[(MMIO_BASE >> PAGE_SHIFT) + i].flags =
+            PTE_VALID | PTE_READ | PTE_WRITE | PTE_USER | PTE_MMIO;
+        tlb_flush_page(vm, (MMIO_BASE >> PAGE_SHIFT) + i);
+    }
+    return 0;
+}
+
+/* Console: a word-wide UART.
+ *   +0 DATA    write: output the low byte; read: next input byte, -1 at EOF
+ *   +4 STATUS  read: bit 0 set when output is ready (always)
+ * Output goes straight to fd 1 so it interleaves correctly with write().
+ */
+#define CONSOLE_DATA     0x00
+#define CONSOLE_STATUS   0x04
+#define CONSOLE_TX_READY 0x01
+
+static int console_read(DeviceDriver* dev, uint32_t offset, uint8_t* buf, uint32_t len) {
+    (void)dev;
+    uint32_t value;
+    if (len != 4) return -1;
+    if (offset == CONSOLE_DATA) {
+        uint8_t c;
+        value = read(0, &c, 1) == 1 ? c : 0xFFFFFFFFu;
+    } else if (offset == CONSOLE_STATUS) {
+        value = CONSOLE_TX_READY;
+    } else {
+        return -1;
+    }
+    wr32(buf, value);
+    return 4;
+}
+
+static int console_write(DeviceDriver* dev, uint32_t offset, const uint8_t* data, uint32_t len) {
+    (void)dev;
+    if (len != 4 || offset != CONSOLE_DATA) return -1;
+    if (write(1, data, 1) != 1) return -1;
+    return 4;
+}
+
+static int32_t console_ioctl(DeviceDriver* dev, uint32_t cmd, uint32_t arg) {
+    (void)dev; (void)cmd; (void)arg;
+    return -UCVM_ENOTTY;
+}
+
+DeviceDriver console_device = {
+    "console", console_read, console_write, console_ioctl, NULL
+};
@@ -0,0 +1,23 @@
+; Compute 10! recursively, store it at 0x8000 and halt
+_start:
+    MOV r1, 10
+    MOV r2, 1
+    MOV r0, 1
+    CALL fact
+    MOV [result], r0
+    HLT
+
+; r0 = r0 * r1 * (r1 - 1) * ... * 1
+fact:
+    MOV r3, r1
+    SUB r3, r2          ; sets ZF when r1 == 1
+    JZ done
+    MUL r0, r1
+    SUB r1, r2
+    CALL fact
+done:
+    RET
+
+.org 0x8000
+result:
+    .word 0
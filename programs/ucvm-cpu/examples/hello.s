@@ -0,0 +1,19 @@
+; Print a greeting and exit (FULL-mode example)
+_start:
+    MOV r0, 13          ; write(fd, buf, len)
+    MOV r1, 1
+    MOV r2, message
+    MOV r3, 17
+    SYSCALL
+
+    MOV r0, 5           ; the spec's arithmetic example
+    MOV r1, 3
+    ADD r0, r1
+
+    MOV r1, r0          ; exit(8)
+    MOV r0, 2
+    SYSCALL
+
+.org 0x8000
+message:
+    .string "Hello from UCVM!\n"
@@ -0,0 +1,30 @@
+; Look up a missing file, remove its directory, then try to create the
+; file. The cached miss must go with the directory: the open fails with
+; ENOENT, and the result at 0x8000 is -2 (0xFFFFFFFE).
+_start:
+    MOV r0, 16          ; mkdir("/a")
+    MOV r1, dir
+    SYSCALL
+    MOV r0, 10          ; open("/a/x", O_RDONLY): ENOENT, cached
+    MOV r1, file
+    MOV r2, 0
+    SYSCALL
+    MOV r0, 15          ; unlink("/a")
+    MOV r1, dir
+    SYSCALL
+    MOV r0, 10          ; open("/a/x", O_CREAT|O_RDWR)
+    MOV r1, file
+    MOV r2, 0x42
+    SYSCALL
+    MOV [result], r0
+    HLT
+
+.org 0x8000
+result:
+    .word 0
+dir:
+    .string "/a"
+    .byte 0
+file:
+    .string "/a/x"
+    .byte 0
@@ -0,0 +1,540 @@
+/* UCVM CPU Engine - instruction execution
+ * A plain switch interpreter (the reference engine) and a threaded
+ * interpreter using computed-goto dispatch over the raw instruction bytes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ucvm.h"
+#include "exec.h"
+
+const uint8_t insn_size[256] = {
+    [OP_HLT] = 1,
+    [OP_MOV_RR] = 2, [OP_MOV_RI] = 6, [OP_LOAD] = 4, [OP_STORE] = 4,
+    [OP_ADD] = 2, [OP_SUB] = 2, [OP_MUL] = 2, [OP_DIV] = 2,
+    [OP_JMP] = 3, [OP_JZ] = 3, [OP_JNZ] = 3, [OP_CALL] = 3, [OP_RET] = 1,
+    [OP_SYSCALL] = 1, [OP_INT] = 2
+};
+
+/* The VM starts with init (pid 1) running on an empty address space */
+void vm_init(VM* vm) {
+    memset(vm, 0, sizeof(*vm));
+    vm->engine = ENGINE_DECODED;
+    vm->fuse = 1;
+    vm->lazy_flags = 1;
+    vm->next_pid = 1;
+    vm->slice_end = PROC_QUANTUM;
+    vm->boost_at = SCHED_BOOST_INTERVAL;
+
+    Process* init = proc_create(vm);
+    init->state = PROC_RUNNING;
+    init->fd_open = 0x7;    /* stdin, stdout, stderr */
+    init->text_id = vm->text_id = ++vm->next_text_id;
+    init->cpu.pc = TEXT_BASE;
+    init->cpu.sp = STACK_TOP;
+    init->cpu.mode = MODE_USER;
+    vm->proc = init;
+    vm->cpu = &init->cpu;
+    vm->tlb = init->tlb;
+    vm->pt = init->pt;
+    mem_init(vm, HEAP_BASE);
+    mmio_attach(vm, MMIO_BASE, PAGE_SIZE, &console_device);
+}
+
+void vm_destroy(VM* vm) {
+    if (vm->procs) {
+        for (uint32_t pid = 0; pid < MAX_PROCS; pid++) {
+            if (vm->procs[pid]) files_close(vm, vm->procs[pid], 0);
+            free(vm->procs[pid]);
+        }
+        free(vm->procs);
+        vm->procs = NULL;
+    }
+    frame_free_all(vm);
+    icache_free(vm);
+    jit_free(vm);
+    trap_free(vm);
+    fs_free(vm);
+}
+
+/* Throw away every cached translation, for a change of image */
+void code_flush(VM* vm) {
+    icache_flush(vm);
+    jit_flush(vm);
+    memset(vm->code_page, 0, sizeof(vm->code_page));
+}
+
+/* Load a program into the running process, replacing its image */
+void vm_load(VM* vm, const Program* prog) {
+    code_flush(vm);
+    vm->proc->text_id = vm->text_id = ++vm->next_text_id;
+
+    /* The heap starts out mapped up to the end of the program's data */
+    uint32_t brk = HEAP_BASE;
+    for (uint32_t page = HEAP_BASE >> PAGE_SHIFT; page < STACK_BASE >> PAGE_SHIFT; page++) {
+        if (prog->present[page]) brk = (page + 1) << PAGE_SHIFT;
+    }
+    mem_init(vm, brk);
+    for (uint32_t page = 0; page < NUM_PAGES; page++) {
+        uint8_t flags = vm->pt[page].flags;
+        if (!prog->present[page] || !flags || (flags & PTE_MMIO)) continue;
+        if (flags & PTE_COW) flags = (flags & ~PTE_COW) | PTE_WRITE;
+        mem_load_page(vm, page, prog->image + (page << PAGE_SHIFT), flags);
+    }
+    vm->cpu->pc = prog->entry;
+}
+
+static VMStatus run_engine(VM* vm, uint64_t budget) {
+    switch (vm->engine) {
+        case ENGINE_SWITCH:
+            return exec_switch(vm, budget);
+        case ENGINE_THREADED:
+            return exec_threaded(vm, budget);
+        case ENGINE_JIT:
+            return exec_jit(vm, budget);
+        case ENGINE_DECODED:
+        default:
+            return exec_decoded(vm, budget);
+    }
+}
+
+/* run_engine with breakpoints or watchpoints set. A run that stopped at
+ * one steps over it with them off before running on; the stop leaves
+ * the next run to do the same.
+ */
+static VMStatus run_traps(VM* vm, Traps* t, uint64_t budget) {
+    t->hit = 0;
+    if (t->step_over) {
+        t->step_over = 0;
+        t->off = 1;
+        VMStatus st = exec_switch(vm, 1);
+        t->off = 0;
+        if (st != VM_BUDGET || --budget == 0) return st;
+    }
+    VMStatus st = run_engine(vm, budget);
+    if (st == VM_BREAK && t->hit) t->step_over = 1;
+    return st;
+}
+
+/* Run for up to budget instructions, in time slices handed out by the
+ * scheduler in proc.c. A process that blocks or exits hands over to the
+ * next one at once. A halt, fault or breakpoint in any process stops the
+ * machine, as does init's exit or every process blocking. Only a
+ * breakpoint can be run on from; after the others vm_run returns the
+ * same status again.
+ */
+VMStatus vm_run(VM* vm, uint64_t budget) {
+    if (vm->stopped) return vm->stopped;
+    for (;;) {
+        if (!vm->proc) return vm->stopped = VM_EXITED;
+        if (vm->icount >= vm->slice_end) proc_preempt(vm);
+        if (budget == 0) return VM_BUDGET;
+
+        uint64_t slice = vm->slice_end - vm->icount;
+        uint64_t start = vm->icount;
+        uint64_t n = slice < budget ? slice : budget;
+        VMStatus st = unlikely(vm->traps != NULL) ? run_traps(vm, vm->traps, n) : run_engine(vm, n);
+        if (budget != BUDGET_UNLIMITED) budget -= vm->icount - start;
+
+        if (st == VM_BUDGET) continue;
+        if (st == VM_EXITED) {
+            if (proc_exit(vm)) return vm->stopped = VM_EXITED;
+        } else if (st != VM_YIELD) {
+            if (st != VM_BREAK) vm->stopped = st;
+            return st;
+        }
+        if (!proc_schedule(vm)) return vm->stopped = VM_DEADLOCK;
+    }
+}
+
+/* Note that a cache now holds code from a page. Writes to it, and to the
+ * page after it, have to leave the TLB fast path from now on.
+ */
+void code_mark_page(VM* vm, uint32_t page, uint8_t kind) {
+    vm->code_page[page] |= kind;
+    tlb_flush_page(vm, page);
+    if (page + 1 < NUM_PAGES) tlb_flush_page(vm, page + 1);
+}
+
+/* Drop every cached translation of a page after a guest write to it */
+void code_invalidate_page(VM* vm, uint32_t page) {
+    if (vm->code_page[page] & CODE_DECODED) icache_invalidate_page(vm, page);
+    if (vm->code_page[page] & CODE_JIT) jit_invalidate_page(vm, page);
+    vm->code_page[page] = 0;
+}
+
+const char* vm_status_name(VMStatus st) {
+    switch (st) {
+        case VM_RUNNING: return "running";
+        case VM_HALTED: return "halted";
+        case VM_EXITED: return "exited";
+        case VM_FAULT: return "fault";
+        case VM_BREAK: return "breakpoint";
+        case VM_BUDGET: return "budget";
+        case VM_YIELD: return "yield";
+        case VM_DEADLOCK: return "deadlock";
+    }
+    return "unknown";
+}
+
+const char* fault_name(FaultKind f) {
+    switch (f) {
+        case FAULT_NONE: return "none";
+        case FAULT_SEGV: return "segmentation fault";
+        case FAULT_ILL: return "illegal instruction";
+        case FAULT_DIV0: return "division by zero";
+    }
+    return "unknown";
+}
+
+/* A data access failed by trap_watch_hit is a stop at a watchpoint, not
+ * a fault
+ */
+VMStatus raise_fault(VM* vm, FaultKind kind, uint32_t addr) {
+    if (unlikely(vm->traps != NULL) && vm->traps->hit) return VM_BREAK;
+    vm->fault = kind;
+    vm->fault_addr = addr;
+    return VM_FAULT;
+}
+
+/* INT n: 3 is the breakpoint trap, 0x80 is an alias for SYSCALL.
+ * Called with PC already past the 2-byte INT instruction.
+ */
+VMStatus do_interrupt(VM* vm, uint8_t n) {
+    if (n == 3) return VM_BREAK;
+    if (n == 0x80) {
+        VMStatus st = do_syscall(vm);
+        /* A blocked call is made again from the INT, a byte longer */
+        if (st == VM_YIELD && vm->proc->state == PROC_BLOCKED) vm->cpu->pc -= 1;
+        return st;
+    }
+    return raise_fault(vm, FAULT_ILL, vm->cpu->pc - 2);
+}
+
+/* Reference interpreter: fetch, decode and execute in a switch loop.
+ * A faulting instruction does not retire and leaves PC pointing at it.
+ */
+VMStatus exec_switch(VM* vm, uint64_t budget) {
+    CPUState* c = vm->cpu;
+    const TLBEntry* tlb = cpu_tlb(c);
+    const PageTableEntry* pt = vm->pt;
+    const Traps* traps = vm->traps;
+    uint8_t ibuf[MAX_INSN_SIZE];
+    uint32_t* r = c->gpr;
+    uint32_t pc = c->pc;
+    uint64_t left = budget;
+    VMStatus st = VM_RUNNING;
+
+    while (st == VM_RUNNING) {
+        if (left == 0) {
+            st = VM_BUDGET;
+            break;
+        }
+        if (!fetch_ok(pc)) {
+            st = raise_fault(vm, FAULT_SEGV, pc);
+            break;
+        }
+        if (unlikely(traps != NULL) && trap_break_at(traps, pc)) {
+            st = trap_stop(vm, pc);
+            break;
+        }
+        const uint8_t* ip = fetch_insn(vm, pt, pc, ibuf);
+        uint32_t addr;
+
+        switch (ip[0]) {
+            case OP_HLT:
+                pc += 1;
+                st = VM_HALTED;
+                break;
+            case OP_MOV_RR:
+                r[ip[1] >> 4] = r[ip[1] & 15];
+                pc += 2;
+                break;
+            case OP_MOV_RI:
+                r[ip[1] >> 4] = rd32(ip + 2);
+                pc += 6;
+                break;
+            case OP_LOAD:
+                addr = effective_addr(c, ip);
+                if (!mem_load32(vm, tlb, addr, &r[ip[1] >> 4])) {
+                    st = raise_fault(vm, FAULT_SEGV, addr);
+                    continue;
+                }
+                pc += 4;
+                break;
+            case OP_STORE:
+                addr = effective_addr(c, ip);
+                if (!mem_store32(vm, tlb, addr, r[ip[1] >> 4])) {
+                    st = raise_fault(vm, FAULT_SEGV, addr);
+                    continue;
+                }
+                pc += 4;
+                break;
+            case OP_ADD:
+                r[ip[1] >> 4] = alu_add(&c->flags, r[ip[1] >> 4], r[ip[1] & 15]);
+                pc += 2;
+                break;
+            case OP_SUB:
+                r[ip[1] >> 4] = alu_sub(&c->flags, r[ip[1] >> 4], r[ip[1] & 15]);
+                pc += 2;
+                break;
+            case OP_MUL:
+                r[ip[1] >> 4] = alu_mul(&c->flags, r[ip[1] >> 4], r[ip[1] & 15]);
+                pc += 2;
+                break;
+            case OP_DIV:
+                if (r[ip[1] & 15] == 0) {
+                    st = raise_fault(vm, FAULT_DIV0, pc);
+                    continue;
+                }
+                r[ip[1] >> 4] = alu_div(&c->flags, r[ip[1] >> 4], r[ip[1] & 15]);
+                pc += 2;
+                break;
+            case OP_JMP:
+                pc = rd16(ip + 1);
+                break;
+            case OP_JZ:
+                pc = c->flags.zero ? rd16(ip + 1) : pc + 3;
+                break;
+            case OP_JNZ:
+                pc = !c->flags.zero ? rd16(ip + 1) : pc + 3;
+                break;
+            case OP_CALL:
+                if (!mem_store32(vm, tlb, c->sp - 4, pc + 3)) {
+                    st = raise_fault(vm, FAULT_SEGV, c->sp - 4);
+                    continue;
+                }
+                c->sp -= 4;
+                pc = rd16(ip + 1);
+                break;
+            case OP_RET:
+                if (!mem_load32(vm, tlb, c->sp, &addr)) {
+                    st = raise_fault(vm, FAULT_SEGV, c->sp);
+                    continue;
+                }
+                pc = addr & 0xFFFF;
+                c->sp += 4;
+                break;
+            case OP_SYSCALL:
+                c->pc = pc + 1;
+                vm->icount += budget - left + 1;    /* the call sees itself retired */
+                budget = left - 1;
+                st = do_syscall(vm);
+                pc = c->pc;
+                break;
+            case OP_INT:
+                c->pc = pc + 2;
+                vm->icount += budget - left + 1;
+                budget = left - 1;
+                st = do_interrupt(vm, ip[1]);
+                if (st == VM_FAULT) continue;
+                pc = c->pc;
+                break;
+            default:
+                st = raise_fault(vm, FAULT_ILL, pc);
+                continue;
+        }
+        left--;
+    }
+
+    c->pc = pc;
+    vm->icount += budget - left;
+    return st;
+}
+
+#define FETCH_NONE 0xFFFF0000u  /* fetch window that no pc falls in */
+
+/* Threaded interpreter: every handler ends with its own copy of the
+ * dispatch sequence (computed goto through a 256-entry label table), so
+ * the host branch predictor sees one indirect jump per guest opcode.
+ */
+THREADED_DISPATCH
+VMStatus exec_threaded(VM* vm, uint64_t budget) {
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static const void* const dispatch[256] = {
+        [0 ... 255] = &&op_ill,
+        [OP_HLT] = &&op_hlt,
+        [OP_MOV_RR] = &&op_mov_rr,
+        [OP_MOV_RI] = &&op_mov_ri,
+        [OP_LOAD] = &&op_load,
+        [OP_STORE] = &&op_store,
+        [OP_ADD] = &&op_add,
+        [OP_SUB] = &&op_sub,
+        [OP_MUL] = &&op_mul,
+        [OP_DIV] = &&op_div,
+        [OP_JMP] = &&op_jmp,
+        [OP_JZ] = &&op_jz,
+        [OP_JNZ] = &&op_jnz,
+        [OP_CALL] = &&op_call,
+        [OP_RET] = &&op_ret,
+        [OP_SYSCALL] = &&op_syscall,
+        [OP_INT] = &&op_int
+    };
+#pragma GCC diagnostic pop
+
+    CPUState* c = vm->cpu;
+    const TLBEntry* tlb = cpu_tlb(c);
+    const PageTableEntry* pt = vm->pt;
+    const Traps* traps = vm->traps;
+    uint8_t ibuf[MAX_INSN_SIZE];
+    uint32_t* r = c->gpr;
+    uint32_t pc = c->pc;
+    uint64_t left = budget;
+    const uint8_t* ip;
+    uint32_t addr;
+    VMStatus st;
+    int m;
+
+    /* Fetch window: ip = ibase + pc for pc in [ipage, ipage + PAGE_SIZE -
+     * MAX_INSN_SIZE] of the current text page. One compare covers both
+     * the text segment check and the page's frame lookup. A store that
+     * moves a text page to a new frame returns MEM_CODE and closes it.
+     * It never opens on a page with breakpoints, so only the slow fetch
+     * looks for them.
+     */
+    uint32_t ipage = FETCH_NONE;
+    uintptr_t ibase = 0;
+
+/* Retire the current instruction and dispatch the one at pc */
+#define DISPATCH() do { \
+        if (unlikely(left == 0)) goto out_budget; \
+        if (likely(pc - ipage <= PAGE_SIZE - MAX_INSN_SIZE)) { \
+            ip = (const uint8_t*)(ibase + pc); \
+        } else { \
+            if (unlikely(!fetch_ok(pc))) goto fault_fetch; \
+            if (unlikely(traps != NULL) && trap_break_at(traps, pc)) goto trap; \
+            ip = fetch_insn(vm, pt, pc, ibuf); \
+            if ((pc & PAGE_MASK) <= PAGE_SIZE - MAX_INSN_SIZE && \
+                (traps == NULL || !traps->break_page[pc >> PAGE_SHIFT])) { \
+                ipage = pc & ~PAGE_MASK; \
+                ibase = (uintptr_t)pt[pc >> PAGE_SHIFT].frame - ipage; \
+            } \
+        } \
+        left--; \
+        goto *dispatch[ip[0]]; \
+    } while (0)
+
+    DISPATCH();
+
+op_hlt:
+    pc += 1;
+    st = VM_HALTED;
+    goto out;
+op_mov_rr:
+    r[ip[1] >> 4] = r[ip[1] & 15];
+    pc += 2;
+    DISPATCH();
+op_mov_ri:
+    r[ip[1] >> 4] = rd32(ip + 2);
+    pc += 6;
+    DISPATCH();
+op_load:
+    addr = effective_addr(c, ip);
+    if (unlikely(!mem_load32(vm, tlb, addr, &r[ip[1] >> 4]))) goto fault_data;
+    pc += 4;
+    DISPATCH();
+op_store:
+    addr = effective_addr(c, ip);
+    m = mem_store32(vm, tlb, addr, r[ip[1] >> 4]);
+    if (unlikely(m != MEM_OK)) {
+        if (!m) goto fault_data;
+        ipage = FETCH_NONE;
+    }
+    pc += 4;
+    DISPATCH();
+op_add:
+    r[ip[1] >> 4] = alu_add(&c->flags, r[ip[1] >> 4], r[ip[1] & 15]);
+    pc += 2;
+    DISPATCH();
+op_sub:
+    r[ip[1] >> 4] = alu_sub(&c->flags, r[ip[1] >> 4], r[ip[1] & 15]);
+    pc += 2;
+    DISPATCH();
+op_mul:
+    r[ip[1] >> 4] = alu_mul(&c->flags, r[ip[1] >> 4], r[ip[1] & 15]);
+    pc += 2;
+    DISPATCH();
+op_div:
+    if (unlikely(r[ip[1] & 15] == 0)) {
+        left++;
+        st = raise_fault(vm, FAULT_DIV0, pc);
+        goto out;
+    }
+    r[ip[1] >> 4] = alu_div(&c->flags, r[ip[1] >> 4], r[ip[1] & 15]);
+    pc += 2;
+    DISPATCH();
+op_jmp:
+    pc = rd16(ip + 1);
+    DISPATCH();
+op_jz:
+    pc = c->flags.zero ? rd16(ip + 1) : pc + 3;
+    DISPATCH();
+op_jnz:
+    pc = !c->flags.zero ? rd16(ip + 1) : pc + 3;
+    DISPATCH();
+op_call:
+    addr = c->sp - 4;
+    m = mem_store32(vm, tlb, addr, pc + 3);
+    if (unlikely(m != MEM_OK)) {
+        if (!m) goto fault_data;
+        ipage = FETCH_NONE;
+    }
+    c->sp = addr;
+    pc = rd16(ip + 1);
+    DISPATCH();
+op_ret:
+    addr = c->sp;
+    if (unlikely(!mem_load32(vm, tlb, addr, &pc))) goto fault_data;
+    pc &= 0xFFFF;
+    c->sp = addr + 4;
+    DISPATCH();
+op_syscall:
+    c->pc = pc + 1;
+    vm->icount += budget - left;    /* the call sees itself retired */
+    budget = left;
+    st = do_syscall(vm);
+    pc = c->pc;
+    ipage = FETCH_NONE;     /* the call may have written to text */
+    if (st != VM_RUNNING) goto out;
+    DISPATCH();
+op_int:
+    c->pc = pc + 2;
+    vm->icount += budget - left;
+    budget = left;
+    st = do_interrupt(vm, ip[1]);
+    ipage = FETCH_NONE;
+    if (st == VM_FAULT) {
+        left++;
+        goto out;
+    }
+    pc = c->pc;
+    if (st != VM_RUNNING) goto out;
+    DISPATCH();
+op_ill:
+    left++;
+    st = raise_fault(vm, FAULT_ILL, pc);
+    goto out;
+
+fault_data:
+    left++;
+    st = raise_fault(vm, FAULT_SEGV, addr);
+    goto out;
+fault_fetch:
+    st = raise_fault(vm, FAULT_SEGV, pc);
+    goto out;
+trap:
+    st = trap_stop(vm, pc);
+    goto out;
+out_budget:
+    st = VM_BUDGET;
+out:
+    c->pc = pc;
+    vm->icount += budget - left;
+    return st;
+#undef DISPATCH
+#else
+    return exec_switch(vm, budget);
+#endif
+}
@@ -0,0 +1,319 @@
+/* UCVM CPU Engine - execution helpers shared by the engines
+ * Internal header: instruction field access, flag updates, permission
+ * checks and the pre-decoded instruction cache.
+ */
+
+#ifndef UCVM_EXEC_H
+#define UCVM_EXEC_H
+
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "ucvm.h"
+
+/* Keep one dispatch jump per handler: stop GCC from merging the identical
+ * dispatch tails of a threaded interpreter back into a single jump.
+ */
+#if defined(__GNUC__) && !defined(__clang__)
+#define THREADED_DISPATCH __attribute__((optimize("no-crossjumping", "no-gcse")))
+#else
+#define THREADED_DISPATCH
+#endif
+
+/* Host is assumed little-endian, like the guest */
+static inline uint32_t rd16(const uint8_t* p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return v;
+}
+
+static inline uint32_t rd32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline void wr32(uint8_t* p, uint32_t v) {
+    memcpy(p, &v, 4);
+}
+
+/* Flag updates (spec section 4.5). CF is the unsigned carry/borrow. */
+static inline uint32_t alu_add(Flags* f, uint32_t a, uint32_t b) {
+    uint32_t r = a + b;
+    f->zero = r == 0;
+    f->sign = r >> 31;
+    f->carry = r < a;
+    f->overflow = ((a ^ r) & (b ^ r)) >> 31;
+    return r;
+}
+
+static inline uint32_t alu_sub(Flags* f, uint32_t a, uint32_t b) {
+    uint32_t r = a - b;
+    f->zero = r == 0;
+    f->sign = r >> 31;
+    f->carry = a < b;
+    f->overflow = ((a ^ b) & (a ^ r)) >> 31;
+    return r;
+}
+
+static inline uint32_t alu_mul(Flags* f, uint32_t a, uint32_t b) {
+    uint64_t p = (uint64_t)a * b;
+    uint32_t r = (uint32_t)p;
+    f->zero = r == 0;
+    f->sign = r >> 31;
+    f->carry = f->overflow = (p >> 32) != 0;
+    return r;
+}
+
+static inline uint32_t alu_div(Flags* f, uint32_t a, uint32_t b) {
+    uint32_t r = a / b;
+    f->zero = r == 0;
+    f->sign = r >> 31;
+    f->carry = f->overflow = 0;
+    return r;
+}
+
+/* Lazy flags: engines may record the last ALU op and its operands
+ * instead of computing all four flags, and evaluate them only when they
+ * are read. ZF alone is cheap to test from the result.
+ */
+enum { LAZY_NONE, LAZY_ADD, LAZY_SUB, LAZY_MUL, LAZY_DIV };
+
+static inline void flags_materialize(Flags* f, uint8_t op, uint32_t a, uint32_t b) {
+    switch (op) {
+        case LAZY_ADD: alu_add(f, a, b); break;
+        case LAZY_SUB: alu_sub(f, a, b); break;
+        case LAZY_MUL: alu_mul(f, a, b); break;
+        case LAZY_DIV: alu_div(f, a, b); break;
+    }
+}
+
+/* Fetch check: user code may only execute from the text segment */
+static inline int fetch_ok(uint32_t pc) {
+    return pc - TEXT_BASE < HEAP_BASE - TEXT_BASE;
+}
+
+const uint8_t* fetch_slow(VM* vm, uint32_t pc, uint8_t* buf);
+
+/* Host address of the instruction at a pc that passed fetch_ok (text
+ * pages always have a frame). One that runs off the end of its page is
+ * gathered into buf, since the next page's frame need not follow it in
+ * host memory.
+ */
+static inline const uint8_t* fetch_insn(VM* vm, const PageTableEntry* pt, uint32_t pc,
+                                        uint8_t* buf) {
+    if (likely((pc & PAGE_MASK) <= PAGE_SIZE - MAX_INSN_SIZE)) {
+        return pt[pc >> PAGE_SHIFT].frame + (pc & PAGE_MASK);
+    }
+    return fetch_slow(vm, pc, buf);
+}
+
+static inline uint32_t effective_addr(const CPUState* c, const uint8_t* ip) {
+    uint32_t base = ip[1] & 15;
+    return ((base ? c->gpr[base] : 0) + rd16(ip + 2)) & 0xFFFF;
+}
+
+/* Pre-decoded micro-op. Ops of one text page live in a fixed array, so a
+ * branch can link to a target op in the same page by relative offset.
+ */
+typedef struct {
+    const void* handler;    /* direct-threaded handler address */
+    uint32_t imm;           /* immediate or displacement; for branches the
+                             * target in the low 16 bits and the relative
+                             * link to the target op in the high 16 bits */
+    uint16_t pc;            /* guest address of the instruction */
+    uint8_t regs;           /* dst<<4 | src (or base) */
+    uint8_t kind;           /* opcode or one of the OPX_ kinds below */
+} DecodedOp;
+
+/* Decoder-only op kinds, in opcode space the ISA leaves undefined */
+enum {
+    OPX_LOAD_ABS = 0xE0,    /* MOV r,[addr] with no base register */
+    OPX_STORE_ABS,          /* MOV [addr],r with no base register */
+    OPX_NEXT,               /* end of a decoded block: continue at imm */
+    OPX_ILL,                /* undefined opcode */
+    OPX_BREAK,              /* breakpoint: stop before the instruction */
+    /* Superinstructions: the first op of a fused pair runs both, taking
+     * the second instruction's operands from the op that follows it */
+    OPX_MOVI_MOVI,          /* MOV r,i ; MOV r,i */
+    OPX_MOVI_ADD,           /* MOV r,i ; ADD r,r */
+    OPX_LOAD_ADD,           /* MOV r,[r+d] ; ADD r,r */
+    OPX_ADD_JNZ,            /* ADD r,r ; JNZ a */
+    OPX_SUB_JNZ,            /* SUB r,r ; JNZ a */
+    OPX_SUB_JZ,             /* SUB r,r ; JZ a */
+    OPX_KIND_COUNT
+};
+
+#define ICACHE_OPS_PER_PAGE (2 * PAGE_SIZE)
+
+/* Decoded ops for one text page. index[] maps a page offset to its op
+ * number + 1, 0 meaning the instruction there has not been decoded.
+ */
+typedef struct ICachePage {
+    uint16_t index[PAGE_SIZE];
+    uint32_t count;
+    DecodedOp ops[ICACHE_OPS_PER_PAGE];
+} ICachePage;
+
+static inline int16_t op_link(const DecodedOp* op) {
+    return (int16_t)(op->imm >> 16);
+}
+
+/* exec.c */
+VMStatus raise_fault(VM* vm, FaultKind kind, uint32_t addr);
+VMStatus do_interrupt(VM* vm, uint8_t n);
+void code_mark_page(VM* vm, uint32_t page, uint8_t kind);
+void code_invalidate_page(VM* vm, uint32_t page);
+void code_flush(VM* vm);
+
+/* mem.c */
+int mem_load_slow(VM* vm, uint32_t addr, uint32_t* value);
+int mem_store_slow(VM* vm, uint32_t addr, uint32_t value);
+void tlb_flush_page(VM* vm, uint32_t page);
+
+/* icache.c */
+DecodedOp* icache_lookup(VM* vm, uint32_t pc, const void* const* handlers);
+void icache_invalidate_page(VM* vm, uint32_t page);
+
+/* jit.c */
+void jit_invalidate_page(VM* vm, uint32_t page);
+
+/* trap.c */
+int trap_watch_hit(VM* vm, uint32_t addr, uint8_t kind);
+
+/* Code caches built from each page (VM.code_page) */
+#define CODE_DECODED 0x01
+#define CODE_JIT     0x02
+
+/* Keep cached code coherent with a guest write of len bytes at addr.
+ * An instruction may straddle into the following page, so a write also
+ * invalidates the page before the one it touches. Returns non-zero when
+ * cached code was thrown away.
+ */
+static inline int code_note_write(VM* vm, uint32_t addr, uint32_t len) {
+    if (likely(addr >= HEAP_BASE)) return 0;
+    int hit = 0;
+    uint32_t first = addr >> PAGE_SHIFT;
+    uint32_t last = (addr + len - 1) >> PAGE_SHIFT;
+    for (uint32_t page = first ? first - 1 : 0; page <= last; page++) {
+        if (vm->code_page[page]) {
+            code_invalidate_page(vm, page);
+            hit = 1;
+        }
+    }
+    return hit;
+}
+
+/* Guest data access. The TLB hit path is one compare and a host pointer
+ * add; misses, faults and writes to pages holding cached code go through
+ * mem.c. A store returns MEM_CODE after throwing cached code away or
+ * copying a shared page to a new frame, so the engine must resynchronise
+ * before running the next instruction.
+ */
+#define MEM_FAULT 0
+#define MEM_OK    1
+#define MEM_CODE  2
+
+/* The TLB of the process whose registers c points at. Engines take it
+ * from the CPUState they already hold, which saves a load of VM.tlb on
+ * every access.
+ */
+#define CPU_TLB_OFFSET (offsetof(Process, tlb) - offsetof(Process, cpu))
+
+static inline const TLBEntry* cpu_tlb(const CPUState* c) {
+    return (const TLBEntry*)((const char*)c + CPU_TLB_OFFSET);
+}
+
+static inline int mem_load32(VM* vm, const TLBEntry* tlb, uint32_t addr, uint32_t* value) {
+    const TLBEntry* e = &tlb[(addr >> PAGE_SHIFT) & (TLB_ENTRIES - 1)];
+    if (likely(e->read_tag == ((addr + 3) & ~PAGE_MASK))) {
+        *value = rd32((const uint8_t*)(e->addend + addr));
+        return MEM_OK;
+    }
+    return mem_load_slow(vm, addr, value);
+}
+
+static inline int mem_store32(VM* vm, const TLBEntry* tlb, uint32_t addr, uint32_t value) {
+    const TLBEntry* e = &tlb[(addr >> PAGE_SHIFT) & (TLB_ENTRIES - 1)];
+    if (likely(e->write_tag == ((addr + 3) & ~PAGE_MASK))) {
+        wr32((uint8_t*)(e->addend + addr), value);
+        return MEM_OK;
+    }
+    return mem_store_slow(vm, addr, value);
+}
+
+/* Timestamps for trace records: the TSC where the host has one, else
+ * the monotonic clock. One is taken per call, at entry.
+ */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define TRACE_CLOCK TRACE_CLOCK_TSC
+static inline uint64_t trace_clock(void) {
+    return __builtin_ia32_rdtsc();
+}
+#else
+#define TRACE_CLOCK TRACE_CLOCK_NS
+static inline uint64_t trace_clock(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+}
+#endif
+
+/* Log a system call of p that began at start. The slot is filled before
+ * head moves past it, so trace_read on another thread never takes a
+ * half-written record for a whole one.
+ */
+static inline void trace_push(Process* p, uint64_t icount, uint32_t nr, uint32_t a1, uint32_t a2,
+                              uint32_t a3, int32_t result, uint64_t start) {
+    TraceRing* t = &p->trace;
+    TraceRecord* r = &t->rec[t->head & (TRACE_ENTRIES - 1)];
+    r->tsc = start;
+    r->icount = icount;
+    r->args[0] = a1;
+    r->args[1] = a2;
+    r->args[2] = a3;
+    r->result = result;
+    r->nr = (uint16_t)nr;
+    r->err = result < 0 ? (uint16_t)-result : 0;
+    r->pid = p->pid;
+    __atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Breakpoints and watchpoints (VM.traps). Nothing checks for them on the
+ * fast paths: code caches are rebuilt with a breakpoint op in place of
+ * each instruction that has one, the threaded engine keeps its fetch
+ * window off their pages, and watched pages are kept out of the TLBs so
+ * every access to them goes through mem.c.
+ */
+typedef struct {
+    uint32_t addr;
+    uint32_t len;
+    uint8_t kind;                       /* TRAP_READ | TRAP_WRITE */
+} Watchpoint;
+
+typedef struct Traps {
+    uint32_t breaks[TRAP_BREAKPOINTS];
+    uint32_t nbreaks;
+    Watchpoint watches[TRAP_WATCHPOINTS];
+    uint32_t nwatches;
+    uint8_t break_map[MEM_SIZE / 8];    /* a bit per address: breakpoint there */
+    uint8_t break_page[NUM_PAGES];      /* breakpoints on each page */
+    uint8_t watch_page[NUM_PAGES];      /* TRAP_READ | TRAP_WRITE watched on each page */
+    uint8_t off;                        /* stepping over a stop: nothing traps */
+    uint8_t step_over;                  /* the next run first steps over the current instruction */
+    uint8_t hit;                        /* TRAP_ kind the run stopped at, 0 if none */
+    uint32_t hit_addr;                  /* its breakpoint or the address accessed */
+} Traps;
+
+static inline int trap_break_at(const Traps* t, uint32_t pc) {
+    return (t->break_map[pc >> 3] >> (pc & 7) & 1) && !t->off;
+}
+
+/* Stop before the instruction at the breakpoint at pc */
+static inline VMStatus trap_stop(VM* vm, uint32_t pc) {
+    vm->traps->hit = TRAP_BREAK;
+    vm->traps->hit_addr = pc;
+    return VM_BREAK;
+}
+
+#endif
@@ -0,0 +1,1816 @@
+/* UCVM CPU Engine - in-memory file system (spec section 8.3)
+ * Each VM has one file system in host memory, made when a process first
+ * opens, creates or removes a path. Files and directories are inodes,
+ * allocated from slabs of FS_SLAB_INODES so that an inode number indexes
+ * its slab and slot directly, and freed inodes are reused first.
+ *
+ * File data lives in a block store of FS_BLOCK_SIZE blocks, one guest
+ * page each, grown a chunk of FS_CHUNK_BLOCKS at a time. A file maps its
+ * blocks as extents, runs of blocks contiguous in the store, kept sorted
+ * so a seek is a binary search however large the file. Blocks come from
+ * a buddy allocator over each chunk: a file growing at its end asks for
+ * as many blocks as it has already, so sequential writes make O(log n)
+ * extents, and extents that come out adjacent are merged. Unwritten
+ * blocks inside a file read as zeros.
+ *
+ * A directory hashes its entries by name, so lookup, create and unlink
+ * cost the same with a hundred thousand entries as with one. Paths are
+ * resolved from the root a component at a time, and the result goes in
+ * a direct-mapped dentry cache keyed by the whole path: a path opened
+ * again resolves in one probe however deep it is. A path that names
+ * nothing is cached too, as a negative entry, so a missing file is also
+ * found missing in one probe. Entries are not tracked to their names.
+ * Each carries the generation it was made in instead. unlink bumps the
+ * generation of positive entries and creating a name that of negative
+ * ones, so either invalidates every entry it could have made wrong at
+ * once. Removing a directory bumps both, as misses below it go too.
+ *
+ * A host directory can be mounted on a directory, read-only or not. A
+ * path that goes into it is resolved by the host from the mount point
+ * on, with openat2 and RESOLVE_BENEATH, so neither ".." nor a symlink
+ * leads out of it. Such paths are not cached. Every open of a host file
+ * shares one transient inode holding the host descriptors, and its data
+ * goes through a page cache of PCACHE_PAGE pages. Eviction is CLOCK-Pro:
+ * a cold page used again within its test period, resident or not, turns
+ * hot, and the room kept for cold pages adapts to how often that happens,
+ * so a file streamed once does not push out the hot pages. A reader that
+ * carries on where it stopped gets a window of pages read ahead, doubling
+ * up to RA_MAX, and reaching the first page of a window reads the next.
+ * Writes stay in the cache until their page is evicted or the file
+ * closed, and go back to the host as runs of dirty pages in one pwritev.
+ *
+ * A pipe is an inode with no name around a ring of PIPE_SIZE bytes, its
+ * read and write counters running freely. Each call moves bytes through
+ * the ring in at most two copies. A reader of an empty pipe or a writer
+ * to a full one is put on the pipe's wait list and blocks; the call runs
+ * again when data or room turns up and the pipe wakes it. splice moves
+ * bytes between a pipe's ring and a file or another pipe directly,
+ * without passing them through guest memory.
+ *
+ * The file system is host state, like output already written: snapshots,
+ * checkpoints and the journal do not include it. VM.fs_calls counts the
+ * calls into it, so the debugger knows how far back a re-run would
+ * still see the file system it saw the first time.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__linux__) && defined(SYS_openat2)
+#include <linux/openat2.h>
+#endif
+#include "exec.h"
+
+#define FS_BLOCK_SHIFT  PAGE_SHIFT
+#define FS_BLOCK_SIZE   (1u << FS_BLOCK_SHIFT)
+#define FS_CHUNK_ORDER  12      /* a chunk holds 2^12 blocks, 1MB */
+#define FS_CHUNK_BLOCKS (1u << FS_CHUNK_ORDER)
+#define FS_SLAB_INODES  1024
+#define FS_MAX_SIZE     0x7FFFFFFFu     /* offsets are 32-bit, results signed */
+#define PIPE_SIZE       0x10000u        /* a power of two */
+#define PIPE_ATOMIC     4096            /* writes up to this size are never split */
+#define FS_NO_BLOCK     UINT32_MAX
+#define FS_NOT_FREE     0xFF
+#define DCACHE_SLOTS    4096    /* a power of two */
+#define DCACHE_PATH     236     /* longest path cached, with its NUL; 256-byte entries */
+#define PCACHE_SHIFT    12
+#define PCACHE_PAGE     (1u << PCACHE_SHIFT)
+#define PCACHE_PAGES    4096    /* resident, 16MB; as many again remembered after eviction */
+#define PCACHE_HASH     13      /* log2 of the hash buckets */
+#define PCACHE_RUN      64      /* most pages read or written back in one call */
+#define PC_NONE         UINT32_MAX
+#define RA_MIN          4       /* pages read ahead when a sequential run starts */
+#define RA_MAX          32      /* the most, 128KB */
+#define HOST_HASH       8       /* log2 of the buckets of open host files */
+
+enum { INODE_FREE = 0, INODE_FILE, INODE_DIR, INODE_HOST, INODE_PIPE };
+
+/* PageEntry flags */
+enum {
+    PC_RESIDENT = 1,        /* has a slot; otherwise remembered for its test period */
+    PC_HOT = 2,
+    PC_TEST = 4,            /* cold, in its test period */
+    PC_REF = 8,             /* accessed since a hand last passed */
+    PC_UPTODATE = 16,       /* holds the file's bytes, not just those written */
+    PC_FRESH = 32,          /* read ahead and not yet accessed */
+    PC_MARK = 64            /* reaching it reads the next window ahead */
+};
+
+typedef struct {
+    uint32_t file_block;    /* first block of the file it maps */
+    uint32_t block;         /* where that is in the store */
+    uint32_t count;
+} Extent;
+
+typedef struct Dirent {
+    struct Dirent* next;    /* in its hash bucket */
+    uint32_t hash;
+    uint32_t ino;
+    uint32_t len;
+    char name[];
+} Dirent;
+
+typedef struct {
+    uint8_t* buf;           /* PIPE_SIZE */
+    uint32_t head, tail;    /* bytes read and written */
+    uint32_t readers, writers;      /* files open on each end */
+    uint32_t* waiting;      /* pids blocked on it */
+    uint32_t nwaiting, waiting_cap;
+} Pipe;
+
+typedef struct Inode {
+    uint32_t ino;
+    uint8_t type;           /* INODE_ */
+    uint32_t nlink;         /* directory entries naming it */
+    uint32_t refs;          /* open files */
+    uint32_t size;
+    uint32_t blocks;        /* allocated to it */
+    Extent* extents;        /* by file_block */
+    uint32_t nextents, extents_cap;
+    Dirent** buckets;       /* directory: entries by name hash */
+    uint32_t nbuckets, nentries;
+    uint32_t parent;        /* directory: ino of .. */
+    uint32_t mount;         /* directory: 1 + index in FileSystem.mounts, 0 if none */
+    int host_fd;            /* INODE_HOST: open for reading, or -1 */
+    int host_wfd;           /* open for writing, or -1; may be host_fd */
+    uint8_t host_dir;
+    uint64_t host_dev, host_ino;    /* the inode is shared by every open of the host file */
+    uint32_t disk_size;     /* bytes the host file holds, as far as written back */
+    uint32_t pages;         /* first of its PageEntrys, or PC_NONE */
+    int32_t wb_error;       /* of a failed write-back, for the next write */
+    struct Inode* next_host;
+    Pipe* pipe;             /* INODE_PIPE */
+    struct Inode* next_free;
+} Inode;
+
+struct File {
+    Inode* inode;
+    uint32_t offset;
+    uint32_t flags;         /* UCVM_O_ flags it was opened with */
+    uint32_t refs;          /* descriptors sharing it */
+    uint32_t ra_next;       /* host file: the page after the last one read */
+    uint32_t ra_end;        /* the page after the last one read ahead */
+    uint32_t ra_window;     /* pages read ahead each time, 0 if not sequential */
+};
+
+/* A resolved path. ino 0 is a negative entry: the directory exists but
+ * has nothing by the last name.
+ */
+typedef struct {
+    uint32_t hash;
+    uint32_t gen;           /* FileSystem.gen if positive, neg_gen if negative */
+    uint32_t dir;           /* ino of the directory holding the last component */
+    uint32_t ino;
+    uint32_t len;           /* 0 for an empty slot */
+    char path[DCACHE_PATH];
+} Dentry;
+
+/* A host directory mounted on a guest one */
+typedef struct {
+    int dirfd;
+    uint8_t readonly;
+} Mount;
+
+/* A page of a host file in the page cache, or one remembered after
+ * eviction until its test period ends. Every entry is on the clock.
+ */
+typedef struct {
+    uint32_t ino;
+    uint32_t page;          /* file offset >> PCACHE_SHIFT */
+    uint32_t slot;          /* resident: its page of PageCache.data */
+    uint32_t prev, next;    /* on the clock; next links free entries too */
+    uint32_t cprev, cnext;  /* resident and cold: on the cold ring */
+    uint32_t hnext;         /* in its hash bucket */
+    uint32_t fprev, fnext;  /* among the entries of its inode */
+    uint16_t dirty_lo, dirty_hi;    /* bytes to write back, none if equal */
+    uint8_t flags;          /* PC_ */
+} PageEntry;
+
+typedef struct {
+    uint8_t* data;          /* PCACHE_PAGES pages */
+    PageEntry* ent;         /* 2 * PCACHE_PAGES */
+    uint32_t* buckets;      /* 1 << PCACHE_HASH */
+    uint32_t* slots;        /* free slots */
+    uint32_t nslots;
+    uint32_t free_ent;
+    uint32_t hand_hot, hand_test;
+    uint32_t hand_cold;     /* the oldest page on the cold ring */
+    uint32_t nhot, ncold, ntest;    /* resident hot and cold, remembered */
+    uint32_t cold_target;   /* resident cold pages the hot ones leave room for */
+} PageCache;
+
+/* A free run of blocks keeps its list links in its first block */
+typedef struct {
+    uint32_t next, prev;
+} FreeLink;
+
+struct FileSystem {
+    Inode** slabs;
+    uint32_t nslabs;
+    Inode* free_inodes;
+    uint8_t** chunks;
+    uint32_t nchunks;
+    uint8_t* free_order;    /* per block: order of the free run it heads, or FS_NOT_FREE */
+    uint32_t free_head[FS_CHUNK_ORDER + 1];
+    Inode* root;
+    Dentry* dcache;         /* DCACHE_SLOTS */
+    uint32_t gen;           /* bumped when a name goes */
+    uint32_t neg_gen;       /* bumped when a name is made or a directory goes */
+    Mount mounts[FS_MOUNTS];
+    uint32_t nmounts;
+    Inode* hosts[1u << HOST_HASH];  /* open host files by device and inode */
+    PageCache* pcache;      /* NULL until a host file is opened */
+};
+
+static void* fs_realloc(void* p, size_t size) {
+    p = realloc(p, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static inline uint8_t* block_data(const FileSystem* fs, uint32_t block) {
+    return fs->chunks[block >> FS_CHUNK_ORDER] + (size_t)(block & (FS_CHUNK_BLOCKS - 1)) * FS_BLOCK_SIZE;
+}
+
+static inline FreeLink* free_link(const FileSystem* fs, uint32_t block) {
+    return (FreeLink*)(void*)block_data(fs, block);
+}
+
+static void free_push(FileSystem* fs, uint32_t block, uint32_t order) {
+    FreeLink* l = free_link(fs, block);
+    l->next = fs->free_head[order];
+    l->prev = FS_NO_BLOCK;
+    if (l->next != FS_NO_BLOCK) free_link(fs, l->next)->prev = block;
+    fs->free_head[order] = block;
+    fs->free_order[block] = (uint8_t)order;
+}
+
+static void free_remove(FileSystem* fs, uint32_t block, uint32_t order) {
+    FreeLink* l = free_link(fs, block);
+    if (l->prev != FS_NO_BLOCK) {
+        free_link(fs, l->prev)->next = l->next;
+    } else {
+        fs->free_head[order] = l->next;
+    }
+    if (l->next != FS_NO_BLOCK) free_link(fs, l->next)->prev = l->prev;
+    fs->free_order[block] = FS_NOT_FREE;
+}
+
+/* 2^order zeroed blocks, aligned to their size within a chunk */
+static uint32_t block_alloc(FileSystem* fs, uint32_t order) {
+    uint32_t o = order;
+    while (o <= FS_CHUNK_ORDER && fs->free_head[o] == FS_NO_BLOCK) o++;
+    if (o > FS_CHUNK_ORDER) {
+        uint32_t n = fs->nchunks++;
+        fs->chunks = fs_realloc(fs->chunks, fs->nchunks * sizeof(uint8_t*));
+        fs->chunks[n] = fs_realloc(NULL, (size_t)FS_CHUNK_BLOCKS * FS_BLOCK_SIZE);
+        fs->free_order = fs_realloc(fs->free_order, (size_t)fs->nchunks * FS_CHUNK_BLOCKS);
+        memset(fs->free_order + (size_t)n * FS_CHUNK_BLOCKS, FS_NOT_FREE, FS_CHUNK_BLOCKS);
+        free_push(fs, n * FS_CHUNK_BLOCKS, FS_CHUNK_ORDER);
+        o = FS_CHUNK_ORDER;
+    }
+    uint32_t block = fs->free_head[o];
+    free_remove(fs, block, o);
+    while (o > order) {
+        o--;
+        free_push(fs, block + (1u << o), o);
+    }
+    memset(block_data(fs, block), 0, (size_t)FS_BLOCK_SIZE << order);
+    return block;
+}
+
+static void block_free(FileSystem* fs, uint32_t block, uint32_t order) {
+    for (; order < FS_CHUNK_ORDER; order++) {
+        uint32_t buddy = block ^ (1u << order);
+        if (fs->free_order[buddy] != order) break;
+        free_remove(fs, buddy, order);
+        block &= ~(1u << order);
+    }
+    free_push(fs, block, order);
+}
+
+/* Free a run of blocks as the aligned pieces it was allocated in */
+static void block_free_run(FileSystem* fs, uint32_t block, uint32_t count) {
+    while (count) {
+        uint32_t order = 0;
+        while (order < FS_CHUNK_ORDER && !(block & (1u << order)) && (2u << order) <= count) order++;
+        block_free(fs, block, order);
+        block += 1u << order;
+        count -= 1u << order;
+    }
+}
+
+static inline uint32_t log2_floor(uint32_t n) {
+#if defined(__GNUC__)
+    return 31 - (uint32_t)__builtin_clz(n);
+#else
+    uint32_t log = 0;
+    while (n >>= 1) log++;
+    return log;
+#endif
+}
+
+static Inode* inode_get(const FileSystem* fs, uint32_t ino) {
+    return &fs->slabs[(ino - 1) / FS_SLAB_INODES][(ino - 1) % FS_SLAB_INODES];
+}
+
+static Inode* inode_alloc(FileSystem* fs, uint8_t type) {
+    if (!fs->free_inodes) {
+        uint32_t n = fs->nslabs++;
+        fs->slabs = fs_realloc(fs->slabs, fs->nslabs * sizeof(Inode*));
+        fs->slabs[n] = fs_realloc(NULL, FS_SLAB_INODES * sizeof(Inode));
+        memset(fs->slabs[n], 0, FS_SLAB_INODES * sizeof(Inode));
+        for (uint32_t i = FS_SLAB_INODES; i-- > 0;) {
+            Inode* in = &fs->slabs[n][i];
+            in->ino = n * FS_SLAB_INODES + i + 1;
+            in->next_free = fs->free_inodes;
+            fs->free_inodes = in;
+        }
+    }
+    Inode* in = fs->free_inodes;
+    fs->free_inodes = in->next_free;
+    in->type = type;
+    in->next_free = NULL;
+    return in;
+}
+
+static void pipe_free(Pipe* p) {
+    if (!p) return;
+    free(p->buf);
+    free(p->waiting);
+    free(p);
+}
+
+static void truncate_blocks(FileSystem* fs, Inode* in) {
+    for (uint32_t i = 0; i < in->nextents; i++) block_free_run(fs, in->extents[i].block, in->extents[i].count);
+    in->nextents = 0;
+    in->blocks = 0;
+    in->size = 0;
+}
+
+/* Free an inode no entry names and no file has open */
+static void inode_put(FileSystem* fs, Inode* in) {
+    if (in->nlink || in->refs) return;
+    pipe_free(in->pipe);
+    truncate_blocks(fs, in);
+    free(in->extents);
+    free(in->buckets);      /* a directory is empty by now */
+    uint32_t ino = in->ino;
+    memset(in, 0, sizeof(Inode));
+    in->ino = ino;
+    in->next_free = fs->free_inodes;
+    fs->free_inodes = in;
+}
+
+static FileSystem* fs_get(VM* vm) {
+    if (!vm->fs) {
+        FileSystem* fs = fs_realloc(NULL, sizeof(FileSystem));
+        memset(fs, 0, sizeof(FileSystem));
+        for (uint32_t o = 0; o <= FS_CHUNK_ORDER; o++) fs->free_head[o] = FS_NO_BLOCK;
+        fs->root = inode_alloc(fs, INODE_DIR);
+        fs->root->nlink = 1;
+        fs->root->parent = fs->root->ino;
+        fs->dcache = fs_realloc(NULL, DCACHE_SLOTS * sizeof(Dentry));
+        memset(fs->dcache, 0, DCACHE_SLOTS * sizeof(Dentry));
+        vm->fs = fs;
+    }
+    return vm->fs;
+}
+
+void fs_free(VM* vm) {
+    FileSystem* fs = vm->fs;
+    if (!fs) return;
+    for (uint32_t s = 0; s < fs->nslabs; s++) {
+        for (uint32_t i = 0; i < FS_SLAB_INODES; i++) {
+            Inode* in = &fs->slabs[s][i];
+            for (uint32_t b = 0; b < in->nbuckets; b++) {
+                for (Dirent* d = in->buckets[b]; d;) {
+                    Dirent* next = d->next;
+                    free(d);
+                    d = next;
+                }
+            }
+            free(in->buckets);
+            free(in->extents);
+            pipe_free(in->pipe);
+        }
+        free(fs->slabs[s]);
+    }
+    for (uint32_t c = 0; c < fs->nchunks; c++) free(fs->chunks[c]);
+    for (uint32_t m = 0; m < fs->nmounts; m++) close(fs->mounts[m].dirfd);
+    if (fs->pcache) {
+        free(fs->pcache->data);
+        free(fs->pcache->ent);
+        free(fs->pcache->buckets);
+        free(fs->pcache->slots);
+        free(fs->pcache);
+    }
+    free(fs->slabs);
+    free(fs->chunks);
+    free(fs->free_order);
+    free(fs->dcache);
+    free(fs);
+    vm->fs = NULL;
+}
+
+/* Directories */
+
+static uint32_t name_hash(const char* name, uint32_t len) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h;
+}
+
+/* The link to the entry for name in dir, or to the NULL ending its bucket */
+static Dirent** dir_slot(const Inode* dir, const char* name, uint32_t len, uint32_t hash) {
+    Dirent** slot = &dir->buckets[hash & (dir->nbuckets - 1)];
+    while (*slot && !((*slot)->hash == hash && (*slot)->len == len && memcmp((*slot)->name, name, len) == 0)) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static Inode* dir_lookup(const FileSystem* fs, const Inode* dir, const char* name, uint32_t len) {
+    if (len == 1 && name[0] == '.') return (Inode*)dir;
+    if (len == 2 && name[0] == '.' && name[1] == '.') return inode_get(fs, dir->parent);
+    if (!dir->nentries) return NULL;
+    Dirent* d = *dir_slot(dir, name, len, name_hash(name, len));
+    return d ? inode_get(fs, d->ino) : NULL;
+}
+
+static void dir_add(Inode* dir, const char* name, uint32_t len, Inode* in) {
+    if (dir->nentries >= dir->nbuckets) {
+        uint32_t n = dir->nbuckets ? dir->nbuckets * 2 : 8;
+        Dirent** buckets = fs_realloc(NULL, n * sizeof(Dirent*));
+        memset(buckets, 0, n * sizeof(Dirent*));
+        for (uint32_t b = 0; b < dir->nbuckets; b++) {
+            for (Dirent* d = dir->buckets[b]; d;) {
+                Dirent* next = d->next;
+                d->next = buckets[d->hash & (n - 1)];
+                buckets[d->hash & (n - 1)] = d;
+                d = next;
+            }
+        }
+        free(dir->buckets);
+        dir->buckets = buckets;
+        dir->nbuckets = n;
+    }
+    Dirent* d = fs_realloc(NULL, sizeof(Dirent) + len);
+    d->hash = name_hash(name, len);
+    d->ino = in->ino;
+    d->len = len;
+    memcpy(d->name, name, len);
+    Dirent** bucket = &dir->buckets[d->hash & (dir->nbuckets - 1)];
+    d->next = *bucket;
+    *bucket = d;
+    dir->nentries++;
+    in->nlink++;
+}
+
+/* Resolve path to the directory holding its last component and that
+ * component's name. A path naming a directory by "/" alone has an empty
+ * last name. Returns 1 for a path that goes on into a mount: *dir is the
+ * mount point and *name the rest, for the host to resolve.
+ */
+static int32_t walk(const FileSystem* fs, const char* path, Inode** dir, const char** name, uint32_t* len) {
+    Inode* d = fs->root;
+    if (!*path) return -UCVM_ENOENT;
+    for (;;) {
+        while (*path == '/') path++;
+        if (d->mount && *path) {
+            *dir = d;
+            *name = path;
+            *len = (uint32_t)strlen(path);
+            return 1;
+        }
+        const char* start = path;
+        while (*path && *path != '/') path++;
+        uint32_t n = (uint32_t)(path - start);
+        if (n > FS_NAME_MAX) return -UCVM_ENAMETOOLONG;
+        const char* rest = path;
+        while (*rest == '/') rest++;
+        if (!*rest) {
+            *dir = d;
+            *name = start;
+            *len = n;
+            return 0;
+        }
+        d = dir_lookup(fs, d, start, n);
+        if (!d) return -UCVM_ENOENT;
+        if (d->type != INODE_DIR) return -UCVM_ENOTDIR;
+    }
+}
+
+/* Hash of a whole path, eight bytes a step */
+static uint32_t path_hash(const char* path, size_t len) {
+    uint64_t h = len;
+    for (; len >= 8; path += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, path, 8);
+        h = (h ^ w) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 32;
+    }
+    uint64_t w = 0;
+    memcpy(&w, path, len);
+    h = (h ^ w) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+/* The last component of a path that walk accepted */
+static void last_component(const char* path, size_t plen, const char** name, uint32_t* len) {
+    const char* end = path + plen;
+    while (end > path && end[-1] == '/') end--;
+    const char* start = end;
+    while (start > path && start[-1] != '/') start--;
+    *name = start;
+    *len = (uint32_t)(end - start);
+}
+
+/* walk, then look up the last component: *in is the inode the path
+ * names, or NULL if its directory has no such entry. Through the dentry
+ * cache. Returns 1 as walk does for a path into a mount.
+ */
+static int32_t resolve(FileSystem* fs, const char* path, Inode** dir, const char** name, uint32_t* len,
+                       Inode** in) {
+    size_t plen = strlen(path);
+    Dentry* d = NULL;
+    uint32_t hash = 0;
+    if (plen < DCACHE_PATH) {
+        hash = path_hash(path, plen);
+        d = &fs->dcache[hash & (DCACHE_SLOTS - 1)];
+        if (d->hash == hash && d->len == plen && d->gen == (d->ino ? fs->gen : fs->neg_gen) &&
+            memcmp(d->path, path, plen) == 0) {
+            *dir = inode_get(fs, d->dir);
+            *in = d->ino ? inode_get(fs, d->ino) : NULL;
+            last_component(path, plen, name, len);
+            return 0;
+        }
+    }
+    int32_t err = walk(fs, path, dir, name, len);
+    if (err) return err;
+    *in = *len ? dir_lookup(fs, *dir, *name, *len) : *dir;
+    if (d) {
+        d->hash = hash;
+        d->dir = (*dir)->ino;
+        d->ino = *in ? (*in)->ino : 0;
+        d->gen = *in ? fs->gen : fs->neg_gen;
+        d->len = (uint32_t)plen;
+        memcpy(d->path, path, plen);
+    }
+    return 0;
+}
+
+static File* file_new(Inode* in, uint32_t flags) {
+    File* f = fs_realloc(NULL, sizeof(File));
+    f->inode = in;
+    f->offset = 0;
+    f->flags = flags;
+    f->refs = 1;
+    f->ra_next = f->ra_end = f->ra_window = 0;
+    in->refs++;
+    return f;
+}
+
+static int is_dot(const char* name, uint32_t len) {
+    return (len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.');
+}
+
+/* Host directories */
+
+static int32_t host_error(int err) {
+    switch (err) {
+        case ENOENT: return -UCVM_ENOENT;
+        case EEXIST: return -UCVM_EEXIST;
+        case ENOTDIR: return -UCVM_ENOTDIR;
+        case EISDIR: return -UCVM_EISDIR;
+        case ENOTEMPTY: return -UCVM_ENOTEMPTY;
+        case ENAMETOOLONG: return -UCVM_ENAMETOOLONG;
+        case EINVAL: return -UCVM_EINVAL;
+        case EFBIG: return -UCVM_EFBIG;
+        case ENOSPC: case EDQUOT: return -UCVM_ENOSPC;
+        case EROFS: return -UCVM_EROFS;
+        case EBUSY: return -UCVM_EBUSY;
+        case EMFILE: case ENFILE: return -UCVM_EMFILE;
+        case ENOMEM: return -UCVM_ENOMEM;
+        case EACCES: case EPERM: case EXDEV: case ELOOP: return -UCVM_EACCES;
+        default: return -UCVM_EIO;
+    }
+}
+
+/* openat beneath a mount's directory. Without openat2 only ".." is kept
+ * from leading out of it, not symlinks.
+ */
+static int host_openat(const Mount* m, const char* path, int flags) {
+    mode_t mode = (flags & O_CREAT) ? 0666 : 0;
+#if defined(__linux__) && defined(SYS_openat2)
+    struct open_how how = {.flags = (uint64_t)flags, .mode = mode, .resolve = RESOLVE_BENEATH};
+    int fd = (int)syscall(SYS_openat2, m->dirfd, path, &how, sizeof(how));
+    if (fd >= 0 || errno != ENOSYS) return fd;
+#endif
+    for (const char* c = path; *c;) {
+        const char* end = strchr(c, '/');
+        size_t n = end ? (size_t)(end - c) : strlen(c);
+        if (n == 2 && c[0] == '.' && c[1] == '.') {
+            errno = EXDEV;
+            return -1;
+        }
+        c += n + (end != NULL);
+    }
+    return openat(m->dirfd, path, flags, mode);
+}
+
+/* The host directory holding the last component of path, a path within
+ * mount m, opened beneath it; the component goes in base. Returns the
+ * descriptor or -errno.
+ */
+static int host_parent(const Mount* m, const char* path, char* base) {
+    char dir[FS_PATH_MAX];
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+    size_t start = len;
+    while (start > 0 && path[start - 1] != '/') start--;
+    if (len - start > FS_NAME_MAX) return -UCVM_ENAMETOOLONG;
+    memcpy(base, path + start, len - start);
+    base[len - start] = 0;
+    if (start == 0) {
+        strcpy(dir, ".");
+    } else {
+        memcpy(dir, path, start);
+        dir[start] = 0;
+    }
+    int fd = host_openat(m, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return fd < 0 ? host_error(errno) : fd;
+}
+
+/* Page cache */
+
+static PageCache* pcache_get(FileSystem* fs) {
+    if (!fs->pcache) {
+        PageCache* c = fs_realloc(NULL, sizeof(PageCache));
+        c->data = fs_realloc(NULL, (size_t)PCACHE_PAGES << PCACHE_SHIFT);
+        c->ent = fs_realloc(NULL, 2 * PCACHE_PAGES * sizeof(PageEntry));
+        c->buckets = fs_realloc(NULL, (1u << PCACHE_HASH) * sizeof(uint32_t));
+        c->slots = fs_realloc(NULL, PCACHE_PAGES * sizeof(uint32_t));
+        for (uint32_t i = 0; i < 1u << PCACHE_HASH; i++) c->buckets[i] = PC_NONE;
+        for (uint32_t i = 0; i < 2 * PCACHE_PAGES; i++) {
+            c->ent[i].flags = 0;
+            c->ent[i].next = i + 1 < 2 * PCACHE_PAGES ? i + 1 : PC_NONE;
+        }
+        for (uint32_t i = 0; i < PCACHE_PAGES; i++) c->slots[i] = PCACHE_PAGES - 1 - i;
+        c->nslots = PCACHE_PAGES;
+        c->free_ent = 0;
+        c->hand_hot = c->hand_cold = c->hand_test = PC_NONE;
+        c->nhot = c->ncold = c->ntest = 0;
+        c->cold_target = 1;
+        fs->pcache = c;
+    }
+    return fs->pcache;
+}
+
+static inline uint32_t page_hash(uint32_t ino, uint32_t page) {
+    return ((ino * 0x9E3779B1u + page) * 0x85EBCA77u) >> (32 - PCACHE_HASH);
+}
+
+static uint32_t page_find(const PageCache* c, uint32_t ino, uint32_t page) {
+    for (uint32_t i = c->buckets[page_hash(ino, page)]; i != PC_NONE; i = c->ent[i].hnext) {
+        if (c->ent[i].page == page && c->ent[i].ino == ino) return i;
+    }
+    return PC_NONE;
+}
+
+static inline uint8_t* page_data(const PageCache* c, const PageEntry* e) {
+    return c->data + ((size_t)e->slot << PCACHE_SHIFT);
+}
+
+static inline int page_dirty(const PageEntry* e) {
+    return e->dirty_lo != e->dirty_hi;
+}
+
+/* Take entry i off the clock, moving any hand on it to the next */
+static void clock_unlink(PageCache* c, uint32_t i) {
+    PageEntry* e = &c->ent[i];
+    uint32_t next = e->next == i ? PC_NONE : e->next;
+    if (c->hand_hot == i) c->hand_hot = next;
+    if (c->hand_test == i) c->hand_test = next;
+    c->ent[e->prev].next = e->next;
+    c->ent[e->next].prev = e->prev;
+}
+
+/* Put entry i on the clock as its newest, the last place hand_hot comes to */
+static void clock_push(PageCache* c, uint32_t i) {
+    PageEntry* e = &c->ent[i];
+    uint32_t h = c->hand_hot;
+    if (h == PC_NONE) {
+        e->prev = e->next = i;
+        c->hand_hot = c->hand_test = i;
+        return;
+    }
+    e->next = h;
+    e->prev = c->ent[h].prev;
+    c->ent[e->prev].next = i;
+    c->ent[h].prev = i;
+}
+
+/* The resident cold pages are on a ring of their own as well, in clock
+ * order, so that hand_cold goes straight from one to the next rather
+ * than past every hot and remembered page between them
+ */
+static void cold_unlink(PageCache* c, uint32_t i) {
+    PageEntry* e = &c->ent[i];
+    if (c->hand_cold == i) c->hand_cold = e->cnext == i ? PC_NONE : e->cnext;
+    c->ent[e->cprev].cnext = e->cnext;
+    c->ent[e->cnext].cprev = e->cprev;
+}
+
+/* Put entry i on the cold ring as its newest */
+static void cold_push(PageCache* c, uint32_t i) {
+    PageEntry* e = &c->ent[i];
+    uint32_t h = c->hand_cold;
+    if (h == PC_NONE) {
+        e->cprev = e->cnext = i;
+        c->hand_cold = i;
+        return;
+    }
+    e->cnext = h;
+    e->cprev = c->ent[h].cprev;
+    c->ent[e->cprev].cnext = i;
+    c->ent[h].cprev = i;
+}
+
+/* Forget entry i, giving back its slot if it has one */
+static void entry_free(FileSystem* fs, uint32_t i) {
+    PageCache* c = fs->pcache;
+    PageEntry* e = &c->ent[i];
+    Inode* in = inode_get(fs, e->ino);
+    if (e->flags & PC_RESIDENT) {
+        c->slots[c->nslots++] = e->slot;
+        if (e->flags & PC_HOT) {
+            c->nhot--;
+        } else {
+            cold_unlink(c, i);
+            c->ncold--;
+        }
+    } else {
+        c->ntest--;
+    }
+    clock_unlink(c, i);
+    uint32_t* link = &c->buckets[page_hash(e->ino, e->page)];
+    while (*link != i) link = &c->ent[*link].hnext;
+    *link = e->hnext;
+    if (e->fprev != PC_NONE) {
+        c->ent[e->fprev].fnext = e->fnext;
+    } else {
+        in->pages = e->fnext;
+    }
+    if (e->fnext != PC_NONE) c->ent[e->fnext].fprev = e->fprev;
+    e->flags = 0;
+    e->next = c->free_ent;
+    c->free_ent = i;
+}
+
+/* Write back the dirty bytes of entry i of in in one pwritev, with those
+ * of the dirty pages either side that join them into one run. The bytes
+ * are clean afterwards whatever happens; a failure is kept for the next
+ * write to report.
+ */
+static void writeback(FileSystem* fs, Inode* in, uint32_t i) {
+    PageCache* c = fs->pcache;
+    uint32_t first = i;
+    for (uint32_t n = 1; n < PCACHE_RUN; n++) {
+        const PageEntry* e = &c->ent[first];
+        if (e->page == 0 || e->dirty_lo != 0) break;
+        uint32_t p = page_find(c, in->ino, e->page - 1);
+        if (p == PC_NONE || !page_dirty(&c->ent[p]) || c->ent[p].dirty_hi != PCACHE_PAGE) break;
+        first = p;
+    }
+
+    uint32_t run[PCACHE_RUN];
+    struct iovec iov[PCACHE_RUN];
+    size_t total = 0;
+    int n = 0;
+    for (uint32_t j = first;;) {
+        const PageEntry* e = &c->ent[j];
+        run[n] = j;
+        iov[n].iov_base = page_data(c, e) + e->dirty_lo;
+        iov[n].iov_len = (size_t)(e->dirty_hi - e->dirty_lo);
+        total += iov[n].iov_len;
+        n++;
+        if (n == PCACHE_RUN || e->dirty_hi != PCACHE_PAGE) break;
+        j = page_find(c, in->ino, e->page + 1);
+        if (j == PC_NONE || !page_dirty(&c->ent[j]) || c->ent[j].dirty_lo != 0) break;
+    }
+
+    uint64_t pos = ((uint64_t)c->ent[first].page << PCACHE_SHIFT) + c->ent[first].dirty_lo;
+    ssize_t put = pwritev(in->host_wfd, iov, n, (off_t)pos);
+    if (put < 0) {
+        in->wb_error = host_error(errno);
+    } else if ((size_t)put < total) {
+        in->wb_error = -UCVM_ENOSPC;
+    }
+    if (put > 0 && pos + (uint64_t)put > in->disk_size) in->disk_size = (uint32_t)(pos + (uint64_t)put);
+    for (int k = 0; k < n; k++) c->ent[run[k]].dirty_lo = c->ent[run[k]].dirty_hi = 0;
+}
+
+static void cold_shrink(PageCache* c) {
+    if (c->cold_target > 1) c->cold_target--;
+}
+
+/* hand_hot: turn cold the first hot page not referenced since it last
+ * came by, ending the test periods of the cold pages it passes
+ */
+static void run_hand_hot(FileSystem* fs) {
+    PageCache* c = fs->pcache;
+    uint32_t i = c->hand_hot;
+    PageEntry* e = &c->ent[i];
+    if (!(e->flags & PC_RESIDENT)) {
+        entry_free(fs, i);
+        cold_shrink(c);
+        return;
+    }
+    if (e->flags & PC_HOT) {
+        if (e->flags & PC_REF) {
+            e->flags &= (uint8_t)~PC_REF;
+        } else {
+            e->flags &= (uint8_t)~PC_HOT;
+            c->nhot--;
+            c->ncold++;
+            cold_push(c, i);     /* the clock has it where hand_cold comes last */
+        }
+    } else if (e->flags & PC_TEST) {
+        e->flags &= (uint8_t)~PC_TEST;
+        cold_shrink(c);
+    }
+    c->hand_hot = e->next;
+}
+
+/* hand_test: end the next test period, forgetting the page if it is no
+ * longer resident
+ */
+static void run_hand_test(FileSystem* fs) {
+    PageCache* c = fs->pcache;
+    uint32_t i = c->hand_test;
+    PageEntry* e = &c->ent[i];
+    if (!(e->flags & PC_RESIDENT)) {
+        entry_free(fs, i);
+        cold_shrink(c);
+        return;
+    }
+    if ((e->flags & (PC_HOT | PC_TEST)) == PC_TEST) {
+        e->flags &= (uint8_t)~PC_TEST;
+        cold_shrink(c);
+    }
+    c->hand_test = e->next;
+}
+
+static void balance_hot(FileSystem* fs) {
+    PageCache* c = fs->pcache;
+    while (c->nhot > PCACHE_PAGES - c->cold_target) run_hand_hot(fs);
+}
+
+/* hand_cold: evict the first cold page not referenced since it last came
+ * by. A referenced one turns hot if it is in its test period, and starts
+ * one if not. An evicted page in its test period is remembered, so that
+ * coming back soon shows it should have been hot.
+ */
+static void run_hand_cold(FileSystem* fs) {
+    PageCache* c = fs->pcache;
+    while (!c->ncold) run_hand_hot(fs);
+    uint32_t i = c->hand_cold;
+    PageEntry* e = &c->ent[i];
+    if (e->flags & PC_REF) {
+        e->flags &= (uint8_t)~PC_REF;
+        cold_unlink(c, i);
+        if (e->flags & PC_TEST) {
+            e->flags = (uint8_t)((e->flags & ~PC_TEST) | PC_HOT);
+            c->ncold--;
+            c->nhot++;
+        } else {
+            e->flags |= PC_TEST;
+            cold_push(c, i);
+        }
+        clock_unlink(c, i);
+        clock_push(c, i);
+        balance_hot(fs);
+        return;
+    }
+    if (page_dirty(e)) writeback(fs, inode_get(fs, e->ino), i);
+    if (!(e->flags & PC_TEST)) {
+        entry_free(fs, i);
+        return;
+    }
+    cold_unlink(c, i);
+    c->slots[c->nslots++] = e->slot;
+    e->flags = PC_TEST;
+    c->ncold--;
+    c->ntest++;
+    while (c->ntest > PCACHE_PAGES) run_hand_test(fs);
+}
+
+static uint32_t slot_alloc(FileSystem* fs) {
+    PageCache* c = fs->pcache;
+    while (!c->nslots) run_hand_cold(fs);
+    return c->slots[--c->nslots];
+}
+
+/* Make page of in resident in slot. A page remembered from its test
+ * period comes back hot, and leaves room for more cold pages; any other
+ * comes in cold with flags. Returns its entry.
+ */
+static uint32_t page_add(FileSystem* fs, Inode* in, uint32_t page, uint32_t slot, uint8_t flags) {
+    PageCache* c = fs->pcache;
+    uint32_t i = page_find(c, in->ino, page);
+    if (i != PC_NONE) {
+        PageEntry* e = &c->ent[i];
+        e->flags = PC_RESIDENT | PC_HOT;
+        e->slot = slot;
+        c->ntest--;
+        c->nhot++;
+        if (c->cold_target < PCACHE_PAGES - 1) c->cold_target++;
+        clock_unlink(c, i);
+        clock_push(c, i);
+        balance_hot(fs);
+        return i;
+    }
+    i = c->free_ent;
+    PageEntry* e = &c->ent[i];
+    c->free_ent = e->next;
+    e->ino = in->ino;
+    e->page = page;
+    e->slot = slot;
+    e->flags = PC_RESIDENT | flags;
+    e->dirty_lo = e->dirty_hi = 0;
+    uint32_t* bucket = &c->buckets[page_hash(in->ino, page)];
+    e->hnext = *bucket;
+    *bucket = i;
+    e->fprev = PC_NONE;
+    e->fnext = in->pages;
+    if (in->pages != PC_NONE) c->ent[in->pages].fprev = i;
+    in->pages = i;
+    c->ncold++;
+    clock_push(c, i);
+    cold_push(c, i);
+    return i;
+}
+
+/* An access to a resident page. The first to a page read ahead stands
+ * for the one that would have brought it in.
+ */
+static inline void page_touch(PageEntry* e) {
+    if (e->flags & PC_FRESH) {
+        e->flags = (uint8_t)((e->flags & ~PC_FRESH) | PC_TEST);
+    } else {
+        e->flags |= PC_REF;
+    }
+}
+
+/* Read pages [page, page + count) of in into the cache in one preadv,
+ * stopping at one already there or the end of the file. The first need
+ * are for a reader now. The rest are read ahead, and the first of them
+ * is marked for the reader to read on from when it gets there; the host
+ * is told to fetch as much again beyond them. Returns how many pages
+ * were read, or -errno.
+ */
+static int32_t cache_fill(FileSystem* fs, Inode* in, uint32_t page, uint32_t need, uint32_t count) {
+    PageCache* c = fs->pcache;
+    uint32_t pages = (uint32_t)(((uint64_t)in->size + PCACHE_PAGE - 1) >> PCACHE_SHIFT);
+    if (page >= pages) return 0;
+    if (count > PCACHE_RUN) count = PCACHE_RUN;
+    if (count > pages - page) count = pages - page;
+    uint32_t n = 0;
+    while (n < count) {
+        uint32_t i = page_find(c, in->ino, page + n);
+        if (i != PC_NONE && (c->ent[i].flags & PC_RESIDENT)) break;
+        n++;
+    }
+    if (!n) return 0;
+
+    /* Slots first: evicting must not take a page of this run */
+    uint32_t slots[PCACHE_RUN], run[PCACHE_RUN];
+    struct iovec iov[PCACHE_RUN];
+    for (uint32_t k = 0; k < n; k++) slots[k] = slot_alloc(fs);
+    for (uint32_t k = 0; k < n; k++) {
+        run[k] = page_add(fs, in, page + k, slots[k], k < need ? PC_TEST : PC_FRESH);
+        iov[k].iov_base = c->data + ((size_t)slots[k] << PCACHE_SHIFT);
+        iov[k].iov_len = PCACHE_PAGE;
+    }
+    uint64_t start = (uint64_t)page << PCACHE_SHIFT;
+    ssize_t got = 0;
+    if (start < in->disk_size) {
+        got = preadv(in->host_fd, iov, (int)n, (off_t)start);
+        if (got < 0) {
+            int32_t err = host_error(errno);
+            for (uint32_t k = 0; k < n; k++) entry_free(fs, run[k]);
+            return err;
+        }
+    }
+    for (uint32_t k = 0; k < n; k++) {
+        size_t at = (size_t)k << PCACHE_SHIFT;
+        size_t valid = (size_t)got > at ? (size_t)got - at : 0;
+        if (valid < PCACHE_PAGE) memset((uint8_t*)iov[k].iov_base + valid, 0, PCACHE_PAGE - valid);
+        c->ent[run[k]].flags |= PC_UPTODATE;
+    }
+    if (n > need) {
+        c->ent[run[need]].flags |= PC_MARK;
+        posix_fadvise(in->host_fd, (off_t)(page + n) << PCACHE_SHIFT, (off_t)(n - need) << PCACHE_SHIFT,
+                      POSIX_FADV_WILLNEED);
+    }
+    return (int32_t)n;
+}
+
+/* Read in a resident page that holds only bytes written to it, writing
+ * those back first
+ */
+static int32_t page_fill(FileSystem* fs, Inode* in, uint32_t i) {
+    PageCache* c = fs->pcache;
+    PageEntry* e = &c->ent[i];
+    if (page_dirty(e)) {
+        writeback(fs, in, i);
+        if (in->wb_error) {
+            int32_t err = in->wb_error;
+            in->wb_error = 0;
+            return err;
+        }
+    }
+    uint64_t start = (uint64_t)e->page << PCACHE_SHIFT;
+    ssize_t got = 0;
+    if (start < in->disk_size) {
+        got = pread(in->host_fd, page_data(c, e), PCACHE_PAGE, (off_t)start);
+        if (got < 0) return host_error(errno);
+    }
+    memset(page_data(c, e) + got, 0, PCACHE_PAGE - (size_t)got);
+    e->flags |= PC_UPTODATE;
+    return 0;
+}
+
+static inline uint32_t ra_grow(uint32_t window) {
+    if (!window) return RA_MIN;
+    return window * 2 < RA_MAX ? window * 2 : RA_MAX;
+}
+
+/* The cached page holding page of f's file, for a read that goes on to
+ * page last; NULL with the error in *err. A miss reads the pages up to
+ * last in one go, plus a window read ahead when the reader carries on
+ * from the page it read last, the window doubling each time up to
+ * RA_MAX. Reaching the first page of a window reads the next, so a
+ * sequential reader finds its pages already there. Reading on in the
+ * same page is not another access.
+ */
+static uint8_t* page_read(FileSystem* fs, File* f, uint32_t page, uint32_t last, int32_t* err) {
+    PageCache* c = fs->pcache;
+    Inode* in = f->inode;
+    for (;;) {
+        uint32_t i = page_find(c, in->ino, page);
+        if (i == PC_NONE || !(c->ent[i].flags & PC_RESIDENT)) {
+            f->ra_window = page == f->ra_next ? ra_grow(f->ra_window) : 0;
+            uint32_t need = last - page + 1;
+            int32_t r = cache_fill(fs, in, page, need, need + f->ra_window);
+            if (r < 0) {
+                *err = r;
+                return NULL;
+            }
+            f->ra_end = page + (uint32_t)r;
+            continue;
+        }
+        PageEntry* e = &c->ent[i];
+        if (e->flags & PC_MARK) {
+            e->flags &= (uint8_t)~PC_MARK;
+            if (f->ra_window && f->ra_end > page && f->ra_end - page <= 2 * RA_MAX) {
+                page_touch(e);
+                f->ra_window = ra_grow(f->ra_window);
+                int32_t r = cache_fill(fs, in, f->ra_end, 0, f->ra_window);
+                if (r > 0) f->ra_end += (uint32_t)r;
+                f->ra_next = page + 1;
+                continue;   /* the fill may have evicted it */
+            }
+        }
+        if (!(e->flags & PC_UPTODATE)) {
+            int32_t r = page_fill(fs, in, i);
+            if (r < 0) {
+                *err = r;
+                return NULL;
+            }
+        }
+        if (page + 1 != f->ra_next) page_touch(e);
+        f->ra_next = page + 1;
+        return page_data(c, e);
+    }
+}
+
+/* The cached page holding page of f's file, for a write to bytes [lo,
+ * hi) of it; PC_NONE with the error in *err. A page past what the host
+ * file holds starts as zeros. Another that the write only partly covers
+ * is read in first if the file is open for reading; if not, its dirty
+ * bytes are written back unless the write joins them, so that they stay
+ * one range.
+ */
+static uint32_t page_write(FileSystem* fs, File* f, uint32_t page, uint32_t lo, uint32_t hi, int32_t* err) {
+    PageCache* c = fs->pcache;
+    Inode* in = f->inode;
+    uint32_t i = page_find(c, in->ino, page);
+    if (i == PC_NONE || !(c->ent[i].flags & PC_RESIDENT)) {
+        uint32_t slot = slot_alloc(fs);
+        i = page_add(fs, in, page, slot, PC_TEST);
+        if ((uint64_t)page << PCACHE_SHIFT >= in->disk_size) {
+            memset(c->data + ((size_t)slot << PCACHE_SHIFT), 0, PCACHE_PAGE);
+            c->ent[i].flags |= PC_UPTODATE;
+        }
+    } else if (page + 1 != f->ra_next) {
+        page_touch(&c->ent[i]);
+    }
+    PageEntry* e = &c->ent[i];
+    if (!(e->flags & PC_UPTODATE) && (lo || hi != PCACHE_PAGE)) {
+        if (in->host_fd >= 0) {
+            int32_t r = page_fill(fs, in, i);
+            if (r < 0) {
+                *err = r;
+                return PC_NONE;
+            }
+        } else if (page_dirty(e) && (hi < e->dirty_lo || lo > e->dirty_hi)) {
+            writeback(fs, in, i);
+        }
+    }
+    f->ra_next = page + 1;
+    return i;
+}
+
+static int by_key(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Write back every dirty page of in, in file order so runs go together */
+static void pcache_flush(FileSystem* fs, Inode* in) {
+    PageCache* c = fs->pcache;
+    uint64_t* keys = NULL;
+    size_t n = 0, cap = 0;
+    for (uint32_t i = in->pages; i != PC_NONE; i = c->ent[i].fnext) {
+        if (!page_dirty(&c->ent[i])) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            keys = fs_realloc(keys, cap * sizeof(uint64_t));
+        }
+        keys[n++] = (uint64_t)c->ent[i].page << 32 | i;
+    }
+    if (!n) return;
+    qsort(keys, n, sizeof(uint64_t), by_key);
+    for (size_t k = 0; k < n; k++) {
+        uint32_t i = (uint32_t)keys[k];
+        if (page_dirty(&c->ent[i])) writeback(fs, in, i);
+    }
+    free(keys);
+}
+
+/* Forget every page of in, written back or not */
+static void pcache_drop(FileSystem* fs, Inode* in) {
+    while (in->pages != PC_NONE) entry_free(fs, in->pages);
+}
+
+/* Read from f's host file into the buffers of iov, through the cache */
+static int32_t host_read(FileSystem* fs, File* f, const struct iovec* iov, int n) {
+    Inode* in = f->inode;
+    uint32_t pos = f->offset;
+    if (pos >= in->size) return 0;
+    uint32_t left = in->size - pos;
+    uint64_t want = 0;
+    for (int k = 0; k < n; k++) want += iov[k].iov_len;
+    uint32_t last = (uint32_t)((pos + (want < left ? want : left) - 1) >> PCACHE_SHIFT);
+    uint32_t done = 0, cur = PC_NONE;
+    uint8_t* data = NULL;
+    for (int k = 0; k < n && left; k++) {
+        uint8_t* buf = iov[k].iov_base;
+        uint32_t len = iov[k].iov_len < left ? (uint32_t)iov[k].iov_len : left;
+        while (len) {
+            uint32_t page = pos >> PCACHE_SHIFT;
+            uint32_t at = pos & (PCACHE_PAGE - 1);
+            if (page != cur) {
+                int32_t err = 0;
+                data = page_read(fs, f, page, last, &err);
+                if (!data) {
+                    f->offset = pos;
+                    return done ? (int32_t)done : err;
+                }
+                cur = page;
+            }
+            uint32_t chunk = PCACHE_PAGE - at < len ? PCACHE_PAGE - at : len;
+            memcpy(buf, data + at, chunk);
+            buf += chunk;
+            pos += chunk;
+            len -= chunk;
+            left -= chunk;
+            done += chunk;
+        }
+    }
+    f->offset = pos;
+    return (int32_t)done;
+}
+
+/* Write the buffers of iov to f's host file at its offset, into the
+ * cache. The bytes go to the host when their page is evicted or the file
+ * closed, runs of dirty pages together.
+ */
+static int32_t host_write(FileSystem* fs, File* f, const struct iovec* iov, int n) {
+    PageCache* c = fs->pcache;
+    Inode* in = f->inode;
+    if (in->wb_error) {
+        int32_t err = in->wb_error;
+        in->wb_error = 0;
+        return err;
+    }
+    uint32_t pos = f->offset, done = 0;
+    int32_t err = 0;
+    for (int k = 0; k < n && !err; k++) {
+        const uint8_t* buf = iov[k].iov_base;
+        uint32_t len = (uint32_t)iov[k].iov_len;
+        while (len) {
+            uint32_t page = pos >> PCACHE_SHIFT;
+            uint32_t at = pos & (PCACHE_PAGE - 1);
+            uint32_t chunk = PCACHE_PAGE - at < len ? PCACHE_PAGE - at : len;
+            uint32_t i = page_write(fs, f, page, at, at + chunk, &err);
+            if (i == PC_NONE) break;
+            PageEntry* e = &c->ent[i];
+            memcpy(page_data(c, e) + at, buf, chunk);
+            if (!page_dirty(e)) {
+                e->dirty_lo = (uint16_t)at;
+                e->dirty_hi = (uint16_t)(at + chunk);
+            } else {
+                if (at < e->dirty_lo) e->dirty_lo = (uint16_t)at;
+                if (at + chunk > e->dirty_hi) e->dirty_hi = (uint16_t)(at + chunk);
+            }
+            if (chunk == PCACHE_PAGE) e->flags |= PC_UPTODATE;
+            buf += chunk;
+            pos += chunk;
+            len -= chunk;
+            done += chunk;
+        }
+    }
+    f->offset = pos;
+    if (pos > in->size) in->size = pos;
+    return done ? (int32_t)done : err;
+}
+
+static inline uint32_t host_hash(uint64_t dev, uint64_t ino) {
+    return (uint32_t)(((ino ^ (dev << 32)) * 0x9E3779B97F4A7C15ull) >> (64 - HOST_HASH));
+}
+
+/* The last file open on a host inode closed: write its pages back, let
+ * them go and close its descriptors
+ */
+static void host_close(FileSystem* fs, Inode* in) {
+    pcache_flush(fs, in);
+    pcache_drop(fs, in);
+    if (in->host_fd >= 0) close(in->host_fd);
+    if (in->host_wfd >= 0 && in->host_wfd != in->host_fd) close(in->host_wfd);
+    Inode** link = &fs->hosts[host_hash(in->host_dev, in->host_ino)];
+    while (*link && *link != in) link = &(*link)->next_host;
+    if (*link) *link = in->next_host;
+}
+
+/* Host files */
+
+/* fs_open for a path within the mount on dir */
+static int32_t host_open(FileSystem* fs, const Inode* dir, const char* path, uint32_t flags, File** out) {
+    const Mount* m = &fs->mounts[dir->mount - 1];
+    uint32_t access = flags & UCVM_O_ACCMODE;
+    int hflags = O_CLOEXEC | O_NONBLOCK | O_NOCTTY |
+                 (access == UCVM_O_WRONLY ? O_WRONLY : access == UCVM_O_RDWR ? O_RDWR : O_RDONLY);
+    int create = (flags & UCVM_O_CREAT) != 0;
+    if (m->readonly && access != UCVM_O_RDONLY) return -UCVM_EROFS;
+    if (create && !m->readonly) hflags |= O_CREAT | ((flags & UCVM_O_EXCL) ? O_EXCL : 0);
+    if ((flags & UCVM_O_TRUNC) && access != UCVM_O_RDONLY) hflags |= O_TRUNC;
+
+    /* A read-only mount creates nothing: a missing file cannot be made
+     * and an existing one fails O_EXCL as usual
+     */
+    int fd = host_openat(m, path, hflags);
+    if (fd < 0) return errno == ENOENT && create && m->readonly ? -UCVM_EROFS : host_error(errno);
+    struct stat st;
+    int32_t err = 0;
+    if (fstat(fd, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+        err = -UCVM_EACCES;
+    } else if (create && m->readonly && (flags & UCVM_O_EXCL)) {
+        err = -UCVM_EEXIST;
+    }
+    if (err < 0) {
+        close(fd);
+        return err;
+    }
+
+    /* Every open of a host file shares one inode, and so its cached pages */
+    uint32_t b = host_hash(st.st_dev, st.st_ino);
+    Inode* in = fs->hosts[b];
+    while (in && (in->host_dev != st.st_dev || in->host_ino != st.st_ino)) in = in->next_host;
+    if (!in) {
+        in = inode_alloc(fs, INODE_HOST);
+        in->host_fd = in->host_wfd = -1;
+        in->host_dir = S_ISDIR(st.st_mode) != 0;
+        in->host_dev = st.st_dev;
+        in->host_ino = st.st_ino;
+        in->size = in->disk_size = st.st_size < FS_MAX_SIZE ? (uint32_t)st.st_size : FS_MAX_SIZE;
+        in->pages = PC_NONE;
+        in->next_host = fs->hosts[b];
+        fs->hosts[b] = in;
+        pcache_get(fs);
+    } else if (hflags & O_TRUNC) {
+        pcache_drop(fs, in);
+        in->size = in->disk_size = 0;
+    }
+    int used = 0;
+    if (access != UCVM_O_WRONLY && in->host_fd < 0) {
+        in->host_fd = fd;
+        used = 1;
+    }
+    if (access != UCVM_O_RDONLY && in->host_wfd < 0) {
+        in->host_wfd = fd;
+        used = 1;
+    }
+    if (!used) close(fd);
+    *out = file_new(in, flags);
+    return 0;
+}
+
+/* fs_mkdir or fs_unlink for a path within the mount on dir */
+static int32_t host_change(FileSystem* fs, const Inode* dir, const char* path, int remove) {
+    const Mount* m = &fs->mounts[dir->mount - 1];
+    char base[FS_NAME_MAX + 1];
+    if (m->readonly) return -UCVM_EROFS;
+    int pfd = host_parent(m, path, base);
+    if (pfd < 0) return pfd;
+    int32_t err = 0;
+    struct stat st;
+    if (is_dot(base, (uint32_t)strlen(base))) {
+        err = remove ? -UCVM_EBUSY : -UCVM_EEXIST;
+    } else if (!remove) {
+        if (mkdirat(pfd, base, 0777) < 0) err = host_error(errno);
+    } else if (fstatat(pfd, base, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+               unlinkat(pfd, base, S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0) < 0) {
+        err = host_error(errno);
+    }
+    close(pfd);
+    return err;
+}
+
+/* Open path with UCVM_O_ flags, creating it with UCVM_O_CREAT. Returns 0
+ * with the open file in *out, or -errno.
+ */
+int32_t fs_open(VM* vm, const char* path, uint32_t flags, File** out) {
+    FileSystem* fs = fs_get(vm);
+    vm->fs_calls++;
+    uint32_t access = flags & UCVM_O_ACCMODE;
+    if (access == UCVM_O_ACCMODE) return -UCVM_EINVAL;
+
+    Inode *dir, *in;
+    const char* name;
+    uint32_t len;
+    int32_t err = resolve(fs, path, &dir, &name, &len, &in);
+    if (err < 0) return err;
+    if (err) return host_open(fs, dir, name, flags, out);
+    if (in && (flags & UCVM_O_CREAT) && (flags & UCVM_O_EXCL)) return -UCVM_EEXIST;
+    if (!in) {
+        if (!(flags & UCVM_O_CREAT)) return -UCVM_ENOENT;
+        in = inode_alloc(fs, INODE_FILE);
+        dir_add(dir, name, len, in);
+        fs->neg_gen++;
+    }
+    if (in->type == INODE_DIR && access != UCVM_O_RDONLY) return -UCVM_EISDIR;
+    if ((flags & UCVM_O_TRUNC) && access != UCVM_O_RDONLY) truncate_blocks(fs, in);
+    *out = file_new(in, flags);
+    return 0;
+}
+
+int32_t fs_mkdir(VM* vm, const char* path) {
+    FileSystem* fs = fs_get(vm);
+    vm->fs_calls++;
+    Inode *dir, *in;
+    const char* name;
+    uint32_t len;
+    int32_t err = resolve(fs, path, &dir, &name, &len, &in);
+    if (err < 0) return err;
+    if (err) return host_change(fs, dir, name, 0);
+    if (!len || is_dot(name, len) || in) return -UCVM_EEXIST;
+    in = inode_alloc(fs, INODE_DIR);
+    in->parent = dir->ino;
+    dir_add(dir, name, len, in);
+    fs->neg_gen++;
+    return 0;
+}
+
+/* Remove the entry for path: a file, or an empty directory. Open files
+ * keep the inode until they are closed.
+ */
+int32_t fs_unlink(VM* vm, const char* path) {
+    FileSystem* fs = fs_get(vm);
+    vm->fs_calls++;
+    Inode *dir, *in;
+    const char* name;
+    uint32_t len;
+    int32_t err = resolve(fs, path, &dir, &name, &len, &in);
+    if (err < 0) return err;
+    if (err) return host_change(fs, dir, name, 1);
+    if (!len || is_dot(name, len)) return -UCVM_EBUSY;
+    if (!in) return -UCVM_ENOENT;
+    if (in->mount) return -UCVM_EBUSY;
+    if (in->type == INODE_DIR && in->nentries) return -UCVM_ENOTEMPTY;
+    /* Misses cached below a directory name a freed inode once it goes */
+    if (in->type == INODE_DIR) fs->neg_gen++;
+    Dirent** slot = dir_slot(dir, name, len, name_hash(name, len));
+    Dirent* d = *slot;
+    *slot = d->next;
+    free(d);
+    dir->nentries--;
+    in->nlink--;
+    inode_put(fs, in);
+    fs->gen++;
+    return 0;
+}
+
+/* Mount the host directory host_dir on the directory path, making path
+ * if it is missing. Returns 0, or -1 with a message in err.
+ */
+int fs_mount(VM* vm, const char* path, const char* host_dir, int readonly, char* err, size_t errlen) {
+    FileSystem* fs = fs_get(vm);
+    Inode *dir, *in;
+    const char* name;
+    uint32_t len;
+    int32_t r = resolve(fs, path, &dir, &name, &len, &in);
+    if (r == 0 && !in && fs_mkdir(vm, path) == 0) r = resolve(fs, path, &dir, &name, &len, &in);
+    if (r != 0 || !in || in->type != INODE_DIR || in->mount || fs->nmounts == FS_MOUNTS) {
+        snprintf(err, errlen, "%s: cannot mount", path);
+        return -1;
+    }
+    int fd = open(host_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(err, errlen, "%s: cannot open", host_dir);
+        return -1;
+    }
+    fs->mounts[fs->nmounts] = (Mount){fd, (uint8_t)(readonly != 0)};
+    in->mount = ++fs->nmounts;
+    /* Cached paths through the mount point now lead elsewhere */
+    fs->gen++;
+    fs->neg_gen++;
+    return 0;
+}
+
+/* Files */
+
+/* Index of the extent mapping file block fb, or of the first after it */
+static uint32_t extent_find(const Inode* in, uint32_t fb) {
+    uint32_t lo = 0, hi = in->nextents;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (in->extents[mid].file_block + in->extents[mid].count <= fb) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Map count blocks at block to file block fb, before extent i. Returns
+ * the index of the extent that maps fb.
+ */
+static uint32_t extent_insert(Inode* in, uint32_t i, uint32_t fb, uint32_t block, uint32_t count) {
+    if (i > 0) {
+        Extent* prev = &in->extents[i - 1];
+        if (prev->file_block + prev->count == fb && prev->block + prev->count == block &&
+            prev->block >> FS_CHUNK_ORDER == block >> FS_CHUNK_ORDER) {
+            prev->count += count;
+            return i - 1;
+        }
+    }
+    if (in->nextents == in->extents_cap) {
+        in->extents_cap = in->extents_cap ? in->extents_cap * 2 : 4;
+        in->extents = fs_realloc(in->extents, in->extents_cap * sizeof(Extent));
+    }
+    memmove(&in->extents[i + 1], &in->extents[i], (in->nextents - i) * sizeof(Extent));
+    in->extents[i] = (Extent){fb, block, count};
+    in->nextents++;
+    return i;
+}
+
+/* Give file blocks [first, last] blocks of the store */
+static void map_blocks(FileSystem* fs, Inode* in, uint32_t first, uint32_t last) {
+    uint32_t i = extent_find(in, first);
+    for (uint32_t fb = first; fb <= last;) {
+        if (i < in->nextents && in->extents[i].file_block <= fb) {
+            fb = in->extents[i].file_block + in->extents[i].count;
+            i++;
+            continue;
+        }
+        uint32_t order;
+        if (i == in->nextents) {
+            /* Growing at the end: as much again as the file has */
+            uint32_t want = last + 1 - fb > in->blocks ? last + 1 - fb : in->blocks;
+            order = log2_floor(want) + ((want & (want - 1)) != 0);
+        } else {
+            /* Filling a hole: no more than it takes */
+            uint32_t gap = in->extents[i].file_block - fb;
+            order = log2_floor(gap < last + 1 - fb ? gap : last + 1 - fb);
+        }
+        if (order > FS_CHUNK_ORDER) order = FS_CHUNK_ORDER;
+        uint32_t count = 1u << order;
+        i = extent_insert(in, i, fb, block_alloc(fs, order), count) + 1;
+        in->blocks += count;
+        fb += count;
+    }
+}
+
+/* Copy len bytes at pos between a file and buf, which must be mapped
+ * for a write
+ */
+static void file_copy(FileSystem* fs, Inode* in, uint32_t pos, uint8_t* buf, uint32_t len, int write) {
+    uint32_t i = extent_find(in, pos >> FS_BLOCK_SHIFT);
+    while (len) {
+        const Extent* e = i < in->nextents ? &in->extents[i] : NULL;
+        uint64_t start = e ? (uint64_t)e->file_block << FS_BLOCK_SHIFT : UINT64_MAX;
+        if (pos < start) {
+            uint32_t n = start - pos < len ? (uint32_t)(start - pos) : len;
+            memset(buf, 0, n);      /* a hole, never a write */
+            buf += n;
+            pos += n;
+            len -= n;
+            continue;
+        }
+        uint64_t end = (uint64_t)(e->file_block + e->count) << FS_BLOCK_SHIFT;
+        uint32_t n = end - pos < len ? (uint32_t)(end - pos) : len;
+        uint8_t* data = block_data(fs, e->block) + (pos - start);
+        if (write) {
+            memcpy(data, buf, n);
+        } else {
+            memcpy(buf, data, n);
+        }
+        buf += n;
+        pos += n;
+        len -= n;
+        i++;
+    }
+}
+
+/* Pipes */
+
+/* Copy len bytes between buf and the ring, from counter pos on */
+static void pipe_copy(Pipe* p, uint32_t pos, uint8_t* buf, uint32_t len, int write) {
+    uint32_t at = pos & (PIPE_SIZE - 1);
+    uint32_t first = PIPE_SIZE - at < len ? PIPE_SIZE - at : len;
+    if (write) {
+        memcpy(p->buf + at, buf, first);
+        memcpy(p->buf, buf + first, len - first);
+    } else {
+        memcpy(buf, p->buf + at, first);
+        memcpy(buf + first, p->buf, len - first);
+    }
+}
+
+/* The ring's bytes from counter pos on as at most two iovecs */
+static int pipe_iov(Pipe* p, uint32_t pos, uint32_t len, struct iovec* iov) {
+    uint32_t at = pos & (PIPE_SIZE - 1);
+    uint32_t first = PIPE_SIZE - at < len ? PIPE_SIZE - at : len;
+    iov[0] = (struct iovec){p->buf + at, first};
+    iov[1] = (struct iovec){p->buf, len - first};
+    return len > first ? 2 : 1;
+}
+
+/* Block the running process until the pipe changes */
+static int32_t pipe_wait(VM* vm, Pipe* p) {
+    if (p->nwaiting == p->waiting_cap) {
+        p->waiting_cap = p->waiting_cap ? p->waiting_cap * 2 : 4;
+        p->waiting = fs_realloc(p->waiting, p->waiting_cap * sizeof(uint32_t));
+    }
+    p->waiting[p->nwaiting++] = vm->proc->pid;
+    return -UCVM_EAGAIN;
+}
+
+/* Wake every process blocked on the pipe, to run its call again. Pids
+ * on the list may have woken or gone since.
+ */
+static void pipe_wake(VM* vm, Pipe* p) {
+    for (uint32_t i = 0; i < p->nwaiting; i++) {
+        Process* w = vm->procs[p->waiting[i]];
+        if (w && w->state == PROC_BLOCKED) proc_wakeup(vm, w);
+    }
+    p->nwaiting = 0;
+}
+
+static uint32_t iov_total(const struct iovec* iov, int n) {
+    uint32_t len = 0;
+    for (int i = 0; i < n; i++) len += (uint32_t)iov[i].iov_len;
+    return len;
+}
+
+static int32_t pipe_read(VM* vm, Pipe* p, const struct iovec* iov, int n) {
+    uint32_t used = p->tail - p->head, done = 0;
+    if (!used) return p->writers && iov_total(iov, n) ? pipe_wait(vm, p) : 0;
+    for (int i = 0; i < n && done < used; i++) {
+        uint32_t len = iov[i].iov_len < used - done ? (uint32_t)iov[i].iov_len : used - done;
+        pipe_copy(p, p->head + done, iov[i].iov_base, len, 0);
+        done += len;
+    }
+    p->head += done;
+    pipe_wake(vm, p);
+    return (int32_t)done;
+}
+
+/* A write that fits in PIPE_ATOMIC bytes goes in whole or waits; a
+ * longer one takes what room there is
+ */
+static int32_t pipe_write(VM* vm, Pipe* p, const struct iovec* iov, int n, uint32_t len) {
+    uint32_t room = PIPE_SIZE - (p->tail - p->head), done = 0;
+    if (!p->readers) return -UCVM_EPIPE;
+    if (!len) return 0;
+    if (!room || (len <= PIPE_ATOMIC && room < len)) return pipe_wait(vm, p);
+    for (int i = 0; i < n && done < room; i++) {
+        uint32_t part = iov[i].iov_len < room - done ? (uint32_t)iov[i].iov_len : room - done;
+        pipe_copy(p, p->tail + done, iov[i].iov_base, part, 1);
+        done += part;
+    }
+    p->tail += done;
+    pipe_wake(vm, p);
+    return (int32_t)done;
+}
+
+/* A new pipe, open for reading at one end and writing at the other */
+void fs_pipe(VM* vm, File** read_end, File** write_end) {
+    FileSystem* fs = fs_get(vm);
+    vm->fs_calls++;
+    Inode* in = inode_alloc(fs, INODE_PIPE);
+    Pipe* p = fs_realloc(NULL, sizeof(Pipe));
+    memset(p, 0, sizeof(Pipe));
+    p->buf = fs_realloc(NULL, PIPE_SIZE);
+    p->readers = p->writers = 1;
+    in->pipe = p;
+    *read_end = file_new(in, UCVM_O_RDONLY);
+    *write_end = file_new(in, UCVM_O_WRONLY);
+}
+
+/* Fill the buffers of iov from the file's offset and move past what was
+ * read. Returns the count, 0 at the end of the file, or -errno; for a
+ * pipe, -UCVM_EAGAIN when the process has to block.
+ */
+int32_t file_read(VM* vm, File* f, const struct iovec* iov, int n) {
+    Inode* in = f->inode;
+    vm->fs_calls++;
+    if ((f->flags & UCVM_O_ACCMODE) == UCVM_O_WRONLY) return -UCVM_EBADF;
+    if (in->type == INODE_DIR) return -UCVM_EISDIR;
+    if (in->type == INODE_PIPE) return pipe_read(vm, in->pipe, iov, n);
+    if (in->type == INODE_HOST) return in->host_dir ? -UCVM_EISDIR : host_read(vm->fs, f, iov, n);
+    uint32_t done = 0;
+    for (int i = 0; i < n && f->offset < in->size; i++) {
+        uint32_t len = (uint32_t)iov[i].iov_len;
+        if (len > in->size - f->offset) len = in->size - f->offset;
+        file_copy(vm->fs, in, f->offset, iov[i].iov_base, len, 0);
+        f->offset += len;
+        done += len;
+    }
+    return (int32_t)done;
+}
+
+/* Write the buffers of iov at the file's offset, or at its end with
+ * UCVM_O_APPEND, and move past them. Returns the count or -errno, as
+ * file_read does.
+ */
+int32_t file_write(VM* vm, File* f, const struct iovec* iov, int n) {
+    Inode* in = f->inode;
+    vm->fs_calls++;
+    uint32_t len = iov_total(iov, n);
+    if ((f->flags & UCVM_O_ACCMODE) == UCVM_O_RDONLY) return -UCVM_EBADF;
+    if (in->type == INODE_PIPE) return pipe_write(vm, in->pipe, iov, n, len);
+    if (f->flags & UCVM_O_APPEND) f->offset = in->size;
+    if (len == 0) return 0;
+    if (len > FS_MAX_SIZE - f->offset) return -UCVM_EFBIG;
+    if (in->type == INODE_HOST) return host_write(vm->fs, f, iov, n);
+    map_blocks(vm->fs, in, f->offset >> FS_BLOCK_SHIFT, (f->offset + len - 1) >> FS_BLOCK_SHIFT);
+    for (int i = 0; i < n; i++) {
+        file_copy(vm->fs, in, f->offset, iov[i].iov_base, (uint32_t)iov[i].iov_len, 1);
+        f->offset += (uint32_t)iov[i].iov_len;
+    }
+    if (f->offset > in->size) in->size = f->offset;
+    return (int32_t)len;
+}
+
+/* Move the offset to offset from the start (whence 0), the current
+ * offset (1) or the end (2). Returns the new offset or -errno.
+ */
+int32_t file_seek(VM* vm, File* f, int32_t offset, uint32_t whence) {
+    int64_t base;
+    vm->fs_calls++;
+    if (f->inode->type == INODE_PIPE) return -UCVM_ESPIPE;
+    switch (whence) {
+        case 0: base = 0; break;
+        case 1: base = f->offset; break;
+        case 2: base = f->inode->size; break;
+        default: return -UCVM_EINVAL;
+    }
+    if (base + offset < 0 || base + offset > FS_MAX_SIZE) return -UCVM_EINVAL;
+    f->offset = (uint32_t)(base + offset);
+    return (int32_t)f->offset;
+}
+
+/* Move up to len bytes from in to out, one of them a pipe, straight
+ * between the pipe's ring and the other file. Returns the count, 0 at
+ * the end of in, or -errno as file_read does.
+ */
+int32_t file_splice(VM* vm, File* in, File* out, uint32_t len) {
+    Pipe* src = in->inode->type == INODE_PIPE ? in->inode->pipe : NULL;
+    Pipe* dst = out->inode->type == INODE_PIPE ? out->inode->pipe : NULL;
+    struct iovec iov[2];
+    vm->fs_calls++;
+    if (src == dst) return -UCVM_EINVAL;
+    if ((in->flags & UCVM_O_ACCMODE) == UCVM_O_WRONLY || (out->flags & UCVM_O_ACCMODE) == UCVM_O_RDONLY) {
+        return -UCVM_EBADF;
+    }
+    if (dst) {
+        uint32_t room = PIPE_SIZE - (dst->tail - dst->head);
+        if (!dst->readers) return -UCVM_EPIPE;
+        if (!len) return 0;
+        if (!room) return pipe_wait(vm, dst);
+        int32_t got = file_read(vm, in, iov, pipe_iov(dst, dst->tail, len < room ? len : room, iov));
+        if (got > 0) {
+            dst->tail += (uint32_t)got;
+            pipe_wake(vm, dst);
+        }
+        return got;
+    }
+    uint32_t used = src->tail - src->head;
+    if (!used) return src->writers && len ? pipe_wait(vm, src) : 0;
+    int32_t put = file_write(vm, out, iov, pipe_iov(src, src->head, len < used ? len : used, iov));
+    if (put > 0) {
+        src->head += (uint32_t)put;
+        pipe_wake(vm, src);
+    }
+    return put;
+}
+
+/* Drop a reference to f. The last one closes it, and closing an end of
+ * a pipe wakes whoever waits at the other, to see the end of the data or
+ * that no one reads, if wake is set.
+ */
+static void file_release(VM* vm, File* f, int wake) {
+    if (--f->refs) return;
+    Pipe* p = f->inode->pipe;
+    if (p) {
+        if ((f->flags & UCVM_O_ACCMODE) == UCVM_O_RDONLY) {
+            p->readers--;
+        } else {
+            p->writers--;
+        }
+        if (wake) pipe_wake(vm, p);
+    }
+    if (!--f->inode->refs && f->inode->type == INODE_HOST) host_close(vm->fs, f->inode);
+    inode_put(vm->fs, f->inode);
+    free(f);
+}
+
+void file_close(VM* vm, File* f) {
+    vm->fs_calls++;
+    file_release(vm, f, 1);
+}
+
+/* Descriptors */
+
+/* A forked child shares its parent's open files */
+void files_fork(const Process* parent, Process* child) {
+    for (uint32_t fd = 0; fd < MAX_FDS; fd++) {
+        child->files[fd] = parent->files[fd];
+        if (child->files[fd]) child->files[fd]->refs++;
+    }
+}
+
+/* Close every file p has open, when it exits or goes. Without wake no
+ * blocked process is woken, for a machine whose run queues are being
+ * replaced or freed; only an exit counts as a file-system call.
+ */
+void files_close(VM* vm, Process* p, int wake) {
+    for (uint32_t fd = 0; fd < MAX_FDS; fd++) {
+        if (p->files[fd]) {
+            file_release(vm, p->files[fd], wake);
+            if (wake) vm->fs_calls++;
+        }
+        p->files[fd] = NULL;
+    }
+}
+
+/* Set the descriptors of a process put back in a saved state. Files are
+ * not saved, so a descriptor stays open only if the process still has
+ * it, or it is a standard stream, which needs no file. Blocked processes
+ * are woken by the restore, not here.
+ */
+void files_restore(VM* vm, Process* p, uint16_t fd_open) {
+    for (uint32_t fd = 0; fd < MAX_FDS; fd++) {
+        if (!(fd_open & (1u << fd)) && p->files[fd]) {
+            file_release(vm, p->files[fd], 0);
+            p->files[fd] = NULL;
+        }
+        if (!p->files[fd] && fd > 2) fd_open &= (uint16_t)~(1u << fd);
+    }
+    p->fd_open = fd_open;
+}
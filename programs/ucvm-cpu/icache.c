@@ -0,0 +1,588 @@
+/* UCVM CPU Engine - pre-decoded instruction cache
+ * Text pages are decoded once, a basic block at a time, into arrays of
+ * micro-ops that carry their handler address (direct threading). Hot
+ * loops then run with no per-instruction fetch or operand parsing.
+ * A guest write to a decoded page throws its ops away. An instruction at
+ * a breakpoint decodes to an op that stops before it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "exec.h"
+
+static ICachePage* icache_page(VM* vm, uint32_t page) {
+    ICachePage* p = vm->icache[page];
+    if (!p) {
+        p = malloc(sizeof(ICachePage));
+        if (!p) {
+            fprintf(stderr, "ucvm-cpu: out of memory\n");
+            exit(1);
+        }
+        memset(p->index, 0, sizeof(p->index));
+        p->count = 0;
+        vm->icache[page] = p;
+    }
+    return p;
+}
+
+void icache_invalidate_page(VM* vm, uint32_t page) {
+    ICachePage* p = vm->icache[page];
+    if (p && p->count) {
+        memset(p->index, 0, sizeof(p->index));
+        p->count = 0;
+    }
+}
+
+void icache_flush(VM* vm) {
+    for (uint32_t page = 0; page < NUM_PAGES; page++) {
+        icache_invalidate_page(vm, page);
+    }
+}
+
+void icache_free(VM* vm) {
+    for (uint32_t page = 0; page < NUM_PAGES; page++) {
+        free(vm->icache[page]);
+        vm->icache[page] = NULL;
+    }
+}
+
+/* Unconditional transfers end a block; conditional branches do not, so
+ * the fall-through path of JZ/JNZ is always the next op in the array.
+ */
+static int ends_block(uint8_t kind) {
+    return kind == OP_JMP || kind == OP_CALL || kind == OP_RET ||
+           kind == OP_HLT || kind == OPX_ILL;
+}
+
+static void decode_one(const uint8_t* ip, uint32_t pc, DecodedOp* op) {
+    op->pc = pc;
+    op->kind = ip[0];
+    op->regs = ip[1];
+    op->imm = 0;
+
+    switch (ip[0]) {
+        case OP_MOV_RI:
+            op->imm = rd32(ip + 2);
+            break;
+        case OP_LOAD:
+        case OP_STORE:
+            op->imm = rd16(ip + 2);
+            if ((ip[1] & 15) == 0) op->kind = ip[0] == OP_LOAD ? OPX_LOAD_ABS : OPX_STORE_ABS;
+            break;
+        case OP_JMP:
+        case OP_JZ:
+        case OP_JNZ:
+        case OP_CALL:
+            op->imm = rd16(ip + 1);
+            op->regs = 0;
+            break;
+        case OP_INT:
+            op->imm = ip[1];
+            op->regs = 0;
+            break;
+        case OP_HLT:
+        case OP_RET:
+        case OP_SYSCALL:
+            op->regs = 0;
+            break;
+        default:
+            if (insn_size[ip[0]] == 0) {
+                op->kind = OPX_ILL;
+                op->regs = 0;
+            }
+            break;
+    }
+}
+
+/* Superinstruction for an adjacent pair of decoded ops, or 0. The pairs
+ * are the ones `ucvm-cpu ngrams` finds hottest in loop-heavy code.
+ */
+static uint8_t fused_kind(uint8_t first, uint8_t second) {
+    switch (first) {
+        case OP_MOV_RI:
+            if (second == OP_MOV_RI) return OPX_MOVI_MOVI;
+            if (second == OP_ADD) return OPX_MOVI_ADD;
+            return 0;
+        case OP_LOAD:
+            return second == OP_ADD ? OPX_LOAD_ADD : 0;
+        case OP_ADD:
+            return second == OP_JNZ ? OPX_ADD_JNZ : 0;
+        case OP_SUB:
+            if (second == OP_JNZ) return OPX_SUB_JNZ;
+            if (second == OP_JZ) return OPX_SUB_JZ;
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+/* Decode the basic block starting at pc, which must be a text address
+ * with no decoded op yet. The block stops at an unconditional transfer,
+ * at the page boundary, or on reaching code that is already decoded.
+ */
+static DecodedOp* decode_block(VM* vm, uint32_t pc, const void* const* handlers) {
+    uint32_t page = pc >> PAGE_SHIFT;
+    ICachePage* p = icache_page(vm, page);
+    DecodedOp* first = &p->ops[p->count];
+    DecodedOp* prev = NULL;
+
+    for (;;) {
+        DecodedOp* op = &p->ops[p->count];
+        uint32_t off = pc & PAGE_MASK;
+
+        if ((pc >> PAGE_SHIFT) != page || !fetch_ok(pc) || p->index[off]) {
+            op->kind = OPX_NEXT;
+            op->pc = pc & 0xFFFF;
+            op->regs = 0;
+            op->imm = pc & 0xFFFF;
+            if ((pc >> PAGE_SHIFT) == page && p->index[off]) {
+                int16_t link = (int16_t)(&p->ops[p->index[off] - 1] - op);
+                op->imm |= (uint32_t)(uint16_t)link << 16;
+            }
+            op->handler = handlers[op->kind];
+            p->count++;
+            break;
+        }
+
+        uint8_t buf[MAX_INSN_SIZE];
+        const uint8_t* ip = fetch_insn(vm, vm->pt, pc, buf);
+        decode_one(ip, pc, op);
+        uint8_t kind = op->kind;
+        if (unlikely(vm->traps != NULL) && trap_break_at(vm->traps, pc)) op->kind = OPX_BREAK;
+        op->handler = handlers[op->kind];
+        if (!(vm->code_page[page] & CODE_DECODED)) code_mark_page(vm, page, CODE_DECODED);
+        p->index[off] = (uint16_t)(++p->count);
+
+        /* The second op keeps its own handler for branches that land on it */
+        uint8_t fused = prev && vm->fuse ? fused_kind(prev->kind, op->kind) : 0;
+        if (fused) {
+            prev->kind = fused;
+            prev->handler = handlers[fused];
+        }
+        prev = op;
+        if (ends_block(kind)) break;
+        pc += insn_size[ip[0]];
+    }
+    return first;
+}
+
+/* Find the decoded op for pc, decoding its block on a miss.
+ * Returns NULL when pc is not executable.
+ */
+DecodedOp* icache_lookup(VM* vm, uint32_t pc, const void* const* handlers) {
+    if (unlikely(!fetch_ok(pc))) return NULL;
+    ICachePage* p = vm->icache[pc >> PAGE_SHIFT];
+    if (likely(p != NULL)) {
+        uint16_t i = p->index[pc & PAGE_MASK];
+        if (likely(i)) return &p->ops[i - 1];
+    }
+    return decode_block(vm, pc, handlers);
+}
+
+/* Direct-threaded interpreter over pre-decoded ops. Taken branches within
+ * a page are linked to their target op on first use, so a hot loop never
+ * consults the page index again.
+ *
+ * With vm->lazy_flags the ALU handlers come from a second table that only
+ * records the last operation; CPUState.flags is brought up to date when
+ * the engine returns or calls out to a syscall or interrupt.
+ */
+THREADED_DISPATCH
+VMStatus exec_decoded(VM* vm, uint64_t budget) {
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+#define COMMON_HANDLERS \
+        [0 ... OPX_KIND_COUNT - 1] = &&op_ill, \
+        [OP_HLT] = &&op_hlt, \
+        [OP_MOV_RR] = &&op_mov_rr, \
+        [OP_MOV_RI] = &&op_mov_ri, \
+        [OP_LOAD] = &&op_load, \
+        [OP_STORE] = &&op_store, \
+        [OP_ADD] = &&op_add, \
+        [OP_SUB] = &&op_sub, \
+        [OP_MUL] = &&op_mul, \
+        [OP_DIV] = &&op_div, \
+        [OP_JMP] = &&op_jmp, \
+        [OP_JZ] = &&op_jz, \
+        [OP_JNZ] = &&op_jnz, \
+        [OP_CALL] = &&op_call, \
+        [OP_RET] = &&op_ret, \
+        [OP_SYSCALL] = &&op_syscall, \
+        [OP_INT] = &&op_int, \
+        [OPX_LOAD_ABS] = &&op_load_abs, \
+        [OPX_STORE_ABS] = &&op_store_abs, \
+        [OPX_NEXT] = &&op_next, \
+        [OPX_ILL] = &&op_ill, \
+        [OPX_BREAK] = &&op_break, \
+        [OPX_MOVI_MOVI] = &&op_movi_movi, \
+        [OPX_MOVI_ADD] = &&op_movi_add, \
+        [OPX_LOAD_ADD] = &&op_load_add, \
+        [OPX_ADD_JNZ] = &&op_add_jnz, \
+        [OPX_SUB_JNZ] = &&op_sub_jnz, \
+        [OPX_SUB_JZ] = &&op_sub_jz
+
+    static const void* const eager_handlers[OPX_KIND_COUNT] = {
+        COMMON_HANDLERS
+    };
+    static const void* const lazy_handlers[OPX_KIND_COUNT] = {
+        COMMON_HANDLERS,
+        [OP_ADD] = &&op_add_lazy,
+        [OP_SUB] = &&op_sub_lazy,
+        [OP_MUL] = &&op_mul_lazy,
+        [OP_DIV] = &&op_div_lazy,
+        [OP_JZ] = &&op_jz_lazy,
+        [OP_JNZ] = &&op_jnz_lazy,
+        [OPX_MOVI_ADD] = &&op_movi_add_lazy,
+        [OPX_LOAD_ADD] = &&op_load_add_lazy,
+        [OPX_ADD_JNZ] = &&op_add_jnz_lazy,
+        [OPX_SUB_JNZ] = &&op_sub_jnz_lazy,
+        [OPX_SUB_JZ] = &&op_sub_jz_lazy
+    };
+#undef COMMON_HANDLERS
+#pragma GCC diagnostic pop
+
+    CPUState* c = vm->cpu;
+    const TLBEntry* tlb = cpu_tlb(c);
+    uint32_t* r = c->gpr;
+    uint64_t left = budget;
+    uint32_t pc = c->pc;
+    uint32_t addr;
+    DecodedOp* op;
+    VMStatus st;
+    const void* const* handlers = vm->lazy_flags ? lazy_handlers : eager_handlers;
+
+    /* Lazy flags: the last ALU op and its operands. ZF is lz_res == 0
+     * whether or not an op is pending. */
+    uint8_t lz_op = LAZY_NONE;
+    uint32_t lz_a = 0, lz_b = 0;
+    uint32_t lz_res = !c->flags.zero;
+
+#define DISPATCH() do { \
+        if (unlikely(left == 0)) goto out_budget; \
+        left--; \
+        goto *op->handler; \
+    } while (0)
+#define NEXT() do { op++; DISPATCH(); } while (0)
+#define JUMP(target) do { pc = (target); goto lookup; } while (0)
+/* Follow a taken branch through its link, or resolve and link it */
+#define BRANCH() do { \
+        int16_t link = op_link(op); \
+        if (likely(link)) { \
+            op += link; \
+            DISPATCH(); \
+        } \
+        goto branch_slow; \
+    } while (0)
+/* Account for the second half of a fused pair, or run the first half
+ * alone when the budget ends between them
+ */
+#define FUSED(single) do { \
+        if (unlikely(left == 0)) goto single; \
+        left--; \
+    } while (0)
+/* A SUB ; JNZ whose branch targets the pair itself counts down in
+ * place, whole iterations at a time while the budget covers them. On
+ * leaving, v is the last result and prev the operand it came from. If
+ * v is zero the JNZ falls through; otherwise the pair runs again.
+ */
+#define COUNT_DOWN(v, prev, d) do { \
+        while (likely(left >= 2)) { \
+            left -= 2; \
+            prev = v; \
+            v -= d; \
+            if (unlikely(v == 0)) break; \
+        } \
+    } while (0)
+#define LAZY(kind, expr) do { \
+        lz_op = (kind); \
+        lz_a = r[A]; \
+        lz_b = r[B]; \
+        r[A] = lz_res = (expr); \
+    } while (0)
+#define SYNC_FLAGS() do { \
+        flags_materialize(&c->flags, lz_op, lz_a, lz_b); \
+        lz_op = LAZY_NONE; \
+    } while (0)
+#define A (op->regs >> 4)
+#define B (op->regs & 15)
+
+lookup:
+    op = icache_lookup(vm, pc, handlers);
+    if (unlikely(!op)) goto fault_fetch;
+    DISPATCH();
+
+branch_slow: {
+        DecodedOp* from = op;
+        pc = from->imm & 0xFFFF;
+        op = icache_lookup(vm, pc, handlers);
+        if (unlikely(!op)) goto fault_fetch;
+        if ((pc >> PAGE_SHIFT) == ((uint32_t)from->pc >> PAGE_SHIFT)) {
+            from->imm = pc | (uint32_t)(uint16_t)(int16_t)(op - from) << 16;
+        }
+        DISPATCH();
+    }
+
+op_hlt:
+    pc = op->pc + 1;
+    st = VM_HALTED;
+    goto out;
+op_mov_rr:
+    r[A] = r[B];
+    NEXT();
+op_mov_ri:
+    r[A] = op->imm;
+    NEXT();
+op_load:
+    addr = (r[B] + op->imm) & 0xFFFF;
+    if (unlikely(!mem_load32(vm, tlb, addr, &r[A]))) goto fault_data;
+    NEXT();
+op_load_abs:
+    addr = op->imm;
+    if (unlikely(!mem_load32(vm, tlb, addr, &r[A]))) goto fault_data;
+    NEXT();
+op_store:
+    addr = (r[B] + op->imm) & 0xFFFF;
+    goto store;
+op_store_abs:
+    addr = op->imm;
+store:
+    switch (mem_store32(vm, tlb, addr, r[A])) {
+        case MEM_OK: NEXT();
+        case MEM_FAULT: goto fault_data;
+        default: JUMP(op->pc + 4);
+    }
+op_add:
+    r[A] = alu_add(&c->flags, r[A], r[B]);
+    NEXT();
+op_sub:
+    r[A] = alu_sub(&c->flags, r[A], r[B]);
+    NEXT();
+op_mul:
+    r[A] = alu_mul(&c->flags, r[A], r[B]);
+    NEXT();
+op_div:
+    if (unlikely(r[B] == 0)) goto fault_div0;
+    r[A] = alu_div(&c->flags, r[A], r[B]);
+    NEXT();
+op_jmp:
+    BRANCH();
+op_jz:
+    if (c->flags.zero) BRANCH();
+    NEXT();
+op_jnz:
+    if (!c->flags.zero) BRANCH();
+    NEXT();
+op_call:
+    addr = c->sp - 4;
+    switch (mem_store32(vm, tlb, addr, op->pc + 3u)) {
+        case MEM_OK:
+            c->sp = addr;
+            BRANCH();
+        case MEM_FAULT:
+            goto fault_data;
+        default:
+            c->sp = addr;
+            JUMP(op->imm & 0xFFFF);
+    }
+op_ret:
+    addr = c->sp;
+    if (unlikely(!mem_load32(vm, tlb, addr, &pc))) goto fault_data;
+    c->sp = addr + 4;
+    JUMP(pc & 0xFFFF);
+op_syscall:
+    /* A system call may rewrite memory or PC, so resume through lookup */
+    SYNC_FLAGS();
+    c->pc = op->pc + 1;
+    vm->icount += budget - left;    /* the call sees itself retired */
+    budget = left;
+    st = do_syscall(vm);
+    lz_res = !c->flags.zero;
+    pc = c->pc;
+    if (st != VM_RUNNING) goto out;
+    goto lookup;
+op_int:
+    SYNC_FLAGS();
+    c->pc = op->pc + 2;
+    vm->icount += budget - left;
+    budget = left;
+    st = do_interrupt(vm, (uint8_t)op->imm);
+    lz_res = !c->flags.zero;
+    if (st == VM_FAULT) left++;
+    pc = st == VM_FAULT ? op->pc : c->pc;
+    if (st != VM_RUNNING) goto out;
+    goto lookup;
+op_next:
+    /* Block continuation, not a guest instruction */
+    left++;
+    BRANCH();
+op_movi_movi:
+    FUSED(op_mov_ri);
+    r[A] = op->imm;
+    op++;
+    r[A] = op->imm;
+    NEXT();
+op_movi_add:
+    FUSED(op_mov_ri);
+    r[A] = op->imm;
+    op++;
+    r[A] = alu_add(&c->flags, r[A], r[B]);
+    NEXT();
+op_load_add:
+    FUSED(op_load);
+    addr = (r[B] + op->imm) & 0xFFFF;
+    if (unlikely(!mem_load32(vm, tlb, addr, &r[A]))) {
+        left++;
+        goto fault_data;
+    }
+    op++;
+    r[A] = alu_add(&c->flags, r[A], r[B]);
+    NEXT();
+op_add_jnz:
+    FUSED(op_add);
+    r[A] = alu_add(&c->flags, r[A], r[B]);
+    op++;
+    if (!c->flags.zero) BRANCH();
+    NEXT();
+op_sub_jnz:
+    FUSED(op_sub);
+    r[A] = alu_sub(&c->flags, r[A], r[B]);
+    op++;
+    if (!c->flags.zero) {
+        if (op_link(op) == -1) goto sub_jnz_self;
+        BRANCH();
+    }
+    NEXT();
+sub_jnz_self: {
+        op--;
+        uint32_t d = r[B], v = r[A], prev = v + d;
+        COUNT_DOWN(v, prev, d);
+        r[A] = alu_sub(&c->flags, prev, d);
+        if (v == 0) {
+            op++;
+            NEXT();
+        }
+        DISPATCH();
+    }
+op_sub_jz:
+    FUSED(op_sub);
+    r[A] = alu_sub(&c->flags, r[A], r[B]);
+    op++;
+    if (c->flags.zero) BRANCH();
+    NEXT();
+
+op_add_lazy:
+    LAZY(LAZY_ADD, lz_a + lz_b);
+    NEXT();
+op_sub_lazy:
+    LAZY(LAZY_SUB, lz_a - lz_b);
+    NEXT();
+op_mul_lazy:
+    LAZY(LAZY_MUL, lz_a * lz_b);
+    NEXT();
+op_div_lazy:
+    if (unlikely(r[B] == 0)) goto fault_div0;
+    LAZY(LAZY_DIV, lz_a / lz_b);
+    NEXT();
+op_jz_lazy:
+    if (lz_res == 0) BRANCH();
+    NEXT();
+op_jnz_lazy:
+    if (lz_res != 0) BRANCH();
+    NEXT();
+op_movi_add_lazy:
+    FUSED(op_mov_ri);
+    r[A] = op->imm;
+    op++;
+    LAZY(LAZY_ADD, lz_a + lz_b);
+    NEXT();
+op_load_add_lazy:
+    FUSED(op_load);
+    addr = (r[B] + op->imm) & 0xFFFF;
+    if (unlikely(!mem_load32(vm, tlb, addr, &r[A]))) {
+        left++;
+        goto fault_data;
+    }
+    op++;
+    LAZY(LAZY_ADD, lz_a + lz_b);
+    NEXT();
+op_add_jnz_lazy:
+    FUSED(op_add_lazy);
+    LAZY(LAZY_ADD, lz_a + lz_b);
+    op++;
+    if (lz_res != 0) BRANCH();
+    NEXT();
+op_sub_jnz_lazy:
+    FUSED(op_sub_lazy);
+    LAZY(LAZY_SUB, lz_a - lz_b);
+    op++;
+    if (lz_res != 0) {
+        if (op_link(op) == -1) goto sub_jnz_self_lazy;
+        BRANCH();
+    }
+    NEXT();
+sub_jnz_self_lazy: {
+        op--;
+        uint32_t d = r[B], v = r[A], prev = lz_a;
+        COUNT_DOWN(v, prev, d);
+        lz_a = prev;
+        r[A] = lz_res = v;
+        if (v == 0) {
+            op++;
+            NEXT();
+        }
+        DISPATCH();
+    }
+op_sub_jz_lazy:
+    FUSED(op_sub_lazy);
+    LAZY(LAZY_SUB, lz_a - lz_b);
+    op++;
+    if (lz_res == 0) BRANCH();
+    NEXT();
+
+op_ill:
+    left++;
+    pc = op->pc;
+    st = raise_fault(vm, FAULT_ILL, pc);
+    goto out;
+op_break:
+    left++;
+    pc = op->pc;
+    st = trap_stop(vm, pc);
+    goto out;
+
+fault_data:
+    left++;
+    pc = op->pc;
+    st = raise_fault(vm, FAULT_SEGV, addr);
+    goto out;
+fault_div0:
+    left++;
+    pc = op->pc;
+    st = raise_fault(vm, FAULT_DIV0, pc);
+    goto out;
+fault_fetch:
+    st = raise_fault(vm, FAULT_SEGV, pc);
+    goto out;
+out_budget:
+    pc = op->pc;
+    st = VM_BUDGET;
+out:
+    SYNC_FLAGS();
+    c->pc = pc;
+    vm->icount += budget - left;
+    return st;
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef BRANCH
+#undef FUSED
+#undef COUNT_DOWN
+#undef LAZY
+#undef SYNC_FLAGS
+#undef A
+#undef B
+#else
+    return exec_switch(vm, budget);
+#endif
+}
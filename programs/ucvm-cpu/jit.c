@@ -0,0 +1,693 @@
+/* UCVM CPU Engine - baseline x86-64 JIT
+ * Each basic block is compiled once by stitching fixed machine-code
+ * templates together into an executable buffer. Guest registers stay in
+ * the CPUState, which is pinned in rbx for the whole block. Loads and
+ * stores probe the software TLB inline and call back into C on a miss,
+ * so permission checks are shared with the interpreters. SYSCALL calls
+ * the syscall table directly. Anything the templates do not cover (INT,
+ * HLT, faults, partial budgets) is handed to the decoded engine one
+ * instruction at a time, so the JIT never has to raise a fault itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include "exec.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE    (4u << 20)   /* executable buffer per VM */
+#define JIT_MAX_BLOCKS   65536
+#define JIT_MAX_INSNS    64           /* guest instructions per block */
+#define JIT_INSN_BYTES   128          /* worst-case template size */
+#define JIT_SMC_LIMIT    4            /* invalidations before a page is interpreted */
+#define JIT_INTERP_SLICE 1024         /* instructions per interpreted slice */
+
+/* A block is called with the remaining budget and returns the next PC
+ * in bits 0-31 and the instructions it retired in bits 32-62.
+ * JIT_INTERPRET asks the dispatcher to run the instruction at that PC
+ * through the interpreter. A block whose branch targets its own start
+ * loops in place while the budget allows, so r13 carries the retired
+ * count of earlier trips (pre-shifted) and r14 the budget left.
+ */
+#define JIT_INTERPRET (1ull << 63)
+#define JIT_RETIRED(n) ((uint64_t)(n) << 32)
+#define JIT_STOP 0x80000000u          /* PC field: a syscall stopped the VM */
+
+/* Helper results */
+#define JIT_FAIL  (1ull << 32)        /* jit_load: access not allowed */
+#define JIT_STORE_OK    0
+#define JIT_STORE_FAIL  1
+#define JIT_STORE_SMC   2             /* stored over compiled code */
+
+typedef uint64_t (*JitCode)(CPUState* c, VM* vm, uint64_t left);
+
+typedef struct {
+    JitCode code;
+    uint32_t ninsns;
+} JitBlock;
+
+typedef struct {
+    JitBlock* entry[PAGE_SIZE];
+    uint32_t invalidations;
+    uint8_t interpret_only;
+} JitPage;
+
+typedef struct Jit Jit;
+
+struct Jit {
+    uint8_t* code;
+    size_t used;
+    JitBlock* blocks;
+    size_t nblocks;
+    JitPage* pages[NUM_PAGES];
+    VMStatus stop;      /* why a syscall stopped the VM (JIT_STOP) */
+    uint32_t stop_pc;   /* and the PC it left */
+};
+
+/* Cached "no block here" marker for non-compilable instructions */
+static JitBlock no_block;
+
+/* x86-64 condition codes */
+enum { CC_O = 0x0, CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_S = 0x8 };
+
+/* Host registers */
+enum { RAX = 0, RCX = 1, RDX = 2, RSI = 6 };
+
+#define OFF_GPR(i)  (uint8_t)(offsetof(CPUState, gpr) + 4 * (i))
+#define OFF_PC      (uint8_t)offsetof(CPUState, pc)
+#define OFF_SP      (uint8_t)offsetof(CPUState, sp)
+#define OFF_ZF      (uint8_t)(offsetof(CPUState, flags) + offsetof(Flags, zero))
+#define OFF_CF      (uint8_t)(offsetof(CPUState, flags) + offsetof(Flags, carry))
+#define OFF_SF      (uint8_t)(offsetof(CPUState, flags) + offsetof(Flags, sign))
+#define OFF_OF      (uint8_t)(offsetof(CPUState, flags) + offsetof(Flags, overflow))
+
+_Static_assert(offsetof(CPUState, mode) < 128, "CPUState fields must be reachable with disp8");
+
+#define OFF_TLB     CPU_TLB_OFFSET
+
+_Static_assert(sizeof(TLBEntry) == 16, "TLB probe scales the index by 16");
+
+static uint64_t jit_load(VM* vm, uint32_t addr) {
+    uint32_t value;
+    if (unlikely(!mem_load32(vm, vm->tlb, addr, &value))) return JIT_FAIL;
+    return value;
+}
+
+static uint32_t jit_store(VM* vm, uint32_t addr, uint32_t value) {
+    switch (mem_store32(vm, vm->tlb, addr, value)) {
+        case MEM_OK: return JIT_STORE_OK;
+        case MEM_FAULT: return JIT_STORE_FAIL;
+        default: return JIT_STORE_SMC;
+    }
+}
+
+/* Run a SYSCALL with PC already past it, as the interpreters do. The
+ * block resumes at the PC the call leaves, or stops with JIT_STOP. The
+ * call sees icount with the block's instructions up to it retired; the
+ * block still reports them when it exits.
+ */
+static uint32_t jit_syscall(VM* vm, uint32_t next_pc, uint32_t retired) {
+    vm->cpu->pc = next_pc;
+    vm->icount += retired;
+    VMStatus st = do_syscall(vm);
+    vm->icount -= retired;
+    if (unlikely(st != VM_RUNNING)) {
+        vm->jit->stop = st;
+        vm->jit->stop_pc = vm->cpu->pc;
+    }
+    return st;
+}
+
+/* ---- code emission ---- */
+
+typedef struct {
+    uint8_t* p;
+    uint8_t* top;       /* loop entry, just after the prologue */
+    uint32_t pc;        /* guest address of the block */
+    uint32_t ninsns;
+    uint32_t insn;      /* index of the instruction being compiled */
+} Emitter;
+
+static void e8(Emitter* e, uint8_t b) {
+    *e->p++ = b;
+}
+
+static void e32(Emitter* e, uint32_t v) {
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+}
+
+static void e64(Emitter* e, uint64_t v) {
+    memcpy(e->p, &v, 8);
+    e->p += 8;
+}
+
+/* Operand [rbx + off] with a register field */
+static void modrm_ctx(Emitter* e, int reg, uint8_t off) {
+    e8(e, 0x40 | (reg << 3) | 3);
+    e8(e, off);
+}
+
+/* mov r32, [rbx + off] */
+static void x_load(Emitter* e, int reg, uint8_t off) {
+    e8(e, 0x8B);
+    modrm_ctx(e, reg, off);
+}
+
+/* mov [rbx + off], r32 */
+static void x_store(Emitter* e, uint8_t off, int reg) {
+    e8(e, 0x89);
+    modrm_ctx(e, reg, off);
+}
+
+/* mov dword [rbx + off], imm32 */
+static void x_store_imm(Emitter* e, uint8_t off, uint32_t imm) {
+    e8(e, 0xC7);
+    modrm_ctx(e, 0, off);
+    e32(e, imm);
+}
+
+/* setcc byte [rbx + off] */
+static void x_setcc(Emitter* e, int cc, uint8_t off) {
+    e8(e, 0x0F);
+    e8(e, 0x90 | cc);
+    modrm_ctx(e, 0, off);
+}
+
+/* mov byte [rbx + off], 0 */
+static void x_clear_byte(Emitter* e, uint8_t off) {
+    e8(e, 0xC6);
+    modrm_ctx(e, 0, off);
+    e8(e, 0);
+}
+
+/* jcc rel8 with the displacement patched later */
+static uint8_t* x_jcc8(Emitter* e, int cc) {
+    e8(e, 0x70 | cc);
+    e8(e, 0);
+    return e->p - 1;
+}
+
+static void x_patch8(Emitter* e, uint8_t* at) {
+    *at = (uint8_t)(e->p - (at + 1));
+}
+
+static void x_prologue(Emitter* e) {
+    e8(e, 0x53);                                        /* push rbx */
+    e8(e, 0x41); e8(e, 0x54);                           /* push r12 */
+    e8(e, 0x41); e8(e, 0x55);                           /* push r13 */
+    e8(e, 0x41); e8(e, 0x56);                           /* push r14 */
+    e8(e, 0x55);                                        /* push rbp (aligns rsp) */
+    e8(e, 0x48); e8(e, 0x89); e8(e, 0xFB);              /* mov rbx, rdi */
+    e8(e, 0x49); e8(e, 0x89); e8(e, 0xF4);              /* mov r12, rsi */
+    e8(e, 0x49); e8(e, 0x89); e8(e, 0xD6);              /* mov r14, rdx */
+    e8(e, 0x45); e8(e, 0x31); e8(e, 0xED);              /* xor r13d, r13d */
+    e->top = e->p;
+}
+
+static void x_epilogue(Emitter* e) {
+    e8(e, 0x4C); e8(e, 0x01); e8(e, 0xE8);              /* add rax, r13 */
+    e8(e, 0x5D);                                        /* pop rbp */
+    e8(e, 0x41); e8(e, 0x5E);                           /* pop r14 */
+    e8(e, 0x41); e8(e, 0x5D);                           /* pop r13 */
+    e8(e, 0x41); e8(e, 0x5C);                           /* pop r12 */
+    e8(e, 0x5B);                                        /* pop rbx */
+    e8(e, 0xC3);                                        /* ret */
+}
+
+/* Return a constant block result */
+static void x_exit(Emitter* e, uint64_t result) {
+    e8(e, 0x48); e8(e, 0xB8);                           /* mov rax, imm64 */
+    e64(e, result);
+    x_epilogue(e);
+}
+
+/* Return eax as the next PC, tagged with the retired count */
+static void x_exit_eax(Emitter* e, uint32_t retired) {
+    e8(e, 0x48); e8(e, 0xBA);                           /* mov rdx, imm64 */
+    e64(e, JIT_RETIRED(retired));
+    e8(e, 0x48); e8(e, 0x09); e8(e, 0xD0);              /* or rax, rdx */
+    x_epilogue(e);
+}
+
+/* Taken branch back to the block start: count the trip, then either
+ * run the block again or leave if the budget cannot cover another trip
+ */
+static void x_loop(Emitter* e) {
+    uint32_t trip = e->insn + 1;
+    e8(e, 0x48); e8(e, 0xB8);                           /* mov rax, imm64 */
+    e64(e, JIT_RETIRED(trip));
+    e8(e, 0x49); e8(e, 0x01); e8(e, 0xC5);              /* add r13, rax */
+    e8(e, 0x49); e8(e, 0x83); e8(e, 0xEE); e8(e, (uint8_t)trip);        /* sub r14, trip */
+    e8(e, 0x49); e8(e, 0x83); e8(e, 0xFE); e8(e, (uint8_t)e->ninsns);   /* cmp r14, ninsns */
+    e8(e, 0x0F); e8(e, 0x83);                           /* jae top */
+    e32(e, (uint32_t)(e->top - (e->p + 4)));
+    x_exit(e, e->pc);
+}
+
+/* Stop before the current instruction and let the interpreter run it */
+static void x_exit_interpret(Emitter* e, uint32_t pc) {
+    x_exit(e, JIT_INTERPRET | JIT_RETIRED(e->insn) | pc);
+}
+
+/* call fn(vm, esi, edx) */
+static void x_call(Emitter* e, const void* fn) {
+    e8(e, 0x4C); e8(e, 0x89); e8(e, 0xE7);              /* mov rdi, r12 */
+    e8(e, 0x48); e8(e, 0xB8);                           /* mov rax, imm64 */
+    e64(e, (uint64_t)(uintptr_t)fn);
+    e8(e, 0xFF); e8(e, 0xD0);                           /* call rax */
+}
+
+/* esi = effective address of a LOAD/STORE */
+static void x_effective_addr(Emitter* e, uint8_t base, uint16_t disp) {
+    if (base == 0) {
+        e8(e, 0xBE);                                    /* mov esi, imm32 */
+        e32(e, disp);
+        return;
+    }
+    x_load(e, RSI, OFF_GPR(base));
+    e8(e, 0x81); e8(e, 0xC6); e32(e, disp);             /* add esi, imm32 */
+    e8(e, 0x81); e8(e, 0xE6); e32(e, 0xFFFF);           /* and esi, 0xFFFF */
+}
+
+/* Inline TLB probe for the address in esi (see TLBEntry). Leaves the
+ * entry's addend in rax and jumps to the returned rel8 on a miss.
+ */
+static uint8_t* x_tlb_probe(Emitter* e, size_t tag) {
+    e8(e, 0x8D); e8(e, 0x4E); e8(e, 3);                 /* lea ecx, [rsi+3] */
+    e8(e, 0x81); e8(e, 0xE1); e32(e, ~PAGE_MASK);       /* and ecx, ~PAGE_MASK */
+    e8(e, 0x89); e8(e, 0xF0);                           /* mov eax, esi */
+    e8(e, 0xC1); e8(e, 0xE8); e8(e, PAGE_SHIFT);        /* shr eax, PAGE_SHIFT */
+    e8(e, 0x83); e8(e, 0xE0); e8(e, TLB_ENTRIES - 1);   /* and eax, TLB_ENTRIES-1 */
+    e8(e, 0xC1); e8(e, 0xE0); e8(e, 4);                 /* shl eax, 4 */
+    e8(e, 0x48); e8(e, 0x01); e8(e, 0xD8);              /* add rax, rbx */
+    e8(e, 0x3B); e8(e, 0x88);                           /* cmp ecx, [rax + tag] */
+    e32(e, (uint32_t)(OFF_TLB + tag));
+    uint8_t* miss = x_jcc8(e, CC_NE);
+    e8(e, 0x48); e8(e, 0x8B); e8(e, 0x80);              /* mov rax, [rax + addend] */
+    e32(e, (uint32_t)(OFF_TLB + offsetof(TLBEntry, addend)));
+    return miss;
+}
+
+static uint8_t* x_jmp8(Emitter* e) {
+    e8(e, 0xEB);
+    e8(e, 0);
+    return e->p - 1;
+}
+
+/* Load from the address in esi into eax; on a TLB miss call jit_load,
+ * bailing out to the interpreter if the access faults
+ */
+static void x_checked_load(Emitter* e, uint32_t pc) {
+    uint8_t* miss = x_tlb_probe(e, offsetof(TLBEntry, read_tag));
+    e8(e, 0x8B); e8(e, 0x04); e8(e, 0x30);              /* mov eax, [rax+rsi] */
+    uint8_t* done = x_jmp8(e);
+    x_patch8(e, miss);
+    x_call(e, (const void*)jit_load);
+    e8(e, 0x48); e8(e, 0x0F); e8(e, 0xBA); e8(e, 0xE0); e8(e, 32);  /* bt rax, 32 */
+    uint8_t* ok = x_jcc8(e, CC_B ^ 1);                  /* jnc ok */
+    x_exit_interpret(e, pc);
+    x_patch8(e, ok);
+    x_patch8(e, done);
+}
+
+/* Call jit_store. On failure the instruction is left to the interpreter;
+ * after a store over compiled code the block exits at next_pc, running
+ * the fixup (if any) first.
+ */
+static void x_checked_store(Emitter* e, uint32_t pc, uint32_t next_pc,
+                            void (*fixup)(Emitter*)) {
+    uint8_t* miss = x_tlb_probe(e, offsetof(TLBEntry, write_tag));
+    e8(e, 0x89); e8(e, 0x14); e8(e, 0x30);              /* mov [rax+rsi], edx */
+    uint8_t* done = x_jmp8(e);
+    x_patch8(e, miss);
+    x_call(e, (const void*)jit_store);
+    e8(e, 0x85); e8(e, 0xC0);                           /* test eax, eax */
+    uint8_t* ok = x_jcc8(e, CC_E);
+    e8(e, 0x83); e8(e, 0xF8); e8(e, JIT_STORE_FAIL);    /* cmp eax, 1 */
+    uint8_t* smc = x_jcc8(e, CC_NE);
+    x_exit_interpret(e, pc);
+    x_patch8(e, smc);
+    if (fixup) fixup(e);
+    x_exit(e, JIT_RETIRED(e->insn + 1) | next_pc);
+    x_patch8(e, ok);
+    x_patch8(e, done);
+}
+
+static void x_push_sp(Emitter* e) {
+    e8(e, 0x83); modrm_ctx(e, 5, OFF_SP); e8(e, 4);     /* sub dword [rbx+sp], 4 */
+}
+
+/* Flag templates; skipped when a later op in the block overwrites them
+ * before anything can see them
+ */
+static void x_flags_result(Emitter* e) {
+    x_setcc(e, CC_E, OFF_ZF);
+    x_setcc(e, CC_S, OFF_SF);
+}
+
+static void x_flags_arith(Emitter* e) {
+    x_setcc(e, CC_E, OFF_ZF);
+    x_setcc(e, CC_B, OFF_CF);
+    x_setcc(e, CC_S, OFF_SF);
+    x_setcc(e, CC_O, OFF_OF);
+}
+
+static int jittable(uint8_t opcode) {
+    switch (opcode) {
+        case OP_MOV_RR: case OP_MOV_RI: case OP_LOAD: case OP_STORE:
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+        case OP_JMP: case OP_JZ: case OP_JNZ: case OP_CALL: case OP_RET:
+        case OP_SYSCALL:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int ends_block(uint8_t opcode) {
+    return (opcode >= OP_JMP && opcode <= OP_RET) || opcode == OP_SYSCALL;
+}
+
+static int writes_flags(uint8_t opcode) {
+    return opcode >= OP_ADD && opcode <= OP_DIV;
+}
+
+/* Can leave the block part-way for the interpreter, which then needs
+ * the flags of everything before it: a fault, a watchpoint, a store
+ * over compiled code or a divide by zero
+ */
+static int may_exit(uint8_t opcode) {
+    return opcode == OP_LOAD || opcode == OP_STORE || opcode == OP_DIV ||
+           opcode == OP_CALL || opcode == OP_RET;
+}
+
+/* Emit one instruction. Returns non-zero if it ended the block. */
+static int emit_insn(Emitter* e, const uint8_t* ip, uint32_t pc, int flags_live) {
+    uint8_t a = ip[1] >> 4, b = ip[1] & 15;
+    uint32_t next = pc + insn_size[ip[0]];
+
+    switch (ip[0]) {
+        case OP_MOV_RR:
+            x_load(e, RAX, OFF_GPR(b));
+            x_store(e, OFF_GPR(a), RAX);
+            return 0;
+        case OP_MOV_RI:
+            x_store_imm(e, OFF_GPR(a), rd32(ip + 2));
+            return 0;
+        case OP_LOAD:
+            x_effective_addr(e, b, rd16(ip + 2));
+            x_checked_load(e, pc);
+            x_store(e, OFF_GPR(a), RAX);
+            return 0;
+        case OP_STORE:
+            x_effective_addr(e, b, rd16(ip + 2));
+            x_load(e, RDX, OFF_GPR(a));
+            x_checked_store(e, pc, next, NULL);
+            return 0;
+        case OP_ADD:
+        case OP_SUB:
+            x_load(e, RAX, OFF_GPR(a));
+            x_load(e, RCX, OFF_GPR(b));
+            e8(e, ip[0] == OP_ADD ? 0x01 : 0x29); e8(e, 0xC8);  /* add/sub eax, ecx */
+            if (flags_live) x_flags_arith(e);
+            x_store(e, OFF_GPR(a), RAX);
+            return 0;
+        case OP_MUL:
+            x_load(e, RAX, OFF_GPR(a));
+            x_load(e, RCX, OFF_GPR(b));
+            e8(e, 0x48); e8(e, 0x0F); e8(e, 0xAF); e8(e, 0xC1);  /* imul rax, rcx */
+            if (flags_live) {
+                e8(e, 0x48); e8(e, 0x89); e8(e, 0xC2);           /* mov rdx, rax */
+                e8(e, 0x48); e8(e, 0xC1); e8(e, 0xEA); e8(e, 32); /* shr rdx, 32 */
+                x_setcc(e, CC_NE, OFF_CF);
+                x_setcc(e, CC_NE, OFF_OF);
+                e8(e, 0x85); e8(e, 0xC0);                        /* test eax, eax */
+                x_flags_result(e);
+            }
+            x_store(e, OFF_GPR(a), RAX);
+            return 0;
+        case OP_DIV: {
+            x_load(e, RAX, OFF_GPR(a));
+            x_load(e, RCX, OFF_GPR(b));
+            e8(e, 0x85); e8(e, 0xC9);                           /* test ecx, ecx */
+            uint8_t* nonzero = x_jcc8(e, CC_NE);
+            x_exit_interpret(e, pc);                            /* raises the fault */
+            x_patch8(e, nonzero);
+            e8(e, 0x31); e8(e, 0xD2);                           /* xor edx, edx */
+            e8(e, 0xF7); e8(e, 0xF1);                           /* div ecx */
+            if (flags_live) {
+                e8(e, 0x85); e8(e, 0xC0);                       /* test eax, eax */
+                x_flags_result(e);
+                x_clear_byte(e, OFF_CF);
+                x_clear_byte(e, OFF_OF);
+            }
+            x_store(e, OFF_GPR(a), RAX);
+            return 0;
+        }
+        case OP_JMP:
+            if (rd16(ip + 1) == e->pc) {
+                x_loop(e);
+                return 1;
+            }
+            x_exit(e, JIT_RETIRED(e->insn + 1) | rd16(ip + 1));
+            return 1;
+        case OP_JZ:
+        case OP_JNZ:
+            if (rd16(ip + 1) == e->pc) {
+                e8(e, 0x80); modrm_ctx(e, 7, OFF_ZF); e8(e, 0); /* cmp byte [zf], 0 */
+                uint8_t* taken = x_jcc8(e, ip[0] == OP_JZ ? CC_NE : CC_E);
+                x_exit(e, JIT_RETIRED(e->insn + 1) | next);
+                x_patch8(e, taken);
+                x_loop(e);
+                return 1;
+            }
+            e8(e, 0xB8); e32(e, next);                          /* mov eax, fall-through */
+            e8(e, 0xB9); e32(e, rd16(ip + 1));                  /* mov ecx, target */
+            e8(e, 0x80); modrm_ctx(e, 7, OFF_ZF); e8(e, 0);     /* cmp byte [zf], 0 */
+            e8(e, 0x0F); e8(e, 0x40 | (ip[0] == OP_JZ ? CC_NE : CC_E)); e8(e, 0xC1);  /* cmovcc eax, ecx */
+            x_exit_eax(e, e->insn + 1);
+            return 1;
+        case OP_CALL:
+            x_load(e, RSI, OFF_SP);
+            e8(e, 0x83); e8(e, 0xEE); e8(e, 4);                 /* sub esi, 4 */
+            e8(e, 0xBA); e32(e, next);                          /* mov edx, return address */
+            x_checked_store(e, pc, rd16(ip + 1), x_push_sp);
+            x_push_sp(e);
+            x_exit(e, JIT_RETIRED(e->insn + 1) | rd16(ip + 1));
+            return 1;
+        case OP_RET:
+            x_load(e, RSI, OFF_SP);
+            x_checked_load(e, pc);
+            e8(e, 0x83); modrm_ctx(e, 0, OFF_SP); e8(e, 4);     /* add dword [rbx+sp], 4 */
+            e8(e, 0x25); e32(e, 0xFFFF);                        /* and eax, 0xFFFF */
+            x_exit_eax(e, e->insn + 1);
+            return 1;
+        case OP_SYSCALL: {
+            e8(e, 0xBE); e32(e, next);                          /* mov esi, next */
+            e8(e, 0xBA); e32(e, e->insn + 1);                   /* mov edx, retired */
+            x_call(e, (const void*)jit_syscall);
+            e8(e, 0x85); e8(e, 0xC0);                           /* test eax, eax */
+            uint8_t* stop = x_jcc8(e, CC_NE);
+            x_load(e, RAX, OFF_PC);
+            x_exit_eax(e, e->insn + 1);
+            x_patch8(e, stop);
+            x_exit(e, JIT_INTERPRET | JIT_RETIRED(e->insn + 1) | JIT_STOP);
+            return 1;
+        }
+    }
+    return 1;
+}
+
+static void jit_reset(Jit* jit) {
+    jit->used = 0;
+    jit->nblocks = 0;
+    for (uint32_t page = 0; page < NUM_PAGES; page++) {
+        if (jit->pages[page]) memset(jit->pages[page]->entry, 0, sizeof(jit->pages[page]->entry));
+    }
+}
+
+static void* jit_alloc(size_t size) {
+    void* p = calloc(1, size);
+    if (!p) {
+        fprintf(stderr, "ucvm-cpu: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static Jit* jit_get(VM* vm) {
+    if (likely(vm->jit != NULL)) return vm->jit;
+
+    void* code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return NULL;
+    Jit* jit = jit_alloc(sizeof(Jit));
+    jit->code = code;
+    jit->blocks = jit_alloc(JIT_MAX_BLOCKS * sizeof(JitBlock));
+    vm->jit = jit;
+    return jit;
+}
+
+/* Compile the block at pc. The buffer is writable only while emitting. */
+static JitBlock* jit_compile(VM* vm, Jit* jit, uint32_t pc) {
+    uint32_t pcs[JIT_MAX_INSNS];
+    uint8_t live[JIT_MAX_INSNS];
+    uint32_t page = pc >> PAGE_SHIFT;
+    uint32_t n = 0;
+    uint32_t p = pc;
+    uint8_t buf[MAX_INSN_SIZE];
+
+    while (n < JIT_MAX_INSNS && (p >> PAGE_SHIFT) == page && fetch_ok(p)) {
+        uint8_t opcode = fetch_insn(vm, vm->pt, p, buf)[0];
+        if (!jittable(opcode)) break;
+        /* The decoded engine stops at breakpoints */
+        if (unlikely(vm->traps != NULL) && trap_break_at(vm->traps, p)) break;
+        pcs[n++] = p;
+        if (ends_block(opcode)) break;
+        p += insn_size[opcode];
+    }
+    if (n == 0) return &no_block;
+
+    /* Flags are live at every exit from the block and dead when
+     * overwritten first
+     */
+    int flags_live = 1;
+    for (uint32_t i = n; i-- > 0;) {
+        uint8_t opcode = fetch_insn(vm, vm->pt, pcs[i], buf)[0];
+        live[i] = (uint8_t)flags_live;
+        if (writes_flags(opcode)) flags_live = 0;
+        if (opcode == OP_JZ || opcode == OP_JNZ || may_exit(opcode)) flags_live = 1;
+    }
+
+    size_t need = 64 + (size_t)n * JIT_INSN_BYTES;
+    if (jit->used + need > JIT_CODE_SIZE || jit->nblocks == JIT_MAX_BLOCKS) {
+        jit_reset(jit);
+    }
+
+    mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE);
+    Emitter e = {jit->code + jit->used, NULL, pc, n, 0};
+    uint8_t* start = e.p;
+    int ended = 0;
+
+    x_prologue(&e);
+    for (uint32_t i = 0; i < n && !ended; i++) {
+        e.insn = i;
+        ended = emit_insn(&e, fetch_insn(vm, vm->pt, pcs[i], buf), pcs[i], live[i]);
+    }
+    if (!ended) x_exit(&e, JIT_RETIRED(n) | p);
+    mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+
+    jit->used += (size_t)(e.p - start + 15) & ~(size_t)15;
+    JitBlock* b = &jit->blocks[jit->nblocks++];
+    b->code = (JitCode)(void*)start;
+    b->ninsns = n;
+    return b;
+}
+
+/* Find or compile the block at pc. Returns NULL when the instruction
+ * there has to be interpreted.
+ */
+static JitBlock* jit_lookup(VM* vm, Jit* jit, uint32_t pc) {
+    if (unlikely(!fetch_ok(pc))) return NULL;
+    uint32_t page = pc >> PAGE_SHIFT;
+    JitPage* p = jit->pages[page];
+    if (unlikely(!p)) p = jit->pages[page] = jit_alloc(sizeof(JitPage));
+    if (unlikely(p->interpret_only)) return NULL;
+
+    JitBlock* b = p->entry[pc & PAGE_MASK];
+    if (unlikely(!b)) {
+        b = p->entry[pc & PAGE_MASK] = jit_compile(vm, jit, pc);
+        if (!(vm->code_page[page] & CODE_JIT)) code_mark_page(vm, page, CODE_JIT);
+    }
+    return b == &no_block ? NULL : b;
+}
+
+/* Pages rewritten again and again are left to the interpreter */
+void jit_invalidate_page(VM* vm, uint32_t page) {
+    JitPage* p = vm->jit ? vm->jit->pages[page] : NULL;
+    if (!p) return;
+    memset(p->entry, 0, sizeof(p->entry));
+    if (++p->invalidations >= JIT_SMC_LIMIT) p->interpret_only = 1;
+}
+
+void jit_flush(VM* vm) {
+    Jit* jit = vm->jit;
+    if (!jit) return;
+    jit_reset(jit);
+    for (uint32_t page = 0; page < NUM_PAGES; page++) {
+        free(jit->pages[page]);
+        jit->pages[page] = NULL;
+    }
+}
+
+void jit_free(VM* vm) {
+    Jit* jit = vm->jit;
+    if (!jit) return;
+    jit_flush(vm);
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit->blocks);
+    free(jit);
+    vm->jit = NULL;
+}
+
+VMStatus exec_jit(VM* vm, uint64_t budget) {
+    Jit* jit = jit_get(vm);
+    if (!jit) return exec_decoded(vm, budget);
+
+    CPUState* c = vm->cpu;
+    uint64_t start = vm->icount;
+
+    for (;;) {
+        uint64_t left = budget - (vm->icount - start);
+        if (left == 0) return VM_BUDGET;
+
+        uint64_t step;
+        JitBlock* b = jit_lookup(vm, jit, c->pc);
+        if (likely(b && b->ninsns <= left)) {
+            uint64_t ret = b->code(c, vm, left);
+            c->pc = (uint32_t)ret;
+            vm->icount += (ret >> 32) & 0x7FFFFFFF;
+            if (likely(!(ret & JIT_INTERPRET))) continue;
+            if ((uint32_t)ret == JIT_STOP) {
+                c->pc = jit->stop_pc;
+                return jit->stop;
+            }
+            step = 1;
+        } else if (b) {
+            step = left;        /* too close to the budget for a whole block */
+        } else if (fetch_ok(c->pc) && jit->pages[c->pc >> PAGE_SHIFT]->interpret_only) {
+            step = left < JIT_INTERP_SLICE ? left : JIT_INTERP_SLICE;
+        } else {
+            step = 1;
+        }
+
+        VMStatus st = exec_decoded(vm, step);
+        if (st != VM_BUDGET) return st;
+    }
+}
+
+#else
+
+/* No JIT for this host: the decoded engine stands in */
+VMStatus exec_jit(VM* vm, uint64_t budget) {
+    return exec_decoded(vm, budget);
+}
+
+void jit_invalidate_page(VM* vm, uint32_t page) {
+    (void)vm;
+    (void)page;
+}
+
+void jit_flush(VM* vm) {
+    (void)vm;
+}
+
+void jit_free(VM* vm) {
+    (void)vm;
+}
+
+#endif
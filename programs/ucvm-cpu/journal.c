@@ -0,0 +1,607 @@
+/* UCVM CPU Engine - write-ahead journal (spec section 2.4)
+ * Keeps a snapshot current without rewriting it. journal_open writes a
+ * full snapshot, the base; from then on each journal_delta appends what
+ * changed since the one before to path.journal: the pages written or
+ * remapped, the records of processes whose state differs, the processes
+ * forked and freed, and the machine state. A delta costs the bytes that
+ * changed, not the size of the machine.
+ *
+ * Pages written since the last delta are found with the copy-on-write
+ * trap: once a page is saved it is made PTE_COW, and the first write to
+ * it marks it dirty on the way through cow_break. Process records are
+ * compared with a copy of the last ones saved. A fork is logged when it
+ * happens, after the parent's dirty pages, so replay can share the
+ * parent's pages with the child just as fork did.
+ *
+ * Deltas are written in groups by a flusher thread, one write and fsync
+ * for each, while the machine runs on. Deltas logged during an fsync
+ * wait for it and go out together in the next group. A crash loses at
+ * most the deltas not yet through an fsync. Each delta ends in a commit
+ * record and every record carries a checksum, so replay stops at the
+ * first torn or partial delta. Once the journal outgrows the base, the
+ * machine is checkpointed into a new base and the journal starts over.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "exec.h"
+#include "snapshot.h"
+
+#define JOURNAL_MAGIC   "UCVMJRNL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_GROUP       16          /* deltas per group commit */
+#define JOURNAL_GROUP_BYTES (1u << 20)  /* or fewer, once this many bytes wait */
+#define JOURNAL_COMPACT_MIN (4u << 20)  /* smallest journal worth compacting */
+
+enum { JREC_PAGE = 1, JREC_FORK, JREC_FREE, JREC_PROCESS, JREC_MACHINE, JREC_COMMIT };
+
+typedef struct {
+    char magic[8];
+    uint64_t base_checksum;     /* of the snapshot the deltas apply to */
+    uint32_t version;
+    uint32_t reserved;
+} JournalHeader;
+
+/* Every record starts with this, followed by size bytes of payload and
+ * padding to the next multiple of 8
+ */
+typedef struct {
+    uint64_t checksum;          /* XXH64 of kind, size and payload */
+    uint32_t kind;
+    uint32_t size;
+} JournalRecord;
+
+enum { JPAGE_NONE = 0, JPAGE_ZERO, JPAGE_DATA };
+
+/* A page's mapping, followed by its contents for JPAGE_DATA */
+typedef struct {
+    uint32_t pid;
+    uint16_t page;
+    uint8_t flags;
+    uint8_t contents;
+} JournalPage;
+
+/* child was forked from parent: it shares the parent's pages as they are */
+typedef struct {
+    uint32_t parent;
+    uint32_t child;
+} JournalFork;
+
+typedef struct {
+    uint32_t pid;
+    uint32_t reserved;
+} JournalFree;
+
+/* A process record is the head of a SnapProcess followed by a SnapIO */
+#define JOURNAL_PROCESS_SIZE (SNAP_PROCESS_HEAD + sizeof(SnapIO))
+
+typedef struct {
+    SnapCPU cpu;
+    SnapClock clock;
+} JournalMachine;
+
+typedef struct {
+    uint64_t seq;               /* deltas since the base */
+    uint64_t icount;
+} JournalCommit;
+
+_Static_assert(sizeof(JournalHeader) % 8 == 0, "journal records are 8-byte aligned");
+_Static_assert(JOURNAL_PROCESS_SIZE % 8 == 0, "journal records are 8-byte aligned");
+
+/* Per pid marks */
+#define MARK_LISTED 0x1         /* in Journal.live */
+#define MARK_DIRTY  0x2         /* in Journal.dirty */
+
+typedef struct Journal {
+    char* path;                 /* of the base snapshot */
+    char* journal_path;
+    uint32_t snap_flags;        /* for the bases compaction writes */
+    int fd;
+    uint64_t size;              /* bytes in the journal file */
+    uint64_t base_size;
+    uint64_t seq;
+    uint8_t* buf;               /* records not yet handed to the flusher */
+    size_t len, cap;
+    uint32_t pending;           /* deltas in buf */
+    /* The flusher thread writes flush_buf while busy. Guarded by lock. */
+    pthread_t flusher;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    uint8_t* flush_buf;
+    size_t flush_len, flush_cap;
+    int busy, stop, failed;
+    int flusher_started;
+    uint8_t** saved;            /* by pid: process record last logged */
+    uint8_t* mark;              /* by pid: MARK_ bits */
+    uint32_t* live;             /* pids with a saved record, or forked since */
+    uint32_t nlive, live_cap;
+    uint32_t* dirty;            /* pids with dirty pages */
+    uint32_t ndirty, dirty_cap;
+} Journal;
+
+static void* journal_calloc(size_t n, size_t size) {
+    void* p = calloc(n, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void* journal_grow(void* p, uint32_t* cap, size_t size) {
+    *cap = *cap ? *cap * 2 : 256;
+    p = realloc(p, *cap * size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static uint32_t pad8(uint32_t n) {
+    return (n + 7) & ~7u;
+}
+
+/* Append a record whose payload is a followed by b */
+static void emit(Journal* j, uint32_t kind, const void* a, uint32_t alen, const void* b, uint32_t blen) {
+    size_t need = sizeof(JournalRecord) + pad8(alen + blen);
+    if (j->len + need > j->cap) {
+        while (j->len + need > j->cap) j->cap = j->cap ? j->cap * 2 : 1u << 16;
+        j->buf = realloc(j->buf, j->cap);
+        if (!j->buf) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    uint8_t* out = j->buf + j->len;
+    JournalRecord* r = (JournalRecord*)(void*)out;
+    r->kind = kind;
+    r->size = alen + blen;
+    memcpy(out + sizeof(*r), a, alen);
+    if (blen) memcpy(out + sizeof(*r) + alen, b, blen);
+    memset(out + sizeof(*r) + r->size, 0, need - sizeof(*r) - r->size);
+    r->checksum = snapshot_xxh64(out + offsetof(JournalRecord, kind), 8 + r->size);
+    j->len += need;
+}
+
+static void list_live(Journal* j, uint32_t pid) {
+    if (j->mark[pid] & MARK_LISTED) return;
+    if (j->nlive == j->live_cap) j->live = journal_grow(j->live, &j->live_cap, sizeof(uint32_t));
+    j->live[j->nlive++] = pid;
+    j->mark[pid] |= MARK_LISTED;
+}
+
+/* A page of the running process is about to change. Called from mem.c. */
+void journal_page_dirty(VM* vm, uint32_t page) {
+    Journal* j = vm->journal;
+    Process* p = vm->proc;
+    p->dirty[page / 32] |= 1u << (page % 32);
+    if (j->mark[p->pid] & MARK_DIRTY) return;
+    if (j->ndirty == j->dirty_cap) j->dirty = journal_grow(j->dirty, &j->dirty_cap, sizeof(uint32_t));
+    j->dirty[j->ndirty++] = p->pid;
+    j->mark[p->pid] |= MARK_DIRTY;
+}
+
+/* Make a saved page trap the next write to it */
+static void protect_page(PageTableEntry* e) {
+    if (e->frame && (e->flags & PTE_WRITE)) e->flags = (e->flags & ~PTE_WRITE) | PTE_COW;
+}
+
+/* Log the dirty pages of p and protect them again */
+static void save_pages(Journal* j, VM* vm, Process* p) {
+    int saved = 0;
+    for (uint32_t page = 0; page < NUM_PAGES; page++) {
+        if (!(p->dirty[page / 32] & (1u << (page % 32)))) continue;
+        PageTableEntry* e = &p->pt[page];
+        protect_page(e);
+        JournalPage r = {p->pid, (uint16_t)page, e->flags,
+                         !e->frame ? JPAGE_NONE : e->frame == vm->zero_frame ? JPAGE_ZERO : JPAGE_DATA};
+        emit(j, JREC_PAGE, &r, sizeof(r), e->frame, r.contents == JPAGE_DATA ? PAGE_SIZE : 0);
+        saved = 1;
+    }
+    memset(p->dirty, 0, sizeof(p->dirty));
+    if (saved) tlb_clear(p->tlb);
+}
+
+/* fork() is about to share the running process's pages with child */
+void journal_fork(VM* vm, Process* child) {
+    Journal* j = vm->journal;
+    Process* parent = vm->proc;
+    save_pages(j, vm, parent);
+    JournalFork r = {parent->pid, child->pid};
+    emit(j, JREC_FORK, &r, sizeof(r), NULL, 0);
+    list_live(j, child->pid);
+}
+
+static int write_all(int fd, const uint8_t* data, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int journal_fail(char* err, size_t errlen, const char* path, const char* msg) {
+    snprintf(err, errlen, "%s: %s", path, msg);
+    return -1;
+}
+
+/* Start the journal over, after the base was rewritten */
+static int journal_reset(Journal* j, uint64_t base_checksum, char* err, size_t errlen) {
+    JournalHeader hdr = {{0}, base_checksum, JOURNAL_VERSION, 0};
+    memcpy(hdr.magic, JOURNAL_MAGIC, 8);
+    if (ftruncate(j->fd, 0) != 0 || lseek(j->fd, 0, SEEK_SET) != 0 ||
+        write_all(j->fd, (const uint8_t*)&hdr, sizeof(hdr)) < 0 || fdatasync(j->fd) != 0) {
+        return journal_fail(err, errlen, j->journal_path, "write error");
+    }
+    j->size = sizeof(hdr);
+    j->seq = 0;
+    return 0;
+}
+
+/* Write a new base holding the whole machine */
+static int journal_compact(VM* vm, char* err, size_t errlen) {
+    Journal* j = vm->journal;
+    uint64_t checksum;
+    if (snapshot_write(vm, j->path, j->snap_flags, &checksum, &j->base_size, err, errlen) < 0) return -1;
+    return journal_reset(j, checksum, err, errlen);
+}
+
+static void* flusher_main(void* arg) {
+    Journal* j = arg;
+    pthread_mutex_lock(&j->lock);
+    for (;;) {
+        while (!j->busy && !j->stop) pthread_cond_wait(&j->work, &j->lock);
+        if (!j->busy) break;
+        pthread_mutex_unlock(&j->lock);
+        int ok = write_all(j->fd, j->flush_buf, j->flush_len) == 0 && fdatasync(j->fd) == 0;
+        pthread_mutex_lock(&j->lock);
+        if (ok) {
+            j->size += j->flush_len;
+        } else {
+            j->failed = 1;
+        }
+        j->busy = 0;
+        pthread_cond_signal(&j->done);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+/* Hand the waiting deltas to the flusher as a group. If it is still busy
+ * with the last group they wait for the next, unless wait is set, which
+ * also waits for them to reach the disk. Compacts once the journal is
+ * big enough and the flusher idle.
+ */
+static int journal_commit(VM* vm, int wait, char* err, size_t errlen) {
+    Journal* j = vm->journal;
+    pthread_mutex_lock(&j->lock);
+    if (wait || j->len >= JOURNAL_GROUP_BYTES) {
+        while (j->busy) pthread_cond_wait(&j->done, &j->lock);
+    }
+    if (!j->busy && j->len) {
+        uint8_t* buf = j->flush_buf;
+        size_t cap = j->flush_cap;
+        j->flush_buf = j->buf;
+        j->flush_cap = j->cap;
+        j->flush_len = j->len;
+        j->buf = buf;
+        j->cap = cap;
+        j->len = 0;
+        j->pending = 0;
+        j->busy = 1;
+        pthread_cond_signal(&j->work);
+    }
+    if (wait) {
+        while (j->busy) pthread_cond_wait(&j->done, &j->lock);
+    }
+    int idle = !j->busy, failed = j->failed;
+    uint64_t size = j->size;
+    pthread_mutex_unlock(&j->lock);
+
+    if (failed) return journal_fail(err, errlen, j->journal_path, "write error");
+    if (idle && size > JOURNAL_COMPACT_MIN && size > j->base_size) return journal_compact(vm, err, errlen);
+    return 0;
+}
+
+/* Log what changed since the last delta. The delta reaches the disk with
+ * the rest of its group. Returns 0, or -1 with a message in err.
+ */
+int journal_delta(VM* vm, char* err, size_t errlen) {
+    Journal* j = vm->journal;
+    uint8_t rec[JOURNAL_PROCESS_SIZE];
+
+    for (uint32_t i = 0; i < j->nlive;) {
+        uint32_t pid = j->live[i];
+        Process* p = vm->procs[pid];
+        if (!p) {
+            JournalFree r = {pid, 0};
+            emit(j, JREC_FREE, &r, sizeof(r), NULL, 0);
+            free(j->saved[pid]);
+            j->saved[pid] = NULL;
+            j->mark[pid] &= ~MARK_LISTED;
+            j->live[i] = j->live[--j->nlive];
+            continue;
+        }
+        memset(rec, 0, sizeof(rec));
+        snapshot_save_head((SnapProcess*)(void*)rec, (SnapIO*)(void*)(rec + SNAP_PROCESS_HEAD), p);
+        if (!j->saved[pid]) j->saved[pid] = journal_calloc(1, JOURNAL_PROCESS_SIZE);
+        if (memcmp(rec, j->saved[pid], JOURNAL_PROCESS_SIZE) != 0) {
+            emit(j, JREC_PROCESS, rec, JOURNAL_PROCESS_SIZE, NULL, 0);
+            memcpy(j->saved[pid], rec, JOURNAL_PROCESS_SIZE);
+        }
+        i++;
+    }
+
+    for (uint32_t i = 0; i < j->ndirty; i++) {
+        Process* p = vm->procs[j->dirty[i]];
+        if (p) save_pages(j, vm, p);
+        j->mark[j->dirty[i]] &= ~MARK_DIRTY;
+    }
+    j->ndirty = 0;
+
+    JournalMachine m;
+    snapshot_save_machine(vm, &m.cpu, &m.clock);
+    emit(j, JREC_MACHINE, &m, sizeof(m), NULL, 0);
+    JournalCommit c = {++j->seq, vm->icount};
+    emit(j, JREC_COMMIT, &c, sizeof(c), NULL, 0);
+
+    if (++j->pending >= JOURNAL_GROUP || j->len >= JOURNAL_GROUP_BYTES) return journal_commit(vm, 0, err, errlen);
+    return 0;
+}
+
+static char* journal_name(const char* path) {
+    size_t len = strlen(path) + 9;
+    char* name = journal_calloc(1, len);
+    snprintf(name, len, "%s.journal", path);
+    return name;
+}
+
+static void journal_free(VM* vm) {
+    Journal* j = vm->journal;
+    if (j->flusher_started) {
+        pthread_mutex_lock(&j->lock);
+        j->stop = 1;
+        pthread_cond_signal(&j->work);
+        pthread_mutex_unlock(&j->lock);
+        pthread_join(j->flusher, NULL);
+    }
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->work);
+    pthread_cond_destroy(&j->done);
+    if (j->fd >= 0) close(j->fd);
+    for (uint32_t i = 0; i < j->nlive; i++) free(j->saved[j->live[i]]);
+    free(j->saved);
+    free(j->mark);
+    free(j->live);
+    free(j->dirty);
+    free(j->buf);
+    free(j->flush_buf);
+    free(j->path);
+    free(j->journal_path);
+    free(j);
+    vm->journal = NULL;
+}
+
+/* Start journaling the machine to path: write it there as the base
+ * snapshot and create an empty path.journal. flags are the SNAP_ flags
+ * for every base written. Returns 0, or -1 with a message in err.
+ */
+int journal_open(VM* vm, const char* path, uint32_t flags, char* err, size_t errlen) {
+    Journal* j = journal_calloc(1, sizeof(Journal));
+    j->path = journal_calloc(1, strlen(path) + 1);
+    strcpy(j->path, path);
+    j->journal_path = journal_name(path);
+    j->snap_flags = flags;
+    j->saved = journal_calloc(MAX_PROCS, sizeof(uint8_t*));
+    j->mark = journal_calloc(MAX_PROCS, 1);
+    j->fd = -1;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->work, NULL);
+    pthread_cond_init(&j->done, NULL);
+    vm->journal = j;
+
+    /* The base holds every page, so every page starts out protected */
+    for (uint32_t pid = 1; pid < MAX_PROCS; pid++) {
+        Process* p = vm->procs[pid];
+        if (!p) continue;
+        for (uint32_t page = 0; page < NUM_PAGES; page++) protect_page(&p->pt[page]);
+        memset(p->dirty, 0, sizeof(p->dirty));
+        tlb_clear(p->tlb);
+        j->saved[pid] = journal_calloc(1, JOURNAL_PROCESS_SIZE);
+        snapshot_save_head((SnapProcess*)(void*)j->saved[pid],
+                           (SnapIO*)(void*)(j->saved[pid] + SNAP_PROCESS_HEAD), p);
+        list_live(j, pid);
+    }
+
+    j->fd = open(j->journal_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (j->fd < 0) {
+        journal_fail(err, errlen, j->journal_path, "cannot create");
+        journal_free(vm);
+        return -1;
+    }
+    if (journal_compact(vm, err, errlen) < 0) {
+        journal_free(vm);
+        return -1;
+    }
+    if (pthread_create(&j->flusher, NULL, flusher_main, j) != 0) {
+        journal_fail(err, errlen, j->journal_path, "cannot start the flusher thread");
+        journal_free(vm);
+        return -1;
+    }
+    j->flusher_started = 1;
+    return 0;
+}
+
+/* Write the deltas not yet on disk and stop journaling */
+int journal_close(VM* vm, char* err, size_t errlen) {
+    int result = journal_commit(vm, 1, err, errlen);
+    journal_free(vm);
+    return result;
+}
+
+/* ---- replay ---- */
+
+static int record_ok(uint32_t kind, uint32_t size, const uint8_t* payload) {
+    switch (kind) {
+        case JREC_PAGE: {
+            if (size < sizeof(JournalPage)) return 0;
+            const JournalPage* r = (const JournalPage*)(const void*)payload;
+            return r->page < NUM_PAGES && r->contents <= JPAGE_DATA &&
+                   size == sizeof(JournalPage) + (r->contents == JPAGE_DATA ? PAGE_SIZE : 0);
+        }
+        case JREC_FORK: return size == sizeof(JournalFork);
+        case JREC_FREE: return size == sizeof(JournalFree);
+        case JREC_PROCESS: return size == JOURNAL_PROCESS_SIZE;
+        case JREC_MACHINE: return size == sizeof(JournalMachine);
+        case JREC_COMMIT: return size == sizeof(JournalCommit);
+        default: return 0;
+    }
+}
+
+/* The end of the last whole delta in a mapped journal: records past it
+ * were torn by a crash or never committed
+ */
+static size_t committed_end(const uint8_t* base, size_t size) {
+    size_t pos = sizeof(JournalHeader), end = pos;
+    while (size - pos >= sizeof(JournalRecord)) {
+        const JournalRecord* r = (const JournalRecord*)(const void*)(base + pos);
+        if (r->size > size - pos - sizeof(*r)) break;
+        if (snapshot_xxh64(base + pos + offsetof(JournalRecord, kind), 8 + (size_t)r->size) != r->checksum) break;
+        if (!record_ok(r->kind, r->size, base + pos + sizeof(*r))) break;
+        pos += sizeof(*r) + pad8(r->size);
+        if (r->kind == JREC_COMMIT) end = pos;
+        if (pos > size) break;
+    }
+    return end;
+}
+
+static int pid_live(VM* vm, uint32_t pid) {
+    return pid > 0 && pid < MAX_PROCS && vm->procs[pid];
+}
+
+static void replay_page(VM* vm, Process* p, const JournalPage* r) {
+    uint8_t* frame = NULL;
+    if (r->contents == JPAGE_ZERO) {
+        frame = vm->zero_frame;
+        frame_ref(frame);
+    } else if (r->contents == JPAGE_DATA) {
+        frame = frame_alloc(vm);
+        memcpy(frame, r + 1, PAGE_SIZE);
+    }
+    PageTableEntry* e = &p->pt[r->page];
+    if (e->frame) frame_unref(vm, e->frame);
+    e->frame = frame;
+    e->flags = r->flags;
+}
+
+/* Apply the records in [pos, end). Returns the deltas applied, or -1 if
+ * a record names a process that is not there.
+ */
+static int64_t replay(VM* vm, const uint8_t* base, size_t pos, size_t end, SnapRecord* recs,
+                      const SnapCPU** cpu, const SnapClock** clock) {
+    int64_t deltas = 0;
+    while (pos < end) {
+        const JournalRecord* r = (const JournalRecord*)(const void*)(base + pos);
+        const uint8_t* payload = base + pos + sizeof(*r);
+        pos += sizeof(*r) + pad8(r->size);
+        switch (r->kind) {
+            case JREC_PAGE: {
+                const JournalPage* page = (const JournalPage*)(const void*)payload;
+                if (!pid_live(vm, page->pid)) return -1;
+                replay_page(vm, vm->procs[page->pid], page);
+                break;
+            }
+            case JREC_FORK: {
+                const JournalFork* f = (const JournalFork*)(const void*)payload;
+                if (!pid_live(vm, f->parent) || f->child == 0 || f->child >= MAX_PROCS) return -1;
+                if (vm->procs[f->child]) proc_free(vm, vm->procs[f->child]);
+                mem_share(vm->procs[f->parent]->pt, proc_create_at(vm, f->child)->pt);
+                break;
+            }
+            case JREC_FREE: {
+                const JournalFree* f = (const JournalFree*)(const void*)payload;
+                if (!pid_live(vm, f->pid)) return -1;
+                proc_free(vm, vm->procs[f->pid]);
+                break;
+            }
+            case JREC_PROCESS: {
+                const SnapProcess* p = (const SnapProcess*)(const void*)payload;
+                if (!pid_live(vm, p->pid)) return -1;
+                recs[p->pid].proc = p;
+                recs[p->pid].io = (const SnapIO*)(const void*)(payload + SNAP_PROCESS_HEAD);
+                break;
+            }
+            case JREC_MACHINE: {
+                const JournalMachine* m = (const JournalMachine*)(const void*)payload;
+                *cpu = &m->cpu;
+                *clock = &m->clock;
+                break;
+            }
+            case JREC_COMMIT:
+                deltas++;
+                break;
+        }
+    }
+    return deltas;
+}
+
+/* Restore the snapshot at path, then replay the committed deltas of
+ * path.journal on top of it. A journal that is missing, or that belongs
+ * to an older base, adds nothing. Returns 0, or -1 with a message in
+ * err; the VM is left as it was unless the journal checks out but does
+ * not fit its base, in which case it must not be run.
+ */
+int vm_recover(VM* vm, const char* path, char* err, size_t errlen) {
+    Snapshot s;
+    if (snapshot_map(&s, path, err, errlen) < 0) return -1;
+
+    char* journal_path = journal_name(path);
+    const uint8_t* base = NULL;
+    size_t size = 0, end = 0;
+    int fd = open(journal_path, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(JournalHeader)) {
+        size = (size_t)st.st_size;
+        void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        base = map == MAP_FAILED ? NULL : map;
+    }
+    if (fd >= 0) close(fd);
+    if (base) {
+        const JournalHeader* hdr = (const JournalHeader*)(const void*)base;
+        if (memcmp(hdr->magic, JOURNAL_MAGIC, 8) == 0 && hdr->version == JOURNAL_VERSION &&
+            hdr->base_checksum == s.checksum) {
+            end = committed_end(base, size);
+        }
+    }
+
+    SnapRecord* recs = journal_calloc(MAX_PROCS, sizeof(SnapRecord));
+    const SnapCPU* cpu = s.cpu;
+    const SnapClock* clock = s.clock;
+    uint32_t text_base = snapshot_load(vm, &s, recs);
+    int64_t deltas = end ? replay(vm, base, sizeof(JournalHeader), end, recs, &cpu, &clock) : 0;
+    int result = 0;
+    if (deltas < 0 || snapshot_link(vm, recs, cpu, clock, text_base) < 0) {
+        result = journal_fail(err, errlen, journal_path, "inconsistent journal");
+    } else if (deltas > 0) {
+        /* Replayed pages no longer share frames the way the text ids say */
+        for (uint32_t pid = 1; pid < MAX_PROCS; pid++) {
+            if (vm->procs[pid]) vm->procs[pid]->text_id = ++vm->next_text_id;
+        }
+        vm->text_id = vm->proc ? vm->proc->text_id : 0;
+    }
+
+    free(recs);
+    if (base) munmap((void*)base, size);
+    free(journal_path);
+    snapshot_unmap(&s);
+    return result;
+}
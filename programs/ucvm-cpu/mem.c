@@ -0,0 +1,398 @@
+/* UCVM CPU Engine - memory manager (spec section 6)
+ * A page table over the 64KB layout and the slow path behind the
+ * software TLB. Engines access data through mem_load32/mem_store32 in
+ * exec.h; a TLB miss lands here, checks the page permissions and refills
+ * the entry. Pages holding cached code are never entered in the TLB for
+ * writing, so stores to them always come here and keep the caches
+ * coherent; watched pages are left out for the accesses watched. MMIO
+ * pages are entered with a sentinel tag that always misses, and are
+ * routed to their device from here.
+ *
+ * Pages are backed by reference-counted frames. Fresh pages all map one
+ * shared zero frame, and fork shares every frame between parent and
+ * child; such mappings are PTE_COW instead of PTE_WRITE, and the first
+ * write to one copies the frame unless nobody else holds it. The journal
+ * uses the same trap to find the pages written since its last delta: it
+ * makes every page it has saved copy-on-write, and the first write after
+ * that lands in cow_break.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include "exec.h"
+
+#define FRAME_CHUNK 256     /* frames allocated from the host at a time */
+
+typedef struct Frame {
+    uint32_t refs;
+    struct Frame* next;     /* free list */
+    uint8_t data[PAGE_SIZE];
+} Frame;
+
+struct FrameChunk {
+    struct FrameChunk* next;
+    Frame frames[FRAME_CHUNK];
+};
+
+static Frame* frame_of(const uint8_t* data) {
+    return (Frame*)(void*)(data - offsetof(Frame, data));
+}
+
+/* A frame with one reference and unspecified contents */
+uint8_t* frame_alloc(VM* vm) {
+    if (unlikely(!vm->frame_free)) {
+        FrameChunk* chunk = malloc(sizeof(FrameChunk));
+        if (!chunk) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        chunk->next = vm->frame_chunks;
+        vm->frame_chunks = chunk;
+        for (uint32_t i = 0; i < FRAME_CHUNK; i++) {
+            chunk->frames[i].next = vm->frame_free;
+            vm->frame_free = &chunk->frames[i];
+        }
+    }
+    Frame* f = vm->frame_free;
+    vm->frame_free = f->next;
+    f->refs = 1;
+    return f->data;
+}
+
+void frame_ref(uint8_t* frame) {
+    frame_of(frame)->refs++;
+}
+
+void frame_unref(VM* vm, uint8_t* frame) {
+    Frame* f = frame_of(frame);
+    if (--f->refs == 0) {
+        f->next = vm->frame_free;
+        vm->frame_free = f;
+    }
+}
+
+void frame_free_all(VM* vm) {
+    while (vm->frame_chunks) {
+        FrameChunk* next = vm->frame_chunks->next;
+        free(vm->frame_chunks);
+        vm->frame_chunks = next;
+    }
+    vm->frame_free = NULL;
+    vm->zero_frame = NULL;
+}
+
+/* Point a page at a frame, taking a reference and dropping the old one.
+ * Writable mappings of the zero frame are made copy-on-write.
+ */
+static void map_frame(VM* vm, uint32_t page, uint8_t* frame, uint8_t flags) {
+    PageTableEntry* e = &vm->pt[page];
+    if (vm->journal) journal_page_dirty(vm, page);
+    if (frame) frame_ref(frame);
+    if (e->frame) frame_unref(vm, e->frame);
+    if (frame == vm->zero_frame && (flags & PTE_WRITE)) flags = (flags & ~PTE_WRITE) | PTE_COW;
+    e->frame = frame;
+    e->flags = flags;
+}
+
+/* Default permissions for each segment of the layout */
+static uint8_t layout_flags(const VM* vm, uint32_t page, uint32_t brk) {
+    uint32_t addr = page << PAGE_SHIFT;
+    if (addr < TEXT_BASE) return PTE_VALID | PTE_READ | PTE_WRITE;
+    if (addr < HEAP_BASE) return PTE_VALID | PTE_READ | PTE_WRITE | PTE_EXEC | PTE_USER;
+    if (addr < STACK_BASE && addr >= brk) return 0;
+    if (addr >= MMIO_BASE) {
+        if (!vm->mmio[(addr - MMIO_BASE) >> PAGE_SHIFT].dev) return 0;
+        return PTE_VALID | PTE_READ | PTE_WRITE | PTE_USER | PTE_MMIO;
+    }
+    return PTE_VALID | PTE_READ | PTE_WRITE | PTE_USER;
+}
+
+/* Map the layout for the current process, every page on the zero
+ * frame; heap pages are mapped below brk only
+ */
+void mem_init(VM* vm, uint32_t brk) {
+    if (!vm->zero_frame) {
+        vm->zero_frame = frame_alloc(vm);
+        memset(vm->zero_frame, 0, PAGE_SIZE);
+    }
+    for (uint32_t page = 0; page < NUM_PAGES; page++) {
+        uint8_t flags = layout_flags(vm, page, brk);
+        map_frame(vm, page, flags && !(flags & PTE_MMIO) ? vm->zero_frame : NULL, flags);
+    }
+    vm->proc->brk = brk;
+    tlb_flush(vm);
+}
+
+/* Give a page a private copy of its contents, mapped with flags */
+void mem_load_page(VM* vm, uint32_t page, const uint8_t* data, uint8_t flags) {
+    uint8_t* frame = frame_alloc(vm);
+    memcpy(frame, data, PAGE_SIZE);
+    map_frame(vm, page, frame, flags);
+    frame_unref(vm, frame);
+    tlb_flush_page(vm, page);
+}
+
+/* Release every mapping of a page table */
+void mem_release(VM* vm, PageTableEntry* pt) {
+    for (uint32_t page = 0; page < NUM_PAGES; page++) {
+        if (pt[page].frame) frame_unref(vm, pt[page].frame);
+        pt[page].frame = NULL;
+        pt[page].flags = 0;
+    }
+}
+
+/* Share every frame of a page table with another, copy-on-write */
+void mem_share(PageTableEntry* from, PageTableEntry* to) {
+    for (uint32_t page = 0; page < NUM_PAGES; page++) {
+        PageTableEntry* e = &from[page];
+        if (e->frame) {
+            frame_ref(e->frame);
+            if (e->flags & PTE_WRITE) e->flags = (e->flags & ~PTE_WRITE) | PTE_COW;
+        }
+        to[page] = *e;
+    }
+}
+
+/* Share every frame of the current process with child, copy-on-write */
+void mem_fork(VM* vm, PageTableEntry* child) {
+    mem_share(vm->pt, child);
+    tlb_flush(vm);
+}
+
+void tlb_clear(TLBEntry* tlb) {
+    for (uint32_t i = 0; i < TLB_ENTRIES; i++) {
+        tlb[i].read_tag = tlb[i].write_tag = TLB_INVALID;
+        tlb[i].addend = 0;
+    }
+}
+
+void tlb_flush(VM* vm) {
+    tlb_clear(vm->tlb);
+}
+
+void tlb_flush_page(VM* vm, uint32_t page) {
+    TLBEntry* e = &vm->tlb[page & (TLB_ENTRIES - 1)];
+    uint32_t base = page << PAGE_SHIFT;
+    if ((e->read_tag & ~TLB_MMIO) == base || (e->write_tag & ~TLB_MMIO) == base) {
+        e->read_tag = e->write_tag = TLB_INVALID;
+    }
+}
+
+/* First write to a copy-on-write page: copy the frame if it is shared.
+ * A new text frame means the process no longer runs the same image as
+ * the processes it shared it with.
+ */
+static void cow_break(VM* vm, uint32_t page) {
+    PageTableEntry* e = &vm->pt[page];
+    if (vm->journal) journal_page_dirty(vm, page);
+    if (frame_of(e->frame)->refs > 1) {
+        uint8_t* copy = frame_alloc(vm);
+        memcpy(copy, e->frame, PAGE_SIZE);
+        frame_unref(vm, e->frame);
+        e->frame = copy;
+        if (fetch_ok(page << PAGE_SHIFT)) vm->proc->text_id = vm->text_id = ++vm->next_text_id;
+    }
+    e->flags = (e->flags & ~PTE_COW) | PTE_WRITE;
+    tlb_flush_page(vm, page);
+}
+
+static int page_allows(const VM* vm, uint32_t page, uint8_t need) {
+    uint8_t flags = vm->pt[page].flags;
+    need |= PTE_VALID;
+    if ((flags & need) != need) return 0;
+    return (flags & PTE_USER) || vm->cpu->mode == MODE_KERNEL;
+}
+
+/* A write to a page can change an instruction that starts on the page
+ * before it, so both must be free of cached code for a write entry
+ */
+static int page_has_code(const VM* vm, uint32_t page) {
+    return vm->code_page[page] || (page > 0 && vm->code_page[page - 1]);
+}
+
+static void tlb_fill(VM* vm, uint32_t page) {
+    TLBEntry* e = &vm->tlb[page & (TLB_ENTRIES - 1)];
+    uint32_t base = page << PAGE_SHIFT;
+    uint32_t tag = vm->pt[page].flags & PTE_MMIO ? base | TLB_MMIO : base;
+    e->read_tag = page_allows(vm, page, PTE_READ) ? tag : TLB_INVALID;
+    e->write_tag = page_allows(vm, page, PTE_WRITE) && !page_has_code(vm, page)
+                   ? tag : TLB_INVALID;
+    e->addend = (uintptr_t)vm->pt[page].frame - base;
+    if (unlikely(vm->traps != NULL)) {
+        /* Watched accesses must miss */
+        uint8_t watched = vm->traps->watch_page[page];
+        if (watched & TRAP_READ) e->read_tag = TLB_INVALID;
+        if (watched & TRAP_WRITE) e->write_tag = TLB_INVALID;
+    }
+}
+
+/* Check that every page of [addr, addr + len) allows the access,
+ * breaking copy-on-write sharing first for writes. Bulk copies cannot
+ * reach devices, so MMIO pages fail here.
+ */
+static int range_allows(VM* vm, uint32_t addr, uint32_t len, uint8_t need) {
+    if (len == 0) return 1;
+    if (addr >= MEM_SIZE || len > MEM_SIZE - addr) return 0;
+    for (uint32_t page = addr >> PAGE_SHIFT; page <= (addr + len - 1) >> PAGE_SHIFT; page++) {
+        if ((need & PTE_WRITE) && (vm->pt[page].flags & PTE_COW) && page_allows(vm, page, 0)) {
+            cow_break(vm, page);
+        }
+        if (!page_allows(vm, page, need) || (vm->pt[page].flags & PTE_MMIO)) return 0;
+    }
+    return 1;
+}
+
+/* Instruction bytes that run past the end of a page, gathered from both
+ * frames. Bytes on an unmapped page read as zero.
+ */
+const uint8_t* fetch_slow(VM* vm, uint32_t pc, uint8_t* buf) {
+    for (uint32_t i = 0; i < MAX_INSN_SIZE; i++) {
+        uint32_t addr = (pc + i) & 0xFFFF;
+        const uint8_t* frame = vm->pt[addr >> PAGE_SHIFT].frame;
+        buf[i] = frame ? frame[addr & PAGE_MASK] : 0;
+    }
+    return buf;
+}
+
+/* Route a word access to the device behind an MMIO page. Accesses that
+ * straddle the page or lack permission fault like any other.
+ */
+static int mmio_access(VM* vm, uint32_t addr, uint8_t* bytes, uint8_t need) {
+    uint32_t page = addr >> PAGE_SHIFT;
+    if ((addr & PAGE_MASK) > PAGE_SIZE - 4 || !page_allows(vm, page, need)) return MEM_FAULT;
+    const MMIOPage* m = &vm->mmio[page - (MMIO_BASE >> PAGE_SHIFT)];
+    uint32_t offset = addr - m->base;
+    if (replay_device(vm, m->dev, offset, bytes, need) != 4) return MEM_FAULT;
+    tlb_fill(vm, page);
+    return MEM_OK;
+}
+
+static int is_mmio(const VM* vm, uint32_t addr, uint32_t tag) {
+    if (tag == (((addr + 3) & ~PAGE_MASK) | TLB_MMIO)) return 1;
+    return addr < MEM_SIZE && (vm->pt[addr >> PAGE_SHIFT].flags & PTE_MMIO);
+}
+
+static uint8_t* host_ptr(VM* vm, uint32_t addr) {
+    return vm->pt[addr >> PAGE_SHIFT].frame + (addr & PAGE_MASK);
+}
+
+int mem_load_slow(VM* vm, uint32_t addr, uint32_t* value) {
+    if (unlikely(vm->traps != NULL) && trap_watch_hit(vm, addr, TRAP_READ)) return MEM_FAULT;
+    const TLBEntry* e = &vm->tlb[(addr >> PAGE_SHIFT) & (TLB_ENTRIES - 1)];
+    if (is_mmio(vm, addr, e->read_tag)) {
+        uint8_t bytes[4];
+        if (!mmio_access(vm, addr, bytes, PTE_READ)) return MEM_FAULT;
+        *value = rd32(bytes);
+        return MEM_OK;
+    }
+    if (!range_allows(vm, addr, 4, PTE_READ)) return MEM_FAULT;
+    if ((addr & PAGE_MASK) <= PAGE_SIZE - 4) {
+        tlb_fill(vm, addr >> PAGE_SHIFT);
+        *value = rd32(host_ptr(vm, addr));
+        return MEM_OK;
+    }
+    uint8_t bytes[4];
+    mem_read(vm, addr, bytes, 4);
+    *value = rd32(bytes);
+    return MEM_OK;
+}
+
+int mem_store_slow(VM* vm, uint32_t addr, uint32_t value) {
+    if (unlikely(vm->traps != NULL) && trap_watch_hit(vm, addr, TRAP_WRITE)) return MEM_FAULT;
+    const TLBEntry* e = &vm->tlb[(addr >> PAGE_SHIFT) & (TLB_ENTRIES - 1)];
+    uint8_t bytes[4];
+    wr32(bytes, value);
+    if (is_mmio(vm, addr, e->write_tag)) return mmio_access(vm, addr, bytes, PTE_WRITE);
+    if (addr > MEM_SIZE - 4) return MEM_FAULT;
+    uint32_t last = (addr + 3) >> PAGE_SHIFT;
+    const uint8_t* first_frame = vm->pt[addr >> PAGE_SHIFT].frame;
+    const uint8_t* last_frame = vm->pt[last].frame;
+    if (!range_allows(vm, addr, 4, PTE_WRITE)) return MEM_FAULT;
+    if ((addr & PAGE_MASK) <= PAGE_SIZE - 4) tlb_fill(vm, addr >> PAGE_SHIFT);
+    int code = mem_write(vm, addr, bytes, 4) > 1;
+    /* Breaking copy-on-write on text moves it to a new frame */
+    code |= vm->pt[addr >> PAGE_SHIFT].frame != first_frame || vm->pt[last].frame != last_frame;
+    return code ? MEM_CODE : MEM_OK;
+}
+
+/* Host address of [addr, addr + len) if it lies within one page that
+ * allows the access, else NULL. For callers that hand guest memory to
+ * the host directly; writers must still report the range through
+ * code_note_write.
+ */
+uint8_t* mem_host(VM* vm, uint32_t addr, uint32_t len, uint8_t need) {
+    if (len == 0 || (addr & PAGE_MASK) + len > PAGE_SIZE) return NULL;
+    if (!range_allows(vm, addr, len, need)) return NULL;
+    return host_ptr(vm, addr);
+}
+
+/* Host iovecs over [addr, addr + len), one per page, if every page of it
+ * allows the access, so the host can fill or drain guest memory in
+ * place. Returns how many, at most MEM_IOV_MAX, or -1. Writers must
+ * still report the range through code_note_write.
+ */
+int mem_iov(VM* vm, uint32_t addr, uint32_t len, uint8_t need, struct iovec* iov) {
+    if (!range_allows(vm, addr, len, need)) return -1;
+    int n = 0;
+    while (len) {
+        uint32_t chunk = PAGE_SIZE - (addr & PAGE_MASK);
+        if (chunk > len) chunk = len;
+        iov[n].iov_base = host_ptr(vm, addr);
+        iov[n++].iov_len = chunk;
+        addr += chunk;
+        len -= chunk;
+    }
+    return n;
+}
+
+/* Copy guest memory out, page by page. Returns 0 if any page of the
+ * range is not readable at the current privilege level.
+ */
+int mem_read(VM* vm, uint32_t addr, void* dst, uint32_t len) {
+    if (!range_allows(vm, addr, len, PTE_READ)) return 0;
+    uint8_t* out = dst;
+    while (len) {
+        uint32_t chunk = PAGE_SIZE - (addr & PAGE_MASK);
+        if (chunk > len) chunk = len;
+        memcpy(out, host_ptr(vm, addr), chunk);
+        out += chunk;
+        addr += chunk;
+        len -= chunk;
+    }
+    return 1;
+}
+
+/* Copy into guest memory. Returns 0 on a protection fault, 2 if the
+ * write replaced cached code and 1 otherwise.
+ */
+int mem_write(VM* vm, uint32_t addr, const void* src, uint32_t len) {
+    if (!range_allows(vm, addr, len, PTE_WRITE)) return 0;
+    if (len == 0) return 1;
+    uint32_t start = addr, total = len;
+    const uint8_t* in = src;
+    while (len) {
+        uint32_t chunk = PAGE_SIZE - (addr & PAGE_MASK);
+        if (chunk > len) chunk = len;
+        memcpy(host_ptr(vm, addr), in, chunk);
+        in += chunk;
+        addr += chunk;
+        len -= chunk;
+    }
+    return code_note_write(vm, start, total) ? 2 : 1;
+}
+
+/* Map zero-filled pages with the given PTE_ flags */
+void mem_map(VM* vm, uint32_t page, uint32_t count, uint8_t flags) {
+    for (uint32_t i = page; i < page + count && i < NUM_PAGES; i++) {
+        map_frame(vm, i, vm->zero_frame, flags | PTE_VALID);
+        tlb_flush_page(vm, i);
+    }
+}
+
+void mem_unmap(VM* vm, uint32_t page, uint32_t count) {
+    for (uint32_t i = page; i < page + count && i < NUM_PAGES; i++) {
+        map_frame(vm, i, NULL, 0);
+        tlb_flush_page(vm, i);
+    }
+}
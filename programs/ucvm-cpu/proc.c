@@ -0,0 +1,328 @@
+/* UCVM CPU Engine - processes (spec section 7)
+ * A process owns its registers, TLB, page table and descriptors, and
+ * the VM runs one at a time, on its registers and TLB in place. fork
+ * shares the parent's frames copy-on-write, so it costs one pass over
+ * the page table rather than a copy of memory.
+ *
+ * The scheduler is a multilevel feedback queue (spec section 7.4). Each
+ * level has a FIFO run queue and a bit in VM.run_mask, so picking the
+ * next process is one count-trailing-zeros whatever the number of
+ * processes. A process that uses up its slice drops a level, and each
+ * level down doubles the slice. One that blocks rises on wakeup, a level
+ * plus one per quantum it slept. Every SCHED_BOOST_INTERVAL instructions
+ * the user levels are spliced onto SCHED_TOP so nothing starves; queued
+ * processes pick up the new level lazily, through their epoch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "exec.h"
+
+static void* proc_calloc(size_t n, size_t size) {
+    void* p = calloc(n, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/* A new process with the given free pid */
+Process* proc_create_at(VM* vm, uint32_t pid) {
+    if (!vm->procs) vm->procs = proc_calloc(MAX_PROCS, sizeof(Process*));
+    Process* p = aligned_alloc(_Alignof(Process), sizeof(Process));
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memset(p, 0, sizeof(*p));
+    tlb_clear(p->tlb);
+    p->pid = pid;
+    p->level = SCHED_TOP;
+    p->epoch = vm->sched_epoch;
+    vm->procs[pid] = p;
+    vm->nprocs++;
+    return p;
+}
+
+/* A new process with the lowest free pid after the last one handed out.
+ * Returns NULL when the table is full.
+ */
+Process* proc_create(VM* vm) {
+    if (vm->nprocs == MAX_PROCS - 1) return NULL;
+    uint32_t pid = vm->next_pid;
+    while (pid == 0 || (vm->procs && vm->procs[pid])) pid = (pid + 1) % MAX_PROCS;
+    vm->next_pid = (pid + 1) % MAX_PROCS;
+    return proc_create_at(vm, pid);
+}
+
+void proc_free(VM* vm, Process* p) {
+    files_close(vm, p, 0);
+    mem_release(vm, p->pt);
+    vm->procs[p->pid] = NULL;
+    vm->nprocs--;
+    free(p);
+}
+
+static inline uint32_t lowest_bit(uint32_t mask) {
+#if defined(__GNUC__)
+    return (uint32_t)__builtin_ctz(mask);
+#else
+    uint32_t n = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/* Queue level of a process that is not running, after any boost it
+ * missed. Processes in kernel mode always queue at level 0.
+ */
+static uint32_t queue_level(VM* vm, Process* p) {
+    if (p->epoch != vm->sched_epoch) {
+        p->epoch = vm->sched_epoch;
+        p->level = SCHED_TOP;
+    }
+    return p->cpu.mode == MODE_KERNEL ? 0 : p->level;
+}
+
+void proc_enqueue(VM* vm, Process* p) {
+    uint32_t level = queue_level(vm, p);
+    p->state = PROC_READY;
+    p->next = NULL;
+    if (vm->run_tail[level]) {
+        vm->run_tail[level]->next = p;
+    } else {
+        vm->run_head[level] = p;
+    }
+    vm->run_tail[level] = p;
+    vm->run_mask |= 1u << level;
+}
+
+/* The first process of the highest non-empty level, or NULL */
+Process* proc_dequeue(VM* vm) {
+    if (!vm->run_mask) return NULL;
+    uint32_t level = lowest_bit(vm->run_mask);
+    Process* p = vm->run_head[level];
+    vm->run_head[level] = p->next;
+    if (!p->next) {
+        vm->run_tail[level] = NULL;
+        vm->run_mask &= ~(1u << level);
+    }
+    return p;
+}
+
+/* Move every queued user process to SCHED_TOP, keeping their order */
+static void boost(VM* vm) {
+    vm->sched_epoch++;
+    vm->boost_at = vm->icount + SCHED_BOOST_INTERVAL;
+    for (uint32_t level = SCHED_TOP + 1; level < SCHED_LEVELS; level++) {
+        if (!vm->run_head[level]) continue;
+        if (vm->run_tail[SCHED_TOP]) {
+            vm->run_tail[SCHED_TOP]->next = vm->run_head[level];
+        } else {
+            vm->run_head[SCHED_TOP] = vm->run_head[level];
+        }
+        vm->run_tail[SCHED_TOP] = vm->run_tail[level];
+        vm->run_head[level] = vm->run_tail[level] = NULL;
+        vm->run_mask = (vm->run_mask & ~(1u << level)) | (1u << SCHED_TOP);
+    }
+}
+
+static void start_slice(VM* vm) {
+    vm->slice_end = vm->icount + ((uint64_t)PROC_QUANTUM << (vm->proc->level - SCHED_TOP));
+}
+
+/* Make next the running process. Its registers and TLB stay where they
+ * are; the code caches survive too when next runs the same image.
+ */
+void proc_switch(VM* vm, Process* next) {
+    vm->proc = next;
+    vm->cpu = &next->cpu;
+    vm->tlb = next->tlb;
+    vm->pt = next->pt;
+    next->state = PROC_RUNNING;
+    if (next->text_id != vm->text_id) {
+        code_flush(vm);
+        vm->text_id = next->text_id;
+    }
+}
+
+/* The running process used up its slice. It drops a level and the
+ * first process of the highest non-empty level runs next, which may be
+ * the same one.
+ */
+void proc_preempt(VM* vm) {
+    Process* p = vm->proc;
+    if (vm->icount >= vm->boost_at) boost(vm);
+    queue_level(vm, p);
+    if (p->level < SCHED_LEVELS - 1) p->level++;
+    if (vm->run_mask) {
+        proc_enqueue(vm, p);
+        Process* next = proc_dequeue(vm);
+        if (next != p) {
+            proc_switch(vm, next);
+        } else {
+            p->state = PROC_RUNNING;
+        }
+    }
+    start_slice(vm);
+}
+
+/* The running process blocked or exited: switch to the next ready one.
+ * Returns 0 if there is none.
+ */
+int proc_schedule(VM* vm) {
+    Process* next = proc_dequeue(vm);
+    if (!next) return 0;
+    proc_switch(vm, next);
+    start_slice(vm);
+    return 1;
+}
+
+/* Block the running process in state. vm_run switches away once the
+ * system call that blocked it returns.
+ */
+void proc_sleep(VM* vm, ProcState state) {
+    vm->proc->state = state;
+    vm->proc->sleep_start = vm->icount;
+}
+
+/* A blocked process can run again. Rising on wakeup keeps interactive
+ * and I/O-bound processes ahead of CPU-bound ones.
+ */
+void proc_wakeup(VM* vm, Process* p) {
+    uint64_t rise = 1 + (vm->icount - p->sleep_start) / PROC_QUANTUM;
+    queue_level(vm, p);
+    p->level = rise >= (uint64_t)(p->level - SCHED_TOP) ? SCHED_TOP : p->level - (uint8_t)rise;
+    proc_enqueue(vm, p);
+}
+
+/* yield(): give up the rest of the slice without losing a level. The
+ * process goes to the back of its queue and vm_run switches away.
+ */
+void proc_yield(VM* vm) {
+    proc_enqueue(vm, vm->proc);
+}
+
+static void link_child(Process* parent, Process* child) {
+    child->parent = parent;
+    child->ppid = parent->pid;
+    child->sibling_prev = NULL;
+    child->sibling = parent->children;
+    if (parent->children) parent->children->sibling_prev = child;
+    parent->children = child;
+}
+
+static void unlink_child(Process* child) {
+    if (child->sibling_prev) {
+        child->sibling_prev->sibling = child->sibling;
+    } else {
+        child->parent->children = child->sibling;
+    }
+    if (child->sibling) child->sibling->sibling_prev = child->sibling_prev;
+}
+
+/* fork(): the child resumes after the SYSCALL with r0 = 0 */
+int32_t proc_fork(VM* vm) {
+    Process* parent = vm->proc;
+    Process* child = proc_create(vm);
+    if (!child) return -UCVM_EAGAIN;
+
+    child->cpu = parent->cpu;
+    child->cpu.gpr[0] = 0;
+    child->text_id = parent->text_id;
+    child->brk = parent->brk;
+    child->fd_open = parent->fd_open;
+    files_fork(parent, child);
+    child->ring_addr = parent->ring_addr;
+    child->ring_entries = parent->ring_entries;
+    child->level = parent->level;
+    child->epoch = parent->epoch;
+    if (vm->journal) journal_fork(vm, child);
+    mem_fork(vm, child->pt);
+
+    link_child(parent, child);
+    proc_enqueue(vm, child);
+    return (int32_t)child->pid;
+}
+
+/* Free an exited child of p, storing its status in cpu's r1. Returns
+ * its pid, or 0 if no child has exited.
+ */
+static int32_t reap(VM* vm, Process* p, CPUState* cpu) {
+    Process* child = p->zombies;
+    if (!child) return 0;
+    int32_t pid = (int32_t)child->pid;
+    p->zombies = child->sibling;
+    cpu->gpr[1] = (uint32_t)child->exit_status;
+    proc_free(vm, child);
+    return pid;
+}
+
+/* Complete the wait() of a blocked parent if one of its children exited */
+static void wake_waiter(VM* vm, Process* p) {
+    if (p->state != PROC_WAITING) return;
+    int32_t pid = reap(vm, p, &p->cpu);
+    if (!pid) return;
+    p->cpu.gpr[0] = (uint32_t)pid;
+    trace_complete(p, pid);
+    proc_wakeup(vm, p);
+}
+
+/* wait(): r0 = pid of an exited child, r1 = its exit status. Blocks
+ * while the children are all still running.
+ */
+int32_t proc_wait(VM* vm) {
+    Process* p = vm->proc;
+    int32_t pid = reap(vm, p, &p->cpu);
+    if (pid) return pid;
+    if (!p->children) return -UCVM_ECHILD;
+    proc_sleep(vm, PROC_WAITING);
+    return 0;
+}
+
+/* The running process called exit(). Returns non-zero when that stops
+ * the machine, which is when init exits. Otherwise the process becomes
+ * a zombie for its parent to reap, its children pass to init, and the
+ * VM has no running process until vm_run switches to the next one.
+ */
+int proc_exit(VM* vm) {
+    Process* p = vm->proc;
+    if (!p->parent) {
+        vm->exit_status = p->exit_status;
+        return 1;
+    }
+
+    Process* init = vm->procs[1];
+    while (p->children) {
+        Process* child = p->children;
+        unlink_child(child);
+        link_child(init, child);
+    }
+    while (p->zombies) {
+        Process* child = p->zombies;
+        p->zombies = child->sibling;
+        child->parent = init;
+        child->ppid = init->pid;
+        child->sibling = init->zombies;
+        init->zombies = child;
+    }
+    files_close(vm, p, 1);
+    mem_release(vm, p->pt);
+    p->state = PROC_ZOMBIE;
+    unlink_child(p);
+    p->sibling = p->parent->zombies;
+    p->parent->zombies = p;
+    vm->proc = NULL;
+    vm->pt = NULL;
+    vm->cpu = &init->cpu;   /* p may be reaped below */
+    vm->tlb = init->tlb;
+
+    wake_waiter(vm, p->parent);
+    wake_waiter(vm, init);
+    return 0;
+}
@@ -0,0 +1,306 @@
+/* UCVM CPU Engine - sampling profiler
+ * A Profile runs a machine in stretches and samples the running process
+ * between them: every PROFILE_EVERY instructions by default, or on the
+ * ticks of a host CPU-time timer. The engines run unchanged, so the cost
+ * is one return from vm_run and one sample per stretch.
+ *
+ * A sample is the PC, its opcode and the call stack. The ISA keeps no
+ * frame pointers, so the stack is recovered the way CALL leaves it: the
+ * words above SP that point just past a CALL are return addresses, and
+ * the CALL's target is the function called. A data word that looks like
+ * one adds a bogus frame; a function that moved SP off its return
+ * address hides one.
+ *
+ * Stacks are counted in a hash table and written in the folded format
+ * flame graph tools read: frames from the outermost in, separated by
+ * semicolons, then the count.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "exec.h"
+
+typedef struct {
+    uint64_t count;         /* 0 for an empty slot */
+    uint32_t hash;
+    uint32_t frames;        /* offset in Profile.frames */
+    uint32_t depth;
+} ProfileStack;
+
+struct Profile {
+    VM* vm;
+    uint64_t every;         /* instructions between samples, 0 with a timer */
+    uint32_t hz;
+    uint64_t poll;          /* timer: instructions between looks at the tick */
+    uint64_t last_tick;     /* timer: icount at the last tick */
+    uint64_t samples;
+    uint64_t pc_samples[MEM_SIZE];
+    uint64_t op_samples[256];
+    ProfileStack* stacks;   /* open addressing, at most half full */
+    uint32_t nstacks, cap;
+    uint16_t* frames;
+    uint32_t nframes, frames_cap;
+};
+
+static volatile sig_atomic_t ticks;
+
+static void on_tick(int sig) {
+    (void)sig;
+    ticks = 1;
+}
+
+static void* profile_realloc(void* p, size_t size) {
+    p = realloc(p, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/* Sample every `every` instructions, or hz times a second of host CPU
+ * time if hz is not 0. Only one profile may use the timer at a time.
+ */
+Profile* profile_open(VM* vm, uint64_t every, uint32_t hz) {
+    Profile* p = profile_realloc(NULL, sizeof(Profile));
+    memset(p, 0, sizeof(Profile));
+    p->vm = vm;
+    p->every = hz ? 0 : (every ? every : PROFILE_EVERY);
+    p->hz = hz;
+    p->poll = PROFILE_POLL;
+    p->cap = 1024;
+    p->stacks = profile_realloc(NULL, p->cap * sizeof(ProfileStack));
+    memset(p->stacks, 0, p->cap * sizeof(ProfileStack));
+    if (hz) {
+        ticks = 0;
+        signal(SIGPROF, on_tick);
+        struct itimerval t = {{0, 1000000 / hz}, {0, 1000000 / hz}};
+        setitimer(ITIMER_PROF, &t, NULL);
+    }
+    return p;
+}
+
+void profile_close(Profile* p) {
+    if (p->hz) {
+        struct itimerval off = {{0, 0}, {0, 0}};
+        setitimer(ITIMER_PROF, &off, NULL);
+        signal(SIGPROF, SIG_DFL);
+    }
+    free(p->stacks);
+    free(p->frames);
+    free(p);
+}
+
+static uint32_t hash_frames(const uint16_t* f, uint32_t n) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < n; i++) h = (h ^ f[i]) * 16777619u;
+    return h;
+}
+
+static void grow(Profile* p) {
+    ProfileStack* old = p->stacks;
+    uint32_t old_cap = p->cap;
+    p->cap *= 2;
+    p->stacks = profile_realloc(NULL, p->cap * sizeof(ProfileStack));
+    memset(p->stacks, 0, p->cap * sizeof(ProfileStack));
+    for (uint32_t i = 0; i < old_cap; i++) {
+        if (!old[i].count) continue;
+        uint32_t slot = old[i].hash & (p->cap - 1);
+        while (p->stacks[slot].count) slot = (slot + 1) & (p->cap - 1);
+        p->stacks[slot] = old[i];
+    }
+    free(old);
+}
+
+static void count_stack(Profile* p, const uint16_t* f, uint32_t n) {
+    uint32_t h = hash_frames(f, n);
+    uint32_t slot = h & (p->cap - 1);
+    for (;; slot = (slot + 1) & (p->cap - 1)) {
+        ProfileStack* s = &p->stacks[slot];
+        if (!s->count) break;
+        if (s->hash == h && s->depth == n && memcmp(p->frames + s->frames, f, n * sizeof(uint16_t)) == 0) {
+            s->count++;
+            return;
+        }
+    }
+    if (p->nframes + n > p->frames_cap) {
+        while (p->nframes + n > p->frames_cap) p->frames_cap = p->frames_cap ? p->frames_cap * 2 : 4096;
+        p->frames = profile_realloc(p->frames, p->frames_cap * sizeof(uint16_t));
+    }
+    memcpy(p->frames + p->nframes, f, n * sizeof(uint16_t));
+    p->stacks[slot] = (ProfileStack){1, h, p->nframes, n};
+    p->nframes += n;
+    if (++p->nstacks * 2 > p->cap) grow(p);
+}
+
+/* Record where the running process is */
+static void sample(Profile* p) {
+    VM* vm = p->vm;
+    if (!vm->proc) return;
+    uint32_t pc = vm->cpu->pc;
+    uint8_t buf[MAX_INSN_SIZE];
+    p->samples++;
+    p->pc_samples[pc & 0xFFFF]++;
+    if (fetch_ok(pc)) p->op_samples[fetch_insn(vm, vm->pt, pc, buf)[0]]++;
+
+    /* Innermost first: the functions called, then where the outermost
+     * call was made from */
+    uint16_t called[PROFILE_DEPTH + 1];
+    uint32_t depth = 0, site = pc;
+    uint32_t sp = vm->cpu->sp;
+    for (uint32_t n = 0; n < PROFILE_SCAN && depth < PROFILE_DEPTH && sp <= STACK_TOP - 4; n++, sp += 4) {
+        uint8_t word[4];
+        if (!mem_read(vm, sp, word, 4)) break;
+        uint32_t ret = rd32(word);
+        if (ret < 3 || !fetch_ok(ret - 3)) continue;
+        const uint8_t* ip = fetch_insn(vm, vm->pt, ret - 3, buf);
+        if (ip[0] != OP_CALL) continue;
+        called[depth++] = (uint16_t)rd16(ip + 1);
+        site = ret - 3;
+    }
+    called[depth++] = (uint16_t)site;
+
+    uint16_t frames[PROFILE_DEPTH + 1];
+    for (uint32_t i = 0; i < depth; i++) frames[i] = called[depth - 1 - i];
+    count_stack(p, frames, depth);
+}
+
+/* vm_run, sampling as it goes */
+VMStatus profile_run(Profile* p, uint64_t budget) {
+    VM* vm = p->vm;
+    uint64_t next = vm->icount + p->every;
+    p->last_tick = vm->icount;
+    for (;;) {
+        uint64_t n = p->every ? next - vm->icount : p->poll;
+        uint64_t start = vm->icount;
+        VMStatus st = vm_run(vm, n < budget ? n : budget);
+        if (budget != BUDGET_UNLIMITED) budget -= vm->icount - start;
+        if (st != VM_BUDGET) return st;
+
+        if (p->every && vm->icount >= next) {
+            sample(p);
+            next = vm->icount + p->every;
+        } else if (!p->every && ticks) {
+            ticks = 0;
+            sample(p);
+            /* Look about eight times a tick */
+            uint64_t per_tick = vm->icount - p->last_tick;
+            p->last_tick = vm->icount;
+            p->poll = per_tick / 8 < PROFILE_POLL ? PROFILE_POLL : per_tick / 8;
+        }
+        if (budget == 0) return st;
+    }
+}
+
+/* Name of the function at addr: the label at or before it, else the
+ * address
+ */
+static const char* function_name(const Program* prog, uint32_t addr, char* buf, size_t len) {
+    const Symbol* sym = prog ? program_symbol(prog, addr) : NULL;
+    if (sym) return sym->name;
+    snprintf(buf, len, "0x%04X", addr);
+    return buf;
+}
+
+typedef struct {
+    char* text;
+    uint64_t count;
+} FoldedLine;
+
+static int by_text(const void* a, const void* b) {
+    return strcmp(((const FoldedLine*)a)->text, ((const FoldedLine*)b)->text);
+}
+
+/* Write the stacks in folded format, naming frames from prog's labels
+ * if it is not NULL. Stacks that differ only in addresses within the
+ * same functions are one line. Returns 0, or -1 with a message in err.
+ */
+int profile_write_folded(const Profile* p, const Program* prog, const char* path, char* err, size_t errlen) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        snprintf(err, errlen, "%s: cannot create", path);
+        return -1;
+    }
+    FoldedLine* lines = profile_realloc(NULL, (p->nstacks + 1) * sizeof(FoldedLine));
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < p->cap; i++) {
+        const ProfileStack* s = &p->stacks[i];
+        if (!s->count) continue;
+        size_t len = 0;
+        char* text = profile_realloc(NULL, s->depth * (MAX_SYMBOL_LENGTH + 1) + 1);
+        for (uint32_t k = 0; k < s->depth; k++) {
+            char buf[16];
+            const char* name = function_name(prog, p->frames[s->frames + k], buf, sizeof(buf));
+            len += sprintf(text + len, "%s%s", k ? ";" : "", name);
+        }
+        lines[n++] = (FoldedLine){text, s->count};
+    }
+    qsort(lines, n, sizeof(FoldedLine), by_text);
+    for (uint32_t i = 0; i < n;) {
+        uint64_t count = 0;
+        uint32_t j = i;
+        for (; j < n && strcmp(lines[j].text, lines[i].text) == 0; j++) count += lines[j].count;
+        fprintf(f, "%s %llu\n", lines[i].text, (unsigned long long)count);
+        for (; i < j; i++) free(lines[i].text);
+    }
+    free(lines);
+    if (ferror(f) | fclose(f)) {
+        snprintf(err, errlen, "%s: write error", path);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    uint32_t key;
+    uint64_t count;
+} ProfileCount;
+
+static int by_count(const void* a, const void* b) {
+    uint64_t x = ((const ProfileCount*)a)->count, y = ((const ProfileCount*)b)->count;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/* Print the hottest top addresses and the opcode mix of the samples.
+ * Instructions are disassembled from prog's image if it is not NULL.
+ */
+void profile_report(const Profile* p, const Program* prog, FILE* out, uint32_t top) {
+    if (p->every) {
+        fprintf(out, "%llu samples, one every %llu instructions\n", (unsigned long long)p->samples,
+                (unsigned long long)p->every);
+    } else {
+        fprintf(out, "%llu samples at %u Hz\n", (unsigned long long)p->samples, p->hz);
+    }
+    if (!p->samples) return;
+
+    ProfileCount* hot = profile_realloc(NULL, MEM_SIZE * sizeof(ProfileCount));
+    uint32_t n = 0;
+    for (uint32_t pc = 0; pc < MEM_SIZE; pc++) {
+        if (p->pc_samples[pc]) hot[n++] = (ProfileCount){pc, p->pc_samples[pc]};
+    }
+    qsort(hot, n, sizeof(ProfileCount), by_count);
+    fprintf(out, "%10s %7s  %-6s  %-24s %s\n", "samples", "share", "addr", "function", "instruction");
+    for (uint32_t i = 0; i < n && i < top; i++) {
+        char where[MAX_SYMBOL_LENGTH + 8] = "", text[64] = "";
+        const Symbol* sym = prog ? program_symbol(prog, hot[i].key) : NULL;
+        if (sym) snprintf(where, sizeof(where), "%s+%u", sym->name, hot[i].key - sym->addr);
+        if (prog && fetch_ok(hot[i].key)) disassemble(prog->image, hot[i].key, text, sizeof(text));
+        fprintf(out, "%10llu %6.1f%%  0x%04X  %-24s %s\n", (unsigned long long)hot[i].count,
+                100.0 * hot[i].count / p->samples, hot[i].key, where, text);
+    }
+
+    n = 0;
+    for (uint32_t op = 0; op < 256; op++) {
+        if (p->op_samples[op]) hot[n++] = (ProfileCount){op, p->op_samples[op]};
+    }
+    qsort(hot, n, sizeof(ProfileCount), by_count);
+    fprintf(out, "\n%10s %7s  opcode\n", "samples", "share");
+    for (uint32_t i = 0; i < n; i++) {
+        fprintf(out, "%10llu %6.1f%%  %s\n", (unsigned long long)hot[i].count,
+                100.0 * hot[i].count / p->samples, opcode_name((uint8_t)hot[i].key));
+    }
+    free(hot);
+}
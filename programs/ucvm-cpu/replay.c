@@ -0,0 +1,149 @@
+/* UCVM CPU Engine - record and replay of host I/O
+ * The machine is deterministic except where it reaches the host: the
+ * input it reads from descriptors and devices, and what the host answers
+ * to its output. With a replay log attached, each of those calls goes
+ * through here and is logged in order. A machine run again from an
+ * earlier state seeks the log back to the position it had then, and
+ * consumes it: input comes from the log and output is not repeated, so
+ * the guest sees what it saw the first time and the host sees it once.
+ * Past the end of the log, calls reach the host again and are appended.
+ *
+ * Without a log each call goes straight to the host.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "ucvm.h"
+
+enum { REPLAY_READ = 1, REPLAY_WRITE, REPLAY_DEVICE_READ, REPLAY_DEVICE_WRITE };
+
+typedef struct {
+    uint32_t kind;
+    int32_t result;
+    uint64_t data;              /* offset of the input read in Replay.data */
+} ReplayEvent;
+
+struct Replay {
+    ReplayEvent* events;
+    uint64_t nevents, cap;
+    uint64_t pos;               /* next event to consume; nevents when live */
+    uint8_t* data;
+    uint64_t len, data_cap;
+};
+
+static void* replay_realloc(void* p, size_t size) {
+    p = realloc(p, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+void replay_open(VM* vm) {
+    vm->replay = replay_realloc(NULL, sizeof(Replay));
+    memset(vm->replay, 0, sizeof(Replay));
+}
+
+void replay_close(VM* vm) {
+    if (!vm->replay) return;
+    free(vm->replay->events);
+    free(vm->replay->data);
+    free(vm->replay);
+    vm->replay = NULL;
+}
+
+/* The position to seek back to for a return to the machine as it is now */
+uint64_t replay_tell(const VM* vm) {
+    return vm->replay->pos;
+}
+
+void replay_seek(VM* vm, uint64_t pos) {
+    vm->replay->pos = pos;
+}
+
+/* The next logged event if the machine is replaying and it is of kind.
+ * A machine that asks for something else has left the recorded run, so
+ * the rest of the log is dropped and it goes live.
+ */
+static const ReplayEvent* next_event(Replay* r, uint32_t kind) {
+    if (r->pos == r->nevents) return NULL;
+    const ReplayEvent* e = &r->events[r->pos];
+    if (e->kind != kind) {
+        r->nevents = r->pos;
+        r->len = e->data;
+        return NULL;
+    }
+    r->pos++;
+    return e;
+}
+
+static void log_event(Replay* r, uint32_t kind, int32_t result, const uint8_t* data, uint32_t len) {
+    if (r->nevents == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 256;
+        r->events = replay_realloc(r->events, r->cap * sizeof(ReplayEvent));
+    }
+    if (r->len + len > r->data_cap) {
+        while (r->len + len > r->data_cap) r->data_cap = r->data_cap ? r->data_cap * 2 : 4096;
+        r->data = replay_realloc(r->data, r->data_cap);
+    }
+    ReplayEvent* e = &r->events[r->nevents++];
+    e->kind = kind;
+    e->result = result;
+    e->data = r->len;
+    if (len) memcpy(r->data + r->len, data, len);
+    r->len += len;
+    r->pos = r->nevents;
+}
+
+/* read() from the host, or the bytes it returned the first time.
+ * Returns what read() did.
+ */
+int32_t replay_read(VM* vm, int fd, uint8_t* buf, uint32_t len) {
+    Replay* r = vm->replay;
+    if (!r) return (int32_t)read(fd, buf, len);
+    const ReplayEvent* e = next_event(r, REPLAY_READ);
+    if (e) {
+        if (e->result > 0) memcpy(buf, r->data + e->data, (size_t)e->result);
+        return e->result;
+    }
+    int32_t n = (int32_t)read(fd, buf, len);
+    log_event(r, REPLAY_READ, n, buf, n > 0 ? (uint32_t)n : 0);
+    return n;
+}
+
+/* writev() to the host, unless this output was written before */
+int32_t replay_writev(VM* vm, int fd, const struct iovec* iov, int n) {
+    Replay* r = vm->replay;
+    if (!r) return (int32_t)writev(fd, iov, n);
+    const ReplayEvent* e = next_event(r, REPLAY_WRITE);
+    if (e) return e->result;
+    int32_t done = (int32_t)writev(fd, iov, n);
+    log_event(r, REPLAY_WRITE, done, NULL, 0);
+    return done;
+}
+
+int32_t replay_write(VM* vm, int fd, const uint8_t* buf, uint32_t len) {
+    struct iovec iov = {(void*)buf, len};
+    return replay_writev(vm, fd, &iov, 1);
+}
+
+/* A device access, replayed like the host calls behind it: a read gives
+ * the word it gave the first time, and a write reaches the device once
+ */
+int replay_device(VM* vm, DeviceDriver* dev, uint32_t offset, uint8_t* bytes, uint8_t need) {
+    Replay* r = vm->replay;
+    int writing = need == PTE_WRITE;
+    if (!r) return writing ? dev->write(dev, offset, bytes, 4) : dev->read(dev, offset, bytes, 4);
+    const ReplayEvent* e = next_event(r, writing ? REPLAY_DEVICE_WRITE : REPLAY_DEVICE_READ);
+    if (e) {
+        if (!writing && e->result == 4) memcpy(bytes, r->data + e->data, 4);
+        return e->result;
+    }
+    int n = writing ? dev->write(dev, offset, bytes, 4) : dev->read(dev, offset, bytes, 4);
+    log_event(r, writing ? REPLAY_DEVICE_WRITE : REPLAY_DEVICE_READ, n, bytes, !writing && n == 4 ? 4 : 0);
+    return n;
+}
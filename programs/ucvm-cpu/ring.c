@@ -0,0 +1,134 @@
+/* UCVM CPU Engine - batched system call ring
+ * An io_uring-style pair of rings in guest memory. The guest queues
+ * system calls as submission entries and traps once with ring_enter;
+ * the VM runs the whole batch and posts a completion for each. Runs of
+ * writes to one descriptor go to the host as a single writev.
+ *
+ * Layout, all fields 32-bit words at the address ring_setup returns:
+ *   +0   sq_head   next entry the VM will consume
+ *   +4   sq_tail   next free entry, advanced by the guest
+ *   +8   cq_head   next completion the guest will read, advanced by it
+ *   +12  cq_tail   next completion the VM will post
+ *   +16  entries   ring size, a power of two
+ *   +32  sqes      entries * {nr, arg1, arg2, arg3}
+ *   ...  cqes      entries * {tag, result}, right after the sqes
+ * The counters run freely; slot = counter & (entries - 1). A completion's
+ * tag is the sq counter value its submission was consumed at.
+ */
+
+#include "exec.h"
+
+#define RING_SQ_HEAD  0
+#define RING_SQ_TAIL  4
+#define RING_CQ_HEAD  8
+#define RING_CQ_TAIL  12
+#define RING_ENTRIES  16
+#define RING_SQES     32
+#define RING_SQE_SIZE 16
+#define RING_CQE_SIZE 8
+
+static uint32_t ring_cqes(uint32_t entries) {
+    return RING_SQES + entries * RING_SQE_SIZE;
+}
+
+/* Copy count ring slots starting at slot first, wrapping at entries, in
+ * at most two transfers
+ */
+static int ring_copy(VM* vm, uint32_t slots, uint32_t first, uint32_t count,
+                     uint32_t entries, uint32_t size, uint8_t* buf, int write) {
+    uint32_t head = count < entries - first ? count : entries - first;
+    uint32_t addr = slots + first * size;
+    if (write) {
+        return mem_write(vm, addr, buf, head * size) &&
+               mem_write(vm, slots, buf + head * size, (count - head) * size);
+    }
+    return mem_read(vm, addr, buf, head * size) &&
+           mem_read(vm, slots, buf + head * size, (count - head) * size);
+}
+
+/* ring_setup(entries): map a zeroed ring in the heap segment and return
+ * its address. One ring per VM.
+ */
+int32_t ring_setup(VM* vm, uint32_t entries) {
+    if (vm->proc->ring_addr) return -UCVM_EBUSY;
+    if (entries == 0 || entries > RING_MAX_ENTRIES || (entries & (entries - 1))) {
+        return -UCVM_EINVAL;
+    }
+    uint32_t size = ring_cqes(entries) + entries * RING_CQE_SIZE;
+    int32_t addr = syscall_call(vm, SYS_MMAP, 0, size, 0);
+    if (addr < 0) return addr;
+
+    uint8_t word[4];
+    wr32(word, entries);
+    mem_write(vm, (uint32_t)addr + RING_ENTRIES, word, 4);
+    vm->proc->ring_addr = (uint32_t)addr;
+    vm->proc->ring_entries = entries;
+    return addr;
+}
+
+/* ring_enter(to_submit): consume up to to_submit queued entries, as many
+ * as the completion ring has room for. Returns the number consumed.
+ */
+int32_t ring_enter(VM* vm, uint32_t to_submit) {
+    uint32_t base = vm->proc->ring_addr, entries = vm->proc->ring_entries, mask = entries - 1;
+    uint8_t hdr[16];
+    if (!base) return -UCVM_EINVAL;
+    if (!mem_read(vm, base, hdr, sizeof(hdr))) return -UCVM_EFAULT;
+
+    uint32_t sq_head = rd32(hdr + RING_SQ_HEAD), sq_tail = rd32(hdr + RING_SQ_TAIL);
+    uint32_t cq_head = rd32(hdr + RING_CQ_HEAD), cq_tail = rd32(hdr + RING_CQ_TAIL);
+    uint32_t pending = sq_tail - sq_head, room = entries - (cq_tail - cq_head);
+    if (pending > entries || room > entries) return -UCVM_EINVAL;
+    uint32_t n = to_submit;
+    if (n > pending) n = pending;
+    if (n > room) n = room;
+
+    uint8_t sqes[RING_MAX_ENTRIES * RING_SQE_SIZE], cqes[RING_MAX_ENTRIES * RING_CQE_SIZE];
+    if (!ring_copy(vm, base + RING_SQES, sq_head & mask, n, entries, RING_SQE_SIZE, sqes, 0)) {
+        return -UCVM_EFAULT;
+    }
+
+    uint32_t nr[RING_MAX_ENTRIES], a1[RING_MAX_ENTRIES], a2[RING_MAX_ENTRIES], a3[RING_MAX_ENTRIES];
+    int32_t res[RING_MAX_ENTRIES];
+    for (uint32_t i = 0; i < n; i++) {
+        const uint8_t* sqe = sqes + i * RING_SQE_SIZE;
+        nr[i] = rd32(sqe);
+        a1[i] = rd32(sqe + 4);
+        a2[i] = rd32(sqe + 8);
+        a3[i] = rd32(sqe + 12);
+    }
+
+    /* Each entry is traced like a call of its own; the writes of a batch
+     * share its time
+     */
+    for (uint32_t i = 0; i < n;) {
+        uint32_t run = 1;
+        uint64_t start = trace_clock();
+        if (nr[i] == SYS_WRITE) {
+            while (i + run < n && nr[i + run] == SYS_WRITE && a1[i + run] == a1[i]) run++;
+            syscall_write_batch(vm, a1[i], a2 + i, a3 + i, run, res + i);
+        } else {
+            res[i] = syscall_call(vm, nr[i], a1[i], a2[i], a3[i]);
+        }
+        for (uint32_t j = i; j < i + run; j++) {
+            trace_push(vm->proc, vm->icount, nr[j], a1[j], a2[j], a3[j], res[j], start);
+        }
+        i += run;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        wr32(cqes + i * RING_CQE_SIZE, sq_head + i);
+        wr32(cqes + i * RING_CQE_SIZE + 4, (uint32_t)res[i]);
+    }
+    if (!ring_copy(vm, base + ring_cqes(entries), cq_tail & mask, n, entries, RING_CQE_SIZE,
+                   cqes, 1)) {
+        return -UCVM_EFAULT;
+    }
+    wr32(hdr + RING_SQ_HEAD, sq_head + n);
+    wr32(hdr + RING_CQ_TAIL, cq_tail + n);
+    if (!mem_write(vm, base + RING_SQ_HEAD, hdr + RING_SQ_HEAD, 4) ||
+        !mem_write(vm, base + RING_CQ_TAIL, hdr + RING_CQ_TAIL, 4)) {
+        return -UCVM_EFAULT;
+    }
+    return (int32_t)n;
+}
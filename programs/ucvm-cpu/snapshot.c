@@ -0,0 +1,777 @@
+/* UCVM CPU Engine - machine snapshots (spec sections 2.3 and 2.4)
+ * checkpoint() and restore() for the whole VM. The spec's JSON state
+ * artifact is replaced by a versioned binary file: a header, a section
+ * table and the sections, each at a 64-byte aligned offset, so a reader
+ * can mmap the file and use the records in place. restore does just
+ * that. JSON is produced on demand, for debugging only.
+ *
+ * A frame is stored once however many pages map it, so a snapshot of
+ * forked processes is as small as their memory and restore brings back
+ * the copy-on-write sharing. Code caches and TLBs are not saved; they
+ * refill by themselves.
+ *
+ * The XXH64 checksum in the header covers every byte after it, and a
+ * SHA-256 digest of the same bytes can be stored too. A snapshot is
+ * written to a temporary file and renamed over the target, so the
+ * target always holds a whole snapshot, old or new.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "exec.h"
+#include "snapshot.h"
+
+#define SNAP_MAGIC   "UCVMSNAP"
+#define SNAP_VERSION 1
+#define SNAP_ALIGN   64
+
+enum { SNAP_CPU = 1, SNAP_CLOCK, SNAP_PROCESS, SNAP_IO, SNAP_MEMORY };
+#define SNAP_SECTIONS 5
+
+/* Frame numbers in a page table record that are not in the memory section */
+#define SNAP_NO_FRAME   0xFFFFFFFFu
+#define SNAP_ZERO_FRAME 0xFFFFFFFEu
+
+typedef struct SnapHeader {
+    char magic[8];
+    uint64_t checksum;          /* XXH64 of the file from version on */
+    uint8_t sha256[32];         /* SHA-256 of the same, with SNAP_SHA256 */
+    uint32_t version;
+    uint32_t flags;
+    uint64_t size;              /* of the whole file */
+    uint32_t nsections;
+    uint32_t reserved;
+} SnapHeader;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t count;             /* records in the section */
+    uint64_t offset;
+    uint64_t size;
+} SnapSection;
+
+/* The memory section is count frames of PAGE_SIZE bytes back to back */
+
+_Static_assert(sizeof(SnapHeader) % 8 == 0, "snapshot records are 8-byte aligned");
+
+/* ---- checksums ---- */
+
+#define XXH_P1 0x9E3779B185EBCA87ull
+#define XXH_P2 0xC2B2AE3D27D4EB4Full
+#define XXH_P3 0x165667B19E3779F9ull
+#define XXH_P4 0x85EBCA77C2B2AE63ull
+#define XXH_P5 0x27D4EB2F165667C5ull
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t rd64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    return rotl64(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    return (acc ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+/* XXH64 with seed 0 */
+uint64_t snapshot_xxh64(const void* data, size_t len) {
+    const uint8_t* p = data;
+    const uint8_t* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = -XXH_P1;
+        do {
+            v1 = xxh_round(v1, rd64(p));
+            v2 = xxh_round(v2, rd64(p + 8));
+            v3 = xxh_round(v3, rd64(p + 16));
+            v4 = xxh_round(v4, rd64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = XXH_P5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) h = rotl64(h ^ xxh_round(0, rd64(p)), 27) * XXH_P1 + XXH_P4;
+    if (p + 4 <= end) {
+        h = rotl64(h ^ (uint64_t)rd32(p) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) h = rotl64(h ^ *p * XXH_P5, 11) * XXH_P1;
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_block(uint32_t h[8], const uint8_t* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) +
+                      sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void snapshot_sha256(const void* data, size_t len, uint8_t digest[32]) {
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    const uint8_t* p = data;
+    size_t left = len;
+    for (; left >= 64; left -= 64, p += 64) sha256_block(h, p);
+
+    /* Padding: 0x80, zeros, then the length in bits, big-endian */
+    uint8_t tail[128] = {0};
+    memcpy(tail, p, left);
+    tail[left] = 0x80;
+    size_t tail_len = left < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++) tail[tail_len - 1 - i] = (uint8_t)(bits >> (8 * i));
+    for (size_t i = 0; i < tail_len; i += 64) sha256_block(h, tail + i);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t)(h[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(h[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(h[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)h[i];
+    }
+}
+
+/* The bytes the checksums cover: everything after them */
+#define SNAP_HASHED_FROM offsetof(SnapHeader, version)
+
+/* ---- checkpoint ---- */
+
+/* Frame numbering: an open-addressed map from frame address to its
+ * number in the memory section, growing at half full
+ */
+typedef struct {
+    uint8_t** keys;
+    uint32_t* values;
+    uint32_t capacity;
+    uint8_t** frames;           /* by number */
+    uint32_t count;
+} FrameMap;
+
+static void* snap_calloc(size_t n, size_t size) {
+    void* p = calloc(n, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static uint32_t frame_slot(const FrameMap* m, const uint8_t* frame) {
+    uint64_t h = (uint64_t)(uintptr_t)frame * XXH_P1;
+    uint32_t slot = (uint32_t)(h >> 32) & (m->capacity - 1);
+    while (m->keys[slot] && m->keys[slot] != frame) slot = (slot + 1) & (m->capacity - 1);
+    return slot;
+}
+
+static void frame_map_grow(FrameMap* m) {
+    FrameMap old = *m;
+    m->capacity = old.capacity ? old.capacity * 2 : 1024;
+    m->keys = snap_calloc(m->capacity, sizeof(uint8_t*));
+    m->values = snap_calloc(m->capacity, sizeof(uint32_t));
+    m->frames = realloc(m->frames, sizeof(uint8_t*) * (m->capacity / 2));
+    if (!m->frames) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < old.capacity; i++) {
+        if (!old.keys[i]) continue;
+        uint32_t slot = frame_slot(m, old.keys[i]);
+        m->keys[slot] = old.keys[i];
+        m->values[slot] = old.values[i];
+    }
+    free(old.keys);
+    free(old.values);
+}
+
+static uint32_t frame_number(FrameMap* m, const VM* vm, uint8_t* frame) {
+    if (!frame) return SNAP_NO_FRAME;
+    if (frame == vm->zero_frame) return SNAP_ZERO_FRAME;
+    if (m->count >= m->capacity / 2) frame_map_grow(m);
+    uint32_t slot = frame_slot(m, frame);
+    if (!m->keys[slot]) {
+        m->keys[slot] = frame;
+        m->values[slot] = m->count;
+        m->frames[m->count++] = frame;
+    }
+    return m->values[slot];
+}
+
+static uint64_t snap_align(uint64_t n) {
+    return (n + SNAP_ALIGN - 1) & ~(uint64_t)(SNAP_ALIGN - 1);
+}
+
+static uint32_t pid_of(const Process* p) {
+    return p ? p->pid : 0;
+}
+
+/* The fields of p before its page table, and its descriptors */
+void snapshot_save_head(SnapProcess* r, SnapIO* io, const Process* p) {
+    r->pid = p->pid;
+    r->ppid = p->ppid;
+    r->state = p->state;
+    r->exit_status = p->exit_status;
+    r->text_id = p->text_id;
+    r->brk = p->brk;
+    r->level = p->level;
+    r->epoch = p->epoch;
+    r->sleep_start = p->sleep_start;
+    r->first_child = pid_of(p->children);
+    r->first_zombie = pid_of(p->zombies);
+    r->sibling = pid_of(p->sibling);
+    r->run_next = p->state == PROC_READY ? pid_of(p->next) : 0;
+    memcpy(r->gpr, p->cpu.gpr, sizeof(r->gpr));
+    r->pc = p->cpu.pc;
+    r->sp = p->cpu.sp;
+    r->flags[0] = p->cpu.flags.zero;
+    r->flags[1] = p->cpu.flags.carry;
+    r->flags[2] = p->cpu.flags.sign;
+    r->flags[3] = p->cpu.flags.overflow;
+    r->mode = p->cpu.mode;
+    memset(r->reserved, 0, sizeof(r->reserved));
+    io->pid = p->pid;
+    io->fd_open = p->fd_open;
+    io->ring_addr = p->ring_addr;
+    io->ring_entries = p->ring_entries;
+}
+
+void snapshot_save_machine(const VM* vm, SnapCPU* cpu, SnapClock* clock) {
+    memset(cpu, 0, sizeof(*cpu));
+    cpu->running = pid_of(vm->proc);
+    cpu->next_pid = vm->next_pid;
+    for (uint32_t level = 0; level < SCHED_LEVELS; level++) cpu->run_head[level] = pid_of(vm->run_head[level]);
+    cpu->exit_status = vm->exit_status;
+    cpu->fault = vm->fault;
+    cpu->fault_addr = vm->fault_addr;
+    cpu->stopped = vm->stopped;
+
+    memset(clock, 0, sizeof(*clock));
+    clock->icount = vm->icount;
+    clock->slice_end = vm->slice_end;
+    clock->boost_at = vm->boost_at;
+    clock->sched_epoch = vm->sched_epoch;
+    clock->host_time = (int64_t)time(NULL);
+}
+
+/* Write the whole machine to path, storing the checksum and size of the
+ * file when asked. Returns 0, or -1 with a message in err.
+ */
+int snapshot_write(VM* vm, const char* path, uint32_t flags, uint64_t* checksum, uint64_t* size_out,
+                   char* err, size_t errlen) {
+    uint32_t nprocs = 0;
+    for (uint32_t pid = 1; pid < MAX_PROCS; pid++) nprocs += vm->procs[pid] != NULL;
+
+    SnapProcess* procs = snap_calloc(nprocs, sizeof(SnapProcess));
+    SnapIO* io = snap_calloc(nprocs, sizeof(SnapIO));
+    FrameMap frames = {0};
+    for (uint32_t pid = 1, n = 0; pid < MAX_PROCS; pid++) {
+        Process* p = vm->procs[pid];
+        if (!p) continue;
+        snapshot_save_head(&procs[n], &io[n], p);
+        for (uint32_t page = 0; page < NUM_PAGES; page++) {
+            procs[n].frame[page] = frame_number(&frames, vm, p->pt[page].frame);
+            procs[n].pte_flags[page] = p->pt[page].flags;
+        }
+        n++;
+    }
+
+    SnapCPU cpu;
+    SnapClock clock;
+    snapshot_save_machine(vm, &cpu, &clock);
+
+    const struct {
+        uint32_t kind;
+        uint32_t count;
+        const void* data;
+        size_t size;
+    } parts[SNAP_SECTIONS] = {
+        {SNAP_CPU, 1, &cpu, sizeof(cpu)},
+        {SNAP_CLOCK, 1, &clock, sizeof(clock)},
+        {SNAP_PROCESS, nprocs, procs, sizeof(SnapProcess) * nprocs},
+        {SNAP_IO, nprocs, io, sizeof(SnapIO) * nprocs},
+        {SNAP_MEMORY, frames.count, NULL, (size_t)PAGE_SIZE * frames.count}
+    };
+
+    uint64_t size = snap_align(sizeof(SnapHeader) + sizeof(SnapSection) * SNAP_SECTIONS);
+    SnapSection table[SNAP_SECTIONS];
+    for (uint32_t i = 0; i < SNAP_SECTIONS; i++) {
+        table[i].kind = parts[i].kind;
+        table[i].count = parts[i].count;
+        table[i].offset = size;
+        table[i].size = parts[i].size;
+        size = snap_align(size + parts[i].size);
+    }
+
+    uint8_t* image = snap_calloc(1, size);
+    SnapHeader* hdr = (SnapHeader*)(void*)image;
+    memcpy(hdr->magic, SNAP_MAGIC, 8);
+    hdr->version = SNAP_VERSION;
+    hdr->flags = flags & SNAP_SHA256;
+    hdr->size = size;
+    hdr->nsections = SNAP_SECTIONS;
+    memcpy(image + sizeof(SnapHeader), table, sizeof(table));
+    for (uint32_t i = 0; i < SNAP_SECTIONS; i++) {
+        if (parts[i].data) memcpy(image + table[i].offset, parts[i].data, parts[i].size);
+    }
+    uint8_t* mem = image + table[SNAP_MEMORY - 1].offset;
+    for (uint32_t i = 0; i < frames.count; i++) memcpy(mem + (size_t)i * PAGE_SIZE, frames.frames[i], PAGE_SIZE);
+
+    hdr->checksum = snapshot_xxh64(image + SNAP_HASHED_FROM, size - SNAP_HASHED_FROM);
+    if (checksum) *checksum = hdr->checksum;
+    if (size_out) *size_out = size;
+    if (hdr->flags & SNAP_SHA256) snapshot_sha256(image + SNAP_HASHED_FROM, size - SNAP_HASHED_FROM, hdr->sha256);
+
+    free(procs);
+    free(io);
+    free(frames.keys);
+    free(frames.values);
+    free(frames.frames);
+
+    /* Write beside the target and rename over it */
+    size_t tmp_len = strlen(path) + 5;
+    char* tmp = snap_calloc(1, tmp_len);
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+    int result = -1;
+    FILE* f = fopen(tmp, "wb");
+    if (!f) {
+        snprintf(err, errlen, "%s: cannot create", tmp);
+    } else if (fwrite(image, 1, size, f) != size || fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        snprintf(err, errlen, "%s: write error", tmp);
+        fclose(f);
+        unlink(tmp);
+    } else if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        snprintf(err, errlen, "%s: cannot replace", path);
+        unlink(tmp);
+    } else {
+        result = 0;
+    }
+    free(tmp);
+    free(image);
+    return result;
+}
+
+/* Write the whole machine to path. flags may ask for a SHA-256 digest
+ * (SNAP_SHA256) on top of the checksum. Returns 0, or -1 with a message
+ * in err.
+ */
+int vm_checkpoint(VM* vm, const char* path, uint32_t flags, char* err, size_t errlen) {
+    return snapshot_write(vm, path, flags, NULL, NULL, err, errlen);
+}
+
+/* ---- restore ---- */
+
+static int snap_fail(char* err, size_t errlen, const char* path, const char* msg) {
+    snprintf(err, errlen, "%s: %s", path, msg);
+    return -1;
+}
+
+void snapshot_unmap(Snapshot* s) {
+    if (s->base) munmap((void*)s->base, s->size);
+    s->base = NULL;
+}
+
+static int pid_ok(const uint8_t* seen, uint32_t pid) {
+    return pid == 0 || (pid < MAX_PROCS && seen[pid]);
+}
+
+/* Check that the records describe a machine restore can build: every
+ * pid and frame number they mention exists, and init is there.
+ */
+static int snapshot_check(const Snapshot* s) {
+    uint8_t* seen = snap_calloc(MAX_PROCS, 1);
+    int ok = 1;
+    for (uint32_t i = 0; i < s->nprocs && ok; i++) {
+        uint32_t pid = s->procs[i].pid;
+        ok = pid > 0 && pid < MAX_PROCS && !seen[pid] && s->io[i].pid == pid;
+        if (ok) seen[pid] = 1;
+    }
+    ok = ok && seen[1] && pid_ok(seen, s->cpu->running) && s->cpu->next_pid < MAX_PROCS &&
+         (s->cpu->stopped <= VM_BUDGET || s->cpu->stopped == VM_DEADLOCK) && s->cpu->stopped != VM_BREAK;
+    for (uint32_t level = 0; level < SCHED_LEVELS && ok; level++) ok = pid_ok(seen, s->cpu->run_head[level]);
+    for (uint32_t i = 0; i < s->nprocs && ok; i++) {
+        const SnapProcess* r = &s->procs[i];
+        ok = pid_ok(seen, r->ppid) && (r->ppid != 0 || r->pid == 1) &&
+             pid_ok(seen, r->first_child) && pid_ok(seen, r->first_zombie) &&
+             pid_ok(seen, r->sibling) && pid_ok(seen, r->run_next) &&
+             r->state <= PROC_BLOCKED && r->level < SCHED_LEVELS && r->mode <= MODE_KERNEL;
+        for (uint32_t page = 0; page < NUM_PAGES && ok; page++) {
+            uint32_t frame = r->frame[page];
+            ok = frame == SNAP_NO_FRAME || frame == SNAP_ZERO_FRAME || frame < s->nframes;
+        }
+    }
+    free(seen);
+    return ok;
+}
+
+/* Map a snapshot and check its header, checksums and sections */
+int snapshot_map(Snapshot* s, const char* path, char* err, size_t errlen) {
+    memset(s, 0, sizeof(*s));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return snap_fail(err, errlen, path, "cannot open");
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapHeader)) {
+        close(fd);
+        return snap_fail(err, errlen, path, "not a snapshot");
+    }
+    void* base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return snap_fail(err, errlen, path, "cannot map");
+    s->base = base;
+    s->size = (size_t)st.st_size;
+    s->hdr = base;
+
+    const SnapHeader* hdr = s->hdr;
+    s->checksum = hdr->checksum;
+    const char* msg = NULL;
+    if (memcmp(hdr->magic, SNAP_MAGIC, 8) != 0) {
+        msg = "not a snapshot";
+    } else if (hdr->version != SNAP_VERSION) {
+        msg = "unsupported snapshot version";
+    } else if (hdr->size != s->size ||
+               hdr->nsections > (s->size - sizeof(SnapHeader)) / sizeof(SnapSection)) {
+        msg = "truncated snapshot";
+    } else if (snapshot_xxh64(s->base + SNAP_HASHED_FROM, s->size - SNAP_HASHED_FROM) != hdr->checksum) {
+        msg = "checksum mismatch";
+    } else if (hdr->flags & SNAP_SHA256) {
+        uint8_t digest[32];
+        snapshot_sha256(s->base + SNAP_HASHED_FROM, s->size - SNAP_HASHED_FROM, digest);
+        if (memcmp(digest, hdr->sha256, 32) != 0) msg = "SHA-256 mismatch";
+    }
+
+    /* Sections of kinds this version does not know are skipped */
+    const SnapSection* table = (const SnapSection*)(const void*)(s->base + sizeof(SnapHeader));
+    for (uint32_t i = 0; !msg && i < hdr->nsections; i++) {
+        const SnapSection* sec = &table[i];
+        const uint8_t* data = s->base + sec->offset;
+        size_t record = sec->kind == SNAP_CPU ? sizeof(SnapCPU) :
+                        sec->kind == SNAP_CLOCK ? sizeof(SnapClock) :
+                        sec->kind == SNAP_PROCESS ? sizeof(SnapProcess) :
+                        sec->kind == SNAP_IO ? sizeof(SnapIO) :
+                        sec->kind == SNAP_MEMORY ? PAGE_SIZE : 0;
+        if (sec->offset % SNAP_ALIGN || sec->offset > s->size || sec->size > s->size - sec->offset ||
+            (record && sec->size != (uint64_t)record * sec->count)) {
+            msg = "corrupt section table";
+            break;
+        }
+        switch (sec->kind) {
+            case SNAP_CPU: s->cpu = (const SnapCPU*)(const void*)data; break;
+            case SNAP_CLOCK: s->clock = (const SnapClock*)(const void*)data; break;
+            case SNAP_PROCESS:
+                s->procs = (const SnapProcess*)(const void*)data;
+                s->nprocs = sec->count;
+                break;
+            case SNAP_IO:
+                s->io = (const SnapIO*)(const void*)data;
+                if (sec->count != s->nprocs) msg = "corrupt section table";
+                break;
+            case SNAP_MEMORY:
+                s->frames = data;
+                s->nframes = sec->count;
+                break;
+        }
+    }
+    if (!msg && (!s->cpu || !s->clock || !s->procs || !s->io || !s->frames)) msg = "missing section";
+    if (!msg && !snapshot_check(s)) msg = "inconsistent snapshot";
+    if (msg) {
+        snapshot_unmap(s);
+        return snap_fail(err, errlen, path, msg);
+    }
+    return 0;
+}
+
+static Process* proc_at(VM* vm, uint32_t pid) {
+    return pid ? vm->procs[pid] : NULL;
+}
+
+/* Replace the processes and memory of the machine with those of s,
+ * pointing recs at each process's records. Returns the base the
+ * snapshot's text ids are moved to, for snapshot_link.
+ */
+uint32_t snapshot_load(VM* vm, const Snapshot* s, SnapRecord* recs) {
+    for (uint32_t pid = 1; pid < MAX_PROCS; pid++) {
+        if (vm->procs[pid]) proc_free(vm, vm->procs[pid]);
+    }
+    code_flush(vm);
+
+    /* The frames, each held by the restore until the pages take theirs */
+    uint8_t** frames = snap_calloc(s->nframes ? s->nframes : 1, sizeof(uint8_t*));
+    for (uint32_t i = 0; i < s->nframes; i++) {
+        frames[i] = frame_alloc(vm);
+        memcpy(frames[i], s->frames + (size_t)i * PAGE_SIZE, PAGE_SIZE);
+    }
+    for (uint32_t i = 0; i < s->nprocs; i++) {
+        const SnapProcess* r = &s->procs[i];
+        Process* p = proc_create_at(vm, r->pid);
+        for (uint32_t page = 0; page < NUM_PAGES; page++) {
+            uint32_t n = r->frame[page];
+            uint8_t* frame = n == SNAP_NO_FRAME ? NULL : n == SNAP_ZERO_FRAME ? vm->zero_frame : frames[n];
+            if (frame) frame_ref(frame);
+            p->pt[page].frame = frame;
+            p->pt[page].flags = r->pte_flags[page];
+        }
+        recs[r->pid].proc = r;
+        recs[r->pid].io = &s->io[i];
+    }
+    for (uint32_t i = 0; i < s->nframes; i++) frame_unref(vm, frames[i]);
+    free(frames);
+    return vm->next_text_id;
+}
+
+static int link_ok(VM* vm, uint32_t pid) {
+    return pid == 0 || (pid < MAX_PROCS && vm->procs[pid]);
+}
+
+/* Give p the state in its records, its links pointing at the processes
+ * now in vm. sibling_prev is left to the caller, which sees all the
+ * siblings. Text ids keep their equalities under text_base.
+ */
+void snapshot_link_process(VM* vm, Process* p, const SnapProcess* r, const SnapIO* io,
+                           uint32_t text_base) {
+    p->ppid = r->ppid;
+    p->state = (ProcState)r->state;
+    p->exit_status = r->exit_status;
+    p->text_id = text_base + r->text_id;
+    if (p->text_id > vm->next_text_id) vm->next_text_id = p->text_id;
+    p->brk = r->brk;
+    p->level = (uint8_t)r->level;
+    p->epoch = r->epoch;
+    p->sleep_start = r->sleep_start;
+    memcpy(p->cpu.gpr, r->gpr, sizeof(r->gpr));
+    p->cpu.pc = r->pc;
+    p->cpu.sp = r->sp;
+    p->cpu.flags.zero = r->flags[0];
+    p->cpu.flags.carry = r->flags[1];
+    p->cpu.flags.sign = r->flags[2];
+    p->cpu.flags.overflow = r->flags[3];
+    p->cpu.mode = r->mode;
+    files_restore(vm, p, (uint16_t)io->fd_open);
+    p->ring_addr = io->ring_addr;
+    p->ring_entries = io->ring_entries;
+    p->parent = proc_at(vm, r->ppid);
+    p->children = proc_at(vm, r->first_child);
+    p->zombies = proc_at(vm, r->first_zombie);
+    p->sibling = proc_at(vm, r->sibling);
+    p->sibling_prev = NULL;
+    p->next = proc_at(vm, r->run_next);
+}
+
+/* Rebuild the run queues from the next links of the processes, and the
+ * machine state from cpu and clock. The code caches are the caller's.
+ * Blocked processes are queued too.
+ */
+void snapshot_link_machine(VM* vm, const SnapCPU* cpu, const SnapClock* clock) {
+    vm->run_mask = 0;
+    for (uint32_t level = 0; level < SCHED_LEVELS; level++) {
+        Process* p = proc_at(vm, cpu->run_head[level]);
+        vm->run_head[level] = vm->run_tail[level] = p;
+        if (!p) continue;
+        vm->run_mask |= 1u << level;
+        for (uint32_t n = 0; p->next && n < vm->nprocs; n++) p = p->next;
+        vm->run_tail[level] = p;
+        p->next = NULL;
+    }
+
+    vm->next_pid = cpu->next_pid;
+    vm->exit_status = cpu->exit_status;
+    vm->fault = (FaultKind)cpu->fault;
+    vm->fault_addr = cpu->fault_addr;
+    vm->stopped = (VMStatus)cpu->stopped;
+    vm->icount = clock->icount;
+    vm->slice_end = clock->slice_end;
+    vm->boost_at = clock->boost_at;
+    vm->sched_epoch = clock->sched_epoch;
+
+    Process* running = proc_at(vm, cpu->running);
+    Process* init = vm->procs[1];
+    vm->proc = running;
+    vm->cpu = running ? &running->cpu : &init->cpu;
+    vm->tlb = running ? running->tlb : init->tlb;
+    vm->pt = running ? running->pt : NULL;
+    vm->text_id = running ? running->text_id : 0;
+
+    /* What a blocked process waited on may not be there any more; its
+     * call runs again and blocks again if it has to
+     */
+    for (uint32_t pid = 1, seen = 0; seen < vm->nprocs; pid++) {
+        Process* p = vm->procs[pid];
+        if (!p) continue;
+        seen++;
+        if (p->state == PROC_BLOCKED && p != running) proc_enqueue(vm, p);
+    }
+}
+
+/* Give every process the state in its records and rebuild the lists
+ * linking them, then the machine state in cpu and clock. Returns -1,
+ * changing nothing, if a process has no records or they name a process
+ * that is not there.
+ */
+int snapshot_link(VM* vm, const SnapRecord* recs, const SnapCPU* cpu, const SnapClock* clock,
+                  uint32_t text_base) {
+    int ok = link_ok(vm, cpu->running);
+    for (uint32_t level = 0; level < SCHED_LEVELS; level++) ok = ok && link_ok(vm, cpu->run_head[level]);
+    for (uint32_t pid = 1; pid < MAX_PROCS && ok; pid++) {
+        if (!vm->procs[pid]) continue;
+        const SnapProcess* r = recs[pid].proc;
+        ok = r && link_ok(vm, r->ppid) && link_ok(vm, r->first_child) && link_ok(vm, r->first_zombie) &&
+             link_ok(vm, r->sibling) && link_ok(vm, r->run_next);
+    }
+    if (!ok || !vm->procs[1]) return -1;
+
+    for (uint32_t pid = 1; pid < MAX_PROCS; pid++) {
+        Process* p = vm->procs[pid];
+        if (!p) continue;
+        snapshot_link_process(vm, p, recs[pid].proc, recs[pid].io, text_base);
+        if (p->state == PROC_ZOMBIE) mem_release(vm, p->pt);
+    }
+    for (uint32_t pid = 1; pid < MAX_PROCS; pid++) {
+        Process* p = vm->procs[pid];
+        if (p && p->sibling && p->state != PROC_ZOMBIE) p->sibling->sibling_prev = p;
+    }
+    snapshot_link_machine(vm, cpu, clock);
+    return 0;
+}
+
+/* Replace the machine's state with the snapshot at path. The engine
+ * settings are kept. On error the VM is left as it was.
+ */
+int vm_restore(VM* vm, const char* path, char* err, size_t errlen) {
+    Snapshot s;
+    if (snapshot_map(&s, path, err, errlen) < 0) return -1;
+    SnapRecord* recs = snap_calloc(MAX_PROCS, sizeof(SnapRecord));
+    uint32_t text_base = snapshot_load(vm, &s, recs);
+    snapshot_link(vm, recs, s.cpu, s.clock, text_base);
+    free(recs);
+    snapshot_unmap(&s);
+    return 0;
+}
+
+/* ---- JSON export ---- */
+
+static const char* state_names[] = {"ready", "running", "waiting", "zombie", "blocked"};
+
+/* Print the snapshot at path as JSON, laid out after the spec's state
+ * artifact (Appendix B). Meant for reading, not for restoring from.
+ */
+int snapshot_export_json(const char* path, FILE* out, char* err, size_t errlen) {
+    Snapshot s;
+    if (snapshot_map(&s, path, err, errlen) < 0) return -1;
+
+    fprintf(out, "{\n  \"version\": %u,\n  \"checksum\": \"xxh64:%016llx\",\n", s.hdr->version,
+            (unsigned long long)s.hdr->checksum);
+    if (s.hdr->flags & SNAP_SHA256) {
+        fprintf(out, "  \"sha256\": \"");
+        for (int i = 0; i < 32; i++) fprintf(out, "%02x", s.hdr->sha256[i]);
+        fprintf(out, "\",\n");
+    }
+    fprintf(out, "  \"modules\": {\n");
+    fprintf(out, "    \"cpu\": {\"current_pid\": %u, \"status\": \"%s\", \"exit_status\": %d, "
+                 "\"fault\": \"%s\", \"fault_addr\": %u},\n",
+            s.cpu->running, vm_status_name((VMStatus)s.cpu->stopped), s.cpu->exit_status,
+            fault_name((FaultKind)s.cpu->fault), s.cpu->fault_addr);
+    fprintf(out, "    \"clock\": {\"system_time\": %lld, \"instructions\": %llu, \"slice_end\": %llu, "
+                 "\"boost_at\": %llu},\n",
+            (long long)s.clock->host_time, (unsigned long long)s.clock->icount,
+            (unsigned long long)s.clock->slice_end, (unsigned long long)s.clock->boost_at);
+
+    fprintf(out, "    \"process\": {\n      \"next_pid\": %u,\n      \"processes\": {", s.cpu->next_pid);
+    for (uint32_t i = 0; i < s.nprocs; i++) {
+        const SnapProcess* r = &s.procs[i];
+        fprintf(out, "%s\n        \"%u\": {\"ppid\": %u, \"state\": \"%s\", \"exit_status\": %d, "
+                     "\"level\": %u, \"brk\": %u, \"fd_open\": %u,\n          \"registers\": {",
+                i ? "," : "", r->pid, r->ppid, state_names[r->state], r->exit_status, r->level, r->brk,
+                s.io[i].fd_open);
+        for (int n = 0; n < NUM_GPRS; n++) fprintf(out, "\"r%d\": %u, ", n, r->gpr[n]);
+        fprintf(out, "\"pc\": %u, \"sp\": %u},\n", r->pc, r->sp);
+        fprintf(out, "          \"flags\": {\"zero\": %u, \"carry\": %u, \"sign\": %u, \"overflow\": %u}, "
+                     "\"mode\": \"%s\",\n          \"pages\": {",
+                r->flags[0], r->flags[1], r->flags[2], r->flags[3], r->mode == MODE_KERNEL ? "KERNEL" : "USER");
+        int first = 1;
+        for (uint32_t page = 0; page < NUM_PAGES; page++) {
+            if (!r->pte_flags[page]) continue;
+            fprintf(out, "%s\"0x%02x\": {\"flags\": %u, \"frame\": ", first ? "" : ", ", page, r->pte_flags[page]);
+            if (r->frame[page] == SNAP_ZERO_FRAME) {
+                fprintf(out, "\"zero\"}");
+            } else if (r->frame[page] == SNAP_NO_FRAME) {
+                fprintf(out, "null}");
+            } else {
+                fprintf(out, "%u}", r->frame[page]);
+            }
+            first = 0;
+        }
+        fprintf(out, "}}");
+    }
+    fprintf(out, "\n      }\n    },\n");
+
+    fprintf(out, "    \"memory\": {\n      \"frames\": [");
+    for (uint32_t i = 0; i < s.nframes; i++) {
+        fprintf(out, "%s\n        \"", i ? "," : "");
+        for (uint32_t b = 0; b < PAGE_SIZE; b++) fprintf(out, "%02x", s.frames[(size_t)i * PAGE_SIZE + b]);
+        fprintf(out, "\"");
+    }
+    fprintf(out, "\n      ]\n    }\n  }\n}\n");
+    snapshot_unmap(&s);
+    return 0;
+}
@@ -0,0 +1,110 @@
+/* UCVM CPU Engine - snapshot records shared with the journal
+ * Internal header: the records a snapshot stores for the machine and
+ * each process, and the steps of restoring them. journal.c logs the
+ * same records as they change, so replaying a journal is restoring its
+ * snapshot with some records swapped for newer ones, and checkpoint.c
+ * keeps them in memory.
+ */
+
+#ifndef UCVM_SNAPSHOT_H
+#define UCVM_SNAPSHOT_H
+
+#include "ucvm.h"
+
+/* Which process runs, which run next, and why the machine stopped */
+typedef struct {
+    uint32_t running;           /* pid, 0 if none */
+    uint32_t next_pid;
+    uint32_t run_head[SCHED_LEVELS];
+    int32_t exit_status;
+    uint32_t fault;
+    uint32_t fault_addr;
+    uint32_t stopped;           /* VM.stopped */
+} SnapCPU;
+
+typedef struct {
+    uint64_t icount;
+    uint64_t slice_end;
+    uint64_t boost_at;
+    uint32_t sched_epoch;
+    uint32_t reserved;
+    int64_t host_time;          /* Unix time the snapshot was taken */
+} SnapClock;
+
+/* One process. The lists linking processes are stored as pids, 0
+ * ending each.
+ */
+typedef struct {
+    uint32_t pid;
+    uint32_t ppid;
+    uint32_t state;
+    int32_t exit_status;
+    uint32_t text_id;
+    uint32_t brk;
+    uint32_t level;
+    uint32_t epoch;
+    uint64_t sleep_start;
+    uint32_t first_child;
+    uint32_t first_zombie;
+    uint32_t sibling;
+    uint32_t run_next;
+    uint32_t gpr[NUM_GPRS];
+    uint32_t pc;
+    uint32_t sp;
+    uint8_t flags[4];           /* zero, carry, sign, overflow */
+    uint8_t mode;
+    uint8_t reserved[3];
+    uint32_t frame[NUM_PAGES];  /* frame number in the memory section */
+    uint8_t pte_flags[NUM_PAGES];
+} SnapProcess;
+
+/* The fields of a SnapProcess before its page table */
+#define SNAP_PROCESS_HEAD offsetof(SnapProcess, frame)
+
+/* Descriptors of one process, in the order of the process section */
+typedef struct {
+    uint32_t pid;
+    uint32_t fd_open;
+    uint32_t ring_addr;
+    uint32_t ring_entries;
+} SnapIO;
+
+_Static_assert(SNAP_PROCESS_HEAD % 8 == 0, "snapshot records are 8-byte aligned");
+_Static_assert(sizeof(SnapProcess) % 8 == 0, "snapshot records are 8-byte aligned");
+
+/* The latest records of one process, read only up to SNAP_PROCESS_HEAD */
+typedef struct {
+    const SnapProcess* proc;
+    const SnapIO* io;
+} SnapRecord;
+
+/* A snapshot mapped read-only, with its sections located */
+typedef struct {
+    const uint8_t* base;
+    size_t size;
+    const struct SnapHeader* hdr;
+    const SnapCPU* cpu;
+    const SnapClock* clock;
+    const SnapProcess* procs;
+    const SnapIO* io;
+    const uint8_t* frames;
+    uint32_t nprocs;
+    uint32_t nframes;
+    uint64_t checksum;
+} Snapshot;
+
+uint64_t snapshot_xxh64(const void* data, size_t len);
+void snapshot_save_machine(const VM* vm, SnapCPU* cpu, SnapClock* clock);
+void snapshot_save_head(SnapProcess* r, SnapIO* io, const Process* p);
+int snapshot_write(VM* vm, const char* path, uint32_t flags, uint64_t* checksum, uint64_t* size,
+                   char* err, size_t errlen);
+int snapshot_map(Snapshot* s, const char* path, char* err, size_t errlen);
+void snapshot_unmap(Snapshot* s);
+uint32_t snapshot_load(VM* vm, const Snapshot* s, SnapRecord* recs);
+int snapshot_link(VM* vm, const SnapRecord* recs, const SnapCPU* cpu, const SnapClock* clock,
+                  uint32_t text_base);
+void snapshot_link_process(VM* vm, Process* p, const SnapProcess* r, const SnapIO* io,
+                           uint32_t text_base);
+void snapshot_link_machine(VM* vm, const SnapCPU* cpu, const SnapClock* clock);
+
+#endif
@@ -0,0 +1,405 @@
+/* UCVM CPU Engine - system calls (spec section 5.3)
+ * Calling convention: r0 = syscall number, r1-r3 = arguments,
+ * result returned in r0 (negative errno on failure).
+ */
+
+#include <sys/uio.h>
+#include "exec.h"
+
+#define HEAP_PAGE_FIRST (HEAP_BASE >> PAGE_SHIFT)
+#define HEAP_PAGE_END   (STACK_BASE >> PAGE_SHIFT)
+
+/* Handlers take the argument registers r1-r3 and return the value for
+ * r0. Each one is a plain function behind a dense table indexed by the
+ * syscall number, so a trap costs one bounds check and an indirect call.
+ */
+typedef int32_t (*SyscallFn)(VM* vm, uint32_t a1, uint32_t a2, uint32_t a3);
+
+/* Returned by a handler whose process has to wait, see do_syscall */
+#define SYSCALL_RESTART INT32_MIN
+
+/* A file call that could not go on without blocking blocks */
+static int32_t blocking(int32_t result) {
+    return result == -UCVM_EAGAIN ? SYSCALL_RESTART : result;
+}
+
+static int fd_valid(const VM* vm, uint32_t fd) {
+    return fd < MAX_FDS && (vm->proc->fd_open & (1u << fd));
+}
+
+static int32_t sys_nosys(VM* vm, uint32_t a1, uint32_t a2, uint32_t a3) {
+    (void)vm; (void)a1; (void)a2; (void)a3;
+    return -UCVM_ENOSYS;
+}
+
+/* exit(status): the table marks it as ending the process, r0 is left
+ * alone. vm_run tears the process down.
+ */
+static int32_t sys_exit(VM* vm, uint32_t status, uint32_t a2, uint32_t a3) {
+    (void)a2; (void)a3;
+    vm->proc->exit_status = (int32_t)status;
+    return 0;
+}
+
+/* fork(): the parent gets the child's pid, the child 0 */
+static int32_t sys_fork(VM* vm, uint32_t a1, uint32_t a2, uint32_t a3) {
+    (void)a1; (void)a2; (void)a3;
+    return proc_fork(vm);
+}
+
+/* exec(path): programs are not loaded from files yet */
+static int32_t sys_exec(VM* vm, uint32_t path, uint32_t a2, uint32_t a3) {
+    (void)vm; (void)path; (void)a2; (void)a3;
+    return -UCVM_ENOENT;
+}
+
+/* wait(): r0 = pid of an exited child and r1 = its status. Blocks the
+ * process until a child exits if none has yet.
+ */
+static int32_t sys_wait(VM* vm, uint32_t a1, uint32_t a2, uint32_t a3) {
+    (void)a1; (void)a2; (void)a3;
+    return proc_wait(vm);
+}
+
+static int32_t sys_getpid(VM* vm, uint32_t a1, uint32_t a2, uint32_t a3) {
+    (void)a1; (void)a2; (void)a3;
+    return (int32_t)vm->proc->pid;
+}
+
+static int32_t sys_yield(VM* vm, uint32_t a1, uint32_t a2, uint32_t a3) {
+    (void)a1; (void)a2; (void)a3;
+    proc_yield(vm);
+    return 0;
+}
+
+/* Copy a NUL-terminated path out of guest memory. Returns 0 or -errno. */
+static int32_t copy_path(VM* vm, uint32_t addr, char* path) {
+    for (uint32_t n = 0; n < FS_PATH_MAX;) {
+        uint32_t chunk = PAGE_SIZE - (addr & PAGE_MASK);
+        if (chunk > FS_PATH_MAX - n) chunk = FS_PATH_MAX - n;
+        if (!mem_read(vm, addr, path + n, chunk)) return -UCVM_EFAULT;
+        if (memchr(path + n, 0, chunk)) return 0;
+        n += chunk;
+        addr += chunk;
+    }
+    return -UCVM_ENAMETOOLONG;
+}
+
+/* open(path, flags): the lowest free descriptor, see UCVM_O_ for flags */
+static int32_t sys_open(VM* vm, uint32_t path, uint32_t flags, uint32_t a3) {
+    (void)a3;
+    char name[FS_PATH_MAX];
+    int32_t err = copy_path(vm, path, name);
+    if (err < 0) return err;
+    uint32_t fd = 0;
+    while (fd < MAX_FDS && (vm->proc->fd_open & (1u << fd))) fd++;
+    if (fd == MAX_FDS) return -UCVM_EMFILE;
+    File* f;
+    err = fs_open(vm, name, flags, &f);
+    if (err < 0) return err;
+    vm->proc->files[fd] = f;
+    vm->proc->fd_open |= (uint16_t)(1u << fd);
+    return (int32_t)fd;
+}
+
+static int32_t sys_close(VM* vm, uint32_t fd, uint32_t a2, uint32_t a3) {
+    (void)a2; (void)a3;
+    if (!fd_valid(vm, fd)) return -UCVM_EBADF;
+    vm->proc->fd_open &= ~(1u << fd);
+    if (vm->proc->files[fd]) file_close(vm, vm->proc->files[fd]);
+    vm->proc->files[fd] = NULL;
+    return 0;
+}
+
+/* read(fd, buf, len): from a file, or from stdin. A file reads straight
+ * into the guest's pages.
+ */
+static int32_t sys_read(VM* vm, uint32_t fd, uint32_t buf, uint32_t len) {
+    if (!fd_valid(vm, fd)) return -UCVM_EBADF;
+    File* f = vm->proc->files[fd];
+    if (!f && fd != 0) return -UCVM_EBADF;
+    if (len > MEM_SIZE) return -UCVM_EFAULT;
+    if (f) {
+        struct iovec iov[MEM_IOV_MAX];
+        int niov = mem_iov(vm, buf, len, PTE_WRITE, iov);
+        if (niov < 0) return -UCVM_EFAULT;
+        int32_t n = file_read(vm, f, iov, niov);
+        if (n > 0) code_note_write(vm, buf, (uint32_t)n);
+        return blocking(n);
+    }
+    uint8_t data[MEM_SIZE];
+    int32_t n = replay_read(vm, 0, data, len);
+    if (n < 0) return -UCVM_EBADF;
+    if (!mem_write(vm, buf, data, (uint32_t)n)) return -UCVM_EFAULT;
+    return n;
+}
+
+/* write(fd, buf, len): to a file, straight from the guest's pages, or to
+ * stdout or stderr
+ */
+static int32_t sys_write(VM* vm, uint32_t fd, uint32_t buf, uint32_t len) {
+    if (!fd_valid(vm, fd)) return -UCVM_EBADF;
+    File* f = vm->proc->files[fd];
+    if (!f && fd == 0) return -UCVM_EBADF;
+    if (len > MEM_SIZE) return -UCVM_EFAULT;
+    if (f) {
+        struct iovec iov[MEM_IOV_MAX];
+        int niov = mem_iov(vm, buf, len, PTE_READ, iov);
+        return niov < 0 ? -UCVM_EFAULT : blocking(file_write(vm, f, iov, niov));
+    }
+    uint8_t data[MEM_SIZE];
+    if (!mem_read(vm, buf, data, len)) return -UCVM_EFAULT;
+    int32_t n = replay_write(vm, (int)fd, data, len);
+    return n < 0 ? -UCVM_EBADF : n;
+}
+
+/* seek(fd, offset, whence): whence 0 is from the start, 1 from the
+ * current offset, 2 from the end. The standard streams are not seekable.
+ */
+static int32_t sys_seek(VM* vm, uint32_t fd, uint32_t offset, uint32_t whence) {
+    if (!fd_valid(vm, fd)) return -UCVM_EBADF;
+    if (!vm->proc->files[fd]) return -UCVM_ESPIPE;
+    return file_seek(vm, vm->proc->files[fd], (int32_t)offset, whence);
+}
+
+/* unlink(path): remove a file, or an empty directory */
+static int32_t sys_unlink(VM* vm, uint32_t path, uint32_t a2, uint32_t a3) {
+    (void)a2; (void)a3;
+    char name[FS_PATH_MAX];
+    int32_t err = copy_path(vm, path, name);
+    return err < 0 ? err : fs_unlink(vm, name);
+}
+
+static int32_t sys_mkdir(VM* vm, uint32_t path, uint32_t a2, uint32_t a3) {
+    (void)a2; (void)a3;
+    char name[FS_PATH_MAX];
+    int32_t err = copy_path(vm, path, name);
+    return err < 0 ? err : fs_mkdir(vm, name);
+}
+
+/* pipe(): r0 = the read end and r1 = the write end, the lowest two free
+ * descriptors
+ */
+static int32_t sys_pipe(VM* vm, uint32_t a1, uint32_t a2, uint32_t a3) {
+    (void)a1; (void)a2; (void)a3;
+    Process* p = vm->proc;
+    uint32_t rfd = 0, wfd;
+    while (rfd < MAX_FDS && (p->fd_open & (1u << rfd))) rfd++;
+    for (wfd = rfd + 1; wfd < MAX_FDS && (p->fd_open & (1u << wfd)); wfd++) {}
+    if (wfd >= MAX_FDS) return -UCVM_EMFILE;
+    fs_pipe(vm, &p->files[rfd], &p->files[wfd]);
+    p->fd_open |= (uint16_t)((1u << rfd) | (1u << wfd));
+    vm->cpu->gpr[1] = wfd;
+    return (int32_t)rfd;
+}
+
+/* splice(fd_in, fd_out, len): move up to len bytes from one file to
+ * another, at least one of them a pipe, without copying them through
+ * guest memory
+ */
+static int32_t sys_splice(VM* vm, uint32_t fd_in, uint32_t fd_out, uint32_t len) {
+    if (!fd_valid(vm, fd_in) || !fd_valid(vm, fd_out)) return -UCVM_EBADF;
+    File* in = vm->proc->files[fd_in];
+    File* out = vm->proc->files[fd_out];
+    if (!in || !out) return -UCVM_EINVAL;
+    return blocking(file_splice(vm, in, out, len));
+}
+
+/* brk(addr): move the end of the heap within the heap segment. Pages
+ * above the old break are mapped zero-filled and pages above the new
+ * one unmapped. Returns the break, unchanged if addr is 0 or invalid.
+ */
+static int32_t sys_brk(VM* vm, uint32_t addr, uint32_t a2, uint32_t a3) {
+    (void)a2; (void)a3;
+    if (addr < HEAP_BASE || addr > STACK_BASE) return (int32_t)vm->proc->brk;
+    uint32_t old_end = (vm->proc->brk + PAGE_MASK) >> PAGE_SHIFT;
+    uint32_t new_end = (addr + PAGE_MASK) >> PAGE_SHIFT;
+    if (new_end > old_end) mem_map(vm, old_end, new_end - old_end, PTE_READ | PTE_WRITE | PTE_USER);
+    if (new_end < old_end) mem_unmap(vm, new_end, old_end - new_end);
+    vm->proc->brk = addr;
+    return (int32_t)addr;
+}
+
+/* mmap(addr, len): map zero-filled read/write pages in the heap segment.
+ * addr 0 takes the lowest free run of pages; otherwise addr must be
+ * page-aligned and any pages already mapped there are replaced.
+ */
+static int32_t sys_mmap(VM* vm, uint32_t addr, uint32_t len, uint32_t a3) {
+    (void)a3;
+    uint32_t count = (len + PAGE_MASK) >> PAGE_SHIFT;
+    uint32_t first = addr >> PAGE_SHIFT;
+    if (len == 0 || count > HEAP_PAGE_END - HEAP_PAGE_FIRST) return -UCVM_EINVAL;
+
+    if (addr == 0) {
+        uint32_t run = 0;
+        for (first = HEAP_PAGE_FIRST; first + run < HEAP_PAGE_END && run < count;) {
+            if (vm->pt[first + run].flags) {
+                first += run + 1;
+                run = 0;
+            } else {
+                run++;
+            }
+        }
+        if (run < count) return -UCVM_ENOMEM;
+    } else if ((addr & PAGE_MASK) || first < HEAP_PAGE_FIRST || first + count > HEAP_PAGE_END) {
+        return -UCVM_EINVAL;
+    }
+    mem_map(vm, first, count, PTE_READ | PTE_WRITE | PTE_USER);
+    return (int32_t)(first << PAGE_SHIFT);
+}
+
+static int32_t sys_munmap(VM* vm, uint32_t addr, uint32_t len, uint32_t a3) {
+    (void)a3;
+    uint32_t count = (len + PAGE_MASK) >> PAGE_SHIFT;
+    uint32_t first = addr >> PAGE_SHIFT;
+    if (len == 0 || (addr & PAGE_MASK) || first < HEAP_PAGE_FIRST ||
+        count > HEAP_PAGE_END - first) {
+        return -UCVM_EINVAL;
+    }
+    mem_unmap(vm, first, count);
+    return 0;
+}
+
+/* Submission rings live in ring.c */
+static int32_t sys_ring_setup(VM* vm, uint32_t entries, uint32_t a2, uint32_t a3) {
+    (void)a2; (void)a3;
+    return ring_setup(vm, entries);
+}
+
+static int32_t sys_ring_enter(VM* vm, uint32_t to_submit, uint32_t a2, uint32_t a3) {
+    (void)a2; (void)a3;
+    return ring_enter(vm, to_submit);
+}
+
+/* Unlisted numbers fall through to sys_nosys. status is what the trap
+ * returns to the engine; only exit stops the process outright.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+static const struct {
+    SyscallFn fn;
+    VMStatus status;
+} syscall_table[SYSCALL_COUNT] = {
+    [0 ... SYSCALL_COUNT - 1] = {sys_nosys, VM_RUNNING},
+    [SYS_FORK] = {sys_fork, VM_RUNNING},
+    [SYS_EXEC] = {sys_exec, VM_RUNNING},
+    [SYS_EXIT] = {sys_exit, VM_EXITED},
+    [SYS_WAIT] = {sys_wait, VM_RUNNING},
+    [SYS_GETPID] = {sys_getpid, VM_RUNNING},
+    [SYS_YIELD] = {sys_yield, VM_RUNNING},
+    [SYS_OPEN] = {sys_open, VM_RUNNING},
+    [SYS_CLOSE] = {sys_close, VM_RUNNING},
+    [SYS_READ] = {sys_read, VM_RUNNING},
+    [SYS_WRITE] = {sys_write, VM_RUNNING},
+    [SYS_SEEK] = {sys_seek, VM_RUNNING},
+    [SYS_UNLINK] = {sys_unlink, VM_RUNNING},
+    [SYS_MKDIR] = {sys_mkdir, VM_RUNNING},
+    [SYS_PIPE] = {sys_pipe, VM_RUNNING},
+    [SYS_SPLICE] = {sys_splice, VM_RUNNING},
+    [SYS_BRK] = {sys_brk, VM_RUNNING},
+    [SYS_MMAP] = {sys_mmap, VM_RUNNING},
+    [SYS_MUNMAP] = {sys_munmap, VM_RUNNING},
+    [SYS_RING_SETUP] = {sys_ring_setup, VM_RUNNING},
+    [SYS_RING_ENTER] = {sys_ring_enter, VM_RUNNING}
+};
+#pragma GCC diagnostic pop
+
+/* Run one call on behalf of a submission ring. Calls that stop, block
+ * or yield the process, fork it, or re-enter a ring cannot be queued,
+ * nor can pipe, whose second result goes in r1 and has no place in a
+ * completion. One that would wait for a pipe fails with -UCVM_EAGAIN.
+ */
+int32_t syscall_call(VM* vm, uint32_t nr, uint32_t a1, uint32_t a2, uint32_t a3) {
+    if (nr >= SYSCALL_COUNT) return -UCVM_ENOSYS;
+    if (nr == SYS_FORK || nr == SYS_WAIT || nr == SYS_YIELD ||
+        nr == SYS_PIPE || nr == SYS_RING_SETUP || nr == SYS_RING_ENTER ||
+        syscall_table[nr].status != VM_RUNNING) {
+        return -UCVM_EINVAL;
+    }
+    int32_t result = syscall_table[nr].fn(vm, a1, a2, a3);
+    return result == SYSCALL_RESTART ? -UCVM_EAGAIN : result;
+}
+
+/* Service a run of n writes to one descriptor with a single host writev.
+ * Buffers within one page are passed to the host in place; others are
+ * staged. res[i] gets what write i would have returned on its own, and
+ * a buffer that cannot be read fails alone without reordering the rest.
+ */
+void syscall_write_batch(VM* vm, uint32_t fd, const uint32_t* buf, const uint32_t* len,
+                         uint32_t n, int32_t* res) {
+    uint8_t data[MEM_SIZE];
+    struct iovec iov[RING_MAX_ENTRIES];
+    uint32_t used = 0, niov = 0, first = 0;
+
+    /* Files take their writes one at a time */
+    if (fd_valid(vm, fd) && vm->proc->files[fd]) {
+        for (uint32_t i = 0; i < n; i++) {
+            res[i] = sys_write(vm, fd, buf[i], len[i]);
+            if (res[i] == SYSCALL_RESTART) res[i] = -UCVM_EAGAIN;
+        }
+        return;
+    }
+
+    for (uint32_t i = 0; i <= n; i++) {
+        int flush = i == n || niov == RING_MAX_ENTRIES ||
+                    (len[i] <= MEM_SIZE && len[i] > MEM_SIZE - used);
+        if (flush && niov) {
+            int32_t done = replay_writev(vm, (int)fd, iov, (int)niov);
+            for (uint32_t j = first, k = 0; j < i; j++) {
+                if (res[j] < 0) continue;
+                uint32_t want = (uint32_t)iov[k++].iov_len;
+                uint32_t got = done < 0 ? 0 : ((size_t)done < want ? (uint32_t)done : want);
+                res[j] = done < 0 ? -UCVM_EBADF : (int32_t)got;
+                if (done > 0) done -= got;
+            }
+            used = niov = 0;
+        }
+        if (flush) first = i;
+        if (i == n) break;
+
+        uint8_t* host = mem_host(vm, buf[i], len[i], PTE_READ);
+        if (!fd_valid(vm, fd) || fd == 0) {
+            res[i] = -UCVM_EBADF;
+        } else if (host) {
+            res[i] = 0;
+            iov[niov].iov_base = host;
+            iov[niov++].iov_len = len[i];
+        } else if (len[i] > MEM_SIZE || !mem_read(vm, buf[i], data + used, len[i])) {
+            res[i] = -UCVM_EFAULT;
+        } else {
+            res[i] = 0;
+            iov[niov].iov_base = data + used;
+            iov[niov++].iov_len = len[i];
+            used += len[i];
+        }
+    }
+}
+
+VMStatus do_syscall(VM* vm) {
+    uint32_t* r = vm->cpu->gpr;
+    uint32_t nr = r[0], a1 = r[1], a2 = r[2], a3 = r[3];
+    uint64_t start = trace_clock();
+    if (unlikely(nr >= SYSCALL_COUNT)) {
+        r[0] = (uint32_t)-UCVM_ENOSYS;
+        trace_push(vm->proc, vm->icount, nr, a1, a2, a3, -UCVM_ENOSYS, start);
+        return VM_RUNNING;
+    }
+    int32_t result = syscall_table[nr].fn(vm, a1, a2, a3);
+    if (unlikely(result == SYSCALL_RESTART)) {
+        /* The process sleeps with PC back on the SYSCALL and r0-r3 as
+         * they were, so once woken it makes the call again from scratch.
+         * It is traced when the call goes through.
+         */
+        proc_sleep(vm, PROC_BLOCKED);
+        vm->cpu->pc -= 1;
+        return VM_YIELD;
+    }
+    trace_push(vm->proc, vm->icount, nr, a1, a2, a3, result, start);
+    VMStatus st = syscall_table[nr].status;
+    if (st != VM_RUNNING) return st;
+    r[0] = (uint32_t)result;
+    /* A blocked or yielding process gives up the CPU; it resumes after
+     * the SYSCALL
+     */
+    return unlikely(vm->proc->state != PROC_RUNNING) ? VM_YIELD : VM_RUNNING;
+}
@@ -0,0 +1,249 @@
+/* UCVM CPU Engine - system call tracing
+ * Every process keeps its last TRACE_ENTRIES system calls in a ring of
+ * fixed-size records: number, arguments, result, error and a timestamp.
+ * The trap fills one record in place and publishes it with a release
+ * store of the ring head, so tracing is always on and costs a few
+ * nanoseconds a call. Nothing locks: a reader on another thread copies
+ * the ring and then drops whatever the writer may have overwritten
+ * during the copy.
+ *
+ * A trace file holds the rings of every process, for trace_print to
+ * format or other tools to read:
+ *   header   magic "UCVMTRCE", version, record size, clock, process count
+ *   then per process: pid, record count, the records oldest first
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "exec.h"
+
+#define TRACE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t clock;         /* TRACE_CLOCK_ */
+    uint32_t nprocs;
+} TraceHeader;
+
+typedef struct {
+    uint32_t pid;
+    uint32_t count;
+} TraceProcess;
+
+static const struct {
+    const char* name;
+    uint8_t nargs;
+} calls[SYSCALL_COUNT] = {
+    [SYS_FORK] = {"fork", 0},
+    [SYS_EXEC] = {"exec", 1},
+    [SYS_EXIT] = {"exit", 1},
+    [SYS_WAIT] = {"wait", 0},
+    [SYS_GETPID] = {"getpid", 0},
+    [SYS_YIELD] = {"yield", 0},
+    [SYS_OPEN] = {"open", 2},
+    [SYS_CLOSE] = {"close", 1},
+    [SYS_READ] = {"read", 3},
+    [SYS_WRITE] = {"write", 3},
+    [SYS_SEEK] = {"seek", 3},
+    [SYS_UNLINK] = {"unlink", 1},
+    [SYS_MKDIR] = {"mkdir", 1},
+    [SYS_PIPE] = {"pipe", 0},
+    [SYS_SPLICE] = {"splice", 3},
+    [SYS_BRK] = {"brk", 1},
+    [SYS_MMAP] = {"mmap", 2},
+    [SYS_MUNMAP] = {"munmap", 2},
+    [SYS_RING_SETUP] = {"ring_setup", 1},
+    [SYS_RING_ENTER] = {"ring_enter", 1}
+};
+
+static const char* error_name(uint16_t err) {
+    switch (err) {
+        case UCVM_ENOENT: return "ENOENT";
+        case UCVM_EIO: return "EIO";
+        case UCVM_EBADF: return "EBADF";
+        case UCVM_ECHILD: return "ECHILD";
+        case UCVM_EAGAIN: return "EAGAIN";
+        case UCVM_ENOMEM: return "ENOMEM";
+        case UCVM_EACCES: return "EACCES";
+        case UCVM_EFAULT: return "EFAULT";
+        case UCVM_EBUSY: return "EBUSY";
+        case UCVM_EEXIST: return "EEXIST";
+        case UCVM_ENOTDIR: return "ENOTDIR";
+        case UCVM_EISDIR: return "EISDIR";
+        case UCVM_EINVAL: return "EINVAL";
+        case UCVM_EMFILE: return "EMFILE";
+        case UCVM_ENOTTY: return "ENOTTY";
+        case UCVM_EFBIG: return "EFBIG";
+        case UCVM_ENOSPC: return "ENOSPC";
+        case UCVM_ESPIPE: return "ESPIPE";
+        case UCVM_EROFS: return "EROFS";
+        case UCVM_EPIPE: return "EPIPE";
+        case UCVM_ENAMETOOLONG: return "ENAMETOOLONG";
+        case UCVM_ENOSYS: return "ENOSYS";
+        case UCVM_ENOTEMPTY: return "ENOTEMPTY";
+        default: return "?";
+    }
+}
+
+/* Copy the records still in p's ring to out, oldest first, and return
+ * how many there are. The VM thread may go on tracing meanwhile.
+ */
+uint32_t trace_read(const Process* p, TraceRecord* out) {
+    const TraceRing* t = &p->trace;
+    uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+    uint64_t from = head > TRACE_ENTRIES ? head - TRACE_ENTRIES : 0;
+    if (from < t->first) from = t->first;
+    for (uint64_t i = from; i < head; i++) out[i - from] = t->rec[i & (TRACE_ENTRIES - 1)];
+
+    /* The writer may be filling the slot of record now - TRACE_ENTRIES */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t now = __atomic_load_n(&t->head, __ATOMIC_RELAXED);
+    uint64_t whole = now >= TRACE_ENTRIES ? now - TRACE_ENTRIES + 1 : 0;
+    if (whole <= from) return (uint32_t)(head - from);
+    if (whole >= head) return 0;
+    memmove(out, out + (whole - from), (head - whole) * sizeof(TraceRecord));
+    return (uint32_t)(head - whole);
+}
+
+/* Drop the records of calls after instruction icount, for a machine
+ * returned to an earlier state. The slots they took from older records
+ * stay lost.
+ */
+void trace_rewind(Process* p, uint64_t icount) {
+    TraceRing* t = &p->trace;
+    uint64_t head = t->head;
+    if (head > TRACE_ENTRIES && t->first < head - TRACE_ENTRIES) t->first = head - TRACE_ENTRIES;
+    while (head > t->first && t->rec[(head - 1) & (TRACE_ENTRIES - 1)].icount > icount) head--;
+    __atomic_store_n(&t->head, head, __ATOMIC_RELEASE);
+}
+
+/* A blocked call of p finished with result: wait() gets its child when
+ * the process wakes, long after the trap that was traced
+ */
+void trace_complete(Process* p, int32_t result) {
+    TraceRing* t = &p->trace;
+    if (t->head == t->first) return;
+    TraceRecord* r = &t->rec[(t->head - 1) & (TRACE_ENTRIES - 1)];
+    r->result = result;
+    r->err = result < 0 ? (uint16_t)-result : 0;
+}
+
+static void format_arg(FILE* out, uint32_t v) {
+    if (v < 0x1000) {
+        fprintf(out, "%u", v);
+    } else {
+        fprintf(out, "0x%04X", v);
+    }
+}
+
+/* One record as a line of text. Timestamps are shown from tsc_base. */
+void trace_format(FILE* out, const TraceRecord* r, uint64_t tsc_base) {
+    const char* name = r->nr < SYSCALL_COUNT ? calls[r->nr].name : NULL;
+    uint32_t nargs = name ? calls[r->nr].nargs : 3;
+    fprintf(out, "icount %llu  pid %u  +%llu  ", (unsigned long long)r->icount, r->pid,
+            (unsigned long long)(r->tsc - tsc_base));
+    if (name) {
+        fprintf(out, "%s(", name);
+    } else {
+        fprintf(out, "syscall_%u(", r->nr);
+    }
+    for (uint32_t i = 0; i < nargs; i++) {
+        if (i) fprintf(out, ", ");
+        format_arg(out, r->args[i]);
+    }
+    fprintf(out, ") = %d", r->result);
+    if (r->err) fprintf(out, " %s", error_name(r->err));
+    fprintf(out, "\n");
+}
+
+/* Save the trace rings of every process to path. Returns 0, or -1 with
+ * a message in err.
+ */
+int trace_write(VM* vm, const char* path, char* err, size_t errlen) {
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        snprintf(err, errlen, "%s: cannot create", path);
+        return -1;
+    }
+    TraceHeader hdr = {"UCVMTRCE", TRACE_VERSION, sizeof(TraceRecord), TRACE_CLOCK, vm->nprocs};
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    TraceRecord recs[TRACE_ENTRIES];
+    for (uint32_t pid = 1, seen = 0; seen < vm->nprocs; pid++) {
+        const Process* p = vm->procs[pid];
+        if (!p) continue;
+        seen++;
+        TraceProcess tp = {pid, trace_read(p, recs)};
+        fwrite(&tp, sizeof(tp), 1, f);
+        fwrite(recs, sizeof(TraceRecord), tp.count, f);
+    }
+    if (ferror(f) | fclose(f)) {
+        snprintf(err, errlen, "%s: write error", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int by_icount(const void* a, const void* b) {
+    const TraceRecord* x = a;
+    const TraceRecord* y = b;
+    if (x->icount != y->icount) return x->icount < y->icount ? -1 : 1;
+    if (x->tsc != y->tsc) return x->tsc < y->tsc ? -1 : 1;
+    return 0;
+}
+
+/* Format a trace file as text, the calls of all processes in the order
+ * they were made. Returns 0, or -1 with a message in err.
+ */
+int trace_print(const char* path, FILE* out, char* err, size_t errlen) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        snprintf(err, errlen, "%s: cannot open", path);
+        return -1;
+    }
+    TraceHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, "UCVMTRCE", 8) != 0 ||
+        hdr.version != TRACE_VERSION || hdr.record_size != sizeof(TraceRecord) ||
+        hdr.nprocs >= MAX_PROCS) {
+        snprintf(err, errlen, "%s: not a trace file", path);
+        fclose(f);
+        return -1;
+    }
+
+    TraceRecord* all = malloc(((size_t)hdr.nprocs * TRACE_ENTRIES + 1) * sizeof(TraceRecord));
+    if (!all) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    size_t n = 0;
+    for (uint32_t i = 0; i < hdr.nprocs; i++) {
+        TraceProcess tp;
+        if (fread(&tp, sizeof(tp), 1, f) != 1 || tp.count > TRACE_ENTRIES) {
+            snprintf(err, errlen, "%s: truncated", path);
+            free(all);
+            fclose(f);
+            return -1;
+        }
+        if (fread(all + n, sizeof(TraceRecord), tp.count, f) != tp.count) {
+            snprintf(err, errlen, "%s: truncated", path);
+            free(all);
+            fclose(f);
+            return -1;
+        }
+        n += tp.count;
+    }
+    fclose(f);
+
+    qsort(all, n, sizeof(TraceRecord), by_icount);
+    uint64_t base = UINT64_MAX;
+    for (size_t i = 0; i < n; i++) {
+        if (all[i].tsc < base) base = all[i].tsc;
+    }
+    fprintf(out, "%zu calls, timestamps in %s\n", n, hdr.clock == TRACE_CLOCK_TSC ? "TSC ticks" : "ns");
+    for (size_t i = 0; i < n; i++) trace_format(out, &all[i], base);
+    free(all);
+    return 0;
+}
@@ -0,0 +1,181 @@
+/* UCVM CPU Engine - breakpoints and watchpoints
+ * A machine with none set has no Traps and runs exactly as it would
+ * without this file. Setting a breakpoint throws away the code caches;
+ * they are rebuilt with a breakpoint op in place of each instruction
+ * that has one, and the JIT ends its blocks before them so that op runs
+ * in the decoded engine. The switch and threaded engines fetch raw
+ * bytes with nothing to patch: the threaded engine only ever fetches
+ * from a page with breakpoints on its slow path, which checks for them,
+ * and the switch engine tests one register before each instruction,
+ * then a bit of a map of breakpoint addresses if it is set.
+ *
+ * A watched page is kept out of every TLB for the kind of access that is
+ * watched, so those accesses miss and reach mem.c, which stops the
+ * instruction before it makes one that overlaps a watched range. Other
+ * accesses to the page run at TLB-miss speed. Host-side accesses for
+ * system calls are not watched.
+ *
+ * A run stops before the instruction that trapped and leaves it to run.
+ * The next run steps over it with traps off in the switch engine, then
+ * goes on in the chosen engine with them armed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "exec.h"
+
+static Traps* traps_get(VM* vm) {
+    if (!vm->traps) {
+        vm->traps = calloc(1, sizeof(Traps));
+        if (!vm->traps) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    return vm->traps;
+}
+
+/* With the last trap deleted the machine goes back to running without */
+static void traps_put(VM* vm) {
+    Traps* t = vm->traps;
+    if (t->nbreaks || t->nwatches) return;
+    free(t);
+    vm->traps = NULL;
+}
+
+static void watch_pages(Traps* t) {
+    memset(t->watch_page, 0, sizeof(t->watch_page));
+    for (uint32_t i = 0; i < t->nwatches; i++) {
+        const Watchpoint* w = &t->watches[i];
+        for (uint32_t page = w->addr >> PAGE_SHIFT; page <= (w->addr + w->len - 1) >> PAGE_SHIFT; page++) {
+            t->watch_page[page] |= w->kind;
+        }
+    }
+}
+
+/* Stop before the instruction at addr, in any process. Returns -1 when
+ * every breakpoint is taken.
+ */
+int trap_break(VM* vm, uint32_t addr) {
+    Traps* t = traps_get(vm);
+    addr &= 0xFFFF;
+    for (uint32_t i = 0; i < t->nbreaks; i++) {
+        if (t->breaks[i] == addr) return 0;
+    }
+    if (t->nbreaks == TRAP_BREAKPOINTS) {
+        traps_put(vm);
+        return -1;
+    }
+    t->breaks[t->nbreaks++] = addr;
+    t->break_map[addr >> 3] |= (uint8_t)(1u << (addr & 7));
+    t->break_page[addr >> PAGE_SHIFT]++;
+    code_flush(vm);
+    return 0;
+}
+
+/* Stop before any instruction that reads (TRAP_READ) or writes
+ * (TRAP_WRITE) a byte of [addr, addr + len), in any process. Returns -1
+ * when every watchpoint is taken or the range is empty or out of memory.
+ */
+int trap_watch(VM* vm, uint32_t addr, uint32_t len, uint8_t kind) {
+    if (len == 0 || addr >= MEM_SIZE || len > MEM_SIZE - addr || !(kind & (TRAP_READ | TRAP_WRITE))) {
+        return -1;
+    }
+    Traps* t = traps_get(vm);
+    if (t->nwatches == TRAP_WATCHPOINTS) {
+        traps_put(vm);
+        return -1;
+    }
+    Watchpoint* w = &t->watches[t->nwatches++];
+    w->addr = addr;
+    w->len = len;
+    w->kind = kind & (TRAP_READ | TRAP_WRITE);
+    watch_pages(t);
+
+    /* tlb_fill leaves watched pages out from now on */
+    for (uint32_t pid = 1, seen = 0; seen < vm->nprocs; pid++) {
+        if (!vm->procs[pid]) continue;
+        seen++;
+        tlb_clear(vm->procs[pid]->tlb);
+    }
+    return 0;
+}
+
+/* Delete the breakpoint at addr and the watchpoints that start there.
+ * Returns -1 if there are none.
+ */
+int trap_delete(VM* vm, uint32_t addr) {
+    Traps* t = vm->traps;
+    int found = 0;
+    if (!t) return -1;
+    for (uint32_t i = 0; i < t->nbreaks; i++) {
+        if (t->breaks[i] == addr) {
+            t->break_map[addr >> 3] &= (uint8_t)~(1u << (addr & 7));
+            t->break_page[addr >> PAGE_SHIFT]--;
+            t->breaks[i] = t->breaks[--t->nbreaks];
+            code_flush(vm);
+            found = 1;
+            break;
+        }
+    }
+    for (uint32_t i = 0; i < t->nwatches;) {
+        if (t->watches[i].addr == addr) {
+            t->watches[i] = t->watches[--t->nwatches];
+            found = 1;
+        } else {
+            i++;
+        }
+    }
+    watch_pages(t);
+    traps_put(vm);
+    return found ? 0 : -1;
+}
+
+/* The TRAP_ kind of breakpoint or watchpoint the last run stopped at,
+ * and its address or the one accessed; 0 if it stopped for another
+ * reason.
+ */
+uint8_t trap_hit(const VM* vm, uint32_t* addr) {
+    const Traps* t = vm->traps;
+    if (!t || !t->hit) return 0;
+    if (addr) *addr = t->hit_addr;
+    return t->hit;
+}
+
+/* Forget the stop the machine is at, for one put in another state. With
+ * step_over the next run begins with the current instruction even if
+ * it traps, as it would after a stop there.
+ */
+void trap_resume(VM* vm, int step_over) {
+    Traps* t = vm->traps;
+    if (!t) return;
+    t->hit = 0;
+    t->step_over = (uint8_t)step_over;
+}
+
+void trap_free(VM* vm) {
+    free(vm->traps);
+    vm->traps = NULL;
+}
+
+/* Called by mem.c on a TLB miss with traps set. Whether the 4-byte access
+ * at addr overlaps a watched range; if so it is recorded as the hit and
+ * mem.c fails the access, which raise_fault turns into a stop.
+ */
+int trap_watch_hit(VM* vm, uint32_t addr, uint8_t kind) {
+    Traps* t = vm->traps;
+    if (addr >= MEM_SIZE) return 0;
+    uint32_t last = addr + 3 < MEM_SIZE ? addr + 3 : MEM_SIZE - 1;
+    if (t->off || !((t->watch_page[addr >> PAGE_SHIFT] | t->watch_page[last >> PAGE_SHIFT]) & kind)) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < t->nwatches; i++) {
+        const Watchpoint* w = &t->watches[i];
+        if ((w->kind & kind) && addr < w->addr + w->len && w->addr <= last) {
+            t->hit = kind;
+            t->hit_addr = addr;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,1059 @@
+/* UCVM CPU Engine
+ * Runs FULL-mode UCVM programs natively instead of simulating them
+ * Compile: gcc -O2 -pthread -o ucvm-cpu *.c
+ * Usage: ./ucvm-cpu run [--engine switch|threaded|unfused|eager|decoded|jit] <program.s>
+ *        ./ucvm-cpu run [--budget n] [--checkpoint file [--sha256]] <program.s | --restore file>
+ *        ./ucvm-cpu run --journal file <program.s | --restore file>
+ *        ./ucvm-cpu run --trace file <program.s>
+ *        ./ucvm-cpu run --mount host_dir:path[:ro] <program.s>
+ *        ./ucvm-cpu debug [--engine name] [-x commands] <program.s>
+ *        ./ucvm-cpu profile [--engine name] [--every n | --hz n] [--folded file] <program.s>
+ *        ./ucvm-cpu snapshot <file>
+ *        ./ucvm-cpu trace <file>
+ *        ./ucvm-cpu batch [-j threads] [--engine name] <program.s>...
+ *        ./ucvm-cpu disasm <program.s>
+ *        ./ucvm-cpu ngrams <program.s> [n]
+ *        ./ucvm-cpu bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ucvm.h"
+
+#define BOLD "\033[1m"
+#define RESET "\033[0m"
+#define CYAN "\033[36m"
+#define GREEN "\033[32m"
+
+#define DEFAULT_BENCH_ITERATIONS 20000000
+
+/* Native equivalent of the memory benchmark: the same loads and stores
+ * as raw host accesses, as the floor for guest memory cost
+ */
+static void host_memory(uint32_t outer) {
+    static volatile uint32_t array[64];
+    for (uint32_t i = 0; i < outer; i++) {
+        for (uint32_t j = 0; j < 64; j++) array[j] += 1;
+    }
+}
+
+/* Benchmark programs; the outer loop count (iterations / scale) is
+ * passed in r1. host, if set, runs the same work natively.
+ */
+typedef struct {
+    const char* name;
+    uint32_t scale;
+    const char* source;
+    void (*host)(uint32_t outer);
+} BenchProgram;
+
+static const BenchProgram bench_programs[] = {
+    {"loop", 1,
+     "    MOV r2, 1\n"
+     "loop:\n"
+     "    SUB r1, r2\n"
+     "    JNZ loop\n"
+     "    HLT\n",
+     NULL},
+    {"arith", 4,
+     "    MOV r2, 1\n"
+     "    MOV r3, 3\n"
+     "    MOV r4, 7\n"
+     "loop:\n"
+     "    MOV r5, 12345\n"
+     "    ADD r4, r5\n"
+     "    MUL r4, r3\n"
+     "    MOV r6, r4\n"
+     "    DIV r6, r3\n"
+     "    ADD r6, r1\n"
+     "    SUB r1, r2\n"
+     "    JNZ loop\n"
+     "    HLT\n",
+     NULL},
+    {"memory", 256,
+     "    MOV r2, 1\n"
+     "    MOV r7, 4\n"
+     "loop:\n"
+     "    MOV r3, array\n"
+     "    MOV r4, 64\n"
+     "inner:\n"
+     "    MOV r5, [r3]\n"
+     "    ADD r5, r2\n"
+     "    MOV [r3], r5\n"
+     "    ADD r3, r7\n"
+     "    SUB r4, r2\n"
+     "    JNZ inner\n"
+     "    SUB r1, r2\n"
+     "    JNZ loop\n"
+     "    HLT\n"
+     ".org 0x8000\n"
+     "array:\n"
+     "    .space 256\n",
+     host_memory},
+    {"call", 2,
+     "    MOV r2, 1\n"
+     "loop:\n"
+     "    CALL work\n"
+     "    SUB r1, r2\n"
+     "    JNZ loop\n"
+     "    HLT\n"
+     "work:\n"
+     "    ADD r3, r2\n"
+     "    RET\n",
+     NULL},
+    {"syscall", 1,
+     "    MOV r2, 1\n"
+     "loop:\n"
+     "    MOV r3, r1\n"
+     "    MOV r0, 4\n"
+     "    SYSCALL\n"
+     "    MOV r1, r3\n"
+     "    SUB r1, r2\n"
+     "    JNZ loop\n"
+     "    HLT\n",
+     NULL},
+    /* write and ring issue the same 8-byte writes, one trap each or
+     * 32 per ring_enter; compare their times rather than their MIPS
+     */
+    {"write", 64,
+     "    MOV r9, r1\n"
+     "    MOV r10, 1\n"
+     "loop:\n"
+     "    MOV r0, 13\n"
+     "    MOV r1, 1\n"
+     "    MOV r2, msg\n"
+     "    MOV r3, 8\n"
+     "    SYSCALL\n"
+     "    SUB r9, r10\n"
+     "    JNZ loop\n"
+     "    HLT\n"
+     ".org 0x8000\n"
+     "msg:\n"
+     "    .string \"ucvm io\\n\"\n",
+     NULL},
+    {"ring", 64,
+     "    MOV r9, r1\n"
+     "    MOV r0, 40\n"
+     "    MOV r1, 32\n"
+     "    SYSCALL\n"
+     "    MOV r8, r0\n"
+     "    MOV r3, 32\n"
+     "    ADD r3, r8\n"
+     "    MOV r5, 32\n"
+     "    MOV r2, 1\n"
+     "    MOV r6, 13\n"
+     "    MOV r7, msg\n"
+     "    MOV r10, 8\n"
+     "    MOV r11, 16\n"
+     "fill:\n"
+     "    MOV [r3], r6\n"
+     "    MOV [r3+4], r2\n"
+     "    MOV [r3+8], r7\n"
+     "    MOV [r3+12], r10\n"
+     "    ADD r3, r11\n"
+     "    SUB r5, r2\n"
+     "    JNZ fill\n"
+     "    MOV r5, 32\n"
+     "    MOV r12, 0\n"
+     "    DIV r9, r5\n"
+     "    JZ done\n"
+     "loop:\n"
+     "    ADD r12, r5\n"
+     "    MOV [r8+4], r12\n"
+     "    MOV r0, 41\n"
+     "    MOV r1, r5\n"
+     "    SYSCALL\n"
+     "    MOV [r8+8], r12\n"
+     "    SUB r9, r2\n"
+     "    JNZ loop\n"
+     "done:\n"
+     "    HLT\n"
+     ".org 0x8000\n"
+     "msg:\n"
+     "    .string \"ucvm io\\n\"\n",
+     NULL},
+    /* fork every child before reaping any, so they all exist at once */
+    {"spawn", 1000,
+     "    MOV r9, r1\n"
+     "    MOV r8, r1\n"
+     "    MOV r2, 1\n"
+     "    MOV r3, 0\n"
+     "fork:\n"
+     "    MOV r0, 0\n"
+     "    SYSCALL\n"
+     "    ADD r0, r3\n"
+     "    JZ child\n"
+     "    SUB r9, r2\n"
+     "    JNZ fork\n"
+     "reap:\n"
+     "    MOV r0, 3\n"
+     "    SYSCALL\n"
+     "    SUB r8, r2\n"
+     "    JNZ reap\n"
+     "    HLT\n"
+     "child:\n"
+     "    MOV r0, 2\n"
+     "    MOV r1, 0\n"
+     "    SYSCALL\n",
+     NULL},
+    /* two processes yielding to each other: one context switch per loop */
+    {"switch", 40,
+     "    MOV r2, 1\n"
+     "    MOV r3, 0\n"
+     "    MOV r0, 0\n"
+     "    SYSCALL\n"
+     "    MOV r8, r0\n"
+     "loop:\n"
+     "    MOV r0, 5\n"
+     "    SYSCALL\n"
+     "    SUB r1, r2\n"
+     "    JNZ loop\n"
+     "    ADD r8, r3\n"
+     "    JZ child\n"
+     "    MOV r0, 3\n"
+     "    SYSCALL\n"
+     "    HLT\n"
+     "child:\n"
+     "    MOV r0, 2\n"
+     "    MOV r1, 0\n"
+     "    SYSCALL\n",
+     NULL}
+};
+
+static const struct {
+    const char* name;
+    Engine engine;
+    uint8_t fuse;
+    uint8_t lazy_flags;
+} engines[] = {
+    {"switch", ENGINE_SWITCH, 0, 0},
+    {"threaded", ENGINE_THREADED, 0, 0},
+    {"unfused", ENGINE_DECODED, 0, 1},
+    {"eager", ENGINE_DECODED, 1, 0},
+    {"decoded", ENGINE_DECODED, 1, 1},
+    {"jit", ENGINE_JIT, 1, 1}
+};
+
+#define NGRAM_TABLE_SIZE 4096
+#define NGRAM_TOP 12
+
+#define BENCH_PROGRAM_COUNT (sizeof(bench_programs) / sizeof(bench_programs[0]))
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+#define DEFAULT_ENGINE 4    /* decoded */
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_engine(const char* name, size_t* index) {
+    for (size_t i = 0; i < ENGINE_COUNT; i++) {
+        if (strcmp(name, engines[i].name) == 0) {
+            *index = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Show CPU state in the same layout as `dump registers` */
+void dump_registers(const VM* vm) {
+    const CPUState* c = vm->cpu;
+    for (int i = 0; i < NUM_GPRS; i++) {
+        printf("r%-2d: 0x%08X%s", i, c->gpr[i], (i % 4 == 3) ? "\n" : "  ");
+    }
+    printf("PC: 0x%04X  SP: 0x%04X  FLAGS: %c%c%c%c  MODE: %s\n",
+           c->pc, c->sp,
+           c->flags.zero ? 'Z' : '-',
+           c->flags.carry ? 'C' : '-',
+           c->flags.sign ? 'S' : '-',
+           c->flags.overflow ? 'O' : '-',
+           c->mode == MODE_KERNEL ? "KERNEL" : "USER");
+}
+
+static void report_status(const VM* vm, VMStatus st) {
+    printf("[%s", vm_status_name(st));
+    if (st == VM_EXITED) printf(" with status %d", vm->exit_status);
+    if (st == VM_FAULT) printf(": %s at 0x%04X", fault_name(vm->fault), vm->fault_addr);
+    printf(" after %llu instructions]\n", (unsigned long long)vm->icount);
+}
+
+/* vm_run with a journal delta every JOURNAL_INTERVAL instructions and
+ * one at the end, then close the journal. Returns -1 with a message in
+ * err if the journal could not be written.
+ */
+static int run_journaled(VM* vm, uint64_t budget, VMStatus* st, char* err, size_t errlen) {
+    int result = 0;
+    for (;;) {
+        uint64_t start = vm->icount;
+        *st = vm_run(vm, budget < JOURNAL_INTERVAL ? budget : JOURNAL_INTERVAL);
+        if (budget != BUDGET_UNLIMITED) budget -= vm->icount - start;
+        if (journal_delta(vm, err, errlen) < 0) {
+            result = -1;
+            break;
+        }
+        if (*st != VM_BUDGET || budget == 0) break;
+    }
+    char close_err[256];
+    if (journal_close(vm, close_err, sizeof(close_err)) < 0 && result == 0) {
+        snprintf(err, errlen, "%s", close_err);
+        result = -1;
+    }
+    return result;
+}
+
+/* Mount a host directory as --mount host_dir:path[:ro] asks */
+static int mount_option(VM* vm, const char* spec, char* err, size_t errlen) {
+    char host[FS_PATH_MAX], path[FS_PATH_MAX];
+    const char* colon = strchr(spec, ':');
+    if (!colon || colon == spec || (size_t)(colon - spec) >= sizeof(host) || strlen(colon + 1) >= sizeof(path)) {
+        snprintf(err, errlen, "%s: expected host_dir:path[:ro]", spec);
+        return -1;
+    }
+    memcpy(host, spec, (size_t)(colon - spec));
+    host[colon - spec] = 0;
+    strcpy(path, colon + 1);
+    size_t len = strlen(path);
+    int readonly = len > 3 && strcmp(path + len - 3, ":ro") == 0;
+    if (readonly) path[len - 3] = 0;
+    return fs_mount(vm, path, host, readonly, err, errlen);
+}
+
+/* Run a program, or resume a snapshot, optionally stopping after a
+ * budget of instructions and saving the machine when the run ends
+ */
+static int cmd_run(int argc, char* argv[]) {
+    size_t engine = DEFAULT_ENGINE;
+    const char* path = NULL;
+    const char* restore = NULL;
+    const char* checkpoint = NULL;
+    const char* journal = NULL;
+    const char* trace = NULL;
+    const char* mounts[FS_MOUNTS];
+    uint32_t nmounts = 0;
+    uint32_t snap_flags = 0;
+    uint64_t budget = BUDGET_UNLIMITED;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            if (parse_engine(argv[++i], &engine) < 0) {
+                fprintf(stderr, "Unknown engine '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+            budget = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--mount") == 0 && i + 1 < argc) {
+            if (nmounts == FS_MOUNTS) {
+                fprintf(stderr, "At most %d mounts\n", FS_MOUNTS);
+                return 1;
+            }
+            mounts[nmounts++] = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint = argv[++i];
+        } else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+            journal = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (strcmp(argv[i], "--sha256") == 0) {
+            snap_flags |= SNAP_SHA256;
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restore = argv[++i];
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!path == !restore) {
+        fprintf(stderr, "Usage: ucvm-cpu run [--engine switch|threaded|unfused|eager|decoded|jit] "
+                        "[--budget n] [--checkpoint file [--sha256]] [--journal file] [--trace file] "
+                        "[--mount host_dir:path[:ro]]... <program.s | --restore file>\n");
+        return 1;
+    }
+
+    Program* prog = malloc(sizeof(Program));
+    VM* vm = malloc(sizeof(VM));
+    char err[256];
+    if (!prog || !vm) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (path && assemble_file(path, prog, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s\n", err);
+        free(prog);
+        free(vm);
+        return 1;
+    }
+
+    vm_init(vm);
+    vm->engine = engines[engine].engine;
+    vm->fuse = engines[engine].fuse;
+    vm->lazy_flags = engines[engine].lazy_flags;
+    if (path) {
+        vm_load(vm, prog);
+    } else if (vm_recover(vm, restore, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s\n", err);
+        vm_destroy(vm);
+        free(prog);
+        free(vm);
+        return 1;
+    }
+    for (uint32_t i = 0; i < nmounts; i++) {
+        if (mount_option(vm, mounts[i], err, sizeof(err)) < 0) {
+            fprintf(stderr, "%s\n", err);
+            vm_destroy(vm);
+            free(prog);
+            free(vm);
+            return 1;
+        }
+    }
+    if (journal && journal_open(vm, journal, snap_flags, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s\n", err);
+        vm_destroy(vm);
+        free(prog);
+        free(vm);
+        return 1;
+    }
+    VMStatus st;
+    if (!journal) {
+        st = vm_run(vm, budget);
+    } else if (run_journaled(vm, budget, &st, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s\n", err);
+        vm_destroy(vm);
+        free(prog);
+        free(vm);
+        return 1;
+    }
+
+    fflush(stdout);
+    report_status(vm, st);
+    dump_registers(vm);
+
+    int status = st == VM_EXITED ? vm->exit_status : (st == VM_HALTED || st == VM_BUDGET ? 0 : 1);
+    if (checkpoint && vm_checkpoint(vm, checkpoint, snap_flags, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s\n", err);
+        status = 1;
+    }
+    if (trace && trace_write(vm, trace, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s\n", err);
+        status = 1;
+    }
+    vm_destroy(vm);
+    free(prog);
+    free(vm);
+    return status;
+}
+
+/* Print a snapshot as JSON */
+static int cmd_snapshot(int argc, char* argv[]) {
+    char err[256];
+    if (argc < 1) {
+        fprintf(stderr, "Usage: ucvm-cpu snapshot <file>\n");
+        return 1;
+    }
+    if (snapshot_export_json(argv[0], stdout, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+    return 0;
+}
+
+/* Print a trace file as text */
+static int cmd_trace(int argc, char* argv[]) {
+    char err[256];
+    if (argc < 1) {
+        fprintf(stderr, "Usage: ucvm-cpu trace <file>\n");
+        return 1;
+    }
+    if (trace_print(argv[0], stdout, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+    return 0;
+}
+
+/* The last n system calls of the running process */
+static void print_trace(const VM* vm, uint32_t n) {
+    TraceRecord recs[TRACE_ENTRIES];
+    uint32_t count = trace_read(vm->proc, recs);
+    uint32_t from = count > n ? count - n : 0;
+    for (uint32_t i = from; i < count; i++) trace_format(stdout, &recs[i], recs[0].tsc);
+    if (!count) printf("No system calls traced\n");
+}
+
+/* A byte of guest memory as the running process maps it, whatever its
+ * permissions. Unmapped and MMIO bytes read as zero.
+ */
+static uint8_t peek(const VM* vm, uint32_t addr) {
+    const uint8_t* frame = vm->pt[(addr & 0xFFFF) >> PAGE_SHIFT].frame;
+    return frame ? frame[addr & PAGE_MASK] : 0;
+}
+
+/* Show memory in the layout of `dump memory` */
+static void dump_memory(const VM* vm, uint32_t addr, uint32_t len) {
+    for (uint32_t off = 0; off < len; off += 16) {
+        printf("%04X ", (addr + off) & 0xFFFF);
+        for (uint32_t i = 0; i < 16 && off + i < len; i++) printf(" %02X", peek(vm, addr + off + i));
+        printf("\n");
+    }
+}
+
+/* Where a debugger command left the machine: how it stopped, or the
+ * instruction it will run next
+ */
+static void report_position(const VM* vm, VMStatus st) {
+    static uint8_t window[MEM_SIZE + MAX_INSN_SIZE];
+    if (vm->stopped || !vm->proc) {
+        report_status(vm, vm->stopped ? vm->stopped : st);
+        return;
+    }
+    uint32_t pc = vm->cpu->pc;
+    char text[64];
+    for (uint32_t i = 0; i < MAX_INSN_SIZE; i++) window[pc + i] = peek(vm, pc + i);
+    disassemble(window, pc, text, sizeof(text));
+    char why[64] = "";
+    uint32_t addr;
+    uint8_t hit = trap_hit(vm, &addr);
+    if (hit & (TRAP_READ | TRAP_WRITE)) {
+        snprintf(why, sizeof(why), "watchpoint: %s 0x%04X, ", hit == TRAP_READ ? "read" : "write", addr);
+    } else if (st == VM_BREAK) {
+        snprintf(why, sizeof(why), "breakpoint: ");
+    }
+    printf("[%spid %u at 0x%04X after %llu instructions]  %s\n", why, vm->proc->pid, pc,
+           (unsigned long long)vm->icount, text);
+}
+
+/* Going back stops short of the last file-system call; say so when a
+ * reverse command ends there
+ */
+static void report_history(const VM* vm, const Debugger* d) {
+    int cut;
+    uint64_t first = debug_first(d, &cut);
+    if (cut && vm->icount == first) {
+        printf("[no history before instruction %llu: the file system has been used since]\n",
+               (unsigned long long)first);
+    }
+}
+
+/* Debug a program, forward and backward, with commands read from stdin
+ * or a script
+ */
+static int cmd_debug(int argc, char* argv[]) {
+    size_t engine = DEFAULT_ENGINE;
+    const char* path = NULL;
+    const char* script = NULL;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            if (parse_engine(argv[++i], &engine) < 0) {
+                fprintf(stderr, "Unknown engine '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+            script = argv[++i];
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!path) {
+        fprintf(stderr, "Usage: ucvm-cpu debug [--engine name] [-x commands] <program.s>\n");
+        return 1;
+    }
+
+    Program* prog = malloc(sizeof(Program));
+    VM* vm = malloc(sizeof(VM));
+    char err[256];
+    if (!prog || !vm) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (assemble_file(path, prog, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s\n", err);
+        free(prog);
+        free(vm);
+        return 1;
+    }
+    FILE* in = script ? fopen(script, "r") : stdin;
+    if (!in) {
+        fprintf(stderr, "Cannot open '%s'\n", script);
+        free(prog);
+        free(vm);
+        return 1;
+    }
+
+    vm_init(vm);
+    vm->engine = engines[engine].engine;
+    vm->fuse = engines[engine].fuse;
+    vm->lazy_flags = engines[engine].lazy_flags;
+    vm_load(vm, prog);
+    Debugger* d = debug_open(vm);
+    int prompt = !script && isatty(0);
+    char line[256];
+
+    for (;;) {
+        if (prompt) printf("(ucvm) ");
+        fflush(stdout);
+        if (!fgets(line, sizeof(line), in)) break;
+        char cmd[32], arg[32], arg2[32], arg3[32];
+        int n = sscanf(line, "%31s %31s %31s %31s", cmd, arg, arg2, arg3);
+        if (n < 1) continue;
+        uint64_t count = n > 1 ? strtoull(arg, NULL, 0) : 1;
+        uint32_t addr = (uint32_t)count;
+
+        if (strcmp(cmd, "step") == 0 || strcmp(cmd, "s") == 0) {
+            report_position(vm, debug_step(d, count));
+        } else if (strcmp(cmd, "continue") == 0 || strcmp(cmd, "c") == 0) {
+            report_position(vm, debug_continue(d));
+        } else if (strcmp(cmd, "reverse-step") == 0 || strcmp(cmd, "rs") == 0) {
+            report_position(vm, debug_reverse_step(d, count));
+            report_history(vm, d);
+        } else if (strcmp(cmd, "reverse-continue") == 0 || strcmp(cmd, "rc") == 0) {
+            report_position(vm, debug_reverse_continue(d));
+            report_history(vm, d);
+        } else if ((strcmp(cmd, "breakpoint") == 0 || strcmp(cmd, "b") == 0) && n > 1) {
+            if (trap_break(vm, addr) < 0) {
+                printf("No more than %d breakpoints\n", TRAP_BREAKPOINTS);
+            } else {
+                printf("Breakpoint at 0x%04X\n", addr);
+            }
+        } else if ((strcmp(cmd, "watch") == 0 || strcmp(cmd, "rwatch") == 0 || strcmp(cmd, "awatch") == 0) &&
+                   n > 1) {
+            uint8_t kind = cmd[0] == 'w' ? TRAP_WRITE : cmd[0] == 'r' ? TRAP_READ : TRAP_READ | TRAP_WRITE;
+            uint32_t len = n > 2 ? (uint32_t)strtoul(arg2, NULL, 0) : 4;
+            if (trap_watch(vm, addr, len, kind) < 0) {
+                printf("Cannot watch %u bytes at 0x%04X (at most %d watchpoints)\n", len, addr, TRAP_WATCHPOINTS);
+            } else {
+                printf("Watchpoint on 0x%04X-0x%04X\n", addr, addr + len - 1);
+            }
+        } else if (strcmp(cmd, "delete") == 0 && n > 1) {
+            if (trap_delete(vm, addr) < 0) printf("No breakpoint or watchpoint at 0x%04X\n", addr);
+        } else if (strcmp(cmd, "dump") == 0 && n > 1 && strcmp(arg, "registers") == 0) {
+            dump_registers(vm);
+        } else if (strcmp(cmd, "dump") == 0 && n > 2 && strcmp(arg, "memory") == 0) {
+            if (vm->proc) {
+                dump_memory(vm, (uint32_t)strtoul(arg2, NULL, 0), n > 3 ? (uint32_t)strtoul(arg3, NULL, 0) : 64);
+            } else {
+                printf("No process is running\n");
+            }
+        } else if (strcmp(cmd, "syscall") == 0 && n > 1 && strcmp(arg, "trace") == 0) {
+            if (vm->proc) {
+                print_trace(vm, n > 2 ? (uint32_t)strtoul(arg2, NULL, 0) : TRACE_ENTRIES);
+            } else {
+                printf("No process is running\n");
+            }
+        } else if (strcmp(cmd, "quit") == 0 || strcmp(cmd, "q") == 0) {
+            break;
+        } else {
+            printf("Unknown command '%s'\n", cmd);
+        }
+    }
+
+    debug_close(d);
+    if (script) fclose(in);
+    vm_destroy(vm);
+    free(prog);
+    free(vm);
+    return 0;
+}
+
+/* Run a program under the sampling profiler and report where it spent
+ * its time
+ */
+static int cmd_profile(int argc, char* argv[]) {
+    size_t engine = DEFAULT_ENGINE;
+    const char* path = NULL;
+    const char* folded = NULL;
+    uint64_t every = 0;
+    uint32_t hz = 0;
+    uint32_t top = 20;
+    uint64_t budget = BUDGET_UNLIMITED;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            if (parse_engine(argv[++i], &engine) < 0) {
+                fprintf(stderr, "Unknown engine '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--every") == 0 && i + 1 < argc) {
+            every = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--hz") == 0 && i + 1 < argc) {
+            hz = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            top = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc) {
+            folded = argv[++i];
+        } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+            budget = strtoull(argv[++i], NULL, 0);
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!path || hz > 1000000) {
+        fprintf(stderr, "Usage: ucvm-cpu profile [--engine name] [--every n | --hz n] [--top n] "
+                        "[--folded file] [--budget n] <program.s>\n");
+        return 1;
+    }
+
+    Program* prog = malloc(sizeof(Program));
+    VM* vm = malloc(sizeof(VM));
+    char err[256];
+    if (!prog || !vm) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (assemble_file(path, prog, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s\n", err);
+        free(prog);
+        free(vm);
+        return 1;
+    }
+
+    vm_init(vm);
+    vm->engine = engines[engine].engine;
+    vm->fuse = engines[engine].fuse;
+    vm->lazy_flags = engines[engine].lazy_flags;
+    vm_load(vm, prog);
+    Profile* p = profile_open(vm, every, hz);
+    VMStatus st = profile_run(p, budget);
+
+    fflush(stdout);
+    report_status(vm, st);
+    profile_report(p, prog, stdout, top);
+    int status = 0;
+    if (folded && profile_write_folded(p, prog, folded, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s\n", err);
+        status = 1;
+    }
+    profile_close(p);
+    vm_destroy(vm);
+    free(prog);
+    free(vm);
+    return status;
+}
+
+/* Run many programs at once, each in its own VM, on a pool of threads */
+static int cmd_batch(int argc, char* argv[]) {
+    size_t engine = DEFAULT_ENGINE;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char** paths = malloc(sizeof(char*) * (argc > 0 ? argc : 1));
+    uint32_t count = 0;
+    if (!paths) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            if (parse_engine(argv[++i], &engine) < 0) {
+                fprintf(stderr, "Unknown engine '%s'\n", argv[i]);
+                free(paths);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = strtol(argv[++i], NULL, 0);
+        } else {
+            paths[count++] = argv[i];
+        }
+    }
+    if (count == 0) {
+        fprintf(stderr, "Usage: ucvm-cpu batch [-j threads] [--engine name] <program.s>...\n");
+        free(paths);
+        return 1;
+    }
+
+    Program* progs = malloc(sizeof(Program) * count);
+    BatchJob* jobs = calloc(count, sizeof(BatchJob));
+    char err[256];
+    if (!progs || !jobs) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (assemble_file(paths[i], &progs[i], err, sizeof(err)) < 0) {
+            fprintf(stderr, "%s: %s\n", paths[i], err);
+            free(progs);
+            free(jobs);
+            free(paths);
+            return 1;
+        }
+        jobs[i].prog = &progs[i];
+        jobs[i].engine = engines[engine].engine;
+        jobs[i].fuse = engines[engine].fuse;
+        jobs[i].lazy_flags = engines[engine].lazy_flags;
+    }
+
+    uint32_t workers = threads > 0 ? (uint32_t)threads : 1;
+    double start = now_seconds();
+    batch_run(jobs, count, workers);
+    double elapsed = now_seconds() - start;
+
+    fflush(stdout);
+    int failed = 0;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const BatchJob* job = &jobs[i];
+        printf("%s: [%s", paths[i], vm_status_name(job->status));
+        if (job->status == VM_EXITED) printf(" with status %d", job->exit_status);
+        if (job->status == VM_FAULT) printf(": %s at 0x%04X", fault_name(job->fault), job->fault_addr);
+        printf(" after %llu instructions]\n", (unsigned long long)job->icount);
+        failed |= job->status != VM_HALTED && job->status != VM_EXITED;
+        total += job->icount;
+    }
+    printf("%u programs, %llu instructions on %u threads in %.3f s\n", count,
+           (unsigned long long)total, workers < count ? workers : count, elapsed);
+
+    free(progs);
+    free(jobs);
+    free(paths);
+    return failed;
+}
+
+static int cmd_disasm(int argc, char* argv[]) {
+    if (argc < 1) {
+        fprintf(stderr, "Usage: ucvm-cpu disasm <program.s>\n");
+        return 1;
+    }
+    Program* prog = malloc(sizeof(Program));
+    char err[256];
+    if (!prog || assemble_file(argv[0], prog, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s\n", prog ? err : "Out of memory");
+        free(prog);
+        return 1;
+    }
+
+    uint32_t pc = TEXT_BASE;
+    while (pc < prog->text_end) {
+        if (!prog->present[pc >> PAGE_SHIFT]) {
+            pc = (pc | PAGE_MASK) + 1;
+            continue;
+        }
+        char text[64];
+        int size = disassemble(prog->image, pc, text, sizeof(text));
+        printf(CYAN "%04X" RESET "  %s\n", pc, text);
+        pc += size ? size : 1;
+    }
+    free(prog);
+    return 0;
+}
+
+typedef struct {
+    uint32_t key;       /* opcodes packed one per byte, oldest first */
+    uint64_t count;     /* 0 for an empty slot */
+} NGram;
+
+static int compare_ngrams(const void* a, const void* b) {
+    uint64_t x = ((const NGram*)a)->count, y = ((const NGram*)b)->count;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/* Single-step a program and count the opcode sequences it executes.
+ * Only straight-line neighbours count, since those are what the decoded
+ * engine can fuse: a taken branch starts a new sequence.
+ */
+static int cmd_ngrams(int argc, char* argv[]) {
+    if (argc < 1) {
+        fprintf(stderr, "Usage: ucvm-cpu ngrams <program.s> [n]\n");
+        return 1;
+    }
+    int n = argc > 1 ? atoi(argv[1]) : 2;
+    if (n < 2 || n > 4) {
+        fprintf(stderr, "n-gram length must be 2 to 4\n");
+        return 1;
+    }
+
+    Program* prog = malloc(sizeof(Program));
+    VM* vm = malloc(sizeof(VM));
+    NGram* table = calloc(NGRAM_TABLE_SIZE, sizeof(NGram));
+    char err[256];
+    if (!prog || !vm || !table) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (assemble_file(argv[0], prog, err, sizeof(err)) < 0) {
+        fprintf(stderr, "%s\n", err);
+        return 1;
+    }
+
+    vm_init(vm);
+    vm_load(vm, prog);
+    uint32_t window = 0, expected = vm->cpu->pc;
+    int filled = 0;
+    uint64_t total = 0;
+    VMStatus st;
+
+    do {
+        uint32_t pc = vm->cpu->pc;
+        uint8_t opcode = 0;
+        mem_read(vm, pc, &opcode, 1);
+        if (pc != expected) filled = 0;
+        window = (window << 8 | opcode) & (n == 4 ? 0xFFFFFFFFu : (1u << (8 * n)) - 1);
+        if (++filled >= n) {
+            uint32_t slot = (window * 2654435761u) % NGRAM_TABLE_SIZE;
+            while (table[slot].count && table[slot].key != window) {
+                slot = (slot + 1) % NGRAM_TABLE_SIZE;
+            }
+            table[slot].key = window;
+            table[slot].count++;
+            total++;
+        }
+        expected = pc + insn_size[opcode];
+        st = vm_run(vm, 1);
+    } while (st == VM_BUDGET);
+
+    qsort(table, NGRAM_TABLE_SIZE, sizeof(NGram), compare_ngrams);
+    printf("%14s %7s  sequence\n", "count", "share");
+    for (int i = 0; i < NGRAM_TOP && table[i].count; i++) {
+        printf("%14llu %6.1f%% ", (unsigned long long)table[i].count,
+               100.0 * table[i].count / total);
+        for (int k = n - 1; k >= 0; k--) {
+            printf(" %s", opcode_name((uint8_t)(table[i].key >> (8 * k))));
+        }
+        printf("\n");
+    }
+    report_status(vm, st);
+
+    vm_destroy(vm);
+    free(table);
+    free(prog);
+    free(vm);
+    return 0;
+}
+
+/* Run one benchmark program to completion; returns elapsed seconds */
+static double bench_once(const Program* prog, size_t engine, uint32_t iterations, VM* vm) {
+    vm_init(vm);
+    vm->engine = engines[engine].engine;
+    vm->fuse = engines[engine].fuse;
+    vm->lazy_flags = engines[engine].lazy_flags;
+    vm_load(vm, prog);
+    vm->cpu->gpr[1] = iterations;
+
+    /* Guest output would swamp the table */
+    fflush(stdout);
+    int saved = dup(1), null = open("/dev/null", O_WRONLY);
+    if (null >= 0) dup2(null, 1);
+
+    double start = now_seconds();
+    VMStatus st = vm_run(vm, BUDGET_UNLIMITED);
+    double elapsed = now_seconds() - start;
+
+    if (null >= 0) {
+        dup2(saved, 1);
+        close(null);
+    }
+    close(saved);
+
+    if (st != VM_HALTED) {
+        fprintf(stderr, "benchmark stopped unexpectedly: ");
+        report_status(vm, st);
+    }
+    return elapsed;
+}
+
+static int cmd_bench(int argc, char* argv[]) {
+    uint32_t iterations = argc > 0 ? (uint32_t)strtoul(argv[0], NULL, 0) : DEFAULT_BENCH_ITERATIONS;
+    Program* prog = malloc(sizeof(Program));
+    VM* vm = malloc(sizeof(VM));
+    VM* reference = malloc(sizeof(VM));
+    char err[256];
+    if (!prog || !vm || !reference) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf(BOLD "UCVM CPU Engine Benchmark" RESET " (%u iterations)\n", iterations);
+    printf("════════════════════════════════════════════════════════════════\n");
+    printf("%-10s %-10s %14s %10s %10s\n", "program", "engine", "instructions", "seconds", "MIPS");
+
+    int mismatches = 0;
+    for (size_t p = 0; p < BENCH_PROGRAM_COUNT; p++) {
+        if (assemble(bench_programs[p].source, prog, err, sizeof(err)) < 0) {
+            fprintf(stderr, "%s: %s\n", bench_programs[p].name, err);
+            return 1;
+        }
+        double baseline = 0;
+        for (size_t e = 0; e < ENGINE_COUNT; e++) {
+            VM* target = e == 0 ? reference : vm;
+            double elapsed = bench_once(prog, e,
+                                        iterations / bench_programs[p].scale, target);
+            double mips = target->icount / elapsed / 1e6;
+            if (e == 0) baseline = elapsed;
+
+            printf("%-10s %-10s %14llu %10.3f %10.1f",
+                   bench_programs[p].name, engines[e].name,
+                   (unsigned long long)target->icount, elapsed, mips);
+            if (e > 0) printf(GREEN "  %.2fx" RESET, baseline / elapsed);
+            printf("\n");
+
+            /* Every engine must agree with the reference interpreter */
+            if (e > 0 && (memcmp(vm->cpu, reference->cpu, sizeof(CPUState)) != 0 ||
+                          vm->icount != reference->icount)) {
+                printf("  mismatch against the switch engine\n");
+                mismatches++;
+            }
+            if (e > 0) vm_destroy(vm);
+        }
+        if (bench_programs[p].host) {
+            double start = now_seconds();
+            bench_programs[p].host(iterations / bench_programs[p].scale);
+            double elapsed = now_seconds() - start;
+            printf("%-10s %-10s %14s %10.3f %10s" GREEN "  %.2fx" RESET "\n",
+                   bench_programs[p].name, "host", "-", elapsed, "-", baseline / elapsed);
+        }
+        vm_destroy(reference);
+    }
+
+    free(prog);
+    free(vm);
+    free(reference);
+    return mismatches ? 1 : 0;
+}
+
+static void print_usage(const char* name) {
+    printf("Usage: %s run [--engine switch|threaded|unfused|eager|decoded|jit] <program.s>\n", name);
+    printf("       %s run [--budget n] [--checkpoint file [--sha256]] <program.s | --restore file>\n", name);
+    printf("       %s run --journal file <program.s | --restore file>\n", name);
+    printf("       %s run --trace file <program.s>\n", name);
+    printf("       %s run --mount host_dir:path[:ro] <program.s>\n", name);
+    printf("       %s debug [--engine name] [-x commands] <program.s>\n", name);
+    printf("       %s profile [--engine name] [--every n | --hz n] [--folded file] <program.s>\n", name);
+    printf("       %s snapshot <file>\n", name);
+    printf("       %s trace <file>\n", name);
+    printf("       %s batch [-j threads] [--engine name] <program.s>...\n", name);
+    printf("       %s disasm <program.s>\n", name);
+    printf("       %s ngrams <program.s> [n]\n", name);
+    printf("       %s bench [iterations]\n", name);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "run") == 0) {
+        return cmd_run(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "batch") == 0) {
+        return cmd_batch(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "debug") == 0) {
+        return cmd_debug(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "profile") == 0) {
+        return cmd_profile(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "snapshot") == 0) {
+        return cmd_snapshot(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "trace") == 0) {
+        return cmd_trace(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "disasm") == 0) {
+        return cmd_disasm(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "ngrams") == 0) {
+        return cmd_ngrams(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "bench") == 0) {
+        return cmd_bench(argc - 2, argv + 2);
+    }
+
+    print_usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,573 @@
+/* UCVM CPU Engine - shared definitions
+ * Native execution engine for the UCVM 3.0 instruction set (spec section 4)
+ * Compile: gcc -O2 -pthread -o ucvm-cpu *.c
+ */
+
+#ifndef UCVM_H
+#define UCVM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* Address space layout (spec section 6.2) */
+#define MEM_SIZE      0x10000
+#define KERNEL_BASE   0x0000
+#define TEXT_BASE     0x1000
+#define HEAP_BASE     0x8000
+#define STACK_BASE    0xC000
+#define STACK_TOP     0xF000
+#define MMIO_BASE     0xF000
+
+#define PAGE_SHIFT    8
+#define PAGE_SIZE     (1u << PAGE_SHIFT)
+#define PAGE_MASK     (PAGE_SIZE - 1)
+#define NUM_PAGES     (MEM_SIZE >> PAGE_SHIFT)
+
+#define NUM_GPRS      16
+#define MAX_FDS       16
+#define MAX_INSN_SIZE 6
+
+#if defined(__GNUC__)
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#else
+#define likely(x)   (x)
+#define unlikely(x) (x)
+#endif
+
+/* Opcodes (spec section 4.3)
+ * Encoding, all multi-byte fields little-endian:
+ *   HLT             00
+ *   MOV r,r         01 [dst<<4|src]
+ *   MOV r,i         02 [dst<<4] imm32
+ *   MOV r,[m]       03 [dst<<4|base] disp16     base 0 = absolute address
+ *   MOV [m],r       04 [src<<4|base] disp16
+ *   ADD..DIV r,r    10..13 [dst<<4|src]
+ *   JMP/JZ/JNZ a    20..22 addr16
+ *   CALL a          24 addr16
+ *   RET             25
+ *   SYSCALL         80                          r0 = number, r1-r3 = args
+ *   INT n           81 n
+ */
+enum {
+    OP_HLT     = 0x00,
+    OP_MOV_RR  = 0x01,
+    OP_MOV_RI  = 0x02,
+    OP_LOAD    = 0x03,
+    OP_STORE   = 0x04,
+    OP_ADD     = 0x10,
+    OP_SUB     = 0x11,
+    OP_MUL     = 0x12,
+    OP_DIV     = 0x13,
+    OP_JMP     = 0x20,
+    OP_JZ      = 0x21,
+    OP_JNZ     = 0x22,
+    OP_CALL    = 0x24,
+    OP_RET     = 0x25,
+    OP_SYSCALL = 0x80,
+    OP_INT     = 0x81
+};
+
+/* System call numbers (spec section 5.3) */
+#define SYS_FORK        0
+#define SYS_EXEC        1
+#define SYS_EXIT        2
+#define SYS_WAIT        3
+#define SYS_GETPID      4
+#define SYS_YIELD       5
+#define SYS_OPEN        10
+#define SYS_CLOSE       11
+#define SYS_READ        12
+#define SYS_WRITE       13
+#define SYS_SEEK        14
+#define SYS_UNLINK      15
+#define SYS_MKDIR       16
+#define SYS_PIPE        17
+#define SYS_SPLICE      18
+#define SYS_BRK         30
+#define SYS_MMAP        31
+#define SYS_MUNMAP      32
+#define SYS_RING_SETUP  40
+#define SYS_RING_ENTER  41
+#define SYSCALL_COUNT   64
+
+/* Error numbers, returned negated in r0 */
+#define UCVM_ENOENT       2
+#define UCVM_EIO          5
+#define UCVM_EBADF        9
+#define UCVM_ECHILD       10
+#define UCVM_EAGAIN       11
+#define UCVM_ENOMEM       12
+#define UCVM_EACCES       13
+#define UCVM_EFAULT       14
+#define UCVM_EBUSY        16
+#define UCVM_EEXIST       17
+#define UCVM_ENOTDIR      20
+#define UCVM_EISDIR       21
+#define UCVM_EINVAL       22
+#define UCVM_EMFILE       24
+#define UCVM_ENOTTY       25
+#define UCVM_EFBIG        27
+#define UCVM_ENOSPC       28
+#define UCVM_ESPIPE       29
+#define UCVM_EROFS        30
+#define UCVM_EPIPE        32
+#define UCVM_ENAMETOOLONG 36
+#define UCVM_ENOSYS       38
+#define UCVM_ENOTEMPTY    39
+
+/* open() flags */
+#define UCVM_O_RDONLY  0x000
+#define UCVM_O_WRONLY  0x001
+#define UCVM_O_RDWR    0x002
+#define UCVM_O_ACCMODE 0x003
+#define UCVM_O_CREAT   0x040
+#define UCVM_O_EXCL    0x080
+#define UCVM_O_TRUNC   0x200
+#define UCVM_O_APPEND  0x400
+
+/* Instruction sizes indexed by opcode, 0 for undefined opcodes */
+extern const uint8_t insn_size[256];
+
+/* CPU state (spec section 4.5) */
+typedef struct {
+    uint8_t zero;
+    uint8_t carry;
+    uint8_t sign;
+    uint8_t overflow;
+} Flags;
+
+typedef enum {
+    MODE_USER = 0,
+    MODE_KERNEL
+} CPUMode;
+
+/* Cache-line aligned: the general registers fill the first line and
+ * pc, sp, flags and mode the second, which nothing else shares.
+ */
+typedef struct {
+    _Alignas(64) uint32_t gpr[NUM_GPRS];
+    uint32_t pc;
+    uint32_t sp;
+    Flags flags;
+    uint8_t mode;
+} CPUState;
+
+/* Why an execution engine returned */
+typedef enum {
+    VM_RUNNING = 0,
+    VM_HALTED,      /* HLT executed */
+    VM_EXITED,      /* exit() system call */
+    VM_FAULT,       /* see VM.fault */
+    VM_BREAK,       /* INT 3 */
+    VM_BUDGET,      /* instruction budget exhausted */
+    VM_YIELD,       /* the running process blocked (internal to vm_run) */
+    VM_DEADLOCK     /* every process is blocked */
+} VMStatus;
+
+typedef enum {
+    FAULT_NONE = 0,
+    FAULT_SEGV,     /* protection or bounds violation */
+    FAULT_ILL,      /* undefined opcode or bad interrupt */
+    FAULT_DIV0      /* division by zero */
+} FaultKind;
+
+typedef enum {
+    ENGINE_SWITCH = 0,
+    ENGINE_THREADED,
+    ENGINE_DECODED,
+    ENGINE_JIT
+} Engine;
+
+/* Page table entry (spec section 6.4) */
+#define PTE_VALID   0x01
+#define PTE_READ    0x02
+#define PTE_WRITE   0x04
+#define PTE_EXEC    0x08
+#define PTE_USER    0x10
+#define PTE_MMIO    0x20    /* backed by a device, see VM.mmio */
+#define PTE_COW     0x40    /* writable, but the frame is shared: copy on write */
+
+typedef struct {
+    uint8_t* frame;         /* reference-counted frame backing the page */
+    uint8_t flags;          /* PTE_ bits, 0 when unmapped */
+} PageTableEntry;
+
+/* Direct-mapped software TLB. A tag is the base address of the page the
+ * entry permits, so a 32-bit access at addr hits when the tag equals
+ * (addr + 3) & ~PAGE_MASK: one compare, which also rejects any access
+ * straddling two pages. TLB_INVALID never matches. An MMIO page is
+ * entered with the sentinel tag base | TLB_MMIO, which also never
+ * matches but tells the slow path to go straight to the device.
+ */
+#define TLB_ENTRIES 64
+#define TLB_INVALID 1u
+#define TLB_MMIO    2u
+
+typedef struct {
+    uint32_t read_tag;
+    uint32_t write_tag;
+    uintptr_t addend;       /* host address = addend + guest address */
+} TLBEntry;
+
+/* Device driver (spec section 8.4). Offsets are relative to the address
+ * the device is attached at. Guest loads and stores reach a device as
+ * 4-byte reads and writes; read and write return the bytes transferred,
+ * and anything short of a full word is a bus error (segmentation fault).
+ */
+typedef struct DeviceDriver {
+    const char* name;
+    int (*read)(struct DeviceDriver* dev, uint32_t offset, uint8_t* buf, uint32_t len);
+    int (*write)(struct DeviceDriver* dev, uint32_t offset, const uint8_t* data, uint32_t len);
+    int32_t (*ioctl)(struct DeviceDriver* dev, uint32_t cmd, uint32_t arg);
+    void* state;
+} DeviceDriver;
+
+#define MMIO_PAGES ((MEM_SIZE - MMIO_BASE) >> PAGE_SHIFT)
+
+typedef struct {
+    DeviceDriver* dev;      /* NULL: page unmapped */
+    uint32_t base;          /* address the device is attached at */
+} MMIOPage;
+
+/* Process (spec section 7.2) */
+#define MAX_PROCS 65536     /* pids run from 1 to MAX_PROCS - 1 */
+
+/* Scheduler levels (spec section 7.4): 0 is reserved for processes in
+ * kernel mode, user processes move between 1 and SCHED_LEVELS - 1
+ */
+#define SCHED_LEVELS 8
+#define SCHED_TOP    1      /* highest user level, where processes start */
+
+typedef enum {
+    PROC_READY = 0,
+    PROC_RUNNING,
+    PROC_WAITING,           /* in wait() until a child exits */
+    PROC_ZOMBIE,            /* exited, not yet waited for */
+    PROC_BLOCKED            /* in a call that runs again when it wakes, see do_syscall */
+} ProcState;
+
+/* One system call in a trace ring (spec Appendix B, last_syscall) */
+typedef struct {
+    uint64_t tsc;           /* timestamp at entry, see trace_clock */
+    uint64_t icount;        /* VM.icount, counting the SYSCALL */
+    uint32_t args[3];       /* r1-r3 on entry */
+    int32_t result;         /* r0 on return */
+    uint16_t nr;            /* r0 on entry, low 16 bits */
+    uint16_t err;           /* -result when the call failed, else 0 */
+    uint32_t pid;
+} TraceRecord;
+
+/* The last TRACE_ENTRIES system calls of a process. Only the VM thread
+ * writes; records before first were dropped by a rewind.
+ */
+#define TRACE_ENTRIES 64    /* a power of two */
+
+typedef struct {
+    uint64_t head;          /* records written, the latest at head - 1 */
+    uint64_t first;
+    TraceRecord rec[TRACE_ENTRIES];
+} TraceRing;
+
+/* The VM runs on the registers and TLB of the running process in place,
+ * through VM.cpu and VM.tlb, so a context switch moves two pointers and
+ * copies nothing. Each process keeping its own TLB also spares the
+ * switch a flush. The engines find tlb at a fixed offset from cpu.
+ */
+typedef struct Process {
+    CPUState cpu;
+    TLBEntry tlb[TLB_ENTRIES];
+    uint32_t pid;
+    uint32_t ppid;
+    ProcState state;
+    int exit_status;
+    uint32_t text_id;       /* equal ids map the same text frames */
+    uint32_t brk;           /* end of the heap (brk syscall) */
+    uint16_t fd_open;       /* bit n set: descriptor n is open */
+    struct File* files[MAX_FDS];    /* NULL for a standard stream */
+    uint32_t ring_addr;     /* submission ring, 0 if none */
+    uint32_t ring_entries;
+    struct Process* parent;
+    struct Process* children;       /* live children */
+    struct Process* zombies;        /* exited children, not yet waited for */
+    struct Process* sibling;        /* next in the parent's children or zombies */
+    struct Process* sibling_prev;
+    struct Process* next;           /* run queue */
+    uint8_t level;                  /* scheduler level */
+    uint32_t epoch;                 /* VM.sched_epoch when level was set */
+    uint64_t sleep_start;           /* VM.icount when it last blocked */
+    uint32_t dirty[NUM_PAGES / 32]; /* pages changed since the journal saw them */
+    PageTableEntry pt[NUM_PAGES];
+    TraceRing trace;                /* latest system calls */
+} Process;
+
+struct ICachePage;
+struct Jit;
+struct Journal;
+struct Replay;
+struct Traps;
+struct FileSystem;
+typedef struct FrameChunk FrameChunk;
+
+/* Virtual machine: one CPU running the processes of a 64KB address
+ * space layout. cpu, tlb and pt belong to the running process.
+ */
+typedef struct VM {
+    CPUState* cpu;
+    uint64_t icount;        /* retired instructions */
+    VMStatus stopped;       /* halt, exit or fault that ended the run, else VM_RUNNING */
+    int exit_status;
+    FaultKind fault;
+    uint32_t fault_addr;
+    Engine engine;
+    uint8_t fuse;           /* decoded engine fuses common opcode pairs */
+    uint8_t lazy_flags;     /* decoded engine evaluates flags on demand;
+                             * like fuse, set before vm_load */
+    struct ICachePage* icache[NUM_PAGES];   /* decoded text pages */
+    struct Jit* jit;                        /* compiled code, NULL until used */
+    uint8_t code_page[NUM_PAGES];           /* CODE_ flags: caches built per page */
+    uint32_t text_id;                       /* image the code caches hold */
+    uint32_t next_text_id;
+    TLBEntry* tlb;
+    PageTableEntry* pt;
+    MMIOPage mmio[MMIO_PAGES];              /* device for each MMIO page */
+    Process* proc;                          /* running process */
+    Process** procs;                        /* by pid */
+    uint32_t nprocs;
+    uint32_t next_pid;
+    Process* run_head[SCHED_LEVELS];        /* ready processes, FIFO per level */
+    Process* run_tail[SCHED_LEVELS];
+    uint32_t run_mask;                      /* bit n set: level n is not empty */
+    uint32_t sched_epoch;                   /* bumped by each priority boost */
+    uint64_t boost_at;                      /* icount of the next boost */
+    uint64_t slice_end;                     /* icount at which proc is preempted */
+    FrameChunk* frame_chunks;
+    struct Frame* frame_free;
+    uint8_t* zero_frame;                    /* shared by every untouched page */
+    struct Journal* journal;                /* NULL unless journaling */
+    struct Replay* replay;                  /* NULL unless host I/O is recorded */
+    struct Traps* traps;                    /* NULL unless breakpoints or watchpoints are set */
+    struct FileSystem* fs;                  /* NULL until a path is first used */
+    uint64_t fs_calls;                      /* calls that used the file system */
+} VM;
+
+#define MAX_SYMBOLS       1024
+#define MAX_SYMBOL_LENGTH 64
+
+typedef struct {
+    char name[MAX_SYMBOL_LENGTH];
+    uint32_t addr;
+} Symbol;
+
+/* Assembled program image */
+typedef struct {
+    uint8_t image[MEM_SIZE];
+    uint8_t present[NUM_PAGES];     /* pages touched by the assembler */
+    uint32_t entry;
+    uint32_t text_end;              /* end of the highest text-segment emission */
+    Symbol symbols[MAX_SYMBOLS];    /* labels in the text segment, by address */
+    uint32_t nsymbols;
+} Program;
+
+#define BUDGET_UNLIMITED UINT64_MAX
+
+/* exec.c */
+void vm_init(VM* vm);
+void vm_destroy(VM* vm);
+void vm_load(VM* vm, const Program* prog);
+VMStatus vm_run(VM* vm, uint64_t budget);
+VMStatus exec_switch(VM* vm, uint64_t budget);
+VMStatus exec_threaded(VM* vm, uint64_t budget);
+const char* vm_status_name(VMStatus st);
+const char* fault_name(FaultKind f);
+
+/* icache.c */
+VMStatus exec_decoded(VM* vm, uint64_t budget);
+void icache_flush(VM* vm);
+void icache_free(VM* vm);
+
+/* mem.c */
+#define MEM_IOV_MAX (NUM_PAGES + 1)    /* iovecs mem_iov may fill */
+struct iovec;
+void mem_init(VM* vm, uint32_t brk);
+void mem_load_page(VM* vm, uint32_t page, const uint8_t* data, uint8_t flags);
+void mem_release(VM* vm, PageTableEntry* pt);
+void mem_fork(VM* vm, PageTableEntry* child);
+void mem_share(PageTableEntry* from, PageTableEntry* to);
+uint8_t* frame_alloc(VM* vm);
+void frame_ref(uint8_t* frame);
+void frame_unref(VM* vm, uint8_t* frame);
+void frame_free_all(VM* vm);
+void mem_map(VM* vm, uint32_t page, uint32_t count, uint8_t flags);
+void mem_unmap(VM* vm, uint32_t page, uint32_t count);
+int mem_read(VM* vm, uint32_t addr, void* dst, uint32_t len);
+int mem_write(VM* vm, uint32_t addr, const void* src, uint32_t len);
+uint8_t* mem_host(VM* vm, uint32_t addr, uint32_t len, uint8_t need);
+int mem_iov(VM* vm, uint32_t addr, uint32_t len, uint8_t need, struct iovec* iov);
+void tlb_clear(TLBEntry* tlb);
+void tlb_flush(VM* vm);
+
+/* proc.c */
+#define PROC_QUANTUM 10000  /* instructions per time slice at SCHED_TOP */
+#define SCHED_BOOST_INTERVAL 1000000
+Process* proc_create(VM* vm);
+Process* proc_create_at(VM* vm, uint32_t pid);
+void proc_free(VM* vm, Process* p);
+void proc_switch(VM* vm, Process* next);
+void proc_enqueue(VM* vm, Process* p);
+Process* proc_dequeue(VM* vm);
+void proc_sleep(VM* vm, ProcState state);
+void proc_wakeup(VM* vm, Process* p);
+void proc_yield(VM* vm);
+void proc_preempt(VM* vm);
+int proc_schedule(VM* vm);
+int32_t proc_fork(VM* vm);
+int32_t proc_wait(VM* vm);
+int proc_exit(VM* vm);
+
+/* snapshot.c */
+#define SNAP_SHA256 0x1     /* store a SHA-256 digest besides the checksum */
+int vm_checkpoint(VM* vm, const char* path, uint32_t flags, char* err, size_t errlen);
+int vm_restore(VM* vm, const char* path, char* err, size_t errlen);
+int snapshot_export_json(const char* path, FILE* out, char* err, size_t errlen);
+
+/* checkpoint.c: in-memory checkpoints sharing frames with the machine */
+typedef struct Checkpoint Checkpoint;
+Checkpoint* checkpoint_take(VM* vm);
+int checkpoint_restore(VM* vm, const Checkpoint* cp, char* err, size_t errlen);
+void checkpoint_free(VM* vm, Checkpoint* cp);
+
+/* replay.c: host I/O logged so a machine run again sees it again */
+typedef struct Replay Replay;
+void replay_open(VM* vm);
+void replay_close(VM* vm);
+uint64_t replay_tell(const VM* vm);
+void replay_seek(VM* vm, uint64_t pos);
+int32_t replay_read(VM* vm, int fd, uint8_t* buf, uint32_t len);
+int32_t replay_write(VM* vm, int fd, const uint8_t* buf, uint32_t len);
+int32_t replay_writev(VM* vm, int fd, const struct iovec* iov, int n);
+int replay_device(VM* vm, DeviceDriver* dev, uint32_t offset, uint8_t* bytes, uint8_t need);
+
+/* debug.c: reverse execution over periodic checkpoints */
+#define DEBUG_INTERVAL    100000    /* instructions between checkpoints */
+#define DEBUG_CHECKPOINTS 1024      /* held at most */
+typedef struct Debugger Debugger;
+Debugger* debug_open(VM* vm);
+void debug_close(Debugger* d);
+VMStatus debug_step(Debugger* d, uint64_t n);
+VMStatus debug_continue(Debugger* d);
+uint64_t debug_first(const Debugger* d, int* cut);
+VMStatus debug_reverse_step(Debugger* d, uint64_t n);
+VMStatus debug_reverse_continue(Debugger* d);
+
+/* trap.c: breakpoints and watchpoints. A run stops with VM_BREAK before
+ * the instruction at a breakpoint or the one making a watched access.
+ */
+#define TRAP_BREAKPOINTS 16
+#define TRAP_WATCHPOINTS 8
+enum { TRAP_READ = 1, TRAP_WRITE = 2, TRAP_BREAK = 4 };
+int trap_break(VM* vm, uint32_t addr);
+int trap_watch(VM* vm, uint32_t addr, uint32_t len, uint8_t kind);
+int trap_delete(VM* vm, uint32_t addr);
+uint8_t trap_hit(const VM* vm, uint32_t* addr);
+void trap_resume(VM* vm, int step_over);
+void trap_free(VM* vm);
+
+/* fs.c: in-memory file system */
+#define FS_NAME_MAX 255     /* bytes in a path component */
+#define FS_PATH_MAX 1024    /* bytes in a path, with its NUL */
+#define FS_MOUNTS   8       /* host directories mounted at once */
+typedef struct File File;
+typedef struct FileSystem FileSystem;
+int32_t fs_open(VM* vm, const char* path, uint32_t flags, File** out);
+int32_t fs_mkdir(VM* vm, const char* path);
+int32_t fs_unlink(VM* vm, const char* path);
+void fs_pipe(VM* vm, File** read_end, File** write_end);
+int fs_mount(VM* vm, const char* path, const char* host_dir, int readonly, char* err, size_t errlen);
+void fs_free(VM* vm);
+int32_t file_read(VM* vm, File* f, const struct iovec* iov, int n);
+int32_t file_write(VM* vm, File* f, const struct iovec* iov, int n);
+int32_t file_seek(VM* vm, File* f, int32_t offset, uint32_t whence);
+int32_t file_splice(VM* vm, File* in, File* out, uint32_t len);
+void file_close(VM* vm, File* f);
+void files_fork(const Process* parent, Process* child);
+void files_close(VM* vm, Process* p, int wake);
+void files_restore(VM* vm, Process* p, uint16_t fd_open);
+
+/* profile.c: sampling profiler */
+#define PROFILE_EVERY 100003    /* instructions between samples; prime, so loops don't alias */
+#define PROFILE_POLL  10000     /* timer: fewest instructions between looks at it */
+#define PROFILE_DEPTH 64        /* frames kept per stack */
+#define PROFILE_SCAN  256       /* stack words searched for them */
+typedef struct Profile Profile;
+Profile* profile_open(VM* vm, uint64_t every, uint32_t hz);
+void profile_close(Profile* p);
+VMStatus profile_run(Profile* p, uint64_t budget);
+void profile_report(const Profile* p, const Program* prog, FILE* out, uint32_t top);
+int profile_write_folded(const Profile* p, const Program* prog, const char* path, char* err, size_t errlen);
+
+/* trace.c: rings of the latest system calls, and trace files */
+#define TRACE_CLOCK_TSC 1   /* timestamps in host TSC ticks */
+#define TRACE_CLOCK_NS  2   /* or in nanoseconds */
+uint32_t trace_read(const Process* p, TraceRecord* out);
+void trace_rewind(Process* p, uint64_t icount);
+void trace_complete(Process* p, int32_t result);
+void trace_format(FILE* out, const TraceRecord* r, uint64_t tsc_base);
+int trace_write(VM* vm, const char* path, char* err, size_t errlen);
+int trace_print(const char* path, FILE* out, char* err, size_t errlen);
+
+/* journal.c: snapshots kept current by a write-ahead log of deltas */
+#define JOURNAL_INTERVAL 100000     /* instructions between deltas */
+int journal_open(VM* vm, const char* path, uint32_t flags, char* err, size_t errlen);
+int journal_delta(VM* vm, char* err, size_t errlen);
+int journal_close(VM* vm, char* err, size_t errlen);
+void journal_page_dirty(VM* vm, uint32_t page);
+void journal_fork(VM* vm, Process* child);
+int vm_recover(VM* vm, const char* path, char* err, size_t errlen);
+
+/* device.c */
+extern DeviceDriver console_device;
+int mmio_attach(VM* vm, uint32_t addr, uint32_t len, DeviceDriver* dev);
+
+/* jit.c */
+VMStatus exec_jit(VM* vm, uint64_t budget);
+void jit_flush(VM* vm);
+void jit_free(VM* vm);
+
+/* syscall.c */
+VMStatus do_syscall(VM* vm);
+int32_t syscall_call(VM* vm, uint32_t nr, uint32_t a1, uint32_t a2, uint32_t a3);
+void syscall_write_batch(VM* vm, uint32_t fd, const uint32_t* buf, const uint32_t* len,
+                         uint32_t n, int32_t* res);
+
+/* ring.c */
+#define RING_MAX_ENTRIES 256
+int32_t ring_setup(VM* vm, uint32_t entries);
+int32_t ring_enter(VM* vm, uint32_t to_submit);
+
+/* batch.c: independent programs run on a pool of host threads */
+typedef struct {
+    const Program* prog;    /* shared read-only between jobs */
+    Engine engine;
+    uint8_t fuse;
+    uint8_t lazy_flags;
+    /* results */
+    VMStatus status;
+    int exit_status;
+    FaultKind fault;
+    uint32_t fault_addr;
+    uint64_t icount;
+    VM* vm;                 /* while running */
+} BatchJob;
+
+void batch_run(BatchJob* jobs, uint32_t njobs, uint32_t nworkers);
+
+/* asm.c */
+int assemble(const char* source, Program* prog, char* err, size_t errlen);
+int assemble_file(const char* path, Program* prog, char* err, size_t errlen);
+int disassemble(const uint8_t* mem, uint32_t pc, char* out, size_t outlen);
+const char* opcode_name(uint8_t opcode);
+const Symbol* program_symbol(const Program* prog, uint32_t addr);
+
+#endif